@@ -0,0 +1,96 @@
+/*
+ * Statically defined tracing probes(USDT) in the format of systemtap's
+ * <sys/sdt.h>, which bpftrace, perf, bcc and gdb read: a probe is a nop
+ * in the code, and an ELF note in .note.stapsdt telling where the nop
+ * is and where to find each argument. Nothing runs until a tracer puts
+ * a breakpoint on the nop.
+ *
+ * The subset TinyVPN needs: C++, x86-64 and AArch64, no semaphores, up
+ * to 6 integer or pointer arguments. Arguments are computed whether the
+ * probe is on or not, so pass what is at hand.
+ * */
+#ifndef SDT_SDT_H
+#define SDT_SDT_H
+
+#include <type_traits>
+
+#ifdef SDT_DISABLE
+
+#define DTRACE_PROBE(provider, name) do {  } while (0)
+#define DTRACE_PROBE1(provider, name, a1) do {  } while (0)
+#define DTRACE_PROBE2(provider, name, a1, a2) do {  } while (0)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) do {  } while (0)
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4) do {  } while (0)
+#define DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5) do {  } while (0)
+#define DTRACE_PROBE6(provider, name, a1, a2, a3, a4, a5, a6) do {  } while (0)
+
+#else
+
+#if __SIZEOF_POINTER__ == 8
+#define _SDT_ADDR ".8byte"
+#else
+#define _SDT_ADDR ".4byte"
+#endif
+
+/* Size of an argument in bytes, negative if signed. %n prints it negated. */
+#define _SDT_SIZE(x) ((std::is_signed<typename std::decay<decltype(x)>::type>::value \
+            ? -1 : 1) * static_cast<int>(sizeof(x)))
+#define _SDT_OP(n, x) [_sdt_s##n] "n" (-_SDT_SIZE(x)), [_sdt_a##n] "nor" (x)
+#define _SDT_FMT(n) "%n[_sdt_s" #n "]@%[_sdt_a" #n "]"
+
+/* The note, and the .stapsdt.base section tracers locate it against,
+ * one per object however many probes there are */
+#define _SDT_PROBE(provider, name, args)                                      \
+    "990: nop\n"                                                              \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                             \
+    ".balign 4\n"                                                             \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                        \
+    "991: .asciz \"stapsdt\"\n"                                               \
+    "992: .balign 4\n"                                                        \
+    "993: " _SDT_ADDR " 990b\n"                                               \
+    _SDT_ADDR " _.stapsdt.base\n"                                             \
+    _SDT_ADDR " 0\n"                                                          \
+    ".asciz \"" #provider "\"\n"                                              \
+    ".asciz \"" #name "\"\n"                                                  \
+    ".asciz \"" args "\"\n"                                                   \
+    "994: .balign 4\n"                                                        \
+    ".popsection\n"                                                           \
+    ".ifndef _.stapsdt.base\n"                                                \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"   \
+    ".weak _.stapsdt.base\n"                                                  \
+    ".hidden _.stapsdt.base\n"                                                \
+    "_.stapsdt.base: .space 1\n"                                              \
+    ".size _.stapsdt.base, 1\n"                                               \
+    ".popsection\n"                                                           \
+    ".endif\n"
+
+#define DTRACE_PROBE(provider, name)                                          \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, ""))
+#define DTRACE_PROBE1(provider, name, a1)                                     \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, _SDT_FMT(1))             \
+            :: _SDT_OP(1, a1))
+#define DTRACE_PROBE2(provider, name, a1, a2)                                 \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, _SDT_FMT(1) " " _SDT_FMT(2)) \
+            :: _SDT_OP(1, a1), _SDT_OP(2, a2))
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)                             \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, _SDT_FMT(1) " " _SDT_FMT(2) \
+                " " _SDT_FMT(3))                                              \
+            :: _SDT_OP(1, a1), _SDT_OP(2, a2), _SDT_OP(3, a3))
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)                         \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, _SDT_FMT(1) " " _SDT_FMT(2) \
+                " " _SDT_FMT(3) " " _SDT_FMT(4))                              \
+            :: _SDT_OP(1, a1), _SDT_OP(2, a2), _SDT_OP(3, a3), _SDT_OP(4, a4))
+#define DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)                     \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, _SDT_FMT(1) " " _SDT_FMT(2) \
+                " " _SDT_FMT(3) " " _SDT_FMT(4) " " _SDT_FMT(5))              \
+            :: _SDT_OP(1, a1), _SDT_OP(2, a2), _SDT_OP(3, a3), _SDT_OP(4, a4), \
+            _SDT_OP(5, a5))
+#define DTRACE_PROBE6(provider, name, a1, a2, a3, a4, a5, a6)                 \
+    __asm__ __volatile__ (_SDT_PROBE(provider, name, _SDT_FMT(1) " " _SDT_FMT(2) \
+                " " _SDT_FMT(3) " " _SDT_FMT(4) " " _SDT_FMT(5) " " _SDT_FMT(6)) \
+            :: _SDT_OP(1, a1), _SDT_OP(2, a2), _SDT_OP(3, a3), _SDT_OP(4, a4), \
+            _SDT_OP(5, a5), _SDT_OP(6, a6))
+
+#endif /* SDT_DISABLE */
+
+#endif
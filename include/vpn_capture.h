@@ -0,0 +1,146 @@
+#ifndef VPN_CAPTURE_H
+#define VPN_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vpn_net.h"
+
+namespace vpn {
+
+/* Where a packet is captured, the interfaces of the pcapng file */
+enum CapturePoint {
+    /* As clients see it: from them before SNAT, to them after DNAT */
+    CAPTURE_PRE_NAT = 0,
+    /* As the internet sees it: to tun after SNAT, from tun before DNAT */
+    CAPTURE_POST_NAT
+};
+
+/*
+ * A filter in the manner of tcpdump's: primitives joined by "and", each
+ * may follow "not". Primitives are ip, ip6, tcp, udp, icmp, icmp6,
+ * [src|dst] host <addr> and [src|dst] port <port>. Empty matches every
+ * packet. IPv6 extension headers are followed.
+ * */
+class CaptureFilter {
+public:
+    CaptureFilter() {  }
+
+    /* Return false and leave this as it was if text is no filter */
+    bool parse(const std::string& text, std::string *error);
+    bool match(const FlowTuple& tuple) const;
+    const std::string& text() const { return _text; }
+private:
+    enum Kind {
+        F_VERSION = 0,
+        F_PROTOCOL,
+        F_HOST,
+        F_PORT
+    };
+    enum Side {
+        EITHER = 0,
+        SRC,
+        DST
+    };
+    struct Term {
+        Kind  kind;
+        Side  side;
+        bool  negate;
+        int   number;
+        Addr  addr;
+    };
+    std::vector<Term>  _terms;
+    std::string        _text;
+};
+
+/* What to capture and how much of it */
+struct CaptureOptions {
+    std::string    filter;
+    /* One in this many packets the filter matches */
+    int            sample;
+    /* Bytes kept of a packet */
+    int            snaplen;
+
+    CaptureOptions() : sample(1), snaplen(128) {  }
+};
+
+/*
+ * Copies of packets into a ring in memory of its own(mmap), written out
+ * as pcapng by a thread of the capture. A packet is taken where it
+ * enters, with sample(), and added there and after NAT under the same
+ * id, so both copies can be told apart and matched up. Start and stop
+ * on the thread that adds; the data path pays one load while stopped.
+ * A full ring drops copies.
+ * */
+class Capture {
+public:
+    Capture();
+    ~Capture();
+    Capture(const Capture&) = delete;
+    Capture& operator=(const Capture&) = delete;
+
+    /* Return false with an error if the filter is wrong or path can't
+     * be opened */
+    bool start(const std::string& path, const CaptureOptions& options, std::string *error);
+    void stop();
+    bool running() const { return _running.load(std::memory_order_relaxed); }
+
+    /* The id to add the packet under if it is taken, 0 if not */
+    uint32_t sample(const char *packet, int size) {
+        if (!running()) {
+            return 0;
+        }
+        return take(packet, size);
+    }
+    void add(uint32_t id, CapturePoint point, int direction, uint32_t session,
+            const char *packet, int size);
+
+    /* Where, what, and how many copies were written and dropped */
+    std::string to_string() const;
+private:
+    struct Slot {
+        uint64_t  ts;
+        uint32_t  id;
+        uint32_t  session;
+        uint32_t  size;
+        uint16_t  caplen;
+        uint8_t   point;
+        uint8_t   direction;
+    };
+
+    CaptureOptions         _options;
+    CaptureFilter          _filter;
+    std::string            _path;
+    FILE                  *_out;
+    std::atomic<bool>      _running;
+    std::thread            _thread;
+
+    /* Of the ring, slots of _slot_size bytes mapped together */
+    char                  *_ring;
+    uint64_t               _slots;
+    uint64_t               _slot_size;
+    char                   _pad0[64];
+    std::atomic<uint64_t>  _head;
+    uint64_t               _cached_tail;
+    uint32_t               _seen;
+    uint32_t               _next_id;
+    std::atomic<uint64_t>  _dropped;
+    char                   _pad1[64];
+    std::atomic<uint64_t>  _tail;
+    std::atomic<uint64_t>  _written;
+
+    uint32_t take(const char *packet, int size);
+    void run();
+    /* Write what the ring holds, return the number of copies */
+    int drain();
+    void write_header();
+};
+
+} /* namespace vpn */
+
+#endif
@@ -5,24 +5,153 @@
 #include <netinet/in.h>
 
 #include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include "vpn_common.h"
+#include "vpn_path.h"
+#include "vpn_queue.h"
+#include "vpn_stream.h"
+#include "vpn_tunnel.h"
 
 namespace vpn {
 
+struct ClientOptions {
+    /* One path per local binding and server address */
+    std::vector<std::string>  srv_addrs;
+    int                       srv_port;
+    /* Local addresses or interface names, empty means the default route */
+    std::vector<std::string>  bind_addrs;
+    Scheduler::Mode           scheduler;
+    /* At least 1, the event loop wakes up this often */
+    int                       probe_interval_ms;
+    /* TCP for networks that block UDP, see Stream */
+    Socket::Type              transport;
+    /* Run tun -> network and network -> tun on two threads, UDP only */
+    bool                      threads;
+    /* Pin them to cpu and cpu + 1, -1 means no pinning */
+    int                       cpu;
+    /* Open the tun device with IFF_MULTI_QUEUE, one client per queue */
+    bool                      multi_queue;
+    /* Attach to this device as another queue, empty creates one */
+    std::string               tun_name;
+    /* Queue upstream packets fairly and let them out at this many bytes
+     * per second, 0 sends them at once */
+    uint64_t                  shape_rate;
+    int                       queue_limit;
+    /* Find the path MTU of every path and fit the tun MTU to it, UDP only */
+    bool                      pmtu;
+    TunnelOptions             tunnel;
+
+    ClientOptions() : srv_addrs(), srv_port(-1), bind_addrs(),
+        scheduler(Scheduler::WRR), probe_interval_ms(200), transport(Socket::UDP),
+        threads(false), cpu(-1), multi_queue(false), tun_name(), shape_rate(0),
+        queue_limit(1024), pmtu(true), tunnel() {  }
+};
+
 class Client {
 public:
-    Client(const std::string& addr, int port);
+    Client(const ClientOptions& options);
+    /* Use the devices given instead of tun and a UDP socket to the server,
+     * eg: QueueDevice, which need no root. One server address, UDP, no
+     * threads and no pmtu. The devices outlive the client. */
+    Client(const ClientOptions& options, PacketDevice *tun, PacketDevice *socket);
     Client(const Client&) = delete;
     bool operator=(const Client&) = delete;
 
+    /* Print session stats every seconds, 0 means never */
+    void set_stats_interval(int seconds) { _stats_interval = seconds; }
+
     void run();
+    /* One round of the event loop without threads, waiting most
+     * milliseconds at most, -1 is no bound */
+    void poll(int most = -1) { step(true, true, most); }
+
+    std::string tun_name() { return _own_tun ? _own_tun->name() : std::string(); }
+    /* Session and path stats, also asked for by the control thread */
+    std::string stats();
 private:
-    Socket _socket;
+    struct Path {
+        std::shared_ptr<Socket>  socket;
+        /* What datagrams go by, the socket or the device given, nullptr
+         * while the path is broken */
+        PacketDevice            *device;
+        /* Only with TCP */
+        std::shared_ptr<Stream>  stream;
+        struct sockaddr_in6      dest;
+        std::string              bind;
+        std::string              name;
+        /* When to reconnect a broken stream */
+        uint64_t                 retry_at;
+    };
+
     Epoll  _epoll;
-    Tun    _tun;
-    int    _srv_port;
-    std::string  _srv_addr;
+    /* Sockets, when they have a thread of their own */
+    Epoll  _net_epoll;
+    /* Made here unless devices were given */
+    std::unique_ptr<Tun>  _own_tun;
+    PacketDevice         *_tun;
+    /* Given in place of the socket of the only path */
+    PacketDevice         *_device;
+
+    std::vector<Path>       _paths;
+    std::vector<PathStats>  _path_stats;
+    Scheduler               _scheduler;
+    Socket::Type            _transport;
+    bool                    _threads;
+    int                     _cpu;
+    /* Guards path stats and the scheduler, both directions use them */
+    std::mutex              _path_lock;
+    int                     _probe_interval_ms;
+    uint32_t                _probe_id;
+    uint64_t                _last_probe;
+    /* One per path with pmtu, guarded by _path_lock too */
+    std::vector<MtuProber>  _mtu;
+    /* What the smallest path MTU found leaves for inner packets, the
+     * MTU of tun */
+    int                     _tun_mtu;
+
+    Session  _session;
+    int      _stats_interval;
+    /* When stats were printed, by rx */
+    time_t   _last_stats;
+    /* Only with shaping, used by tx alone */
+    std::unique_ptr<FairQueue>  _queue;
+
+    /* Datagram buffers of one batch, parities may follow the last packet */
+    char     _rx[BATCH_SIZE][MAX_DATAGRAM];
+    char     _tx[BATCH_SIZE + FEC_MAX_M][MAX_DATAGRAM];
+
+    /* Adopts own_tun, or uses the devices given */
+    Client(const ClientOptions& options, Tun *own_tun, PacketDevice *tun, PacketDevice *socket);
+
+    /* Event loop of tx(tun -> network), rx(network -> tun) or both */
+    void loop(bool tx, bool rx);
+    /* One round of it */
+    void step(bool tx, bool rx, int most);
+    Epoll& net_epoll() { return _threads ? _net_epoll : _epoll; }
+
+    void tun2socket();
+    /* Send what the rate allows from _queue */
+    void drain();
+    void socket2tun(int path);
+    void stream2tun(int path);
+    /* Open the socket of a path, and close a broken one */
+    void connect(int path);
+    void disconnect(int path);
+    /* Datagrams that came by path */
+    void receive(Datagram *batch, int n, int path);
+    void tick(bool tx, bool rx);
+    void probe(uint64_t now);
+    /* Send the MTU probes that are due, fit tun to what they found */
+    void probe_mtu(uint64_t now);
+
+    /* Append pending parities to batch, going the way of path */
+    int take_parities(Datagram *batch, int *paths, int path, int n);
+    /* Send datagrams of batch through paths[i] */
+    void send(Datagram *batch, const int *paths, int n);
+    void write_ready();
 };
 
 } /* namespace vpn */
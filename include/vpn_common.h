@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <unistd.h>
 
 #include <string>
@@ -22,31 +24,64 @@
 
 namespace vpn {
 
-class Tun {
+/*
+ * Where packets are read from and written to: a tun device, a UDP
+ * socket, or a queue in memory(QueueDevice) for benchmarks. fd() turns
+ * readable when there is something to read. Datagram devices fill in
+ * and take the peer from msg_name of the batched calls, others leave
+ * it alone, and do them a packet at a time by default.
+ * */
+class PacketDevice {
+public:
+    PacketDevice() = default;
+    virtual ~PacketDevice() {  }
+    PacketDevice(const PacketDevice&) = delete;
+    PacketDevice& operator=(const PacketDevice&) = delete;
+
+    virtual int fd() = 0;
+    /* Non-blocking, -1 with EAGAIN when drained */
+    virtual int read(char* out, int size) = 0;
+    virtual int write(const void* in, int size) = 0;
+    /* Return the number of messages handled or -1 */
+    virtual int recvmmsg(struct mmsghdr* msgs, int n);
+    virtual int sendmmsg(struct mmsghdr* msgs, int n);
+};
+
+class Tun : public PacketDevice {
 public:
     Tun();
     Tun(const std::string& addr);
+    /* One queue of a IFF_MULTI_QUEUE device, each queue has its own fd.
+     * An empty name creates the device, others attach to it by name. */
+    Tun(const std::string& name, bool multi_queue);
     ~Tun();
     Tun(const Tun&) = delete;
     Tun& operator=(const Tun&) = delete;
 
     int up();
+    int set_mtu(int mtu);
+    /* Route an IPv6 address to tun without taking it, so packets to it
+     * come out of the device. ip() is reached the same way. */
+    int route6(const std::string& addr);
 
-    int fd() { return _fd; }
+    int fd() override { return _fd; }
     std::string ip() { return _ip; }
+    std::string ip6() { return _ip6; }
     std::string name() { return _name; }
 
-    int write(const void* in, int size) { return ::write(_fd, in, size); }
-    int read(char* out, int size) { return ::read(_fd, out, size); }
+    int write(const void* in, int size) override { return ::write(_fd, in, size); }
+    /* Non-blocking, -1 with EAGAIN when drained */
+    int read(char* out, int size) override { return ::read(_fd, out, size); }
 private:
     int  _fd;
     std::string _ip;
+    std::string _ip6;
     std::string _name;
 
-    void init();
+    void init(const std::string& name = "", bool multi_queue = false);
 };
 
-class Socket {
+class Socket : public PacketDevice {
 public:
     enum Domain {
         IPv4 = 0,
@@ -57,23 +92,79 @@ public:
         UDP
     };
     Socket(Domain d, Type t);
+    /* Adopt a connected TCP socket, eg: from accept() */
+    explicit Socket(int fd);
     ~Socket();
     Socket(const Socket&) = delete;
     Socket& operator=(const Socket&) = delete;
 
-    int fd() { return _fd; }
+    int fd() override { return _fd; }
 
-    // just support UDP now
+    /* An IPv6 socket is dual-stack, IPv4 peers show up as v4-mapped
+     * addresses(RFC 4291), so one sockaddr_in6 fits every peer */
     int bind(int port);
+    int bind(const std::string& addr, int port);
+    /* Send through an interface whatever the routes say, needs root */
+    int bind_device(const std::string& name);
     int sendto(const void* in, int size, const std::string& addr, int port);
     int sendto(const void* in, int size, struct sockaddr* sock, int sock_len);
     int recvfrom(char* out, int size, struct sockaddr* src, socklen_t* len);
+
+    /* Batched I/O, return the number of messages handled or -1.
+     * recvmmsg() blocks for the first message only. */
+    int recvmmsg(struct mmsghdr* msgs, int n) override;
+    int sendmmsg(struct mmsghdr* msgs, int n) override;
+
+    /* A connected UDP socket needs no address per datagram, and only
+     * receives from dest. A TCP one is non-blocking from here on, and
+     * 0 is returned while the connection is in progress. */
+    int connect(const struct sockaddr_in6& dest);
+
+    /* TCP only, the socket is non-blocking once listening */
+    int listen(int backlog = 128);
+    /* Return a non-blocking fd or -1 */
+    int accept(struct sockaddr_in6* from);
+    int read(char* out, int size) override { return ::read(_fd, out, size); }
+    /* Of a connected socket */
+    int write(const void* in, int size) override { return ::write(_fd, in, size); }
+    int writev(const struct iovec* iov, int n);
+
+    /* Both directions, beyond net.core.[rw]mem_max when root */
+    int set_buffers(int bytes);
+    /* TCP_NODELAY, and TCP_NOTSENT_LOWAT so unsent bytes wait in user
+     * space instead of queueing up latency in the kernel */
+    int set_low_latency(int lowat);
+    /* UDP only, let an SCM_TXTIME cmsg of CLOCK_MONOTONIC ns set when a
+     * datagram leaves. Only the fq qdisc honours it, see txtime_qdisc(). */
+    int set_txtime();
+    /* UDP only, stamp datagrams with their arrival in an SCM_TIMESTAMPNS
+     * cmsg of CLOCK_REALTIME */
+    int set_timestamps();
+    /* UDP only. Set DF and ignore the path MTU the kernel learned, so a
+     * probe larger than the path is lost instead of fragmented. Off goes
+     * back to the default(IP_PMTUDISC_WANT). Both families are set on an
+     * IPv6 socket, whichever the peer is. */
+    int set_mtu_probe(bool on);
+    /* MTU of the route of a connected socket, -1 if unknown */
+    int mtu();
 private:
     int _fd;
     int _type;
     int _domain;
 };
 
+/* addr of either family as an IPv6 socket address, an IPv4 one mapped.
+ * Return false if addr is neither. */
+bool make_sockaddr(const std::string& addr, int port, struct sockaddr_in6 *sock);
+/* Whether a socket address is of an IPv4 peer */
+bool is_v4(const struct sockaddr_in6& sock);
+/* "addr:port", or "[addr]:port" for IPv6 */
+std::string sockaddr_string(const struct sockaddr_in6& sock);
+
+/* Whether the interface the route to dest goes by has an fq qdisc, which
+ * sends datagrams at their SO_TXTIME */
+bool txtime_qdisc(const struct sockaddr_in6& dest);
+
 class Epoll {
 public:
     Epoll();
@@ -82,7 +173,11 @@ public:
     Epoll& operator=(const Epoll&) = delete;
 
     int add_read_event(int fd);
-    std::vector<struct epoll_event> wait();
+    /* Also wait for fd to be writable, or stop */
+    int set_write_event(int fd, bool on);
+    int del_event(int fd);
+    /* timeout in milliseconds, -1 means forever */
+    std::vector<struct epoll_event> wait(int timeout = -1);
 private:
     int  _fd;
 };
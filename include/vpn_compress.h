@@ -0,0 +1,32 @@
+#ifndef VPN_COMPRESS_H
+#define VPN_COMPRESS_H
+
+namespace vpn {
+
+/*
+ * A small LZ77 compressor in the spirit of LZ4, tuned for single packets.
+ *
+ * Block format, a list of sequences:
+ *      ----------------------------------------------------------------
+ *      | token | [lit len ext] | literals | offset(LE16) | [match ext] |
+ *      ----------------------------------------------------------------
+ * token's high nibble is the literal length and the low nibble is the
+ * match length minus LZ_MIN_MATCH, 15 means "followed by 255-terminated
+ * extension bytes". The last sequence carries literals only.
+ * */
+static const int LZ_MIN_MATCH = 4;
+
+/* Return the compressed size, or -1 if the output is not smaller
+ * than the input (the caller should send the data as is) */
+int lz_compress(const char *in, int size, char *out, int cap);
+
+/* Return the decompressed size, or -1 on malformed input */
+int lz_decompress(const char *in, int size, char *out, int cap);
+
+/* Shannon entropy in bits per byte, estimated from a strided sample
+ * of at most 256 bytes. Compressed or encrypted data is close to 8. */
+double lz_entropy(const char *data, int size);
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef VPN_CONTROL_H
+#define VPN_CONTROL_H
+
+#include <functional>
+#include <map>
+#include <string>
+
+namespace vpn {
+
+/*
+ * A local unix socket answering one line commands, eg: "stats". The
+ * owner polls fd() and calls serve(), or leaves it to run() on a thread
+ * of its own. A connection is one command and its reply.
+ * */
+class Control {
+public:
+    /* Get the arguments after the command name, return the reply */
+    using Handler = std::function<std::string(const std::string& args)>;
+
+    Control(const std::string& path);
+    ~Control();
+    Control(const Control&) = delete;
+    Control& operator=(const Control&) = delete;
+
+    /* -1 if the socket could not be bound, or another instance answers on it */
+    int fd() { return _fd; }
+    void handle(const std::string& command, const Handler& handler);
+
+    /* Answer one pending connection */
+    void serve();
+    /* serve() forever */
+    void run();
+
+    /* Send a command to path, return false if nobody answers */
+    static bool query(const std::string& path, const std::string& command,
+            std::string *reply);
+private:
+    int          _fd;
+    std::string  _path;
+    std::map<std::string, Handler>  _handlers;
+};
+
+} /* namespace vpn */
+
+#endif
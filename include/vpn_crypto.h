@@ -0,0 +1,59 @@
+#ifndef VPN_CRYPTO_H
+#define VPN_CRYPTO_H
+
+#include <stdint.h>
+
+namespace vpn {
+
+/* ChaCha20-Poly1305 AEAD, RFC 8439 */
+static const int AEAD_KEY_SIZE = 32;
+static const int AEAD_NONCE_SIZE = 12;
+static const int AEAD_TAG_SIZE = 16;
+
+/*
+ * One AEAD operation of a batch, data is encrypted/decrypted in place.
+ * Operations of a batch may use different keys: the ChaCha20 blocks of
+ * all of them are computed together, several blocks per SIMD kernel call,
+ * so short packets fill the vector lanes as well as long ones.
+ * */
+struct AeadOp {
+    const uint8_t  *key;
+    const uint8_t  *nonce;
+    const uint8_t  *aad;
+    int             aad_len;
+    uint8_t        *data;
+    int             len;
+    /* Written by aead_seal(), checked by aead_open() */
+    uint8_t        *tag;
+    /* Result of aead_open() */
+    bool            ok;
+};
+
+void aead_seal(AeadOp *ops, int n);
+/* Return the number of authentic operations, the others are left as is */
+int aead_open(AeadOp *ops, int n);
+
+/* The name of the ChaCha20 kernel in use, eg: "avx2" */
+const char* aead_kernel();
+
+/* Sliding window of received sequence numbers */
+class ReplayWindow {
+public:
+    ReplayWindow();
+
+    /* False if seq is too old or has been seen */
+    bool check(uint64_t seq) const;
+    /* Call after the datagram proves authentic */
+    void update(uint64_t seq);
+private:
+    static const int WORDS = 32;
+    static const int BITS = WORDS * 64;
+
+    uint64_t  _top;
+    bool      _empty;
+    uint64_t  _bitmap[WORDS];
+};
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef VPN_FEC_H
+#define VPN_FEC_H
+
+#include <stdint.h>
+
+#include <vector>
+#include <deque>
+
+namespace vpn {
+
+/*
+ * Systematic erasure code over groups of K datagrams plus M parities.
+ * M == 1 is plain XOR parity, M > 1 uses a Cauchy Reed-Solomon matrix
+ * over GF(256), so any K of the K + M symbols rebuild the group.
+ * A symbol is whatever the caller hands in, shorter ones are zero padded.
+ * */
+static const int FEC_MAX_K = 32;
+static const int FEC_MAX_M = 8;
+
+struct FecHeader {
+    uint32_t    group;
+    /* 0..k-1 data, k..k+m-1 parity */
+    uint8_t     index;
+    /* Data symbols in this group, may be less than K on a flushed group */
+    uint8_t     k;
+    uint8_t     m;
+    uint8_t     reserved;
+} __attribute__((packed));
+
+class FecEncoder {
+public:
+    FecEncoder(int k, int m);
+    FecEncoder(const FecEncoder&) = delete;
+    FecEncoder& operator=(const FecEncoder&) = delete;
+
+    /* Add a data symbol, fill *hdr for it (network order).
+     * Return true if the group is full and parities are ready. */
+    bool add(const uint8_t *symbol, int len, FecHeader *hdr);
+    /* Close a partial group, return false if it is empty */
+    bool flush();
+    /* Take the next ready parity, return its length or -1 if none */
+    int take_parity(uint8_t *out, int cap, FecHeader *hdr);
+
+    /* Data symbols in the open group */
+    int pending() const { return _count; }
+private:
+    int       _k;
+    int       _m;
+    uint32_t  _group;
+    int       _count;
+    int       _len;
+    std::vector<std::vector<uint8_t>>  _parity;
+
+    void close();
+
+    /* Parities of the last closed group */
+    int       _ready;
+    int       _next;
+    int       _ready_k;
+    int       _ready_len;
+    uint32_t  _ready_group;
+    std::vector<std::vector<uint8_t>>  _out;
+};
+
+class FecDecoder {
+public:
+    FecDecoder();
+    FecDecoder(const FecDecoder&) = delete;
+    FecDecoder& operator=(const FecDecoder&) = delete;
+
+    /* Feed a received symbol, hdr in network order. Return false if
+     * it is a data symbol that has been rebuilt already(drop it). */
+    bool add(const FecHeader& hdr, const uint8_t *symbol, int len);
+    /* Take a rebuilt data symbol, return its length or -1 if none */
+    int take(uint8_t *out, int cap);
+
+    uint64_t recovered() const { return _recovered; }
+    /* Groups evicted while still missing data */
+    uint64_t unrecoverable() const { return _unrecoverable; }
+private:
+    static const int GROUPS = 16;
+
+    struct Group {
+        uint32_t  id;
+        bool      used;
+        bool      done;
+        /* Data symbols as parities tell, FEC_MAX_K + 1 until one comes,
+         * as data symbols tell, 0 until one comes, and parities. Symbols
+         * that disagree with the first are dropped. */
+        int       k;
+        int       data_k;
+        int       m;
+        int       have;
+        int       len;
+        uint64_t  present;
+        uint64_t  rebuilt;
+        std::vector<std::vector<uint8_t>>  symbols;
+        std::vector<int>                    lens;
+    };
+    Group     _groups[GROUPS];
+    std::deque<std::vector<uint8_t>>  _rebuilt;
+    uint64_t  _recovered;
+    uint64_t  _unrecoverable;
+
+    void rebuild(Group *g);
+};
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef VPN_FRAG_H
+#define VPN_FRAG_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "vpn_nat.h"
+
+namespace vpn {
+
+/* What the fragments of one datagram share(RFC 791, RFC 8200). session
+ * tells clients apart, whose addresses may be the same. 0 for packets
+ * from tun. */
+struct FragKey {
+    uint32_t    session;
+    Addr        saddr;
+    Addr        daddr;
+    uint32_t    id;
+    uint8_t     protocol;
+
+    bool operator==(const FragKey& other) const {
+        return session == other.session && saddr == other.saddr && daddr == other.daddr
+            && id == other.id && protocol == other.protocol;
+    }
+};
+
+struct FragKeyHash {
+    size_t operator()(const FragKey& key) const;
+};
+
+/*
+ * Keeps the fragments of a datagram translated the same way, without
+ * reassembling them. Only the first fragment has ports:
+ *  - From clients, every fragment can be translated alone but the id,
+ *    which is remapped so two clients never share one after SNAT.
+ *  - From tun, the first fragment finds the client by NAT and the others
+ *    follow it by key. Those ahead of it are held until it comes, in a
+ *    bounded cache, then handed out again by take().
+ * Entries live for TIMEOUT, like the kernel's reassembly queues.
+ * */
+class Fragments {
+public:
+    Fragments();
+    Fragments(const Fragments&) = delete;
+    Fragments& operator=(const Fragments&) = delete;
+
+    /* The id every fragment of the datagram from a client goes out with,
+     * IPv4 takes the low 16 bits */
+    uint32_t map_id(const FragKey& key, uint64_t now);
+
+    /* The first fragment of a datagram from tun is for origin, releases
+     * the fragments held for it */
+    void learn(const FragKey& key, const OriginData& origin, uint64_t now);
+    /* Whom a later fragment is for, nullptr if its first one is not seen */
+    const OriginData* lookup(const FragKey& key) const;
+    /* Keep a fragment until learn(), false if it is dropped instead */
+    bool hold(const FragKey& key, const char *packet, int size, uint64_t now);
+    /* The next released fragment, -1 if none */
+    int take(char *out, int cap);
+
+    /* Forget entries and held fragments older than TIMEOUT */
+    void expire(uint64_t now);
+
+    /* Fragments waiting now */
+    int holding() const { return _holding; }
+    uint64_t held() const { return _held; }
+    uint64_t dropped() const { return _dropped; }
+    std::string to_string() const;
+private:
+    static const uint64_t TIMEOUT = 30000000000ULL;
+    /* Per table, the oldest entry makes room for a new one */
+    static const size_t MAX_ENTRIES = 4096;
+    /* Fragments waiting for their first one, all datagrams together */
+    static const int MAX_HELD = 256;
+
+    struct IdEntry {
+        uint32_t  id;
+        uint64_t  at;
+    };
+    struct OriginEntry {
+        OriginData  origin;
+        uint64_t    at;
+    };
+    struct HeldEntry {
+        std::deque<std::string>  packets;
+        uint64_t                 at;
+    };
+    std::unordered_map<FragKey, IdEntry, FragKeyHash>      _ids;
+    std::unordered_map<FragKey, OriginEntry, FragKeyHash>  _origins;
+    std::unordered_map<FragKey, HeldEntry, FragKeyHash>    _pending;
+    /* Keys in the order they were added, for expiry */
+    using Order = std::deque<std::pair<uint64_t, FragKey>>;
+    Order  _id_order;
+    Order  _origin_order;
+    Order  _pending_order;
+    /* Released by learn(), waiting for take() */
+    std::deque<std::string>  _ready;
+
+    uint32_t  _next_id;
+    int       _holding;
+    uint64_t  _held;
+    uint64_t  _dropped;
+
+    /* Drop the oldest entry of a table */
+    template <typename Map>
+    void evict(Map *map, Order *order);
+    void drop_pending(const FragKey& key);
+    /* The oldest key of _pending_order, with its fragments if still held */
+    void pop_pending();
+};
+
+} /* namespace vpn */
+
+#endif
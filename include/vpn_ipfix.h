@@ -0,0 +1,102 @@
+#ifndef VPN_IPFIX_H
+#define VPN_IPFIX_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "vpn_common.h"
+#include "vpn_ring.h"
+
+namespace vpn {
+
+/* natEvent(RFC 8158), NAT66 has none of its own */
+static const uint8_t NAT_EVENT_CREATE = 1;
+static const uint8_t NAT_EVENT_DELETE = 2;
+
+/* IPFIX(RFC 7011) numbers of what the exporter writes */
+static const uint16_t IPFIX_VERSION = 10;
+static const uint16_t IPFIX_TEMPLATE_SET = 2;
+static const uint16_t IPFIX_TEMPLATE_ID = 256;
+/* Of the reverse direction of a biflow(RFC 5103) */
+static const uint32_t IPFIX_REVERSE_PEN = 29305;
+
+/* A NAT mapping made or reclaimed, addresses are IPv6 ones, IPv4 mapped */
+struct FlowRecord {
+    uint64_t  start_ms;
+    /* Last used */
+    uint64_t  end_ms;
+    /* Of the client inside the tunnel */
+    uint8_t   addr[16];
+    uint16_t  port;
+    /* What it is translated to */
+    uint8_t   nat_addr[16];
+    uint16_t  nat_port;
+    /* Where the tunnel of the client ends */
+    uint8_t   peer[16];
+    uint8_t   event;
+    /* From the client, and to it */
+    uint64_t  packets;
+    uint64_t  bytes;
+    uint64_t  reverse_packets;
+    uint64_t  reverse_bytes;
+};
+
+/*
+ * Writes flow records as IPFIX messages, to a file or to a collector
+ * over UDP. Records are pushed by one thread into a ring and encoded by
+ * a thread of the exporter, many to a message. A full ring drops them.
+ * The template goes first and, over UDP, every TEMPLATE_EVERY messages.
+ * */
+class FlowExporter {
+public:
+    FlowExporter();
+    ~FlowExporter();
+    FlowExporter(const FlowExporter&) = delete;
+    FlowExporter& operator=(const FlowExporter&) = delete;
+
+    /* target is a path, or udp:addr:port of a collector. Return false
+     * if it can't be opened. */
+    bool start(const std::string& target);
+    void stop();
+
+    /* Return false if the record is dropped */
+    bool push(const FlowRecord& record) { return _ring.push(record); }
+
+    std::string to_string() const;
+private:
+    /* Fits into a datagram of the usual MTU */
+    static const int MESSAGE_SIZE = 1400;
+    static const int TEMPLATE_EVERY = 32;
+
+    SpscRing<FlowRecord>     _ring;
+    FILE                    *_file;
+    std::unique_ptr<Socket>  _socket;
+    struct sockaddr_in6      _collector;
+    std::atomic<bool>        _running;
+    std::thread              _thread;
+
+    /* Records written before the next message, its sequence number */
+    uint32_t                 _sequence;
+    std::atomic<uint64_t>    _messages;
+    std::atomic<uint64_t>    _exported;
+
+    void run();
+    /* Encode and write what the ring holds, return the records written */
+    int flush();
+    void write(const char *message, int size);
+};
+
+/* Encode the template set into out, return its size */
+int ipfix_template(char *out);
+/* Encode a record of the template into out, return its size */
+int ipfix_record(const FlowRecord& record, char *out);
+
+} /* namespace vpn */
+
+#endif
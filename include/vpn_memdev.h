@@ -0,0 +1,74 @@
+#ifndef VPN_MEMDEV_H
+#define VPN_MEMDEV_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <vector>
+
+#include "vpn_common.h"
+
+namespace vpn {
+
+/*
+ * A PacketDevice of two queues in memory, standing in for tun or a UDP
+ * socket so the forwarding code runs without root or a network, eg: in
+ * benchmarks. The far end inject()s what read() returns and take()s what
+ * was written. fd() is an eventfd, readable while something waits to be
+ * read, so the device goes into an Epoll like a real one. Slots are
+ * allocated once, a full queue drops packets. Safe to use from two
+ * threads.
+ * */
+class QueueDevice : public PacketDevice {
+public:
+    /* capacity packets of up to mtu bytes each way */
+    explicit QueueDevice(int capacity = 1024, int mtu = 4096);
+    ~QueueDevice();
+
+    int fd() override { return _event; }
+    int read(char* out, int size) override;
+    int write(const void* in, int size) override;
+    int recvmmsg(struct mmsghdr* msgs, int n) override;
+    int sendmmsg(struct mmsghdr* msgs, int n) override;
+
+    /* The far end. from is the peer recvmmsg() tells, return false if
+     * the packet is dropped */
+    bool inject(const void* data, int size, const struct sockaddr_in6* from = nullptr);
+    /* What was written, and the peer it was sent to. -1 if nothing. */
+    int take(char* out, int size, struct sockaddr_in6* to = nullptr);
+
+    /* Written and not taken yet */
+    int pending();
+    /* By full queues, both ways */
+    uint64_t dropped();
+private:
+    struct Slot {
+        int                  size;
+        struct sockaddr_in6  peer;
+        std::vector<char>    data;
+    };
+    struct Queue {
+        std::vector<Slot>  slots;
+        size_t             head;
+        size_t             count;
+    };
+    int         _event;
+    bool        _readable;
+    int         _mtu;
+    std::mutex  _lock;
+    /* Read by this side, written by it */
+    Queue       _in;
+    Queue       _out;
+    uint64_t    _dropped;
+
+    /* The slot to fill at the tail, nullptr if queue is full */
+    Slot* push(Queue* queue);
+    int pop(Queue* queue, char* out, int size, struct sockaddr_in6* peer);
+    /* Readable as long as _in holds something, call with _lock held */
+    void signal();
+};
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef VPN_METRICS_H
+#define VPN_METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace vpn {
+
+/*
+ * Counters and histograms cheap enough for the data path. Every thread
+ * writes a shard of its own, on its own cache lines, with plain relaxed
+ * stores; reads add the shards up. Shards are made on a thread's first
+ * write, without locks. Threads past METRICS_THREADS share the last
+ * shard, which is written atomically.
+ * */
+static const int METRICS_THREADS = 64;
+
+/* Shard of the calling thread */
+int next_metrics_thread();
+inline int metrics_thread() {
+    static thread_local int index = next_metrics_thread();
+    return index;
+}
+
+class Counter {
+public:
+    Counter();
+    ~Counter();
+    Counter(const Counter&) = delete;
+    Counter& operator=(const Counter&) = delete;
+
+    void add(uint64_t n = 1) {
+        int thread = metrics_thread();
+        Shard *shard = _shards[thread].load(std::memory_order_acquire);
+        if (shard == nullptr) {
+            shard = make(thread);
+        }
+        if (thread < METRICS_THREADS - 1) {
+            shard->value.store(shard->value.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+        } else {
+            shard->value.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+    uint64_t value() const;
+private:
+    struct Shard {
+        std::atomic<uint64_t>  value;
+        char                   pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    std::atomic<Shard*>  _shards[METRICS_THREADS];
+
+    Shard* make(int thread);
+};
+
+/*
+ * Log-linear buckets in the manner of HdrHistogram: 16 per power of 2,
+ * so a value is known to within 1/16, from 1 up to 2^40(18 minutes of
+ * nanoseconds). Larger values go into the last bucket.
+ * */
+class Histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = (40 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    /* Merged over threads */
+    struct Snapshot {
+        std::vector<uint64_t>  buckets;
+        uint64_t               count;
+        uint64_t               sum;
+
+        /* The value q(0..1) of them are below, 0 if empty */
+        uint64_t quantile(double q) const;
+        /* How many are below value, a power of 2 */
+        uint64_t below(uint64_t value) const;
+        /* p50, p99 and p99.9 of nanoseconds in us */
+        std::string to_string() const;
+    };
+
+    Histogram();
+    ~Histogram();
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t value) {
+        int thread = metrics_thread();
+        Shard *shard = _shards[thread].load(std::memory_order_acquire);
+        if (shard == nullptr) {
+            shard = make(thread);
+        }
+        int index = bucket(value);
+        if (thread < METRICS_THREADS - 1) {
+            bump(&shard->buckets[index], 1);
+            bump(&shard->count, 1);
+            bump(&shard->sum, value);
+        } else {
+            shard->buckets[index].fetch_add(1, std::memory_order_relaxed);
+            shard->count.fetch_add(1, std::memory_order_relaxed);
+            shard->sum.fetch_add(value, std::memory_order_relaxed);
+        }
+    }
+    Snapshot snapshot() const;
+
+    static int bucket(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        int index = ((shift + 1) << SUB_BITS) + ((value >> shift) & (SUB_BUCKETS - 1));
+        return index < BUCKETS ? index : BUCKETS - 1;
+    }
+    /* Smallest value of a bucket */
+    static uint64_t lowest(int index);
+private:
+    struct Shard {
+        /* Away from whatever was allocated before */
+        char                   pad[64];
+        std::atomic<uint64_t>  count;
+        std::atomic<uint64_t>  sum;
+        std::atomic<uint64_t>  buckets[BUCKETS];
+    };
+    std::atomic<Shard*>  _shards[METRICS_THREADS];
+
+    static void bump(std::atomic<uint64_t> *value, uint64_t n) {
+        value->store(value->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    Shard* make(int thread);
+};
+
+/*
+ * Named metrics, exported in the Prometheus text format. Metrics of a
+ * name differ by labels, eg: direction="up". Register before the data
+ * path runs; the Counter and Histogram returned live as long as this.
+ * */
+class Metrics {
+public:
+    Metrics() {  }
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    Counter* counter(const std::string& name, const std::string& help,
+            const std::string& labels = "");
+    /* Histogram of nanoseconds, exported in seconds */
+    Histogram* histogram(const std::string& name, const std::string& help,
+            const std::string& labels = "");
+    /* Values kept elsewhere, read by to_prometheus() on its thread */
+    void counter(const std::string& name, const std::string& help, const std::string& labels,
+            const std::function<uint64_t()>& read);
+    void gauge(const std::string& name, const std::string& help, const std::string& labels,
+            const std::function<double()>& read);
+
+    std::string to_prometheus() const;
+private:
+    enum Type {
+        COUNTER = 0,
+        GAUGE,
+        HISTOGRAM
+    };
+    struct Series {
+        std::string                  labels;
+        std::unique_ptr<Counter>     counter;
+        std::unique_ptr<Histogram>   histogram;
+        std::function<double()>      read;
+    };
+    struct Family {
+        std::string          name;
+        std::string          help;
+        Type                 type;
+        std::vector<Series>  series;
+    };
+    /* In the order they were registered */
+    std::vector<Family>  _families;
+    mutable std::mutex   _lock;
+
+    Series* add(const std::string& name, const std::string& help, Type type,
+            const std::string& labels);
+};
+
+} /* namespace vpn */
+
+#endif
@@ -2,19 +2,28 @@
 #define VPN_NAT_H
 
 #include <netinet/in.h>
+#include <stdint.h>
 
+#include <functional>
 #include <unordered_map>
 #include <string>
 #include <memory>
 
+#include "vpn_net.h"
+
 namespace vpn {
 
 struct NATNode {
-    struct sockaddr_in sock;
-    std::string  addr;
+    struct sockaddr_in6 sock;
+    uint32_t     session;
+    Addr         addr;
     time_t       use;
+    time_t       created;
     int          port;
     int          new_port;
+    /* From the client and to it, since created */
+    uint64_t     packets[2];
+    uint64_t     bytes[2];
 
     NATNode     *prev;
     NATNode     *next;
@@ -23,49 +32,63 @@ struct NATNode {
 };
 
 struct OriginData {
-    struct sockaddr_in sock;
-    std::string addr;
+    struct sockaddr_in6 sock;
+    uint32_t session;
+    Addr addr;
     int port;
 };
 
 class NAT {
 public:
+    /* A mapping of a port was made(true) or reclaimed */
+    using Observer = std::function<void(const NATNode& node, bool created)>;
+
     explicit NAT();
     ~NAT();
     NAT(const NAT&) = delete;
     NAT& operator=(const NAT&) = delete;
 
-    /* Return a new port */
-    int snat(const std::string& addr, int port, struct sockaddr_in sock);
-    /* Return the OriginData
+    /* Return a new port. Ports are shared by both families, addr
+     * tells them apart on the way back. size is counted to the mapping. */
+    int snat(const Addr& addr, int port, const struct sockaddr_in6& sock, uint32_t session,
+            int size = 0);
+    /* Fill the OriginData, return false if none
      * Port is returned by a previous snat()
      * */
-    std::shared_ptr<OriginData> dnat(int port);
+    bool dnat(int port, OriginData *origin, int size = 0);
 
     /* Available to ICMP */
-    void snat(const std::string& saddr, const std::string& daddr, struct sockaddr_in sock);
-    std::shared_ptr<OriginData> dnat(const std::string& daddr);
+    void snat(const Addr& saddr, const Addr& daddr,
+            const struct sockaddr_in6& sock, uint32_t session);
+    bool dnat(const Addr& daddr, OriginData *origin);
+
+    /* Ports in use and addresses known to ICMP */
+    int ports() const { return _used; }
+    size_t addrs() const { return _addrmap.size(); }
+    /* Told of port mappings as they come and go, on the calling thread */
+    void set_observer(const Observer& observer) { _observer = observer; }
+    /* Reclaim ports unused for timeout seconds, 0 reclaims all of them */
+    void prune(int timeout);
 private:
     /* Dummy head of list */
     NATNode  _nat;
     NATNode  _in_use;
+    int      _used;
+    Observer _observer;
 
     /* Available to ICMP */
-    using AddrMap = std::unordered_map<std::string, OriginData>;
+    using AddrMap = std::unordered_map<Addr, OriginData, AddrHash>;
     AddrMap  _addrmap;
 
     void init();
 
     /* TODO: Using skiplist to optimize */
     NATNode* lookup(int port);
-    NATNode* lookup(const std::string& addr, int port);
+    NATNode* lookup(const Addr& addr, int port);
 
     void remove(NATNode *node);
     void append(NATNode *list, NATNode *node);
 
-    /* Prune _in_use when _nat is empty */
-    void prune(int timeout);
-
     bool empty(const NATNode *list);
 };
 
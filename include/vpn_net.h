@@ -2,6 +2,7 @@
 #define VPN_NET_H
 
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 #include <linux/icmp.h>
@@ -17,9 +18,36 @@ enum Protocol {
     P_TCP,
     P_UDP,
     P_IP,
+    P_ICMP6,
     P_NSY  // Not support yet
 };
 
+/* IPv4 flags and fragment offset, netinet/ clashes with linux/ */
+static const uint16_t IP_FRAG_MF = 0x2000;
+static const uint16_t IP_FRAG_OFFSET = 0x1fff;
+
+/* An IPv4 or IPv6 address as it lies in a packet, IPv4 takes the first
+ * 4 bytes. Compared and hashed without allocating, unlike strings. */
+struct Addr {
+    /* AF_INET or AF_INET6, 0 is no address */
+    uint8_t     family;
+    uint8_t     bytes[16];
+
+    Addr() : family(0), bytes() {  }
+    Addr(int af, const void *raw);
+
+    /* Either family, an empty Addr if it is neither */
+    static Addr parse(const std::string& text);
+    std::string to_string() const;
+    int size() const { return family == AF_INET6 ? 16 : 4; }
+    bool operator==(const Addr& other) const;
+    bool operator!=(const Addr& other) const { return !(*this == other); }
+};
+
+struct AddrHash {
+    size_t operator()(const Addr& addr) const;
+};
+
 class Inner {
 public:
     Inner() = default;
@@ -54,6 +82,7 @@ public:
     int dport() { return ntohs(_tcp->dest); }
     int set_sport(int port) { return _tcp->source = htons(port); }
     int set_dport(int port) { return _tcp->dest = htons(port); }
+    void attach(char *data) { _tcp = reinterpret_cast<struct tcphdr*>(data); }
 
     int checksum() { return ntohs(_tcp->check); }
     void calc_checksum(const struct iphdr *ip);
@@ -73,6 +102,7 @@ public:
     int dport() { return ntohs(_udp->dest); }
     int set_sport(int port) { return _udp->source = htons(port); }
     int set_dport(int port) { return _udp->dest = htons(port); }
+    void attach(char *data) { _udp = reinterpret_cast<struct udphdr*>(data); }
 
     int checksum() { return ntohs(_udp->check); }
     void calc_checksum(const struct iphdr *ip);
@@ -82,17 +112,24 @@ private:
 
 class ICMP : public Inner {
 public:
-    ICMP(char *data);
+    explicit ICMP(char *data);
     ~ICMP() = default;
     ICMP& operator=(const ICMP&) = delete;
     ICMP(const ICMP&) = delete;
 
+    void attach(char *data) { _icmp = reinterpret_cast<struct icmphdr*>(data); }
+
     int checksum() { return ntohs(_icmp->checksum); };
     void calc_checksum(const struct iphdr *ip);
 private:
     struct icmphdr* _icmp;
 };
 
+/*
+ * An IPv4 or IPv6 packet. IPv4 options and IPv6 extension headers are
+ * skipped to find the transport header. Nothing is allocated with REUSE,
+ * which is what the data path uses.
+ * */
 class IP {
 public:
     /* Reuse or alloc memory */
@@ -100,34 +137,133 @@ public:
         REUSE = 0,
         ALLOC = 1
     };
+    /* data has to pass valid() */
     explicit IP(char *data, int size, Memory option);
     ~IP();
     IP& operator=(const IP&) = delete;
     IP(const IP&) = delete;
 
+    /* A whole IPv4 header, options included, or an IPv6 header with a
+     * readable chain of extension headers, and a length that covers the
+     * headers and fits into size */
+    static bool valid(const char *data, int size);
+
+    int version() { return _version; }
     std::string saddr();
     std::string daddr();
     void set_saddr(const std::string& addr);
     void set_daddr(const std::string& addr);
+    /* Same without strings, addr has to be of the packet's family */
+    Addr src();
+    Addr dst();
+    void set_src(const Addr& addr);
+    void set_dst(const Addr& addr);
 
-    Protocol protocol();
+    Protocol protocol() { return _protocol; }
+    /* The ECN field, 0 is not ECN capable, 3 is CE */
+    int ecn();
+    void set_ecn(int ecn);
+    /* nullptr if the transport header is not in this packet, as in every
+     * fragment but the first */
     Inner* inner() { return _inner; };
     int size() { return _size; }
+    /* IPv4 options or IPv6 extension headers included */
+    int header_size() { return _l4; }
+
+    /* One of several fragments, only the first(offset 0) has the
+     * transport header. Fragments of a datagram share addresses,
+     * protocol and id, which is 32 bits for IPv6. */
+    bool fragment() { return _fragment; }
+    int offset() { return _offset; }
+    uint32_t id() { return _id; }
+    void set_id(uint32_t id);
 
     int checksum() { return ntohs(_ip->check); }
+    /* The IPv4 header checksum, IPv6 has none */
     void calc_checksum();
 
+    /* Fix the checksums and return the packet. TCP, UDP and ICMPv6
+     * checksums are updated for the addresses and ports that changed
+     * (RFC 1624), which also works for a first fragment whose checksum
+     * covers the others. ICMP ones are computed anew, but left alone in
+     * fragments. */
     const char* raw_data();
 private:
+    /* Both addresses and both ports of IPv6 */
+    static const int PSEUDO_WORDS = 18;
+
     struct iphdr  *_ip;
+    struct ipv6hdr  *_ip6;
     Memory   _option;
     Inner   *_inner;
     char    *_data;
     int      _size;
+    int      _version;
+    Protocol _protocol;
+    /* Where the transport header starts */
+    int      _l4;
+    bool     _fragment;
+    int      _offset;
+    uint32_t _id;
+    /* Where the id of an IPv6 fragment header is */
+    int      _id_at;
+    /* Inner points to one of them */
+    TCP      _tcp;
+    UDP      _udp;
+    ICMP     _icmp;
+    /* Addresses and ports as they were, see raw_data() */
+    uint16_t _origin[PSEUDO_WORDS];
 
     void init(char *data, int isze, Memory option);
+    /* Words of addresses and ports as they are now */
+    void pseudo_words(uint16_t *words);
+    void update_checksum();
+};
+
+/* Lower the MSS option of a TCP SYN or SYN-ACK to mss, updating the
+ * checksum incrementally. Return true if it was lowered. mss is for
+ * IPv4, 20 less is used for IPv6. */
+bool clamp_mss(char *packet, int size, int mss);
+
+/* Addresses, protocol and ports of a packet as it lies in memory */
+struct FlowTuple {
+    int       version;
+    /* IPPROTO_* */
+    uint8_t   protocol;
+    Addr      src;
+    Addr      dst;
+    /* 0 for other protocols and later fragments */
+    int       sport;
+    int       dport;
 };
 
+/* Return false if the headers don't fit into size */
+bool flow_tuple(const char *packet, int size, FlowTuple *tuple);
+
+/* The packet an ICMP or ICMPv6 error quotes, see icmp_quote() */
+struct Quote {
+    int        family;
+    /* The quoted IP header and transport header, the latter 8 bytes at
+     * least */
+    char      *ip;
+    char      *trans;
+    uint8_t    protocol;
+    /* ICMPv6 checksum, which covers the quote and the addresses. ICMP
+     * ones are left to IP::raw_data(). */
+    uint16_t  *check;
+};
+
+/* Find the packet an error(ICMP destination unreachable, time exceeded,
+ * parameter problem, and ICMPv6 packet too big) quotes, return false if
+ * packet is not one */
+bool icmp_quote(char *packet, int size, Quote *quote);
+/* The source port of a quoted TCP or UDP packet, -1 for other protocols */
+int quote_sport(const Quote& quote);
+Addr quote_daddr(const Quote& quote);
+/* Set the source of a quoted packet to addr, and port for TCP and UDP,
+ * keeping the checksums in and over the quote right */
+void set_quote_source(Quote *quote, const Addr& addr, int port);
+
 } /* namespace vpn */
 
 #endif
@@ -0,0 +1,189 @@
+#ifndef VPN_PATH_H
+#define VPN_PATH_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace vpn {
+
+/* Body of T_PROBE and T_PROBE_REPLY, echoed as is */
+struct ProbeBody {
+    uint32_t    id;
+    uint32_t    path;
+    uint64_t    sent;
+} __attribute__((packed));
+
+/* RTT(RFC 6298 smoothing), jitter(RFC 3550) and loss of one path,
+ * measured by probes */
+class PathStats {
+public:
+    PathStats();
+
+    void on_probe_sent(uint32_t id, uint64_t now);
+    void on_probe_reply(uint32_t id, uint64_t sent, uint64_t now);
+    /* Count probes without reply for too long as lost */
+    void tick(uint64_t now);
+
+    /* Nanoseconds, 0 before the first sample */
+    uint64_t srtt() const { return _srtt; }
+    uint64_t rttvar() const { return _rttvar; }
+    /* Smoothed difference between consecutive RTT samples */
+    uint64_t jitter() const { return _jitter; }
+    /* EWMA of probe loss, 0..1 */
+    double loss() const { return _loss; }
+    bool up() const { return _misses < MAX_MISSES; }
+
+    /* Share of traffic this path deserves, 0 when down */
+    double weight() const;
+    std::string to_string() const;
+private:
+    static const int PENDING = 8;
+    static const int MAX_MISSES = 3;
+
+    uint64_t  _srtt;
+    uint64_t  _rttvar;
+    uint64_t  _jitter;
+    uint64_t  _last_rtt;
+    double    _loss;
+    int       _misses;
+    uint64_t  _sent;
+    uint64_t  _replied;
+
+    /* Outstanding probes, a small ring keyed by id */
+    uint32_t  _pending_id[PENDING];
+    uint64_t  _pending_at[PENDING];
+
+    uint64_t timeout() const;
+};
+
+/*
+ * Packetization layer path MTU discovery(RFC 8899) of one path. Probes
+ * padded to a size go with DF set, a reply confirms the size and
+ * MAX_TRIES probes without reply rule it out. The search starts with the
+ * largest size, then halves the range in between. Sizes are path MTUs,
+ * datagrams of the outer IPv4 and UDP headers included.
+ * */
+class MtuProber {
+public:
+    /* Search [least, most], least is assumed to work until told otherwise */
+    MtuProber(int least = 576, int most = 1500);
+
+    /* Size to probe now, 0 if nothing is due. Starts over once in a while
+     * after settling, the path may have changed. */
+    int next(uint64_t now);
+    void on_reply(int size);
+
+    /* Largest size confirmed, 0 before any reply */
+    int mtu() const { return _confirmed ? _low : 0; }
+    std::string to_string() const;
+private:
+    static const int MAX_TRIES = 3;
+    /* Stop when the range is this narrow */
+    static const int GRANULARITY = 8;
+
+    int       _least;
+    int       _most;
+    bool      _confirmed;
+    /* Largest size that made it, smallest one that did not */
+    int       _low;
+    int       _high;
+    /* In flight, 0 if none */
+    int       _size;
+    int       _tries;
+    uint64_t  _sent_at;
+    uint64_t  _settled_at;
+
+    bool settled() const { return _high - _low <= GRANULARITY; }
+};
+
+/* Spread datagrams over paths by their weights */
+class Scheduler {
+public:
+    enum Mode {
+        /* Smooth weighted round robin, per datagram */
+        WRR = 0,
+        /* The same path for a flow while weights stay the same */
+        FLOW
+    };
+
+    Scheduler(Mode mode, int paths);
+
+    /* Recompute weights from stats */
+    void update(const std::vector<PathStats>& stats);
+    /* flow is a hash of the inner 5-tuple, used by FLOW */
+    int pick(uint32_t flow);
+private:
+    Mode                 _mode;
+    std::vector<double>  _weight;
+    std::vector<double>  _current;
+};
+
+/* Hash of the 5-tuple of an IPv4 or IPv6 packet, 0 if it can't be parsed */
+uint32_t flow_hash(const char *packet, int size);
+
+/*
+ * Puts datagrams that went over different paths back in order. Each path
+ * is taken as FIFO, so a gap is given up as soon as every recently heard
+ * path has gone past it, or after delay at the latest. Later arrivals of
+ * it are delivered at once. A seq beyond the window pushes the window
+ * forward, giving up on gaps.
+ * */
+class ReorderBuffer {
+public:
+    ReorderBuffer(int delay_ms);
+    ReorderBuffer(const ReorderBuffer&) = delete;
+    ReorderBuffer& operator=(const ReorderBuffer&) = delete;
+
+    /* Return true if the packet can be delivered now, otherwise it is
+     * copied into the buffer. path is where it came from, -1 if unknown.
+     * Drain take() after either. */
+    bool push(uint32_t seq, int path, const char *packet, int size, uint64_t now);
+    /* Next in order packet, -1 if none */
+    int take(char *out, int cap);
+    /* Give up on gaps older than delay */
+    void tick(uint64_t now);
+
+    uint64_t reordered() const { return _reordered; }
+    uint64_t skipped() const { return _skipped; }
+    uint64_t late() const { return _late; }
+private:
+    static const int WINDOW = 1024;
+    static const int PATHS = 16;
+
+    struct Slot {
+        bool        used;
+        uint32_t    seq;
+        uint64_t    arrived;
+        std::string data;
+    };
+    std::vector<Slot>  _slots;
+    bool      _started;
+    uint32_t  _next;
+    int       _buffered;
+    uint64_t  _delay;
+
+    /* Highest seq and last arrival per path */
+    uint32_t  _path_high[PATHS];
+    uint64_t  _path_seen[PATHS];
+
+    /* Released in order up to here before _pending is stored */
+    uint32_t  _force;
+    bool      _has_pending;
+    Slot      _pending;
+
+    uint64_t  _reordered;
+    uint64_t  _skipped;
+    uint64_t  _late;
+
+    void store(const Slot& slot);
+    /* Release up to the first buffered seq */
+    void skip_gap();
+    /* Whether every path heard within delay is past _next */
+    bool passed(uint64_t now) const;
+};
+
+} /* namespace vpn */
+
+#endif
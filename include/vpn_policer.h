@@ -0,0 +1,108 @@
+#ifndef VPN_POLICER_H
+#define VPN_POLICER_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace vpn {
+
+/*
+ * Token bucket policing packets to a rate in bytes per second with a
+ * burst of depth bytes. Over the rate a packet is dropped, or let through
+ * to be marked ECN CE if it is ECN capable and the debt stays within one
+ * burst. Refilled lazily by take(), so it costs a few integer operations
+ * per packet and no timer. Tokens are kept in byte-nanoseconds to stay in
+ * integers without losing fractions.
+ * */
+class TokenBucket {
+public:
+    enum Verdict {
+        PASS = 0,
+        /* Over the rate, forward it with ECN CE set */
+        MARK,
+        DROP
+    };
+
+    /* Unlimited until set_rate() */
+    TokenBucket();
+
+    /* rate 0 means unlimited */
+    void set_rate(uint64_t rate, uint64_t depth);
+    bool limited() const { return _rate > 0; }
+
+    /* Charge a packet of size bytes at now(monotonic_ns()). ecn tells
+     * whether the packet could be marked instead of dropped. */
+    Verdict take(int size, bool ecn, uint64_t now);
+
+    /* For shaping: whether size bytes fit at now, nothing is charged */
+    bool fits(int size, uint64_t now);
+    /* For shaping: charge a packet let out after fits() */
+    void charge(int size);
+
+    uint64_t passed() const { return _passed; }
+    uint64_t marked() const { return _marked; }
+    uint64_t dropped() const { return _dropped; }
+    std::string to_string() const;
+private:
+    uint64_t  _rate;
+    int64_t   _depth;
+    /* Time to refill from a full debt, longer gaps just fill the bucket */
+    uint64_t  _fill;
+    int64_t   _tokens;
+    uint64_t  _last;
+
+    uint64_t  _passed;
+    uint64_t  _marked;
+    uint64_t  _dropped;
+
+    void refill(uint64_t now);
+};
+
+/*
+ * Departure times spacing packets of one flow at a rate, with no credit
+ * for idle time, so nothing leaves in a burst the rate doesn't allow.
+ * Also measures what the packets really did: the rate they left at and
+ * how many left back to back. Whoever holds the packets bounds delay().
+ * */
+class Pacer {
+public:
+    Pacer();
+
+    /* Bytes per second */
+    void set_rate(uint64_t rate);
+    uint64_t rate() const { return _rate; }
+
+    /* How long a packet handed over at now would wait */
+    uint64_t delay(uint64_t now) const { return _next > now ? _next - now : 0; }
+    /* When a packet of size bytes handed over at now should leave */
+    uint64_t schedule(int size, uint64_t now);
+    /* Count a packet that would have waited too long */
+    void drop() { ++_dropped; }
+    /* A packet left(or is set to leave) at at */
+    void sent(int size, uint64_t at);
+
+    /* Bytes per second over the last full window */
+    uint64_t achieved() const { return _achieved; }
+    int max_burst() const { return _max_burst; }
+    std::string to_string() const;
+private:
+    uint64_t  _rate;
+    uint64_t  _next;
+
+    uint64_t  _window_start;
+    uint64_t  _window_bytes;
+    uint64_t  _achieved;
+
+    /* Packets closer than half their time at the rate count as a burst */
+    uint64_t  _last_at;
+    int       _burst;
+    int       _max_burst;
+    uint64_t  _bursts;
+    uint64_t  _packets;
+    uint64_t  _dropped;
+};
+
+} /* namespace vpn */
+
+#endif
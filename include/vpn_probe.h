@@ -0,0 +1,28 @@
+#ifndef VPN_PROBE_H
+#define VPN_PROBE_H
+
+#include "sdt/sdt.h"
+
+/*
+ * USDT probes of provider tinyvpn, kept stable for bpftrace and perf,
+ * see scripts/bpftrace. direction is 0 up(from clients) and 1 down.
+ *
+ * server and client:
+ *   receive(direction, session, size)   a packet read, session 0 if unknown yet
+ *   send(direction, count)              count packets written to tun or sent
+ * server:
+ *   checksum__start(direction)          checksums of a rewritten packet
+ *   checksum__done(direction, size)
+ *   drop(direction, verdict, session, size)
+ *   nat__snat(port, new_port, created)  created is 1 for a new mapping
+ *   nat__dnat(new_port, session)
+ *   nat__miss(new_port)                 no mapping, 0 for ICMP ones
+ *   nat__expire(new_port, session, idle_seconds)
+ * */
+#define VPN_PROBE(name) DTRACE_PROBE(tinyvpn, name)
+#define VPN_PROBE1(name, a1) DTRACE_PROBE1(tinyvpn, name, a1)
+#define VPN_PROBE2(name, a1, a2) DTRACE_PROBE2(tinyvpn, name, a1, a2)
+#define VPN_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(tinyvpn, name, a1, a2, a3)
+#define VPN_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(tinyvpn, name, a1, a2, a3, a4)
+
+#endif
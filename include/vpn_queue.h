@@ -0,0 +1,97 @@
+#ifndef VPN_QUEUE_H
+#define VPN_QUEUE_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "vpn_policer.h"
+
+namespace vpn {
+
+/*
+ * Egress queue in front of the tunnel socket. Deficit round robin over
+ * flow buckets, so a bulk flow gets its share and no more, and a strict
+ * priority class for interactive packets served before any bucket while
+ * it stays short. When full the head of the longest bucket is dropped.
+ * A rate set a little below the bottleneck link holds packets back, so
+ * the queue builds here, where it is fair, instead of in front of that
+ * link. Packets are copied in, the buffers are reused.
+ * */
+class FairQueue {
+public:
+    /* At most limit packets queued */
+    FairQueue(int limit);
+    FairQueue(const FairQueue&) = delete;
+    FairQueue& operator=(const FairQueue&) = delete;
+
+    /* Bytes per second let out in bursts of a few ms, 0 means as fast as
+     * pop() is called */
+    void set_rate(uint64_t rate);
+
+    /* flow picks the bucket, flow, owner and tag come back from pop() */
+    void push(uint32_t flow, bool priority, uint32_t owner, uint64_t tag,
+            const char *packet, int size);
+    /* The next packet the rate allows at now(monotonic_ns()), return its
+     * length or -1 if none */
+    int pop(uint64_t now, char *out, int cap, uint32_t *flow, uint32_t *owner,
+            uint64_t *tag);
+
+    bool empty() const { return _count == 0; }
+    int size() const { return _count; }
+    uint64_t dropped() const { return _dropped; }
+    std::string to_string() const;
+private:
+    static const int FLOWS = 1024;
+    /* Bytes a bucket may send per round */
+    static const int QUANTUM = 1514;
+    /* Beyond this priority packets wait in their buckets like the rest */
+    static const int PRIORITY_LIMIT = 64;
+
+    struct Packet {
+        std::string  data;
+        uint32_t     flow;
+        uint32_t     owner;
+        uint64_t     tag;
+        int          next;
+    };
+    struct Bucket {
+        int     head;
+        int     tail;
+        int     count;
+        int     bytes;
+        int     deficit;
+        /* In _active, maybe emptied by a drop since */
+        bool    active;
+    };
+
+    std::vector<Packet>  _packets;
+    std::vector<int>     _free;
+    /* The last one is the priority class */
+    std::vector<Bucket>  _buckets;
+    std::deque<int>      _active;
+    int          _limit;
+    int          _count;
+    TokenBucket  _rate;
+
+    uint64_t     _enqueued;
+    uint64_t     _prioritized;
+    uint64_t     _dropped;
+
+    /* Unlink the head of a bucket, return its packet */
+    int unlink(int bucket);
+    /* Make room by dropping from the longest bucket */
+    void drop();
+    int copy(int packet, char *out, int cap, uint32_t *flow, uint32_t *owner,
+            uint64_t *tag);
+};
+
+/* Whether an IP packet is small or has a DSCP of CS5 and up(EF, network
+ * control), likely keystrokes, DNS, ACKs or voice */
+bool interactive(const char *packet, int size);
+
+} /* namespace vpn */
+
+#endif
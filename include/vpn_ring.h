@@ -0,0 +1,75 @@
+#ifndef VPN_RING_H
+#define VPN_RING_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+namespace vpn {
+
+/*
+ * Fixed size queue of one writer and one reader, without locks. A full
+ * ring turns records away and counts them instead of blocking the
+ * writer, which is the data path.
+ * */
+template <typename T>
+class SpscRing {
+public:
+    /* capacity is rounded up to a power of 2 */
+    explicit SpscRing(int capacity) : _records(), _mask(0), _head(0), _cached_tail(0),
+        _dropped(0), _tail(0) {
+        uint64_t size = 1;
+        while (size < static_cast<uint64_t>(capacity)) {
+            size <<= 1;
+        }
+        _records.resize(size);
+        _mask = size - 1;
+    }
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    /* Return false if the ring is full */
+    bool push(const T& record) {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        if (head - _cached_tail > _mask) {
+            _cached_tail = _tail.load(std::memory_order_acquire);
+            if (head - _cached_tail > _mask) {
+                _dropped.store(_dropped.load(std::memory_order_relaxed) + 1,
+                        std::memory_order_relaxed);
+                return false;
+            }
+        }
+        _records[head & _mask] = record;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    /* Return false if the ring is empty */
+    bool pop(T *record) {
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        *record = _records[tail & _mask];
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+private:
+    std::vector<T>         _records;
+    uint64_t               _mask;
+    /* Apart, the writer and the reader don't share a cache line */
+    char                   _pad0[64];
+    std::atomic<uint64_t>  _head;
+    /* What the writer last saw of _tail */
+    uint64_t               _cached_tail;
+    std::atomic<uint64_t>  _dropped;
+    char                   _pad1[64];
+    std::atomic<uint64_t>  _tail;
+    char                   _pad2[64];
+};
+
+} /* namespace vpn */
+
+#endif
@@ -1,37 +1,356 @@
 #ifndef VPN_SERVER_H
 #define VPN_SERVER_H
 
+#include <atomic>
+#include <deque>
 #include <string>
 #include <memory>
 #include <map>
+#include <unordered_map>
 
+#include "vpn_capture.h"
 #include "vpn_common.h"
+#include "vpn_control.h"
+#include "vpn_frag.h"
+#include "vpn_ipfix.h"
+#include "vpn_metrics.h"
 #include "vpn_nat.h"
 #include "vpn_net.h"
+#include "vpn_policer.h"
+#include "vpn_probe.h"
+#include "vpn_queue.h"
+#include "vpn_sketch.h"
+#include "vpn_stream.h"
+#include "vpn_trace.h"
+#include "vpn_tunnel.h"
 
 namespace vpn {
 
 using AddrPort = std::pair<std::string, int>;
 
+/* Rates of inner packets in bytes per second, 0 means unlimited */
+struct RateLimit {
+    uint64_t  client_up;
+    uint64_t  client_down;
+    uint64_t  total_up;
+    uint64_t  total_down;
+    /* Burst each bucket allows, as time at its rate */
+    int       burst_ms;
+
+    RateLimit()
+        : client_up(0), client_down(0), total_up(0), total_down(0), burst_ms(200) {  }
+};
+
 class Server {
 public:
-    Server(const std::string& addr, int port);
+    /* How paced datagrams wait for their time */
+    enum Pacing {
+        /* SO_TXTIME toward clients behind an fq qdisc, a timer otherwise */
+        PACE_AUTO = 0,
+        /* SO_TXTIME whatever the qdisc is */
+        PACE_TXTIME,
+        /* Held in user space until due */
+        PACE_TIMER
+    };
+
+    Server(const std::string& addr, int port,
+            const TunnelOptions& options = TunnelOptions());
+    /* Forward between the devices given instead of tun and a UDP socket,
+     * eg: QueueDevice, which need no root. addr is the one of tun. The
+     * devices outlive the server, no TCP clients are taken. */
+    Server(PacketDevice *tun, PacketDevice *socket, const std::string& addr,
+            const TunnelOptions& options = TunnelOptions());
+    /* Reclaims the NAT mappings left, exporting them as deleted */
+    ~Server();
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
+    /* Print session stats every seconds, 0 means never */
+    void set_stats_interval(int seconds) { _stats_interval = seconds; }
+    /* Measure RTT and loss to every client this often */
+    void set_probe_interval(int ms) { _probe_interval_ms = ms; }
+    /* Forget sessions that sent nothing for this long, 0 means never */
+    void set_session_timeout(int seconds) { _session_timeout = seconds; }
+    /* Reclaim NAT ports unused for this long, 0 only when they run out */
+    void set_nat_timeout(int seconds) { _nat_timeout = seconds; }
+    /* Answer queries on a unix socket at path, false if it can't be bound */
+    bool set_control(const std::string& path);
+    /* Police every client and all of them together, in both directions */
+    void set_rate_limit(const RateLimit& limit);
+    /* Queue what goes to clients fairly, let out at rate bytes per second */
+    void set_shaping(uint64_t rate, int limit);
+    /* Space out the datagrams to each client at rate bytes per second */
+    void set_pacing(uint64_t rate, Pacing mode);
+    /* Clamp the MSS of TCP handshakes so their datagrams fit into mtu,
+     * 0 leaves them alone */
+    void set_link_mtu(int mtu);
+    /* The IPv6 address packets of clients are NATed to, routed to tun.
+     * They are dropped without one. */
+    void set_tun_addr6(const std::string& addr);
+    /* Write traced packets to path, "-" is stdout as text. What is traced
+     * is set by trace_level or the trace command. */
+    bool set_trace(const std::string& path);
+    /* Export NAT mappings as IPFIX flow records when made and reclaimed,
+     * to a file at target or a collector at udp:addr:port */
+    bool set_flow_export(const std::string& target);
+    /* Capture packets before and after NAT into a pcapng file at path,
+     * also started and stopped by the capture command */
+    bool set_capture(const std::string& path, const CaptureOptions& options,
+            std::string *error);
+
+    /* Count top clients, destinations and ports, print and start over
+     * every seconds. 0 means no counting. */
+    void set_top_interval(int seconds);
+
+    /* Session stats with RTT and loss */
+    std::string stats() const;
+    /* Counters and stage timings in the Prometheus text format */
+    std::string metrics() const { return _metrics.to_prometheus(); }
+    /* Top talkers since the last interval */
+    std::string top() const;
+
+    /* start() and poll() until stop() */
     void run();
+    /* Make run() return, safe from a signal handler */
+    void stop() { _stopped = true; }
+    /* Set up the devices, once before poll() */
+    void start();
+    /* Wait for events until the next timer is due, or most milliseconds
+     * if that is sooner, and handle them. -1 is no bound. */
+    void poll(int most = -1);
 private:
-    Socket  _socket;
+    /* Where time goes, see _stages */
+    enum Stage {
+        /* A batch from clients, or from tun until it is sent */
+        S_CLIENT2SERVER = 0,
+        S_SERVER2CLIENT,
+        /* An iteration of run() after epoll returns */
+        S_LOOP,
+        S_RECVMMSG,
+        S_SENDMMSG,
+        /* Per packet, sampled */
+        S_TUN_READ,
+        S_TUN_WRITE,
+        /* NAT lookups and the rewrites they decide */
+        S_NAT,
+        /* Checksums of a rewritten packet */
+        S_CHECKSUM,
+        STAGES
+    };
+    /* Parts of the time a packet spends here, see _dwell */
+    enum Dwell {
+        /* From clients, in the socket queue until read, by kernel RX
+         * timestamps. From tun, after epoll woke us until read. */
+        W_WAIT = 0,
+        /* From read until written to tun or sent, per packet, sampled */
+        W_PROCESSING,
+        DWELL_PARTS
+    };
+    /* What top talkers are counted by */
+    enum TopKind {
+        T_CLIENT = 0,
+        /* Addresses beyond the server */
+        T_DESTINATION,
+        /* Protocol and port beyond the server */
+        T_PORT,
+        TOP_KINDS
+    };
+    /* Per packet stages are timed for one packet in this many, reading
+     * the clock would cost about as much as they do */
+    static const uint32_t SAMPLE_EVERY = 16;
+
+    /* Made here unless devices were given */
+    std::unique_ptr<Socket>  _own_socket;
+    std::unique_ptr<Tun>     _own_tun;
+    PacketDevice  *_socket;
+    Socket  _listener;
     Epoll   _epoll;
-    Tun     _tun;
+    PacketDevice  *_tun;
     int     _port;
+    /* Of tun, what packets of clients go out from */
+    Addr    _addr;
+    Addr    _addr6;
 
     NAT     _nat;
+    /* Fragments of a datagram follow the NAT of the first one */
+    Fragments  _frags;
+
+    using SessionMap = std::unordered_map<uint32_t, std::shared_ptr<Session>>;
+    SessionMap     _sessions;
+    TunnelOptions  _options;
+    int            _stats_interval;
+    uint64_t       _last_tick;
+    int            _probe_interval_ms;
+    uint64_t       _last_probe;
+    /* Seconds, 0 keeps sessions forever */
+    int            _session_timeout;
+    /* Seconds, 0 keeps NAT ports until they run out */
+    int            _nat_timeout;
+    uint64_t       _last_expire;
+    uint32_t       _probe_id;
+
+    std::unique_ptr<Control>  _control;
+    /* Only with set_trace() */
+    std::unique_ptr<TraceDrainer>  _tracer;
+    /* Only with set_flow_export() */
+    std::unique_ptr<FlowExporter>  _flows;
+    Capture        _capture;
+
+    Metrics        _metrics;
+    /* By direction, forwarded */
+    Counter       *_packets[2];
+    Counter       *_bytes[2];
+    /* By direction and verdict, nullptr for those that are no drops */
+    Counter       *_drops[2][V_VERDICTS];
+    Histogram     *_stages[STAGES];
+    /* By direction */
+    Histogram     *_dwell[2][DWELL_PARTS];
+    /* When the datagrams being forwarded were read */
+    uint64_t       _arrived;
+
+    int            _top_interval;
+    /* Only with set_top_interval(), by TopKind */
+    std::unique_ptr<HeavyHitters>  _top[TOP_KINDS];
+    uint32_t       _sampled;
+
+    /* Read once per loop, good enough for policing */
+    uint64_t       _now;
+    RateLimit      _limit;
+    TokenBucket    _up;
+    TokenBucket    _down;
+    struct ClientPolicer {
+        TokenBucket  up;
+        TokenBucket  down;
+    };
+    /* By session id, created on the first packet when clients are limited */
+    std::unordered_map<uint32_t, ClientPolicer>  _policers;
+    /* Only with shaping */
+    std::unique_ptr<FairQueue>  _queue;
+
+    uint64_t       _pace_rate;
+    Pacing         _pacing;
+    /* SO_TXTIME is on for _socket */
+    bool           _txtime;
+    struct Held {
+        uint64_t             at;
+        struct sockaddr_in6  dest;
+        std::string          data;
+    };
+    struct PacedSession {
+        Pacer             pacer;
+        bool              txtime;
+        /* Sealed datagrams waiting for their time, without txtime */
+        std::deque<Held>  held;
+    };
+    /* By session id, UDP clients only */
+    std::unordered_map<uint32_t, PacedSession>  _paced;
+    /* Datagrams in every held */
+    int            _held;
+
+    /* 0 means no clamping */
+    int            _mss;
+    uint64_t       _clamped;
+    /* Quoting a packet of a client, see icmp_quote() */
+    uint64_t       _icmp_errors;
+
+    /* Clients on TCP, see Stream */
+    struct StreamConn {
+        std::shared_ptr<Stream>  stream;
+        struct sockaddr_in6      from;
+    };
+    std::unordered_map<int, StreamConn>                    _streams;
+    std::unordered_map<uint64_t, std::shared_ptr<Stream>>  _stream_addrs;
+    /* IPv6 clients by the key they are queued with, see addr_key() */
+    std::unordered_map<uint64_t, struct sockaddr_in6>      _v6_addrs;
+    /* Shortest Session::timeout_ms() seen, -1 means no ticks needed */
+    int            _timeout;
+    /* When stats and top talkers were printed */
+    time_t         _last_stats;
+    time_t         _last_top;
+    /* Set by stop() */
+    std::atomic<bool>  _stopped;
+
+    /* Datagram buffers of one batch */
+    char    _rx[BATCH_SIZE][MAX_DATAGRAM];
+    char    _tx[BATCH_SIZE + FEC_MAX_M][MAX_DATAGRAM];
 
     void client2server();
+    /* Handle datagrams from clients, whatever they came by */
+    void receive(char **bufs, int *sizes, struct sockaddr_in6 *socks, int n);
+    void accept_streams();
+    void stream_event(int fd, uint32_t events);
+    void close_stream(int fd);
+    /* Poll for writable while it has queued bytes */
+    void watch(Stream *stream);
     void server2client();
+    /* Send what the rate allows from _queue */
+    void drain();
+    void tick();
+    /* Probe every client with a known address */
+    void probe(uint64_t now);
+    /* Forget sessions idle for _session_timeout, with their policers and
+     * paced datagrams */
+    void expire_sessions(uint64_t now);
+
+    /* Append pending parities of session to batch, return the new size */
+    int take_parities(Session *session, const struct sockaddr_in6& dest,
+            Datagram *batch, struct sockaddr_in6 *dests, int n);
+    void send(Datagram *batch, struct sockaddr_in6 *dests, int n);
+    /* What addr_key() hides */
+    struct sockaddr_in6 key_addr(uint64_t key) const;
+    PacedSession& pacing(Session *session, const struct sockaddr_in6& dest);
+    /* Send held datagrams that are due */
+    void release();
+
+    /* Clamp the MSS of a packet going by peer */
+    void clamp(char *packet, int size, const struct sockaddr_in6& peer);
+    /* NAT a packet from a client and write it to tun */
+    void forward(char *buf, int size, const struct sockaddr_in6& sock, Session *session);
+    /* NAT a packet from tun and wrap it into out, false if nobody wants it
+     * or it went to _queue */
+    bool translate(char *buf, int size, char *out, Datagram *datagram,
+            struct sockaddr_in6 *dest);
+
+    /* Charge a packet to its client and the total, mark it CE if it is over
+     * but can be marked. Return false if it is to be dropped. */
+    bool police(uint32_t session, IP *ip, bool up);
+
+    /* Adopts own_tun and own_socket, or uses the devices given */
+    Server(Tun *own_tun, Socket *own_socket, PacketDevice *tun, PacketDevice *socket,
+            const std::string& addr, int port, const TunnelOptions& options);
+
+    void register_metrics();
+    /* Whether to time the per packet stages of this packet */
+    bool sample() { return (++_sampled % SAMPLE_EVERY) == 0; }
+    /* Count and trace a packet dropped for verdict, ip is nullptr if it
+     * was not parsed */
+    void drop(int direction, int verdict, uint32_t session, IP *ip, int size) {
+        VPN_PROBE4(drop, direction, verdict, session, size);
+        _drops[direction][verdict]->add();
+        if (tracing(TRACE_DROPS)) {
+            TraceRecord record;
+            trace_fill(&record, direction, verdict, session, ip, size);
+            trace(record);
+        }
+    }
+    static void trace_fill(TraceRecord *record, int direction, int verdict, uint32_t session,
+            IP *ip, int size);
+    /* Count a forwarded packet in _top */
+    void account(uint32_t session, IP *ip, bool up);
+    std::string top_key(int kind, const SketchKey& key) const;
+    /* Reply to the trace command */
+    std::string trace_command(const std::string& args);
+    std::string capture_command(const std::string& args);
 
-    std::shared_ptr<IP> get_ip_packet(char *buf, int size);
+    /* Size of a valid IP packet in buf, -1 if it is not one */
+    static int packet_size(const char *buf, int size);
+    /* Whether the protocol of a packet is NATed */
+    static bool translatable(IP *ip);
+    /* Whether an IPv6 destination is beyond the tunnel */
+    static bool routable6(const Addr& addr);
+    /* Find the session of a datagram, or make one that is not kept
+     * until a datagram of it is opened, see receive() */
+    std::shared_ptr<Session> get_session(const char *buf, int size, bool *fresh);
 };
 
 } /* namespace vpn */
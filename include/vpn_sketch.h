@@ -0,0 +1,84 @@
+#ifndef VPN_SKETCH_H
+#define VPN_SKETCH_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+namespace vpn {
+
+/* What is counted, eg: an address and a port, up to 20 bytes */
+struct SketchKey {
+    uint8_t   size;
+    uint8_t   bytes[20];
+
+    SketchKey() : size(0), bytes() {  }
+    SketchKey(const void *data, int n) : size(n) {
+        memcpy(bytes, data, n);
+    }
+    bool operator==(const SketchKey& other) const {
+        return size == other.size && memcmp(bytes, other.bytes, size) == 0;
+    }
+    uint64_t hash() const;
+};
+
+/*
+ * Packets and bytes of many keys in fixed memory: a count-min sketch
+ * (Cormode and Muthukrishnan) with conservative update, whose estimates
+ * are never below the truth and over it by a small share of the total.
+ * The K keys estimated largest, by packets and by bytes, are kept aside
+ * so they can be listed. Every add() costs the same whatever the number
+ * of keys.
+ * */
+class HeavyHitters {
+public:
+    struct Entry {
+        SketchKey  key;
+        uint64_t   packets;
+        uint64_t   bytes;
+    };
+
+    /* width is rounded up to a power of 2 */
+    HeavyHitters(int width = 2048, int depth = 4, int k = 10);
+
+    void add(const SketchKey& key, uint32_t bytes);
+    /* Estimates of a key */
+    Entry estimate(const SketchKey& key) const;
+    /* Largest first, by packets or bytes */
+    std::vector<Entry> top(bool by_bytes) const;
+    void clear();
+
+    uint64_t packets() const { return _packets; }
+    uint64_t bytes() const { return _bytes; }
+private:
+    struct Cell {
+        uint64_t  packets;
+        uint64_t  bytes;
+    };
+    struct Candidate {
+        SketchKey  key;
+        uint64_t   hash;
+        uint64_t   count;
+    };
+    /* Of the high bits of a hash that index a row */
+    int                 _shift;
+    int                 _width;
+    int                 _depth;
+    int                 _k;
+    /* _depth rows of _width cells */
+    std::vector<Cell>   _cells;
+    /* By packets and by bytes, unordered */
+    std::vector<Candidate>  _top[2];
+    /* Smallest count in a full _top, others below it are not looked at */
+    uint64_t            _least[2];
+    uint64_t            _packets;
+    uint64_t            _bytes;
+
+    int index(int row, uint64_t hash) const;
+    void offer(int which, const SketchKey& key, uint64_t hash, uint64_t count);
+};
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef VPN_STREAM_H
+#define VPN_STREAM_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <vector>
+
+#include "vpn_common.h"
+
+namespace vpn {
+
+/*
+ * Tunnel datagrams over a TCP connection, each one framed by its length:
+ *      -----------------------------
+ *      | length(BE16) | datagram |
+ *      -----------------------------
+ * Writes never block. What the socket doesn't take is queued up to
+ * MAX_QUEUED bytes, beyond that datagrams are dropped like a full UDP
+ * buffer would, and left to the inner TCP to resend.
+ * */
+class Stream {
+public:
+    static const int MAX_QUEUED = 1 << 20;
+    /* Unsent bytes the kernel may hold, see Socket::set_low_latency() */
+    static const int LOWAT = 128 * 1024;
+    static const int BUFFERS = 4 << 20;
+
+    Stream(const std::shared_ptr<Socket>& socket);
+    Stream(const Stream&) = delete;
+    Stream& operator=(const Stream&) = delete;
+
+    int fd() { return _socket->fd(); }
+
+    /* Frame datagrams and send them with one writev(). Return n, or -1 if
+     * the connection is broken. Those that don't fit count in dropped(). */
+    int write(const struct iovec *datagrams, int n);
+    /* Send queued bytes when writable, -1 if broken */
+    int flush();
+    /* Waiting for the socket to be writable */
+    bool blocked() const { return _out_begin < _out.size(); }
+
+    /* Fill the read buffer, -1 on EOF or error */
+    int read();
+    /* Point at the next complete datagram, return its size, 0 if none and
+     * -1 if the framing is broken. Valid until the next read(). */
+    int next(char **datagram);
+
+    uint64_t dropped() const { return _dropped; }
+
+    /* Whether EPOLLOUT is on for it, kept by the owner of the Epoll */
+    bool  polling_out;
+private:
+    std::shared_ptr<Socket>  _socket;
+
+    std::vector<char>  _out;
+    size_t             _out_begin;
+
+    std::vector<char>  _in;
+    size_t             _in_begin;
+    size_t             _in_end;
+
+    uint64_t           _dropped;
+
+    void queue(const char *data, int size);
+};
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef VPN_TRACE_H
+#define VPN_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vpn_ring.h"
+
+namespace vpn {
+
+/*
+ * Packet tracing. Every thread records into a ring of its own, without
+ * locks or formatting, and a drainer thread writes the rings out. A full
+ * ring drops records instead of blocking the data path.
+ * */
+enum TraceLevel {
+    TRACE_OFF = 0,
+    /* Packets that are dropped */
+    TRACE_DROPS,
+    /* Every packet */
+    TRACE_ALL
+};
+
+enum TraceDirection {
+    /* Client -> tun */
+    D_UP = 0,
+    /* Tun -> client */
+    D_DOWN
+};
+
+/* What happened to a packet, the ones after V_HELD are drops */
+enum TraceVerdict {
+    V_FORWARDED = 0,
+    /* Left to the fair queue */
+    V_QUEUED,
+    /* A fragment waiting for its first one */
+    V_HELD,
+    /* Not an IP packet that is translated */
+    V_INVALID,
+    /* No NAT entry, or of the other family */
+    V_NO_NAT,
+    /* IPv6 without an address to NAT to, or to a link-local or
+     * multicast address */
+    V_NO_ROUTE,
+    V_NO_SESSION,
+    V_POLICED,
+    V_VERDICTS
+};
+
+/* One packet, a cache line. Addresses are as they lie in the packet,
+ * IPv4 ones take the first 4 bytes. */
+struct TraceRecord {
+    /* monotonic_ns() */
+    uint64_t  ts;
+    uint32_t  session;
+    uint16_t  size;
+    uint16_t  sport;
+    uint16_t  dport;
+    /* The port NAT gave the client's sport, 0 if none */
+    uint16_t  nat_port;
+    uint8_t   direction;
+    uint8_t   verdict;
+    uint8_t   protocol;
+    /* 4 or 6, 0 if the packet could not be parsed */
+    uint8_t   version;
+    uint8_t   saddr[16];
+    uint8_t   daddr[16];
+    uint8_t   reserved[8];
+} __attribute__((packed));
+
+/* Written by one thread, read by the drainer */
+using TraceRing = SpscRing<TraceRecord>;
+
+/* Records at or below this level are taken, set at any time */
+extern std::atomic<int> trace_level;
+
+inline bool tracing(int level) {
+    return level != TRACE_OFF && level <= trace_level.load(std::memory_order_relaxed);
+}
+
+/* Record into the ring of this thread, which is made on its first record */
+void trace(const TraceRecord& record);
+
+/* eg: no-nat */
+const char* verdict_name(int verdict);
+
+/* One line of text, without a newline */
+std::string format_trace(const TraceRecord& record);
+
+/* Start of a binary trace file, records follow as they are in memory */
+struct TraceFileHeader {
+    char      magic[4];
+    uint16_t  version;
+    uint16_t  record_size;
+} __attribute__((packed));
+
+static const char TRACE_MAGIC[4] = {'T', 'V', 'T', 'R'};
+static const uint16_t TRACE_VERSION = 1;
+
+/*
+ * Writes the records of every thread, as text to stdout("-") or in the
+ * binary format to a file, which trace_decode turns into text. Records
+ * of different threads may be out of order with each other.
+ * */
+class TraceDrainer {
+public:
+    TraceDrainer();
+    ~TraceDrainer();
+    TraceDrainer(const TraceDrainer&) = delete;
+    TraceDrainer& operator=(const TraceDrainer&) = delete;
+
+    /* Return false if path can't be opened */
+    bool start(const std::string& path);
+    void stop();
+
+    /* Records written and dropped by full rings */
+    std::string to_string() const;
+private:
+    FILE                   *_out;
+    bool                    _binary;
+    std::atomic<bool>       _running;
+    std::thread             _thread;
+    std::atomic<uint64_t>   _written;
+
+    void run();
+    /* Write what the rings hold, return the number of records */
+    int drain();
+};
+
+} /* namespace vpn */
+
+#endif
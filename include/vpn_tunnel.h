@@ -0,0 +1,260 @@
+#ifndef VPN_TUNNEL_H
+#define VPN_TUNNEL_H
+
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <string>
+#include <memory>
+
+#include "vpn_crypto.h"
+#include "vpn_fec.h"
+#include "vpn_path.h"
+
+namespace vpn {
+
+/* Big enough for any packet read from tun plus tunnel overhead */
+static const int MAX_DATAGRAM = 4096;
+static const int MAX_PACKET = MAX_DATAGRAM - 64;
+static const int TUNNEL_VERSION = 1;
+/* Packets read/sent per syscall batch */
+static const int BATCH_SIZE = 32;
+
+enum TunnelType {
+    T_DATA = 0,
+    T_FEC_PARITY,
+    /* Client -> server, echoed back as T_PROBE_REPLY, body is ProbeBody */
+    T_PROBE,
+    T_PROBE_REPLY,
+    /* Client -> server with DF, padded to the size in ProbeBody::id and
+     * answered by a short T_MTU_REPLY, see MtuProber */
+    T_MTU_PROBE,
+    T_MTU_REPLY
+};
+
+enum TunnelFlag {
+    F_COMPRESSED = 0x01,
+    F_ENCRYPTED  = 0x02,
+    F_FEC        = 0x04,
+    F_ORDERED    = 0x08
+};
+
+enum TunnelRole {
+    R_CLIENT = 0,
+    R_SERVER
+};
+
+/*
+ * Every datagram between client and server starts with this header:
+ *      ---------------------------------------------------------
+ *      | version | type | flags |   path   | session | payload |
+ *      ---------------------------------------------------------
+ * session is chosen by the client and identifies it on the server, path
+ * is the index of the path the sender put the datagram on.
+ *
+ * With F_ENCRYPTED the payload is sealed by ChaCha20-Poly1305:
+ *      ---------------------------------------------
+ *      | header | seq(BE64) | ciphertext | tag(16) |
+ *      ---------------------------------------------
+ * The nonce is session | seq, the aad is header | seq. The server sets
+ * the top bit of seq so both directions never share a nonce, and each
+ * side starts seq at a random point so that restarted clients reusing a
+ * session id hardly collide.
+ *
+ * With F_FEC a FecHeader follows(seq), data datagrams of a group are
+ * followed by T_FEC_PARITY datagrams. FEC symbols are the payloads with
+ * a prefix, so a rebuilt one can be decompressed:
+ *      ------------------------------------
+ *      | flags | length(BE16) | payload |
+ *      ------------------------------------
+ * Order on the sender: compress -> FEC -> encrypt.
+ *
+ * With F_ORDERED a data sequence number(BE32) follows seq, datagrams are
+ * spread over several paths and put back in order by the receiver. It is
+ * also carried by FEC symbols, after length.
+ * */
+struct TunnelHeader {
+    uint8_t     version;
+    uint8_t     type;
+    uint8_t     flags;
+    uint8_t     path;
+    uint32_t    session;
+} __attribute__((packed));
+
+static const int TUNNEL_SEQ_SIZE = 8;
+static const int TUNNEL_CRYPTO_OVERHEAD = TUNNEL_SEQ_SIZE + AEAD_TAG_SIZE;
+static const int TUNNEL_DSEQ_SIZE = 4;
+/* flags and length in front of a FEC symbol */
+static const int TUNNEL_SYMBOL_PREFIX = 3;
+/* Outer IPv4 and UDP headers */
+static const int TUNNEL_UDP_OVERHEAD = 28;
+/* Outer IPv6 and UDP headers */
+static const int TUNNEL_UDP6_OVERHEAD = 48;
+
+struct TunnelOptions {
+    bool         compress;
+    /* AEAD_KEY_SIZE raw bytes, empty means no encryption */
+    std::string  key;
+    /* m parities per k datagrams, fec_k == 0 means no FEC */
+    int          fec_k;
+    int          fec_m;
+    /* Send the parities of a partial group after it, at least 1 */
+    int          fec_timeout_ms;
+    /* Number data datagrams for a reordering receiver, see F_ORDERED */
+    bool         ordered;
+    /* How long the receiver waits for a gap in F_ORDERED datagrams, at
+     * least 1 */
+    int          reorder_ms;
+
+    TunnelOptions() : compress(false), key(), fec_k(0), fec_m(1), fec_timeout_ms(5),
+        ordered(false), reorder_ms(30) {  }
+
+    /* Read a key of 64 hex characters, return false if malformed */
+    bool load_key(const std::string& path);
+    /* Largest inner packet whose datagrams, parities included, fit into
+     * link_mtu. Counts F_ORDERED, which a peer may turn on. */
+    int inner_mtu(int link_mtu, bool ipv6 = false) const;
+};
+
+class Session;
+
+/* A datagram of a batch passed to Session::seal()/open() */
+struct Datagram {
+    Session  *session;
+    char     *data;
+    int       size;
+    bool      ok;
+};
+
+/* Counters of one direction, cpu_ns is the time spent in lz_*(). Data
+ * packets count once compression is on, rx can't tell expanded ones from
+ * bypassed ones and counts both as bypassed. */
+struct CompressStats {
+    uint64_t    packets;
+    uint64_t    compressed;
+    uint64_t    bypassed;
+    uint64_t    expanded;
+    uint64_t    raw_bytes;
+    uint64_t    wire_bytes;
+    uint64_t    cpu_ns;
+
+    CompressStats() : packets(0), compressed(0), bypassed(0), expanded(0),
+        raw_bytes(0), wire_bytes(0), cpu_ns(0) {  }
+
+    /* wire_bytes / raw_bytes, less is better */
+    double ratio() const;
+};
+
+class Session {
+public:
+    Session(uint32_t id, const TunnelOptions& options, TunnelRole role);
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    uint32_t id() const { return _id; }
+    const TunnelOptions& options() const { return _options; }
+
+    /* Wrap an IP packet into a datagram, return the datagram size.
+     * An encrypted datagram is still plaintext until seal(). */
+    int encap(const char *in, int size, char *out, int cap);
+    /* Unwrap a datagram into an IP packet, return -1 if it is malformed
+     * and 0 if it carries no packet(eg: a parity). An encrypted datagram
+     * must have passed open(). */
+    int decap(const char *in, int size, char *out, int cap);
+
+    /* Build the next pending parity datagram, -1 if none.
+     * Call after every encap() and tick(). */
+    int take_parity(char *out, int cap);
+    /* Take a packet rebuilt by FEC or released by the reorder buffer,
+     * -1 if none. Call after decap() and tick(). */
+    int take_ready(char *out, int cap);
+    /* Timers, now is monotonic_ns() */
+    void tick(uint64_t now) { tick_tx(now); tick_rx(now); }
+    /* The timers of one direction, for callers running them on two
+     * threads. encap() and decap() share no state otherwise. */
+    void tick_tx(uint64_t now);
+    void tick_rx(uint64_t now);
+    /* How often tick() wants to run, -1 means never */
+    int timeout_ms() const;
+
+    /* Build a probe or probe reply datagram of any probe type, zero padded
+     * to size bytes once sealed if it is shorter. Plaintext until seal(). */
+    int probe(uint8_t type, const ProbeBody& body, char *out, int cap, int size = 0);
+    /* Return true if an opened datagram is a probe or a probe reply */
+    static bool parse_probe(const char *in, int size, uint8_t *type, ProbeBody *body);
+
+    /* RTT and loss to the peer, kept by whoever probes it */
+    PathStats& path_stats() { return _path_stats; }
+
+    /* Where the last datagram came from */
+    const struct sockaddr_in6& peer() const { return _peer; }
+    void set_peer(const struct sockaddr_in6& peer) { _peer = peer; }
+    /* When the last datagram was opened(monotonic_ns()), kept by whoever
+     * expires sessions */
+    uint64_t active_at() const { return _active_at; }
+    void set_active(uint64_t now) { _active_at = now; }
+
+    /* Tag a datagram built by encap() with the path it goes by */
+    static void set_path(Datagram *datagram, int path);
+    /* Encrypt datagrams built by encap() in place */
+    static void seal(Datagram *batch, int n);
+    /* Authenticate, check replay and decrypt in place, set ok.
+     * Sessions without key accept only plaintext datagrams. */
+    static void open(Datagram *batch, int n);
+
+    const CompressStats& tx_stats() const { return _tx; }
+    const CompressStats& rx_stats() const { return _rx; }
+    std::string stats() const;
+
+    /* Check version and size, the payload follows *hdr */
+    static bool parse_header(const char *in, int size, TunnelHeader *hdr);
+private:
+    uint32_t       _id;
+    TunnelOptions  _options;
+    CompressStats  _tx;
+    CompressStats  _rx;
+
+    TunnelRole     _role;
+    /* Probes may be built on another thread than encap() */
+    std::atomic<uint64_t>  _tx_seq;
+    ReplayWindow   _replay;
+    uint64_t       _rejected;
+
+    struct sockaddr_in6 _peer;
+    uint64_t       _active_at;
+    PathStats      _path_stats;
+
+    std::unique_ptr<FecEncoder>  _fec_tx;
+    FecDecoder     _fec_rx;
+    uint64_t       _fec_opened;
+    uint64_t       _fec_parities;
+    uint64_t       _fec_duplicates;
+
+    /* Created by the first F_ORDERED datagram */
+    std::unique_ptr<ReorderBuffer>  _reorder;
+    /* _reorder exists, read by encap() maybe on another thread */
+    std::atomic<bool>  _reordering;
+    uint32_t       _tx_dseq;
+
+    /* Fill header and seq, return where the rest goes */
+    char* write_header(char *out, uint8_t type, uint8_t flags);
+    int overhead() const;
+    int unwrap(const char *payload, int size, uint8_t flags, char *out, int cap);
+    /* unwrap() then reorder, return 0 if the packet is held back */
+    int deliver(const char *payload, int size, uint8_t flags, uint32_t dseq, int path,
+            char *out, int cap);
+    /* Reply in order once the peer does */
+    bool ordered() const {
+        return _options.ordered || _reordering.load(std::memory_order_relaxed);
+    }
+    bool worth_compress(const char *in, int size);
+    bool encrypted() const { return !_options.key.empty(); }
+};
+
+uint64_t monotonic_ns();
+
+} /* namespace vpn */
+
+#endif
@@ -0,0 +1,653 @@
+#!/usr/bin/env python3
+"""
+Throughput and latency of the whole client + server stack on one box.
+
+Three network namespaces stand in for a client host, the server host and
+the internet behind it:
+
+    tvpn-cli             tvpn-srv                         tvpn-net
+    client  --veth--  server, tun, SNAT(as README)  --veth--  sinks
+    10.210.0.2        10.210.0.1 | 10.211.0.1            10.211.0.2
+
+The client routes everything through its tun, the server forwards it out
+with SNAT to its address on the internet side. Workloads run from the
+client's namespace against sinks of this script in tvpn-net:
+
+    tcp-bulk   tcp-rr   tcp-churn
+    udp-bulk   udp-rr   udp-churn
+    icmp-rr
+
+bulk is goodput, rr is transactions over open sockets, churn opens a new
+flow(a new NAT mapping) per transaction. Reported are Gbit/s, packets/s
+through the server's tun, RTT percentiles and CPU time of server and
+client per tun packet, as a table and a JSON report(--out).
+
+    $ sudo scripts/netns_bench.py --bin _build/bin --seconds 10 --out report.json
+    $ sudo scripts/netns_bench.py --workloads udp-bulk,udp-rr --server_flags "--fec_k 8"
+
+Needs root, iproute2 and the built binaries. Without iptables or nft the
+SNAT is replaced by a route back to the tun subnet.
+"""
+
+import argparse
+import json
+import os
+import shlex
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+NS_CLI = "tvpn-cli"
+NS_SRV = "tvpn-srv"
+NS_NET = "tvpn-net"
+
+CLI_ADDR = "10.210.0.2"
+SRV_ADDR = "10.210.0.1"
+SRV_OUT_ADDR = "10.211.0.1"
+NET_ADDR = "10.211.0.2"
+TUN_ADDR = "10.9.0.1"
+TUN_NET = "10.9.0.0/24"
+VPN_PORT = 5555
+
+PORT_SINK = 7001
+PORT_ECHO = 7002
+PORT_UDP_SINK = 7003
+PORT_UDP_ECHO = 7004
+
+WORKLOADS = ["tcp-bulk", "udp-bulk", "tcp-rr", "udp-rr", "icmp-rr", "tcp-churn", "udp-churn"]
+
+
+# ---------------------------------------------------------------- sinks
+
+def serve(addr):
+    """Sinks and echoes of the internet side, until killed"""
+    def tcp_sink(conn):
+        total = 0
+        while True:
+            data = conn.recv(1 << 16)
+            if not data:
+                break
+            total += len(data)
+        conn.sendall(str(total).encode())
+        conn.close()
+
+    def tcp_echo(conn):
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        while True:
+            data = conn.recv(1 << 16)
+            if not data:
+                break
+            conn.sendall(data)
+        conn.close()
+
+    def guarded(handler, conn):
+        # Churn resets its connections
+        try:
+            handler(conn)
+        except OSError:
+            conn.close()
+
+    def listen(port, handler):
+        sock = socket.socket()
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind((addr, port))
+        sock.listen(1024)
+        while True:
+            conn, _ = sock.accept()
+            threading.Thread(target=guarded, args=(handler, conn), daemon=True).start()
+
+    def udp_sink():
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 24)
+        sock.bind((addr, PORT_UDP_SINK))
+        packets = 0
+        total = 0
+        while True:
+            data, peer = sock.recvfrom(1 << 16)
+            if data == b"?reset":
+                packets = total = 0
+                sock.sendto(b"ok", peer)
+            elif data == b"?stats":
+                sock.sendto(("%d %d" % (packets, total)).encode(), peer)
+            else:
+                packets += 1
+                total += len(data)
+
+    def udp_echo():
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind((addr, PORT_UDP_ECHO))
+        while True:
+            data, peer = sock.recvfrom(1 << 16)
+            sock.sendto(data, peer)
+
+    threads = [
+        threading.Thread(target=listen, args=(PORT_SINK, tcp_sink), daemon=True),
+        threading.Thread(target=listen, args=(PORT_ECHO, tcp_echo), daemon=True),
+        threading.Thread(target=udp_sink, daemon=True),
+        threading.Thread(target=udp_echo, daemon=True),
+    ]
+    for thread in threads:
+        thread.start()
+    print("ready", flush=True)
+    for thread in threads:
+        thread.join()
+
+
+# ------------------------------------------------------------ workloads
+
+def percentiles(samples):
+    """RTTs in microseconds"""
+    if not samples:
+        return None
+    samples.sort()
+    def at(q):
+        return round(samples[min(len(samples) - 1, int(q * len(samples)))] / 1e3, 1)
+    return {"p50": at(0.5), "p90": at(0.9), "p99": at(0.99), "p999": at(0.999),
+            "max": round(samples[-1] / 1e3, 1)}
+
+
+def parallel(count, body):
+    """Run body(index) on count threads, return their results"""
+    results = [None] * count
+    def run(i):
+        results[i] = body(i)
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(count)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return results
+
+
+def ask(sock, request, target, tries=20):
+    """A control datagram of the UDP sink, which may be lost on the way"""
+    sock.settimeout(0.2)
+    for _ in range(tries):
+        sock.sendto(request, target)
+        try:
+            while True:
+                reply, _ = sock.recvfrom(256)
+                if reply != b"ok" or request == b"?reset":
+                    return reply
+        except socket.timeout:
+            continue
+    raise RuntimeError("no answer from the UDP sink")
+
+
+def tcp_bulk(args):
+    chunk = b"x" * (1 << 16)
+    def body(_):
+        sock = socket.create_connection((args.target, PORT_SINK), timeout=10)
+        end = time.monotonic() + args.seconds
+        while time.monotonic() < end:
+            sock.sendall(chunk)
+        sock.shutdown(socket.SHUT_WR)
+        received = int(sock.recv(64))
+        sock.close()
+        return received
+    start = time.monotonic()
+    received = sum(parallel(args.parallel, body))
+    elapsed = time.monotonic() - start
+    return {"seconds": round(elapsed, 3), "bytes": received,
+            "gbps": round(received * 8 / elapsed / 1e9, 4)}
+
+
+def udp_bulk(args):
+    target = (args.target, PORT_UDP_SINK)
+    control = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    ask(control, b"?reset", target)
+    payload = b"x" * args.size
+    def body(_):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, 1 << 22)
+        sock.connect(target)
+        rate = args.rate / args.parallel if args.rate > 0 else 0
+        sent = 0
+        start = time.monotonic()
+        end = start + args.seconds
+        now = start
+        while now < end:
+            for _ in range(64):
+                try:
+                    sock.send(payload)
+                    sent += 1
+                except (BlockingIOError, OSError):
+                    pass
+            now = time.monotonic()
+            if rate > 0 and sent > rate * (now - start):
+                time.sleep(sent / rate - (now - start))
+        return sent
+    start = time.monotonic()
+    sent = sum(parallel(args.parallel, body))
+    elapsed = time.monotonic() - start
+    # What is still on the way
+    time.sleep(0.5)
+    packets, received = map(int, ask(control, b"?stats", target).split())
+    return {"seconds": round(elapsed, 3), "bytes": received,
+            "gbps": round(received * 8 / elapsed / 1e9, 4), "sent": sent, "received": packets,
+            "loss": round(1 - packets / sent, 4) if sent else None}
+
+
+def transactions(args, body):
+    """Run body(index, rtts) on every thread until the time is up, body
+    appends the RTT of each transaction in ns and returns the lost ones"""
+    rtts = [[] for _ in range(args.parallel)]
+    start = time.monotonic()
+    lost = sum(parallel(args.parallel, lambda i: body(i, rtts[i], start + args.seconds)))
+    elapsed = time.monotonic() - start
+    samples = [rtt for thread in rtts for rtt in thread]
+    return {"seconds": round(elapsed, 3), "transactions": len(samples),
+            "tps": round(len(samples) / elapsed, 1), "lost": lost,
+            "rtt_us": percentiles(samples)}
+
+
+def tcp_rr(args):
+    payload = b"x" * args.rr_size
+    def body(_, rtts, end):
+        sock = socket.create_connection((args.target, PORT_ECHO), timeout=2)
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        while time.monotonic() < end:
+            start = time.perf_counter_ns()
+            sock.sendall(payload)
+            got = 0
+            while got < len(payload):
+                got += len(sock.recv(len(payload) - got))
+            rtts.append(time.perf_counter_ns() - start)
+        sock.close()
+        return 0
+    return transactions(args, body)
+
+
+def udp_exchange(sock, payload, target, rtts):
+    start = time.perf_counter_ns()
+    sock.sendto(payload, target)
+    try:
+        sock.recvfrom(1 << 16)
+    except socket.timeout:
+        return 1
+    rtts.append(time.perf_counter_ns() - start)
+    return 0
+
+
+def udp_rr(args):
+    payload = b"x" * args.rr_size
+    target = (args.target, PORT_UDP_ECHO)
+    def body(_, rtts, end):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.settimeout(1)
+        lost = 0
+        while time.monotonic() < end:
+            lost += udp_exchange(sock, payload, target, rtts)
+        return lost
+    return transactions(args, body)
+
+
+def icmp_checksum(data):
+    if len(data) % 2:
+        data += b"\0"
+    total = sum(struct.unpack("!%dH" % (len(data) // 2), data))
+    total = (total >> 16) + (total & 0xffff)
+    total += total >> 16
+    return ~total & 0xffff
+
+
+def icmp_rr(args):
+    payload = b"x" * args.rr_size
+    def body(index, rtts, end):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_RAW, socket.IPPROTO_ICMP)
+        ident = (os.getpid() + index) & 0xffff
+        lost = 0
+        seq = 0
+        while time.monotonic() < end:
+            seq = (seq + 1) & 0xffff
+            header = struct.pack("!BBHHH", 8, 0, 0, ident, seq)
+            check = icmp_checksum(header + payload)
+            packet = struct.pack("!BBHHH", 8, 0, check, ident, seq) + payload
+            start = time.perf_counter_ns()
+            sock.sendto(packet, (args.target, 0))
+            deadline = time.monotonic() + 1
+            while True:
+                sock.settimeout(max(deadline - time.monotonic(), 0.001))
+                try:
+                    reply = sock.recv(1 << 16)
+                except socket.timeout:
+                    lost += 1
+                    break
+                ihl = (reply[0] & 0x0f) * 4
+                kind, _, _, got_ident, got_seq = struct.unpack("!BBHHH", reply[ihl:ihl + 8])
+                if kind == 0 and got_ident == ident and got_seq == seq:
+                    rtts.append(time.perf_counter_ns() - start)
+                    break
+        return lost
+    return transactions(args, body)
+
+
+def tcp_churn(args):
+    payload = b"x" * args.rr_size
+    def body(_, rtts, end):
+        lost = 0
+        while time.monotonic() < end:
+            start = time.perf_counter_ns()
+            try:
+                sock = socket.create_connection((args.target, PORT_ECHO), timeout=2)
+                # No TIME_WAIT on this side, ports are reused sooner
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+                sock.sendall(payload)
+                got = 0
+                while got < len(payload):
+                    got += len(sock.recv(len(payload) - got))
+                sock.close()
+            except OSError:
+                lost += 1
+                continue
+            rtts.append(time.perf_counter_ns() - start)
+        return lost
+    return transactions(args, body)
+
+
+def udp_churn(args):
+    payload = b"x" * args.rr_size
+    target = (args.target, PORT_UDP_ECHO)
+    def body(_, rtts, end):
+        lost = 0
+        while time.monotonic() < end:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            sock.settimeout(1)
+            lost += udp_exchange(sock, payload, target, rtts)
+            sock.close()
+        return lost
+    return transactions(args, body)
+
+
+def run_workload(args):
+    runners = {"tcp-bulk": tcp_bulk, "udp-bulk": udp_bulk, "tcp-rr": tcp_rr,
+               "udp-rr": udp_rr, "icmp-rr": icmp_rr, "tcp-churn": tcp_churn,
+               "udp-churn": udp_churn}
+    if args.parallel <= 0:
+        args.parallel = 4 if args.workload.endswith("churn") else 1
+    result = {"parallel": args.parallel}
+    result.update(runners[args.workload](args))
+    print(json.dumps(result), flush=True)
+
+
+# ---------------------------------------------------------- the harness
+
+def sh(command, ns=None, check=True):
+    if ns is not None:
+        command = "ip netns exec %s %s" % (ns, command)
+    result = subprocess.run(command, shell=True, capture_output=True, text=True)
+    if check and result.returncode != 0:
+        raise RuntimeError("%s: %s" % (command, result.stderr.strip()))
+    return result.stdout
+
+
+def have(tool):
+    return subprocess.run("command -v %s" % tool, shell=True,
+                          capture_output=True).returncode == 0
+
+
+def teardown():
+    for ns in (NS_CLI, NS_SRV, NS_NET):
+        sh("ip netns del %s" % ns, check=False)
+
+
+def setup(args):
+    teardown()
+    for ns in (NS_CLI, NS_SRV, NS_NET):
+        sh("ip netns add %s" % ns)
+        sh("ip link set lo up", ns)
+    sh("ip link add tvpn-c0 netns %s type veth peer name tvpn-s0 netns %s" % (NS_CLI, NS_SRV))
+    sh("ip link add tvpn-s1 netns %s type veth peer name tvpn-n0 netns %s" % (NS_SRV, NS_NET))
+    for ns, dev, addr in ((NS_CLI, "tvpn-c0", CLI_ADDR), (NS_SRV, "tvpn-s0", SRV_ADDR),
+                          (NS_SRV, "tvpn-s1", SRV_OUT_ADDR), (NS_NET, "tvpn-n0", NET_ADDR)):
+        sh("ip addr add %s/24 dev %s" % (addr, dev), ns)
+        sh("ip link set %s up" % dev, ns)
+        if args.mtu:
+            sh("ip link set %s mtu %d" % (dev, args.mtu), ns)
+    if args.netem:
+        sh("tc qdisc add dev tvpn-c0 root netem %s" % args.netem, NS_CLI)
+    sh("sysctl -qw net.ipv4.ip_forward=1", NS_SRV)
+
+    # SNAT of the tun subnet out of the internet side, as the README does
+    if have("iptables"):
+        sh("iptables -t nat -A POSTROUTING -s %s -o tvpn-s1 -j SNAT --to-source %s"
+           % (TUN_NET, SRV_OUT_ADDR), NS_SRV)
+        return "iptables"
+    if have("nft"):
+        sh("nft add table ip nat", NS_SRV)
+        sh("nft 'add chain ip nat postrouting { type nat hook postrouting priority 100; }'",
+           NS_SRV)
+        sh("nft add rule ip nat postrouting ip saddr %s oifname tvpn-s1 snat to %s"
+           % (TUN_NET, SRV_OUT_ADDR), NS_SRV)
+        return "nft"
+    sh("ip route add %s via %s" % (TUN_NET, SRV_OUT_ADDR), NS_NET)
+    return "route"
+
+
+def tun_of(ns):
+    for line in sh("ip -o link", ns).splitlines():
+        name = line.split(":")[1].strip().split("@")[0]
+        if name.startswith("tun"):
+            return name
+    return None
+
+
+def wait_for(what, test, seconds=5):
+    end = time.monotonic() + seconds
+    while time.monotonic() < end:
+        value = test()
+        if value:
+            return value
+        time.sleep(0.1)
+    raise RuntimeError("timed out waiting for %s" % what)
+
+
+def tun_packets(tun):
+    base = "/sys/class/net/%s/statistics/" % tun
+    return sum(int(sh("cat %s%s" % (base, name), NS_SRV))
+               for name in ("rx_packets", "tx_packets"))
+
+
+def cpu_ns(pid):
+    with open("/proc/%d/stat" % pid) as stat:
+        fields = stat.read().rsplit(")", 1)[1].split()
+    # utime and stime, fields 14 and 15
+    ticks = int(fields[11]) + int(fields[12])
+    return ticks * 1e9 / os.sysconf("SC_CLK_TCK")
+
+
+def spawn(ns, command, log):
+    return subprocess.Popen("exec ip netns exec %s %s" % (ns, command), shell=True,
+                            stdout=log, stderr=subprocess.STDOUT)
+
+
+def agent(ns, *options):
+    return "ip netns exec %s %s %s %s" % (ns, shlex.quote(sys.executable),
+                                          shlex.quote(os.path.abspath(__file__)),
+                                          " ".join(shlex.quote(str(o)) for o in options))
+
+
+def echoed(probe):
+    """Whether a short udp-rr run got any answer, a failed run got none"""
+    result = subprocess.run(probe, shell=True, capture_output=True, text=True, timeout=30)
+    if result.returncode != 0:
+        return False
+    try:
+        return json.loads(result.stdout).get("transactions", 0) > 0
+    except ValueError:
+        return False
+
+
+def measure(args, name, server, client, tun):
+    command = agent(NS_CLI, "run", "--workload", name, "--target", NET_ADDR,
+                    "--seconds", args.seconds, "--size", args.size, "--rr_size", args.rr_size,
+                    "--parallel", args.parallel, "--rate", args.rate)
+    packets = tun_packets(tun)
+    server_cpu = cpu_ns(server.pid)
+    client_cpu = cpu_ns(client.pid)
+    result = subprocess.run(command, shell=True, capture_output=True, text=True,
+                            timeout=args.seconds + 60)
+    packets = tun_packets(tun) - packets
+    server_cpu = cpu_ns(server.pid) - server_cpu
+    client_cpu = cpu_ns(client.pid) - client_cpu
+    if result.returncode != 0:
+        return {"workload": name, "error": result.stderr.strip().splitlines()[-1:]}
+
+    report = {"workload": name}
+    report.update(json.loads(result.stdout))
+    report["tun_packets"] = packets
+    report["pps"] = round(packets / report["seconds"])
+    report["server_cpu_ns_per_packet"] = round(server_cpu / packets) if packets else None
+    report["client_cpu_ns_per_packet"] = round(client_cpu / packets) if packets else None
+    return report
+
+
+ROW = "%-10s %8s %10s %9s %9s %9s %9s %9s %9s"
+
+
+def print_header():
+    print(ROW % ("workload", "Gbit/s", "pps", "tps", "p50(us)", "p99(us)", "p999(us)",
+                 "srv ns/p", "cli ns/p"))
+
+
+def print_row(r):
+    if "error" in r:
+        print("%-10s failed: %s" % (r["workload"], " ".join(r["error"])))
+        return
+    rtt = r.get("rtt_us") or {}
+    def cell(value, form):
+        return form % value if value is not None else "-"
+    print(ROW % (r["workload"], cell(r.get("gbps"), "%.3f"), r["pps"],
+                 cell(r.get("tps"), "%.0f"), cell(rtt.get("p50"), "%.1f"),
+                 cell(rtt.get("p99"), "%.1f"), cell(rtt.get("p999"), "%.1f"),
+                 cell(r["server_cpu_ns_per_packet"], "%d"),
+                 cell(r["client_cpu_ns_per_packet"], "%d")))
+
+
+def harness(args):
+    if os.geteuid() != 0:
+        sys.exit("needs root, for namespaces and tun")
+    for binary in ("server", "client"):
+        if not os.access(os.path.join(args.bin, binary), os.X_OK):
+            sys.exit("no %s in %s, see --bin" % (binary, args.bin))
+    names = args.workloads.split(",")
+    for name in names:
+        if name not in WORKLOADS:
+            sys.exit("unknown workload %s, one of %s" % (name, ",".join(WORKLOADS)))
+
+    processes = []
+    # Control sockets of their own, leaving those of a running VPN alone
+    controls = tempfile.mkdtemp(prefix="netns_bench.")
+    try:
+        nat = setup(args)
+        logs = open(os.path.join(args.logs, "netns_bench.log"), "w")
+        sink = spawn(NS_NET, "%s %s serve --addr %s" % (
+            shlex.quote(sys.executable), shlex.quote(os.path.abspath(__file__)), NET_ADDR), logs)
+        processes.append(sink)
+        server = spawn(NS_SRV, "%s --tun_addr %s --port %d --control %s %s" % (
+            os.path.join(args.bin, "server"), TUN_ADDR, VPN_PORT,
+            os.path.join(controls, "server.sock"), args.server_flags), logs)
+        processes.append(server)
+        wait_for("the tun of server", lambda: tun_of(NS_SRV))
+        client = spawn(NS_CLI, "%s --srv_addr %s --srv_port %d --control %s %s" % (
+            os.path.join(args.bin, "client"), SRV_ADDR, VPN_PORT,
+            os.path.join(controls, "client.sock"), args.client_flags), logs)
+        processes.append(client)
+        client_tun = wait_for("the tun of client", lambda: tun_of(NS_CLI))
+        # As the README says, the server itself is on the link here
+        sh("ip route add default dev %s" % client_tun, NS_CLI)
+        tun = tun_of(NS_SRV)
+
+        probe = agent(NS_CLI, "run", "--workload", "udp-rr", "--target", NET_ADDR,
+                      "--seconds", 0.2)
+        wait_for("a first echo through the tunnel", lambda: echoed(probe), seconds=10)
+
+        reports = []
+        if not args.json:
+            print_header()
+        for name in names:
+            for server_or_client in (server, client):
+                if server_or_client.poll() is not None:
+                    raise RuntimeError("server or client exited, see %s" % logs.name)
+            reports.append(measure(args, name, server, client, tun))
+            if not args.json:
+                print_row(reports[-1])
+                sys.stdout.flush()
+
+        report = {
+            "started": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            "server_flags": args.server_flags,
+            "client_flags": args.client_flags,
+            "snat": nat,
+            "netem": args.netem,
+            "size": args.size,
+            "rr_size": args.rr_size,
+            "workloads": reports,
+        }
+        if args.out:
+            with open(args.out, "w") as out:
+                json.dump(report, out, indent=2)
+        if args.json:
+            print(json.dumps(report, indent=2))
+    finally:
+        for process in processes:
+            process.terminate()
+        for process in processes:
+            try:
+                process.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                process.kill()
+        if not args.keep:
+            teardown()
+        shutil.rmtree(controls, ignore_errors=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].strip())
+    sub = parser.add_subparsers(dest="mode")
+
+    serve_parser = sub.add_parser("serve", help="(internal) sinks of the internet side")
+    serve_parser.add_argument("--addr", required=True)
+
+    run_parser = sub.add_parser("run", help="(internal) one workload, as JSON")
+    run_parser.add_argument("--workload", choices=WORKLOADS, required=True)
+    run_parser.add_argument("--target", required=True)
+
+    for p in (parser, run_parser):
+        p.add_argument("--seconds", type=float, default=5, help="per workload")
+        p.add_argument("--size", type=int, default=1400, help="UDP payload of udp-bulk")
+        p.add_argument("--rr_size", type=int, default=64,
+                       help="request and response size of rr and churn")
+        p.add_argument("--parallel", type=int, default=0,
+                       help="connections or threads, 0 is 1(4 for churn)")
+        p.add_argument("--rate", type=float, default=0,
+                       help="packets per second of udp-bulk, 0 is as fast as it goes")
+
+    parser.add_argument("--bin", default="_build/bin", help="where server and client are")
+    parser.add_argument("--workloads", default=",".join(WORKLOADS))
+    parser.add_argument("--server_flags", default="")
+    parser.add_argument("--client_flags", default="")
+    parser.add_argument("--mtu", type=int, default=0, help="of the veths, 0 leaves 1500")
+    parser.add_argument("--netem", default="", help="tc netem of the client's link, "
+                        "eg: 'delay 10ms loss 0.1%%'")
+    parser.add_argument("--out", default="", help="write the JSON report here")
+    parser.add_argument("--json", action="store_true", help="print the JSON report only")
+    parser.add_argument("--logs", default="/tmp", help="where the log of server and client goes")
+    parser.add_argument("--keep", action="store_true", help="leave the namespaces up")
+
+    args = parser.parse_args()
+    if args.mode == "serve":
+        serve(args.addr)
+    elif args.mode == "run":
+        run_workload(args)
+    else:
+        harness(args)
+
+
+if __name__ == "__main__":
+    main()
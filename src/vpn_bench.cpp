@@ -0,0 +1,564 @@
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "vpn_client.h"
+#include "vpn_memdev.h"
+#include "vpn_nat.h"
+#include "vpn_net.h"
+#include "vpn_server.h"
+#include "vpn_tunnel.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(seconds, 1, "seconds per case");
+DEFINE_int32(payload, 512, "transport payload of the packets in bytes");
+DEFINE_string(nat_sizes, "1000,10000,25000", "mappings in the NAT table, capped at "
+        "ip_local_port_range");
+DEFINE_int32(flows, 64, "flows of the end to end cases");
+DEFINE_string(filter, "", "run the cases whose names have this in them");
+DEFINE_bool(json, false, "print results as JSON, to track them between releases");
+
+static bool validate_seconds(const char* flagname, int value) {
+    return value >= 1;
+}
+
+DEFINE_validator(seconds, validate_seconds);
+
+/*
+ * What the server spends on a packet, piece by piece: parsing(IP),
+ * checksums, NAT lookups at several table sizes, and the whole of
+ * client2server()/server2client() driven through QueueDevice in place of
+ * tun and the socket. Cases report ns, heap allocations and, where
+ * perf_event_open() is allowed, cache misses per operation. Only what is
+ * measured counts, eg: the client making datagrams for client2server is
+ * left out.
+ * */
+
+/* malloc() and what calls it, operator new among them */
+static std::atomic<uint64_t> g_allocs(0);
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+}
+static const bool COUNTS_ALLOCS = true;
+#else
+static const bool COUNTS_ALLOCS = false;
+#endif
+
+/* Cache misses of this thread, user and kernel if allowed, -1 if perf
+ * events are not */
+class Misses {
+public:
+    Misses() : _fd(open(false)) {
+        if (_fd < 0) {
+            _fd = open(true);
+        }
+    }
+    ~Misses() {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+    }
+
+    bool available() const { return _fd >= 0; }
+    int64_t read() const {
+        uint64_t value = 0;
+        if (_fd < 0 || ::read(_fd, &value, sizeof(value)) != sizeof(value)) {
+            return -1;
+        }
+        return value;
+    }
+private:
+    int _fd;
+
+    static int open(bool user_only) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+};
+
+static Misses *g_misses;
+
+/* Adds up what happens between start() and stop(), a case may measure
+ * only part of what it does */
+struct Meter {
+    uint64_t  ops;
+    uint64_t  ns;
+    uint64_t  allocs;
+    int64_t   misses;
+
+    uint64_t  ns_at;
+    uint64_t  allocs_at;
+    int64_t   misses_at;
+
+    Meter() : ops(0), ns(0), allocs(0), misses(0), ns_at(0), allocs_at(0), misses_at(0) {  }
+
+    void start() {
+        misses_at = g_misses->read();
+        allocs_at = g_allocs.load(std::memory_order_relaxed);
+        ns_at = vpn::monotonic_ns();
+    }
+    void stop(uint64_t n) {
+        ns += vpn::monotonic_ns() - ns_at;
+        allocs += g_allocs.load(std::memory_order_relaxed) - allocs_at;
+        int64_t now = g_misses->read();
+        if (misses >= 0 && now >= 0) {
+            misses += now - misses_at;
+        } else {
+            misses = -1;
+        }
+        ops += n;
+    }
+};
+
+/* Run one round of a case, which measures with the meter, until the
+ * seconds are up */
+using Round = std::function<void(Meter *meter)>;
+
+struct Result {
+    std::string  name;
+    Meter        meter;
+};
+
+static std::vector<Result> g_results;
+
+static bool wanted(const std::string& name) {
+    return name.find(FLAGS_filter) != std::string::npos;
+}
+
+static void run(const std::string& name, const Round& round) {
+    if (!wanted(name)) {
+        return;
+    }
+    Result result;
+    result.name = name;
+    /* Warm up */
+    round(&result.meter);
+    result.meter = Meter();
+
+    uint64_t end = vpn::monotonic_ns() + FLAGS_seconds * 1000000000ULL;
+    while (vpn::monotonic_ns() < end) {
+        round(&result.meter);
+    }
+
+    const Meter& m = result.meter;
+    if (!FLAGS_json && m.ops == 0) {
+        printf("%-24s no ops, nothing got through\n", name.c_str());
+        fflush(stdout);
+    } else if (!FLAGS_json) {
+        printf("%-24s %10.2f ns/op %8.2f allocs/op", name.c_str(),
+                static_cast<double>(m.ns) / m.ops, static_cast<double>(m.allocs) / m.ops);
+        if (m.misses >= 0) {
+            printf(" %8.2f misses/op", static_cast<double>(m.misses) / m.ops);
+        }
+        printf(" %12.1f K ops\n", m.ops / 1e3);
+        fflush(stdout);
+    }
+    g_results.push_back(result);
+}
+
+/* value / ops, null when nothing was measured */
+static void print_per_op(double value, uint64_t ops) {
+    if (ops == 0 || value < 0) {
+        printf("null");
+    } else {
+        printf("%.3f", value / ops);
+    }
+}
+
+static void print_json() {
+    printf("{\n  \"seconds\": %d,\n  \"payload\": %d,\n  \"flows\": %d,\n", FLAGS_seconds,
+            FLAGS_payload, FLAGS_flows);
+    printf("  \"allocs_counted\": %s,\n  \"cache_misses_counted\": %s,\n  \"cases\": [",
+            COUNTS_ALLOCS ? "true" : "false", g_misses->available() ? "true" : "false");
+    for (size_t i = 0; i < g_results.size(); ++i) {
+        const Meter& m = g_results[i].meter;
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": ",
+                i == 0 ? "" : ",", g_results[i].name.c_str(),
+                static_cast<unsigned long long>(m.ops));
+        print_per_op(m.ns, m.ops);
+        printf(", \"allocs_per_op\": ");
+        print_per_op(m.allocs, m.ops);
+        printf(", \"cache_misses_per_op\": ");
+        print_per_op(m.misses, m.ops);
+        printf("}");
+    }
+    printf("\n  ]\n}\n");
+}
+
+/* Checksums are left for the cases to compute, nothing here checks them */
+static std::string make_packet(int version, int protocol, const char *src, const char *dst,
+        int sport, int dport, int payload) {
+    int l3 = version == 4 ? sizeof(struct iphdr) : sizeof(struct ipv6hdr);
+    int l4 = protocol == IPPROTO_TCP ? sizeof(struct tcphdr)
+        : protocol == IPPROTO_UDP ? sizeof(struct udphdr) : sizeof(struct icmphdr);
+    std::string packet(l3 + l4 + payload, 'x');
+    char *data = &packet[0];
+    memset(data, 0, l3 + l4);
+
+    if (version == 4) {
+        struct iphdr *ip = reinterpret_cast<struct iphdr*>(data);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(packet.size());
+        ip->ttl = 64;
+        ip->protocol = protocol;
+        inet_pton(AF_INET, src, &ip->saddr);
+        inet_pton(AF_INET, dst, &ip->daddr);
+    } else {
+        struct ipv6hdr *ip6 = reinterpret_cast<struct ipv6hdr*>(data);
+        ip6->version = 6;
+        ip6->payload_len = htons(l4 + payload);
+        ip6->nexthdr = protocol;
+        ip6->hop_limit = 64;
+        inet_pton(AF_INET6, src, &ip6->saddr);
+        inet_pton(AF_INET6, dst, &ip6->daddr);
+    }
+
+    char *trans = data + l3;
+    if (protocol == IPPROTO_TCP) {
+        struct tcphdr *tcp = reinterpret_cast<struct tcphdr*>(trans);
+        tcp->source = htons(sport);
+        tcp->dest = htons(dport);
+        tcp->doff = 5;
+        tcp->ack = 1;
+        tcp->window = htons(65535);
+    } else if (protocol == IPPROTO_UDP) {
+        struct udphdr *udp = reinterpret_cast<struct udphdr*>(trans);
+        udp->source = htons(sport);
+        udp->dest = htons(dport);
+        udp->len = htons(l4 + payload);
+        udp->check = htons(0x1234);
+    } else {
+        struct icmphdr *icmp = reinterpret_cast<struct icmphdr*>(trans);
+        icmp->type = version == 4 ? ICMP_ECHO : 128;
+        icmp->un.echo.id = htons(sport);
+    }
+    return packet;
+}
+
+static const int ROUND = 1024;
+
+struct Kind {
+    const char  *name;
+    int          version;
+    int          protocol;
+};
+
+static const Kind KINDS[] = {
+    {"tcp", 4, IPPROTO_TCP},
+    {"udp", 4, IPPROTO_UDP},
+    {"icmp", 4, IPPROTO_ICMP},
+    {"tcp6", 6, IPPROTO_TCP},
+    {"udp6", 6, IPPROTO_UDP},
+    {"icmp6", 6, IPPROTO_ICMPV6},
+};
+
+static std::string kind_packet(const Kind& kind) {
+    return kind.version == 4
+        ? make_packet(4, kind.protocol, "10.9.0.2", "8.8.8.8", 40000, 443, FLAGS_payload)
+        : make_packet(6, kind.protocol, "fd00::2", "2001:db8::1", 40000, 443, FLAGS_payload);
+}
+
+static void bench_ip() {
+    for (const Kind& kind : KINDS) {
+        std::string packet = kind_packet(kind);
+        run(std::string("ip/") + kind.name, [&packet](Meter *meter) {
+            uint64_t sum = 0;
+            meter->start();
+            for (int i = 0; i < ROUND; ++i) {
+                vpn::IP ip(&packet[0], packet.size(), vpn::IP::REUSE);
+                sum += ip.protocol() + ip.header_size();
+            }
+            meter->stop(ROUND);
+            if (sum == 0) {
+                abort();
+            }
+        });
+    }
+    std::string packet = kind_packet(KINDS[0]);
+    run("ip/tcp/alloc", [&packet](Meter *meter) {
+        meter->start();
+        for (int i = 0; i < ROUND; ++i) {
+            vpn::IP ip(&packet[0], packet.size(), vpn::IP::ALLOC);
+        }
+        meter->stop(ROUND);
+    });
+}
+
+/* Whole checksums, as of ICMP and packets made anew, then the rewrite of
+ * the data path: new source address and port, checksums updated */
+static void bench_checksum() {
+    for (const Kind& kind : KINDS) {
+        if (kind.version != 4) {
+            continue;
+        }
+        std::string packet = kind_packet(kind);
+        vpn::IP ip(&packet[0], packet.size(), vpn::IP::REUSE);
+        const struct iphdr *hdr = reinterpret_cast<const struct iphdr*>(packet.data());
+        run(std::string("checksum/") + kind.name, [&ip, hdr](Meter *meter) {
+            meter->start();
+            for (int i = 0; i < ROUND; ++i) {
+                ip.inner()->calc_checksum(hdr);
+            }
+            meter->stop(ROUND);
+        });
+    }
+    {
+        std::string packet = kind_packet(KINDS[0]);
+        vpn::IP ip(&packet[0], packet.size(), vpn::IP::REUSE);
+        run("checksum/ip", [&ip](Meter *meter) {
+            meter->start();
+            for (int i = 0; i < ROUND; ++i) {
+                ip.calc_checksum();
+            }
+            meter->stop(ROUND);
+        });
+    }
+
+    for (const Kind& kind : KINDS) {
+        std::string packet = kind_packet(kind);
+        vpn::Addr addrs[2] = {
+            vpn::Addr::parse(kind.version == 4 ? "10.0.0.1" : "2001:db8::2"),
+            vpn::Addr::parse(kind.version == 4 ? "10.9.0.2" : "fd00::2")
+        };
+        run(std::string("rewrite/") + kind.name, [&packet, &addrs](Meter *meter) {
+            meter->start();
+            for (int i = 0; i < ROUND; ++i) {
+                vpn::IP ip(&packet[0], packet.size(), vpn::IP::REUSE);
+                ip.set_src(addrs[i & 1]);
+                if (ip.protocol() == vpn::P_TCP || ip.protocol() == vpn::P_UDP) {
+                    static_cast<vpn::TransLayer*>(ip.inner())->set_sport(32768 + (i & 1));
+                }
+                ip.raw_data();
+            }
+            meter->stop(ROUND);
+        });
+    }
+}
+
+static std::vector<int> parse_sizes(const std::string& text) {
+    std::vector<int> sizes;
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        sizes.push_back(atoi(text.substr(start, end - start).c_str()));
+        start = end + 1;
+    }
+    return sizes;
+}
+
+/* Ports NAT hands out, as it reads them */
+static int port_range() {
+    FILE *fp = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+    int start = 0;
+    int end = -1;
+    if (fp != nullptr) {
+        if (fscanf(fp, "%d%d", &start, &end) != 2) {
+            end = -1;
+        }
+        fclose(fp);
+    }
+    return end - start + 1;
+}
+
+/* Lookups of mappings that exist, spread over the table */
+static void bench_nat() {
+    struct sockaddr_in6 sock;
+    vpn::make_sockaddr("192.0.2.1", 40000, &sock);
+    for (int size : parse_sizes(FLAGS_nat_sizes)) {
+        size = std::min(size, port_range());
+        std::string suffix = "/" + std::to_string(size);
+        if (size <= 0 || (!wanted("nat/snat" + suffix) && !wanted("nat/dnat" + suffix))) {
+            continue;
+        }
+        vpn::NAT nat;
+        std::vector<vpn::Addr> addrs;
+        std::vector<int> ports;
+        for (int i = 0; i < size; ++i) {
+            char text[32];
+            snprintf(text, sizeof(text), "10.9.%d.%d", (i >> 8) & 0xff, i & 0xff);
+            vpn::Addr addr = vpn::Addr::parse(text);
+            addrs.push_back(addr);
+            ports.push_back(nat.snat(addr, 1024 + i % 50000, sock, 1));
+        }
+
+        /* Strided, so neighbours in the table are not neighbours in time */
+        size_t next = 0;
+        run("nat/snat" + suffix, [&](Meter *meter) {
+            meter->start();
+            for (int i = 0; i < ROUND; ++i) {
+                next = (next + 7919) % size;
+                nat.snat(addrs[next], 1024 + next % 50000, sock, 1);
+            }
+            meter->stop(ROUND);
+        });
+        run("nat/dnat" + suffix, [&](Meter *meter) {
+            vpn::OriginData origin;
+            meter->start();
+            for (int i = 0; i < ROUND; ++i) {
+                next = (next + 7919) % size;
+                nat.dnat(ports[next], &origin);
+            }
+            meter->stop(ROUND);
+        });
+    }
+}
+
+/* Move datagrams the client sent to the server's socket, as from peer */
+static int carry(vpn::QueueDevice *from, vpn::QueueDevice *to, const struct sockaddr_in6& peer) {
+    char buf[vpn::MAX_DATAGRAM];
+    int n = 0;
+    int size;
+    while ((size = from->take(buf, sizeof(buf))) >= 0) {
+        to->inject(buf, size, &peer);
+        ++n;
+    }
+    return n;
+}
+
+static int discard(vpn::QueueDevice *device) {
+    char buf[vpn::MAX_DATAGRAM];
+    int n = 0;
+    while (device->take(buf, sizeof(buf)) >= 0) {
+        ++n;
+    }
+    return n;
+}
+
+/*
+ * A client and a server back to back over QueueDevices, as they run but
+ * for the devices: a lock and a copy in place of a system call. Batches
+ * of BATCH_SIZE UDP packets of FLAGS_flows flows, only the server's poll
+ * is measured.
+ * */
+static void bench_forward() {
+    if (!wanted("forward/client2server") && !wanted("forward/server2client")) {
+        return;
+    }
+    vpn::QueueDevice client_tun, client_socket, server_tun, server_socket;
+    vpn::ClientOptions options;
+    options.srv_addrs.push_back("192.0.2.2");
+    options.srv_port = 5003;
+    options.pmtu = false;
+    vpn::Client client(options, &client_tun, &client_socket);
+    vpn::Server server(&server_tun, &server_socket, "10.0.0.1");
+    server.start();
+
+    struct sockaddr_in6 peer;
+    vpn::make_sockaddr("192.0.2.1", 40000, &peer);
+
+    std::vector<std::string> ups;
+    for (int i = 0; i < FLAGS_flows; ++i) {
+        ups.push_back(make_packet(4, IPPROTO_UDP, "10.9.0.2", "8.8.8.8", 10000 + i, 53,
+                    FLAGS_payload));
+    }
+
+    /* One packet of each flow through, to learn its port after NAT */
+    std::vector<std::string> downs;
+    char buf[vpn::MAX_DATAGRAM];
+    for (const auto& up : ups) {
+        client_tun.inject(up.data(), up.size());
+        client.poll(0);
+        carry(&client_socket, &server_socket, peer);
+        server.poll(0);
+        int size = server_tun.take(buf, sizeof(buf));
+        if (size < 0) {
+            fprintf(stderr, "a packet of the client didn't get through the server\n");
+            exit(1);
+        }
+        vpn::IP ip(buf, size, vpn::IP::REUSE);
+        int port = static_cast<vpn::TransLayer*>(ip.inner())->sport();
+        downs.push_back(make_packet(4, IPPROTO_UDP, "8.8.8.8", ip.saddr().c_str(), 53, port,
+                    FLAGS_payload));
+    }
+    discard(&server_socket);
+
+    size_t next = 0;
+    run("forward/client2server", [&](Meter *meter) {
+        for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+            const std::string& up = ups[next++ % ups.size()];
+            client_tun.inject(up.data(), up.size());
+        }
+        client.poll(0);
+        carry(&client_socket, &server_socket, peer);
+        meter->start();
+        server.poll(0);
+        meter->stop(0);
+        meter->ops += discard(&server_tun);
+        /* Replies and probes of the server */
+        discard(&server_socket);
+    });
+    run("forward/server2client", [&](Meter *meter) {
+        for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+            const std::string& down = downs[next++ % downs.size()];
+            server_tun.inject(down.data(), down.size());
+        }
+        meter->start();
+        server.poll(0);
+        meter->stop(0);
+        meter->ops += discard(&server_socket);
+    });
+    if (server_tun.dropped() + server_socket.dropped() > 0) {
+        fprintf(stderr, "devices dropped packets, results are off\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("bench [--seconds N] [--filter name] [--json]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    Misses misses;
+    g_misses = &misses;
+    if (!misses.available() && !FLAGS_json) {
+        printf("no perf events(see /proc/sys/kernel/perf_event_paranoid), no cache misses\n");
+    }
+
+    bench_ip();
+    bench_checksum();
+    bench_nat();
+    bench_forward();
+
+    if (FLAGS_json) {
+        print_json();
+    }
+    return 0;
+}
@@ -0,0 +1,370 @@
+#include "vpn_capture.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <chrono>
+#include <sstream>
+
+#include "vpn_trace.h"
+
+namespace vpn {
+
+/* Memory of the ring, whatever the snaplen */
+static const uint64_t RING_BYTES = 8 << 20;
+static const uint64_t MIN_SLOTS = 256;
+/* Sleep of the writer when the ring is empty */
+static const int DRAIN_INTERVAL_MS = 10;
+
+/* pcapng(draft-ietf-opsawg-pcapng) blocks and options */
+static const uint32_t BLOCK_SECTION = 0x0a0d0d0a;
+static const uint32_t BLOCK_INTERFACE = 1;
+static const uint32_t BLOCK_PACKET = 6;
+static const uint32_t BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+/* Packets start at the IP header */
+static const uint16_t LINKTYPE_RAW = 101;
+static const uint16_t OPT_END = 0;
+static const uint16_t OPT_COMMENT = 1;
+static const uint16_t OPT_SHB_USERAPPL = 4;
+static const uint16_t OPT_IF_NAME = 2;
+static const uint16_t OPT_IF_DESCRIPTION = 3;
+static const uint16_t OPT_IF_TSRESOL = 9;
+static const uint16_t OPT_EPB_FLAGS = 2;
+static const uint32_t FLAG_INBOUND = 1;
+static const uint32_t FLAG_OUTBOUND = 2;
+
+bool CaptureFilter::parse(const std::string& text, std::string *error) {
+    std::vector<std::string> words;
+    std::istringstream in(text);
+    std::string word;
+    while (in >> word) {
+        words.push_back(word);
+    }
+
+    std::vector<Term> terms;
+    size_t i = 0;
+    while (i < words.size()) {
+        Term term = {F_VERSION, EITHER, false, 0, Addr()};
+        if (words[i] == "not") {
+            term.negate = true;
+            ++i;
+        }
+        if (i < words.size() && (words[i] == "src" || words[i] == "dst")) {
+            term.side = words[i] == "src" ? SRC : DST;
+            ++i;
+        }
+        if (i == words.size()) {
+            *error = "filter ends early";
+            return false;
+        }
+        const std::string& name = words[i++];
+        if (name == "host" || name == "port") {
+            if (i == words.size()) {
+                *error = name + " needs a value";
+                return false;
+            }
+            const std::string& value = words[i++];
+            if (name == "host") {
+                term.kind = F_HOST;
+                term.addr = Addr::parse(value);
+                if (term.addr.family == 0) {
+                    *error = "bad address " + value;
+                    return false;
+                }
+            } else {
+                term.kind = F_PORT;
+                term.number = atoi(value.c_str());
+                if (term.number <= 0 || term.number > 65535) {
+                    *error = "bad port " + value;
+                    return false;
+                }
+            }
+        } else if (term.side != EITHER) {
+            *error = "src and dst go before host or port";
+            return false;
+        } else if (name == "ip" || name == "ip6") {
+            term.kind = F_VERSION;
+            term.number = name == "ip" ? 4 : 6;
+        } else if (name == "tcp" || name == "udp" || name == "icmp" || name == "icmp6") {
+            term.kind = F_PROTOCOL;
+            term.number = name == "tcp" ? IPPROTO_TCP : name == "udp" ? IPPROTO_UDP
+                : name == "icmp" ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+        } else {
+            *error = "unknown primitive " + name;
+            return false;
+        }
+        terms.push_back(term);
+
+        if (i < words.size()) {
+            if (words[i] != "and") {
+                *error = "expected and, got " + words[i];
+                return false;
+            }
+            if (++i == words.size()) {
+                *error = "filter ends early";
+                return false;
+            }
+        }
+    }
+    _terms = terms;
+    _text = text;
+    return true;
+}
+
+bool CaptureFilter::match(const FlowTuple& tuple) const {
+    for (const Term& term : _terms) {
+        bool hit = false;
+        switch (term.kind) {
+            case F_VERSION:
+                hit = tuple.version == term.number;
+                break;
+            case F_PROTOCOL:
+                hit = tuple.protocol == term.number;
+                break;
+            case F_HOST:
+                hit = (term.side != DST && tuple.src == term.addr)
+                    || (term.side != SRC && tuple.dst == term.addr);
+                break;
+            case F_PORT:
+                hit = (term.side != DST && tuple.sport == term.number)
+                    || (term.side != SRC && tuple.dport == term.number);
+                break;
+        }
+        if (hit == term.negate) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Capture::Capture() : _options(), _filter(), _path(), _out(nullptr), _running(false), _thread(),
+    _ring(nullptr), _slots(0), _slot_size(0), _head(0), _cached_tail(0), _seen(0),
+    _next_id(0), _dropped(0), _tail(0), _written(0) {  }
+
+Capture::~Capture() {
+    stop();
+}
+
+bool Capture::start(const std::string& path, const CaptureOptions& options,
+        std::string *error) {
+    CaptureFilter filter;
+    if (!filter.parse(options.filter, error)) {
+        return false;
+    }
+    if (options.sample < 1 || options.snaplen < 1 || options.snaplen > 65535) {
+        *error = "sample must be 1 or more, snaplen 1 to 65535";
+        return false;
+    }
+    stop();
+    _out = fopen(path.c_str(), "wb");
+    if (_out == nullptr) {
+        *error = "failed to open " + path;
+        return false;
+    }
+
+    _slot_size = (sizeof(Slot) + options.snaplen + 63) & ~63ULL;
+    _slots = MIN_SLOTS;
+    while (_slots * 2 * _slot_size <= RING_BYTES) {
+        _slots *= 2;
+    }
+    void *ring = mmap(nullptr, _slots * _slot_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        fclose(_out);
+        _out = nullptr;
+        *error = "failed to map the ring";
+        return false;
+    }
+    _ring = static_cast<char*>(ring);
+    _options = options;
+    _filter = filter;
+    _path = path;
+    _head = 0;
+    _cached_tail = 0;
+    _tail = 0;
+    _seen = 0;
+    _dropped = 0;
+    _written = 0;
+    write_header();
+    _running = true;
+    _thread = std::thread(&Capture::run, this);
+    return true;
+}
+
+void Capture::stop() {
+    if (!running()) {
+        return;
+    }
+    _running = false;
+    _thread.join();
+    drain();
+    fclose(_out);
+    _out = nullptr;
+    munmap(_ring, _slots * _slot_size);
+    _ring = nullptr;
+}
+
+uint32_t Capture::take(const char *packet, int size) {
+    FlowTuple tuple;
+    bool parsed = flow_tuple(packet, size, &tuple);
+    if (parsed ? !_filter.match(tuple) : !_filter.text().empty()) {
+        return 0;
+    }
+    if (++_seen < static_cast<uint32_t>(_options.sample)) {
+        return 0;
+    }
+    _seen = 0;
+    if (++_next_id == 0) {
+        _next_id = 1;
+    }
+    return _next_id;
+}
+
+void Capture::add(uint32_t id, CapturePoint point, int direction, uint32_t session,
+        const char *packet, int size) {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    if (head - _cached_tail >= _slots) {
+        _cached_tail = _tail.load(std::memory_order_acquire);
+        if (head - _cached_tail >= _slots) {
+            _dropped.store(_dropped.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+            return ;
+        }
+    }
+    char *at = _ring + (head & (_slots - 1)) * _slot_size;
+    Slot *slot = reinterpret_cast<Slot*>(at);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->ts = static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+    slot->id = id;
+    slot->session = session;
+    slot->size = size;
+    slot->caplen = size < _options.snaplen ? size : _options.snaplen;
+    slot->point = point;
+    slot->direction = direction;
+    memcpy(at + sizeof(Slot), packet, slot->caplen);
+    _head.store(head + 1, std::memory_order_release);
+}
+
+static void put16(std::string *out, uint16_t value) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put32(std::string *out, uint32_t value) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void pad(std::string *out) {
+    out->append((4 - out->size() % 4) % 4, '\0');
+}
+
+static void option(std::string *out, uint16_t code, const void *value, int size) {
+    put16(out, code);
+    put16(out, size);
+    out->append(static_cast<const char*>(value), size);
+    pad(out);
+}
+
+static void option(std::string *out, uint16_t code, const std::string& value) {
+    option(out, code, value.data(), value.size());
+}
+
+/* Wrap body into a block of type */
+static void block(FILE *out, uint32_t type, std::string *body) {
+    put16(body, OPT_END);
+    put16(body, 0);
+    uint32_t length = body->size() + 12;
+    fwrite(&type, sizeof(type), 1, out);
+    fwrite(&length, sizeof(length), 1, out);
+    fwrite(body->data(), body->size(), 1, out);
+    fwrite(&length, sizeof(length), 1, out);
+}
+
+void Capture::write_header() {
+    /* In host byte order, readers check the magic */
+    std::string section;
+    put32(&section, BYTE_ORDER_MAGIC);
+    put16(&section, 1);
+    put16(&section, 0);
+    /* Section length unknown */
+    put32(&section, 0xffffffff);
+    put32(&section, 0xffffffff);
+    option(&section, OPT_SHB_USERAPPL, std::string("TinyVPN server"));
+    block(_out, BLOCK_SECTION, &section);
+
+    static const char *names[] = {"pre-nat", "post-nat"};
+    static const char *descriptions[] = {"packets as clients see them",
+        "packets as the internet sees them"};
+    for (int i = CAPTURE_PRE_NAT; i <= CAPTURE_POST_NAT; ++i) {
+        std::string interface;
+        put16(&interface, LINKTYPE_RAW);
+        put16(&interface, 0);
+        put32(&interface, _options.snaplen);
+        option(&interface, OPT_IF_NAME, std::string(names[i]));
+        option(&interface, OPT_IF_DESCRIPTION, std::string(descriptions[i]));
+        /* Nanoseconds */
+        uint8_t resolution = 9;
+        option(&interface, OPT_IF_TSRESOL, &resolution, sizeof(resolution));
+        block(_out, BLOCK_INTERFACE, &interface);
+    }
+    fflush(_out);
+}
+
+void Capture::run() {
+    while (running()) {
+        if (drain() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+        }
+    }
+}
+
+int Capture::drain() {
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    uint64_t head = _head.load(std::memory_order_acquire);
+    std::string packet;
+    for (uint64_t i = tail; i < head; ++i) {
+        const char *at = _ring + (i & (_slots - 1)) * _slot_size;
+        const Slot *slot = reinterpret_cast<const Slot*>(at);
+        packet.clear();
+        put32(&packet, slot->point);
+        put32(&packet, slot->ts >> 32);
+        put32(&packet, slot->ts);
+        put32(&packet, slot->caplen);
+        put32(&packet, slot->size);
+        packet.append(at + sizeof(Slot), slot->caplen);
+        pad(&packet);
+        /* Into the server from a client or tun, or out of it */
+        bool inbound = (slot->direction == D_UP) == (slot->point == CAPTURE_PRE_NAT);
+        uint32_t flags = inbound ? FLAG_INBOUND : FLAG_OUTBOUND;
+        option(&packet, OPT_EPB_FLAGS, &flags, sizeof(flags));
+        char comment[64];
+        snprintf(comment, sizeof(comment), "%s #%u session %08x",
+                slot->direction == D_UP ? "up" : "down", slot->id, slot->session);
+        option(&packet, OPT_COMMENT, std::string(comment));
+        block(_out, BLOCK_PACKET, &packet);
+        /* Give the slot back as soon as it is copied */
+        _tail.store(i + 1, std::memory_order_release);
+    }
+    int count = head - tail;
+    if (count > 0) {
+        fflush(_out);
+        _written.store(_written.load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+    }
+    return count;
+}
+
+std::string Capture::to_string() const {
+    if (!running()) {
+        return "off";
+    }
+    return "on " + _path + " filter '" + _filter.text() + "' 1 in "
+        + std::to_string(_options.sample) + " snaplen " + std::to_string(_options.snaplen)
+        + ", written " + std::to_string(_written.load()) + " dropped "
+        + std::to_string(_dropped.load());
+}
+
+} /* namespace vpn */
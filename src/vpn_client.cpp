@@ -1,39 +1,550 @@
 #include "vpn_client.h"
+#include "vpn_probe.h"
+#include "vpn_trace.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <random>
+#include <thread>
 
 namespace vpn {
 
-Client::Client(const std::string& addr, int port)
-    : _socket(Socket::IPv4, Socket::UDP), _epoll(), _tun(),
-    _srv_port(port), _srv_addr(addr) {
-    assert(_epoll.add_read_event(_tun.fd()) == 0);
-    assert(_epoll.add_read_event(_socket.fd()) == 0);
+/* Wraps around on boxes with fewer cpus */
+static void pin(int cpu) {
+    int cpus = std::thread::hardware_concurrency();
+    if (cpu < 0 || cpus <= 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % cpus, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "failed to pin to cpu %d\n", cpu % cpus);
+    }
+}
+
+static uint32_t random_session() {
+    std::random_device rd;
+    uint32_t id = 0;
+    while (id == 0) {
+        id = rd();
+    }
+    return id;
+}
+
+/* Datagrams need putting back in order once there are several paths */
+static TunnelOptions tunnel_options(const ClientOptions& options) {
+    size_t binds = options.bind_addrs.empty() ? 1 : options.bind_addrs.size();
+    TunnelOptions tunnel(options.tunnel);
+    tunnel.ordered = binds * options.srv_addrs.size() > 1;
+    return tunnel;
+}
+
+Client::Client(const ClientOptions& options)
+    : Client(options, new Tun(options.tun_name, options.multi_queue), nullptr, nullptr) {  }
+
+Client::Client(const ClientOptions& options, PacketDevice *tun, PacketDevice *socket)
+    : Client(options, nullptr, tun, socket) {  }
+
+Client::Client(const ClientOptions& options, Tun *own_tun, PacketDevice *tun, PacketDevice *socket)
+    : _epoll(), _net_epoll(), _own_tun(own_tun), _tun(tun ? tun : own_tun), _device(socket),
+    _paths(), _path_stats(),
+    _scheduler(options.scheduler, 1), _transport(options.transport),
+    _threads(options.threads), _cpu(options.cpu), _path_lock(),
+    _probe_interval_ms(options.probe_interval_ms),
+    _probe_id(0), _last_probe(0), _mtu(), _tun_mtu(0),
+    _session(random_session(), tunnel_options(options), R_CLIENT), _stats_interval(0),
+    _last_stats(time(nullptr)), _queue() {
+    std::vector<std::string> binds(options.bind_addrs);
+    if (binds.empty()) {
+        binds.push_back("");
+    }
+
+    for (const auto& bind : binds) {
+        for (const auto& addr : options.srv_addrs) {
+            Path path;
+            assert(make_sockaddr(addr, options.srv_port, &path.dest));
+            path.bind = bind;
+            path.name = (bind.empty() ? "*" : bind) + " -> " + addr;
+            path.device = nullptr;
+            path.retry_at = 0;
+            _paths.push_back(path);
+        }
+    }
+    assert(!_paths.empty() && _paths.size() <= BATCH_SIZE);
+    /* A Stream is not safe to share between threads */
+    assert(!_threads || _transport == Socket::UDP);
+    assert(_device == nullptr || (_paths.size() == 1 && _transport == Socket::UDP && !_threads));
+    for (size_t i = 0; i < _paths.size(); ++i) {
+        connect(i);
+    }
+    if (options.shape_rate > 0) {
+        _queue.reset(new FairQueue(options.queue_limit));
+        _queue->set_rate(options.shape_rate);
+    }
+    _path_stats.resize(_paths.size());
+    _scheduler = Scheduler(options.scheduler, _paths.size());
+    if (options.pmtu && _transport == Socket::UDP && _device == nullptr) {
+        for (const Path& path : _paths) {
+            /* No larger than the interface the route goes by. IPv6 links
+             * carry 1280 at least(RFC 8200). */
+            int least = is_v4(path.dest) ? 576 : 1280;
+            int most = path.socket->mtu();
+            _mtu.push_back(MtuProber(least, most > least ? most : 1500));
+        }
+    }
+
+    assert(_epoll.add_read_event(_tun->fd()) == 0);
+}
+
+void Client::connect(int index) {
+    Path& path = _paths[index];
+    if (_device != nullptr) {
+        path.device = _device;
+        assert(net_epoll().add_read_event(_device->fd()) == 0);
+        return;
+    }
+    /* Dual-stack, the server may be of either family */
+    path.socket.reset(new Socket(Socket::IPv6, _transport));
+    if (!path.bind.empty() && path.socket->bind(path.bind, 0) != 0) {
+        /* Not an address, an interface then */
+        assert(path.socket->bind_device(path.bind) == 0);
+    }
+
+    /* In progress for TCP, datagrams queue up meanwhile */
+    assert(path.socket->connect(path.dest) == 0);
+    if (_transport == Socket::TCP) {
+        path.stream.reset(new Stream(path.socket));
+    } else {
+        path.socket->set_buffers(Stream::BUFFERS);
+    }
+    path.device = path.socket.get();
+    assert(net_epoll().add_read_event(path.socket->fd()) == 0);
+}
+
+void Client::disconnect(int index) {
+    Path& path = _paths[index];
+    net_epoll().del_event(path.device->fd());
+    path.stream.reset();
+    path.socket.reset();
+    path.device = nullptr;
+    path.retry_at = monotonic_ns() + 1000000000ULL;
 }
 
 void Client::run() {
-    assert(_tun.up() == 0);
-    char buf[4096];
+    if (_own_tun) {
+        assert(_own_tun->up() == 0);
+    }
+    if (!_threads) {
+        pin(_cpu);
+        loop(true, true);
+        return;
+    }
+
+    std::thread rx([this]() {
+        pin(_cpu < 0 ? -1 : _cpu + 1);
+        loop(false, true);
+    });
+    pin(_cpu);
+    loop(true, false);
+    rx.join();
+}
+
+void Client::loop(bool tx, bool rx) {
     for ( ; ; ) {
-        std::vector<struct epoll_event> events(_epoll.wait());
-
-        for (const auto& event : events) {
-            if (event.data.fd == _tun.fd()) {
-                int nread = _tun.read(buf, sizeof(buf));
-                assert(nread != -1);
-                assert(_socket.sendto(buf, nread, _srv_addr, _srv_port) == nread);
-            } else if (event.data.fd == _socket.fd()) {
-                struct sockaddr_in sock;
-                socklen_t len = sizeof(sock);
-                int nread = _socket.recvfrom(buf, sizeof(buf), (struct sockaddr*)&sock, &len);
-                assert(nread != -1);
-                assert(_tun.write(buf, nread) == nread);
-            } else {
-                /* nerver do this */
-                assert(false);
+        step(tx, rx, -1);
+    }
+}
+
+void Client::step(bool tx, bool rx, int most) {
+    Epoll& epoll = tx ? _epoll : _net_epoll;
+    /* Changes once the server starts ordering its datagrams */
+    int timeout = _session.timeout_ms();
+    if (timeout < 0 || timeout > _probe_interval_ms) {
+        timeout = _probe_interval_ms;
+    }
+    if (most >= 0 && timeout > most) {
+        timeout = most;
+    }
+    if (_stats_interval > 0 && (timeout < 0 || timeout > 1000)) {
+        timeout = 1000;
+    }
+    if (tx && _queue && !_queue->empty()) {
+        /* Held back by the rate */
+        timeout = 1;
+    }
+
+    std::vector<struct epoll_event> events(epoll.wait(timeout));
+
+    for (const auto& event : events) {
+        if (event.data.fd == _tun->fd()) {
+            tun2socket();
+            continue;
+        }
+        size_t i = 0;
+        while (i < _paths.size()
+                && !(_paths[i].device && _paths[i].device->fd() == event.data.fd)) {
+            ++i;
+        }
+        /* nerver do this */
+        assert(i < _paths.size());
+        if (!_paths[i].stream) {
+            socket2tun(i);
+            continue;
+        }
+
+        Stream *stream = _paths[i].stream.get();
+        if ((event.events & EPOLLOUT) && stream->flush() < 0) {
+            disconnect(i);
+            continue;
+        }
+        if (stream->blocked() != stream->polling_out) {
+            stream->polling_out = stream->blocked();
+            epoll.set_write_event(stream->fd(), stream->polling_out);
+        }
+        if (event.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            stream2tun(i);
+        }
+    }
+    tick(tx, rx);
+
+    time_t now = time(nullptr);
+    if (rx && _stats_interval > 0 && now - _last_stats >= _stats_interval) {
+        _last_stats = now;
+        printf("%s", stats().c_str());
+        fflush(stdout);
+    }
+}
+
+void Client::tun2socket() {
+    Datagram batch[BATCH_SIZE + FEC_MAX_M];
+    int paths[BATCH_SIZE + FEC_MAX_M];
+    char buf[MAX_PACKET];
+
+    int n = 0;
+    while (n < BATCH_SIZE) {
+        int nread = _tun->read(buf, sizeof(buf));
+        if (nread < 0) {
+            /* Drained */
+            break;
+        }
+        VPN_PROBE3(receive, D_UP, _session.id(), nread);
+        if (_queue) {
+            _queue->push(flow_hash(buf, nread), interactive(buf, nread), 0, 0, buf, nread);
+            continue;
+        }
+        int nwrite = _session.encap(buf, nread, _tx[n], sizeof(_tx[n]));
+        assert(nwrite != -1);
+        batch[n] = Datagram{&_session, _tx[n], nwrite, false};
+        {
+            std::lock_guard<std::mutex> lock(_path_lock);
+            paths[n] = _scheduler.pick(flow_hash(buf, nread));
+        }
+        n = take_parities(batch, paths, paths[n], n + 1);
+    }
+    send(batch, paths, n);
+    if (_queue) {
+        drain();
+    }
+}
+
+void Client::drain() {
+    Datagram batch[BATCH_SIZE + FEC_MAX_M];
+    int paths[BATCH_SIZE + FEC_MAX_M];
+    char buf[MAX_PACKET];
+    uint64_t now = monotonic_ns();
+    int size = 0;
+    while (size >= 0) {
+        int n = 0;
+        while (n < BATCH_SIZE) {
+            uint32_t flow, owner;
+            uint64_t tag;
+            size = _queue->pop(now, buf, sizeof(buf), &flow, &owner, &tag);
+            if (size < 0) {
+                break;
+            }
+            int nwrite = _session.encap(buf, size, _tx[n], sizeof(_tx[n]));
+            assert(nwrite != -1);
+            batch[n] = Datagram{&_session, _tx[n], nwrite, false};
+            {
+                std::lock_guard<std::mutex> lock(_path_lock);
+                paths[n] = _scheduler.pick(flow);
             }
+            n = take_parities(batch, paths, paths[n], n + 1);
         }
+        send(batch, paths, n);
+    }
+}
+
+void Client::tick(bool tx, bool rx) {
+    uint64_t now = monotonic_ns();
+    if (rx) {
+        _session.tick_rx(now);
+        write_ready();
+    }
+    if (!tx) {
+        return;
+    }
+    _session.tick_tx(now);
+    if (_queue && !_queue->empty()) {
+        drain();
+    }
+
+    for (size_t i = 0; i < _paths.size(); ++i) {
+        if (!_paths[i].device && now >= _paths[i].retry_at) {
+            connect(i);
+        }
+    }
+
+    int path;
+    {
+        std::lock_guard<std::mutex> lock(_path_lock);
+        path = _scheduler.pick(0);
+    }
+    Datagram batch[FEC_MAX_M];
+    int paths[FEC_MAX_M];
+    send(batch, paths, take_parities(batch, paths, path, 0));
+
+    /* Keep NAT bindings on the way alive too */
+    if (now - _last_probe >= _probe_interval_ms * 1000000ULL) {
+        _last_probe = now;
+        probe(now);
+        if (!_mtu.empty()) {
+            probe_mtu(now);
+        }
+    }
+}
+
+void Client::probe(uint64_t now) {
+    Datagram batch[BATCH_SIZE];
+    int paths[BATCH_SIZE];
+    int n = _paths.size();
+    std::unique_lock<std::mutex> lock(_path_lock);
+    for (int i = 0; i < n; ++i) {
+        _path_stats[i].tick(now);
+
+        ProbeBody body = {++_probe_id, static_cast<uint32_t>(i), now};
+        int nwrite = _session.probe(T_PROBE, body, _tx[i], sizeof(_tx[i]));
+        assert(nwrite != -1);
+        batch[i] = Datagram{&_session, _tx[i], nwrite, false};
+        paths[i] = i;
+        _path_stats[i].on_probe_sent(body.id, now);
+    }
+    _scheduler.update(_path_stats);
+    lock.unlock();
+    send(batch, paths, n);
+}
+
+void Client::probe_mtu(uint64_t now) {
+    /* Of inner packets, paths of either family */
+    int least = 0;
+    for (int i = 0; i < static_cast<int>(_paths.size()); ++i) {
+        bool ipv6 = !is_v4(_paths[i].dest);
+        int size;
+        {
+            std::lock_guard<std::mutex> lock(_path_lock);
+            size = _mtu[i].next(now);
+            int mtu = _mtu[i].mtu();
+            if (mtu > 0) {
+                mtu = _session.options().inner_mtu(mtu, ipv6);
+                if (least == 0 || mtu < least) {
+                    least = mtu;
+                }
+            }
+        }
+        if (size == 0) {
+            continue;
+        }
+        /* The id is the size, so the reply tells which one made it */
+        ProbeBody body = {static_cast<uint32_t>(size), static_cast<uint32_t>(i), now};
+        Datagram probe = {&_session, _tx[0], 0, false};
+        probe.size = _session.probe(T_MTU_PROBE, body, _tx[0], sizeof(_tx[0]),
+                size - (ipv6 ? TUNNEL_UDP6_OVERHEAD : TUNNEL_UDP_OVERHEAD));
+        assert(probe.size != -1);
+        _paths[i].socket->set_mtu_probe(true);
+        send(&probe, &i, 1);
+        _paths[i].socket->set_mtu_probe(false);
+    }
+
+    /* Packets may take any path, tun has to fit the narrowest */
+    if (least > 0 && least != _tun_mtu && _own_tun) {
+        _tun_mtu = least;
+        if (_own_tun->set_mtu(least) != 0) {
+            fprintf(stderr, "failed to set the MTU of %s to %d\n", _own_tun->name().c_str(),
+                    least);
+        }
+    }
+}
+
+int Client::take_parities(Datagram *batch, int *paths, int path, int n) {
+    int nwrite;
+    while ((nwrite = _session.take_parity(_tx[n], sizeof(_tx[n]))) > 0) {
+        batch[n] = Datagram{&_session, _tx[n], nwrite, false};
+        paths[n] = path;
+        ++n;
+    }
+    return n;
+}
+
+void Client::send(Datagram *batch, const int *paths, int n) {
+    if (n == 0) {
+        return;
+    }
+    for (int i = 0; i < n; ++i) {
+        Session::set_path(&batch[i], paths[i]);
+    }
+    Session::seal(batch, n);
+
+    /* One sendmmsg() or writev() per path, a dead path only loses its own share */
+    struct mmsghdr msgs[BATCH_SIZE + FEC_MAX_M];
+    struct iovec iovs[BATCH_SIZE + FEC_MAX_M];
+    for (size_t p = 0; p < _paths.size(); ++p) {
+        int count = 0;
+        for (int i = 0; i < n; ++i) {
+            if (paths[i] != static_cast<int>(p)) {
+                continue;
+            }
+            memset(&msgs[count], 0, sizeof(msgs[count]));
+            iovs[count].iov_base = batch[i].data;
+            iovs[count].iov_len = batch[i].size;
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+            ++count;
+        }
+        if (count == 0 || !_paths[p].device) {
+            continue;
+        }
+
+        Stream *stream = _paths[p].stream.get();
+        if (stream == nullptr) {
+            _paths[p].device->sendmmsg(msgs, count);
+            continue;
+        }
+        if (stream->write(iovs, count) < 0) {
+            disconnect(p);
+        } else if (stream->blocked() != stream->polling_out) {
+            stream->polling_out = stream->blocked();
+            net_epoll().set_write_event(stream->fd(), stream->polling_out);
+        }
+    }
+    VPN_PROBE2(send, D_UP, n);
+}
+
+void Client::socket2tun(int path) {
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH_SIZE; ++i) {
+        iovs[i].iov_base = _rx[i];
+        iovs[i].iov_len = sizeof(_rx[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int nread = _paths[path].device->recvmmsg(msgs, BATCH_SIZE);
+    if (nread < 0) {
+        /* eg: ICMP unreachable of a dead path */
+        return;
+    }
+
+    Datagram batch[BATCH_SIZE];
+    for (int i = 0; i < nread; ++i) {
+        batch[i] = Datagram{&_session, _rx[i], static_cast<int>(msgs[i].msg_len), false};
+    }
+    receive(batch, nread, path);
+}
+
+void Client::stream2tun(int path) {
+    Stream *stream = _paths[path].stream.get();
+    if (stream->read() < 0) {
+        disconnect(path);
+        return;
+    }
+
+    Datagram batch[BATCH_SIZE];
+    for ( ; ; ) {
+        int n = 0;
+        int size = 0;
+        char *data;
+        while (n < BATCH_SIZE && (size = stream->next(&data)) > 0) {
+            batch[n++] = Datagram{&_session, data, size, false};
+        }
+        receive(batch, n, path);
+        if (size < 0) {
+            /* Lost the framing, start over */
+            disconnect(path);
+            return;
+        }
+        if (n < BATCH_SIZE) {
+            return;
+        }
+    }
+}
+
+void Client::receive(Datagram *batch, int nread, int path) {
+    Session::open(batch, nread);
+
+    char buf[MAX_DATAGRAM];
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < nread; ++i) {
+        if (!batch[i].ok) {
+            continue;
+        }
+        uint8_t type;
+        ProbeBody body;
+        if (Session::parse_probe(batch[i].data, batch[i].size, &type, &body)) {
+            if (type == T_PROBE_REPLY && body.path < _paths.size()) {
+                std::lock_guard<std::mutex> lock(_path_lock);
+                _path_stats[body.path].on_probe_reply(body.id, body.sent, now);
+                _scheduler.update(_path_stats);
+            } else if (type == T_MTU_REPLY && body.path < _mtu.size()) {
+                std::lock_guard<std::mutex> lock(_path_lock);
+                _mtu[body.path].on_reply(body.id);
+            } else if (type == T_PROBE) {
+                /* The server measures us, answer by the same path */
+                Datagram reply = {&_session, buf, 0, false};
+                reply.size = _session.probe(T_PROBE_REPLY, body, buf, sizeof(buf));
+                send(&reply, &path, reply.size > 0 ? 1 : 0);
+            }
+            continue;
+        }
+        VPN_PROBE3(receive, D_DOWN, _session.id(), batch[i].size);
+        int nwrite = _session.decap(batch[i].data, batch[i].size, buf, sizeof(buf));
+        if (nwrite <= 0) {
+            continue;
+        }
+        assert(_tun->write(buf, nwrite) == nwrite);
+        VPN_PROBE2(send, D_DOWN, 1);
+    }
+    write_ready();
+}
+
+std::string Client::stats() {
+    std::string stats = _session.stats();
+    if (_queue) {
+        stats += "  egress: " + _queue->to_string() + "\n";
+    }
+    std::lock_guard<std::mutex> lock(_path_lock);
+    for (size_t i = 0; i < _paths.size(); ++i) {
+        stats += "  path " + _paths[i].name + ": " + _path_stats[i].to_string()
+            + (i < _mtu.size() ? " " + _mtu[i].to_string() : "") + "\n";
+    }
+    return stats;
+}
+
+void Client::write_ready() {
+    char buf[MAX_DATAGRAM];
+    int nwrite;
+    while ((nwrite = _session.take_ready(buf, sizeof(buf))) > 0) {
+        assert(_tun->write(buf, nwrite) == nwrite);
+        VPN_PROBE2(send, D_DOWN, 1);
     }
 }
 
@@ -0,0 +1,231 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vpn_common.h"
+#include "vpn_tunnel.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(seconds, 1, "seconds per case");
+DEFINE_int32(size, 1400, "packet size in bytes");
+DEFINE_int32(port, 15556, "loopback port to use");
+DEFINE_bool(encrypt, true, "seal/open datagrams in the pipeline cases");
+
+/*
+ * The client's send path over loopback: per packet sendto() with the
+ * server given as a string, as the client used to, against a connected
+ * socket with send() and sendmmsg(). Then the whole encap -> seal -> send
+ * / recv -> open -> decap pipeline on one thread against two.
+ * */
+static const char *ADDR = "127.0.0.1";
+
+static struct sockaddr_in6 loopback() {
+    struct sockaddr_in6 sock;
+    vpn::make_sockaddr(ADDR, FLAGS_port, &sock);
+    return sock;
+}
+
+/* Keep the receiver drained so the sender never sees a full buffer */
+static void drain(vpn::Socket *rx, std::atomic<bool> *done, uint64_t *received) {
+    static char bufs[vpn::BATCH_SIZE][vpn::MAX_DATAGRAM];
+    struct mmsghdr msgs[vpn::BATCH_SIZE];
+    struct iovec iovs[vpn::BATCH_SIZE];
+    while (!*done) {
+        struct pollfd pfd = {rx->fd(), POLLIN, 0};
+        poll(&pfd, 1, 50);
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+            iovs[i].iov_base = bufs[i];
+            iovs[i].iov_len = sizeof(bufs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = ::recvmmsg(rx->fd(), msgs, vpn::BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        *received += n > 0 ? n : 0;
+    }
+}
+
+enum Mode {
+    SENDTO_STRING = 0,
+    CONNECTED_SEND,
+    CONNECTED_SENDMMSG
+};
+
+/* Return the send rate in packets per second */
+static double run_send(Mode mode) {
+    vpn::Socket rx(vpn::Socket::IPv6, vpn::Socket::UDP);
+    vpn::Socket tx(vpn::Socket::IPv6, vpn::Socket::UDP);
+    rx.set_buffers(4 << 20);
+    if (rx.bind(ADDR, FLAGS_port) != 0) {
+        perror("bind");
+        exit(1);
+    }
+    if (mode != SENDTO_STRING) {
+        tx.connect(loopback());
+    }
+
+    std::atomic<bool> done(false);
+    uint64_t received = 0;
+    std::thread receiver(drain, &rx, &done, &received);
+
+    std::vector<char> data(FLAGS_size, 'x');
+    std::string addr(ADDR);
+    struct mmsghdr msgs[vpn::BATCH_SIZE];
+    struct iovec iov = {data.data(), data.size()};
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t sent = 0;
+    uint64_t start = vpn::monotonic_ns();
+    uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+    uint64_t now = start;
+    while (now < end) {
+        for (int i = 0; i < 64; ++i) {
+            switch (mode) {
+                case SENDTO_STRING:
+                    sent += tx.sendto(data.data(), data.size(), addr, FLAGS_port) > 0;
+                    break;
+                case CONNECTED_SEND:
+                    sent += ::send(tx.fd(), data.data(), data.size(), 0) > 0;
+                    break;
+                case CONNECTED_SENDMMSG:
+                    sent += tx.sendmmsg(msgs, vpn::BATCH_SIZE);
+                    break;
+            }
+        }
+        now = vpn::monotonic_ns();
+    }
+    done = true;
+    receiver.join();
+    return sent / ((now - start) / 1e9);
+}
+
+/* One batch through encap and seal into sendmmsg() */
+static int send_batch(vpn::Session *session, vpn::Socket *tx, char (*bufs)[vpn::MAX_DATAGRAM],
+        const std::vector<char>& packet) {
+    vpn::Datagram batch[vpn::BATCH_SIZE];
+    struct mmsghdr msgs[vpn::BATCH_SIZE];
+    struct iovec iovs[vpn::BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+        int size = session->encap(packet.data(), packet.size(), bufs[i], vpn::MAX_DATAGRAM);
+        batch[i] = vpn::Datagram{session, bufs[i], size, false};
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    vpn::Session::seal(batch, vpn::BATCH_SIZE);
+    return tx->sendmmsg(msgs, vpn::BATCH_SIZE);
+}
+
+/* What recvmmsg() has, through open and decap, return packets decapped */
+static int receive_batch(vpn::Session *session, vpn::Socket *rx,
+        char (*bufs)[vpn::MAX_DATAGRAM], int wait_ms) {
+    struct pollfd pfd = {rx->fd(), POLLIN, 0};
+    if (wait_ms > 0 && poll(&pfd, 1, wait_ms) <= 0) {
+        return 0;
+    }
+    struct mmsghdr msgs[vpn::BATCH_SIZE];
+    struct iovec iovs[vpn::BATCH_SIZE];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = vpn::MAX_DATAGRAM;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = ::recvmmsg(rx->fd(), msgs, vpn::BATCH_SIZE, MSG_DONTWAIT, nullptr);
+    if (n <= 0) {
+        return 0;
+    }
+
+    vpn::Datagram batch[vpn::BATCH_SIZE];
+    for (int i = 0; i < n; ++i) {
+        batch[i] = vpn::Datagram{session, bufs[i], static_cast<int>(msgs[i].msg_len), false};
+    }
+    vpn::Session::open(batch, n);
+    char out[vpn::MAX_DATAGRAM];
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        count += batch[i].ok && session->decap(batch[i].data, batch[i].size,
+                out, sizeof(out)) > 0;
+    }
+    return count;
+}
+
+/* Return packets per second making it through */
+static double run_pipeline(bool threads) {
+    vpn::TunnelOptions options;
+    if (FLAGS_encrypt) {
+        options.key = std::string(vpn::AEAD_KEY_SIZE, '\x42');
+    }
+    vpn::Session sender(1, options, vpn::R_CLIENT);
+    vpn::Session receiver(1, options, vpn::R_SERVER);
+
+    vpn::Socket rx(vpn::Socket::IPv6, vpn::Socket::UDP);
+    vpn::Socket tx(vpn::Socket::IPv6, vpn::Socket::UDP);
+    rx.set_buffers(4 << 20);
+    if (rx.bind(ADDR, FLAGS_port) != 0) {
+        perror("bind");
+        exit(1);
+    }
+    tx.connect(loopback());
+
+    static char tx_bufs[vpn::BATCH_SIZE][vpn::MAX_DATAGRAM];
+    static char rx_bufs[vpn::BATCH_SIZE][vpn::MAX_DATAGRAM];
+    std::vector<char> packet(FLAGS_size, 'x');
+    uint64_t received = 0;
+    uint64_t start = vpn::monotonic_ns();
+    uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+
+    if (!threads) {
+        while (vpn::monotonic_ns() < end) {
+            send_batch(&sender, &tx, tx_bufs, packet);
+            received += receive_batch(&receiver, &rx, rx_bufs, 0);
+        }
+    } else {
+        std::atomic<bool> done(false);
+        std::thread rx_thread([&]() {
+            while (!done) {
+                received += receive_batch(&receiver, &rx, rx_bufs, 50);
+            }
+        });
+        while (vpn::monotonic_ns() < end) {
+            send_batch(&sender, &tx, tx_bufs, packet);
+        }
+        done = true;
+        rx_thread.join();
+    }
+    return received / ((vpn::monotonic_ns() - start) / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("client_bench [--seconds N] [--size BYTES]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    printf("%dB packets over loopback, %u cpus\n", FLAGS_size,
+            std::thread::hardware_concurrency());
+    printf("%-28s %12s %10s\n", "case", "pps", "Gbit/s");
+    auto print = [](const char *name, double pps) {
+        printf("%-28s %12.0f %10.2f\n", name, pps, pps * FLAGS_size * 8 / 1e9);
+    };
+    print("sendto(addr string)", run_send(SENDTO_STRING));
+    print("connected send()", run_send(CONNECTED_SEND));
+    print("connected sendmmsg() x32", run_send(CONNECTED_SENDMMSG));
+    print(FLAGS_encrypt ? "pipeline 1 thread, sealed" : "pipeline 1 thread",
+            run_pipeline(false));
+    print(FLAGS_encrypt ? "pipeline 2 threads, sealed" : "pipeline 2 threads",
+            run_pipeline(true));
+    return 0;
+}
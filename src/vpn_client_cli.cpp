@@ -1,30 +1,205 @@
 #include <arpa/inet.h>
+#include <stdio.h>
+
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include "vpn_client.h"
+#include "vpn_control.h"
 
 #include "gflags/gflags.h"
 
-DEFINE_string(srv_addr, "", "server's address. eg: 127.0.0.1");
+DEFINE_string(control, "/run/tinyvpn-client.sock", "unix socket answering --query, "
+        "empty disables it");
+DEFINE_string(query, "", "send a command(eg: stats, help) to a running client and exit");
+DEFINE_string(srv_addr, "", "server's addresses, comma separated, IPv4 or IPv6. eg: 127.0.0.1");
 DEFINE_int32(srv_port, -1, "server's port. eg: 5003");
+DEFINE_bool(compress, false, "compress tunnel payloads, incompressible ones are sent as is");
+DEFINE_string(key_file, "", "file holding a 64 hex digits key, encrypts the tunnel when given");
+DEFINE_int32(fec_k, 0, "datagrams per FEC group, 0 disables FEC. eg: 10");
+DEFINE_int32(fec_m, 1, "parity datagrams per FEC group, 1 is XOR, more is Reed-Solomon");
+DEFINE_int32(fec_timeout_ms, 5, "send parities of a partial FEC group after this");
+DEFINE_string(bind_addrs, "", "local addresses or interfaces to send from, comma separated. "
+        "eg: 192.168.1.2,wlan0");
+DEFINE_string(scheduler, "wrr", "how datagrams are spread over paths: wrr or flow");
+DEFINE_string(transport, "udp", "udp, or tcp where UDP is blocked");
+DEFINE_bool(threads, false, "run each direction on a thread of its own, udp only");
+DEFINE_int32(cpu, -1, "pin the threads to this cpu and the next one, -1 means no pinning");
+DEFINE_int32(queues, 1, "tun queues, each one with its own thread, sockets and session");
+DEFINE_int32(probe_interval_ms, 200, "measure RTT and loss of every path this often, "
+        "also keeps NAT bindings alive");
+DEFINE_int32(reorder_ms, 30, "longest wait for a datagram missing on another path");
+DEFINE_int32(shape_mbit, 0, "queue upstream packets fairly and send them at this Mbit/s, "
+        "a little below the uplink. 0 sends them at once");
+DEFINE_int32(queue_limit, 1024, "packets queued by --shape_mbit before dropping");
+DEFINE_bool(pmtu, true, "probe the path MTU of every path and fit the tun MTU to it, udp only");
+DEFINE_int32(stats_interval, 0, "print session stats every N seconds, 0 means never");
+
+static std::vector<std::string> split(const std::string& value) {
+    std::vector<std::string> items;
+    std::istringstream in(value);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
 
+/* Nothing else is needed to query */
 static bool validate_addr(const char* flagname, const std::string& value) {
-    struct in_addr addr;
-    return inet_pton(AF_INET, value.c_str(), &addr);
+    if (!FLAGS_query.empty()) {
+        return true;
+    }
+    std::vector<std::string> addrs = split(value);
+    for (const auto& it : addrs) {
+        struct sockaddr_in6 sock;
+        if (!vpn::make_sockaddr(it, 0, &sock)) {
+            return false;
+        }
+    }
+    return !addrs.empty();
+}
+
+static bool validate_scheduler(const char* flagname, const std::string& value) {
+    return value == "wrr" || value == "flow";
+}
+
+static bool validate_queues(const char* flagname, int value) {
+    return value >= 1 && value <= 64;
+}
+
+/* Probes also pace the event loop, 0 would spin it */
+static bool validate_probe_interval(const char* flagname, int value) {
+    return value >= 1;
+}
+
+static bool validate_rate(const char* flagname, int value) {
+    return value >= 0;
+}
+
+static bool validate_queue_limit(const char* flagname, int value) {
+    return value >= 1 && value <= 65536;
+}
+
+static bool validate_transport(const char* flagname, const std::string& value) {
+    return value == "udp" || value == "tcp";
 }
 
 static bool validate_port(const char* flagname, int value) {
-    return value >= 1 && value <= 65535;
+    return !FLAGS_query.empty() || (value >= 1 && value <= 65535);
+}
+
+static bool validate_fec_k(const char* flagname, int value) {
+    return value >= 0 && value <= vpn::FEC_MAX_K;
+}
+
+static bool validate_fec_m(const char* flagname, int value) {
+    return value >= 1 && value <= vpn::FEC_MAX_M;
+}
+
+/* A wait of 0 spins the event loop, a negative one never ends */
+static bool validate_wait_ms(const char* flagname, int value) {
+    return value >= 1;
 }
 
 DEFINE_validator(srv_addr, validate_addr);
 DEFINE_validator(srv_port, validate_port);
+DEFINE_validator(fec_k, validate_fec_k);
+DEFINE_validator(fec_m, validate_fec_m);
+DEFINE_validator(fec_timeout_ms, validate_wait_ms);
+DEFINE_validator(reorder_ms, validate_wait_ms);
+DEFINE_validator(scheduler, validate_scheduler);
+DEFINE_validator(transport, validate_transport);
+DEFINE_validator(queues, validate_queues);
+DEFINE_validator(probe_interval_ms, validate_probe_interval);
+DEFINE_validator(shape_mbit, validate_rate);
+DEFINE_validator(queue_limit, validate_queue_limit);
 
 int main(int argc, char *argv[]) {
     google::SetUsageMessage("sudo client --srv_addr <addr> --srv_port <port>");
     google::SetVersionString("1.0.0");
     google::ParseCommandLineFlags(&argc, &argv, true);
 
-    vpn::Client client(FLAGS_srv_addr, FLAGS_srv_port);
-    client.run();
+    if (!FLAGS_query.empty()) {
+        std::string reply;
+        if (!vpn::Control::query(FLAGS_control, FLAGS_query, &reply)) {
+            fprintf(stderr, "no client at %s\n", FLAGS_control.c_str());
+            return 1;
+        }
+        printf("%s", reply.c_str());
+        return 0;
+    }
+
+    vpn::ClientOptions options;
+    options.srv_addrs = split(FLAGS_srv_addr);
+    options.srv_port = FLAGS_srv_port;
+    options.bind_addrs = split(FLAGS_bind_addrs);
+    options.scheduler = FLAGS_scheduler == "flow" ? vpn::Scheduler::FLOW : vpn::Scheduler::WRR;
+    options.probe_interval_ms = FLAGS_probe_interval_ms;
+    options.transport = FLAGS_transport == "tcp" ? vpn::Socket::TCP : vpn::Socket::UDP;
+    options.threads = FLAGS_threads;
+    options.cpu = FLAGS_cpu;
+    if (options.threads && options.transport != vpn::Socket::UDP) {
+        fprintf(stderr, "--threads needs --transport udp\n");
+        return 1;
+    }
+    /* Each tun queue shapes its share */
+    options.shape_rate = static_cast<uint64_t>(FLAGS_shape_mbit) * 1000000 / 8 / FLAGS_queues;
+    options.queue_limit = FLAGS_queue_limit;
+    options.pmtu = FLAGS_pmtu;
+    options.tunnel.compress = FLAGS_compress;
+    options.tunnel.fec_k = FLAGS_fec_k;
+    options.tunnel.fec_m = FLAGS_fec_m;
+    options.tunnel.fec_timeout_ms = FLAGS_fec_timeout_ms;
+    options.tunnel.reorder_ms = FLAGS_reorder_ms;
+    if (!FLAGS_key_file.empty() && !options.tunnel.load_key(FLAGS_key_file)) {
+        fprintf(stderr, "invalid key file: %s\n", FLAGS_key_file.c_str());
+        return 1;
+    }
+
+    /* Answered on a thread of its own, off the data path */
+    std::vector<std::unique_ptr<vpn::Client>> clients;
+    std::unique_ptr<vpn::Control> control;
+    if (!FLAGS_control.empty()) {
+        control.reset(new vpn::Control(FLAGS_control));
+        if (control->fd() < 0) {
+            fprintf(stderr, "failed to listen on %s, --query disabled\n", FLAGS_control.c_str());
+        } else {
+            control->handle("stats", [&clients](const std::string&) {
+                std::string reply;
+                for (const auto& client : clients) {
+                    reply += client->stats();
+                }
+                return reply;
+            });
+        }
+    }
+
+    /* The kernel spreads flows over the queues by their hash, a flow stays
+     * on one client and the server answers it through the same socket */
+    options.multi_queue = FLAGS_queues > 1;
+    std::vector<std::thread> threads;
+    int stride = options.threads ? 2 : 1;
+    int cpu = options.cpu;
+    for (int i = 0; i < FLAGS_queues; ++i) {
+        options.cpu = cpu < 0 ? -1 : cpu + i * stride;
+        clients.emplace_back(new vpn::Client(options));
+        clients.back()->set_stats_interval(FLAGS_stats_interval);
+        options.tun_name = clients[0]->tun_name();
+    }
+    for (int i = 1; i < FLAGS_queues; ++i) {
+        threads.emplace_back(&vpn::Client::run, clients[i].get());
+    }
+    if (control && control->fd() >= 0) {
+        std::thread(&vpn::Control::run, control.get()).detach();
+    }
+    clients[0]->run();
+    for (auto& thread : threads) {
+        thread.join();
+    }
     return 0;
 }
@@ -1,6 +1,11 @@
 #include "vpn_common.h"
 
 #include <linux/if_tun.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
@@ -8,16 +13,46 @@
 #include <sys/types.h>
 #include <sys/epoll.h>
 #include <linux/if.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 
 namespace vpn {
 
 static const int MAX_EVENTS = 512;
 
-Tun::Tun(): _fd(-1), _ip(), _name() {
+int PacketDevice::recvmmsg(struct mmsghdr* msgs, int n) {
+    int count = 0;
+    while (count < n) {
+        struct msghdr *hdr = &msgs[count].msg_hdr;
+        int nread = read(static_cast<char*>(hdr->msg_iov[0].iov_base), hdr->msg_iov[0].iov_len);
+        if (nread < 0) {
+            break;
+        }
+        hdr->msg_controllen = 0;
+        msgs[count++].msg_len = nread;
+    }
+    return count ? count : -1;
+}
+
+int PacketDevice::sendmmsg(struct mmsghdr* msgs, int n) {
+    int count = 0;
+    while (count < n) {
+        const struct iovec *iov = &msgs[count].msg_hdr.msg_iov[0];
+        if (write(iov->iov_base, iov->iov_len) < 0) {
+            break;
+        }
+        ++count;
+    }
+    return count ? count : -1;
+}
+
+Tun::Tun(): _fd(-1), _ip(), _ip6(), _name() {
     init();
 }
 
@@ -29,6 +64,10 @@ Tun::Tun(const std::string& addr) : _ip(addr) {
     assert(system(command.c_str()) == 0);
 }
 
+Tun::Tun(const std::string& name, bool multi_queue) : _fd(-1), _ip(), _ip6(), _name() {
+    init(name, multi_queue);
+}
+
 Tun::~Tun() {
     close(_fd);
 }
@@ -39,17 +78,38 @@ int Tun::up() {
     return system(command.c_str());
 }
 
-void Tun::init() {
+int Tun::set_mtu(int mtu) {
+    std::string command;
+    command = "ip link set dev " + _name + " mtu " + std::to_string(mtu);
+    return system(command.c_str());
+}
+
+int Tun::route6(const std::string& addr) {
+    std::string command;
+    command = "ip -6 route add " + addr + "/128 dev " + _name;
+    if (system(command.c_str()) != 0) {
+        return -1;
+    }
+    _ip6 = addr;
+    return 0;
+}
+
+void Tun::init(const std::string& name, bool multi_queue) {
     _fd = open("/dev/net/tun", O_RDWR);
     assert(_fd >= 0);
 
     struct ifreq ifr;
     memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | (multi_queue ? IFF_MULTI_QUEUE : 0);
+    strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
 
     assert(ioctl(_fd, TUNSETIFF, &ifr) == 0);
 
     _name = ifr.ifr_name;
+
+    /* Readers drain the device in batches */
+    int flags = fcntl(_fd, F_GETFL);
+    assert(flags != -1 && fcntl(_fd, F_SETFL, flags | O_NONBLOCK) == 0);
 }
 
 Socket::Socket(Domain d, Type t) : _fd(-1), _type(-1), _domain(-1) {
@@ -76,14 +136,32 @@ Socket::Socket(Domain d, Type t) : _fd(-1), _type(-1), _domain(-1) {
             assert(false);
     }
     _fd = socket(_domain, _type, 0);
+    if (_domain == AF_INET6) {
+        int off = 0;
+        setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
 }
 
+Socket::Socket(int fd) : _fd(fd), _type(SOCK_STREAM), _domain(AF_INET6) {  }
+
 Socket::~Socket() {
     close(_fd);
 }
 
 int Socket::bind(int port) {
-    assert(_type == SOCK_DGRAM);
+    if (_type == SOCK_STREAM) {
+        int on = 1;
+        setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+
+    if (_domain == AF_INET6) {
+        struct sockaddr_in6 sock;
+        memset(&sock, 0, sizeof(sock));
+        sock.sin6_family = AF_INET6;
+        sock.sin6_port = htons(static_cast<in_port_t>(port));
+        sock.sin6_addr = in6addr_any;
+        return ::bind(_fd, reinterpret_cast<struct sockaddr*>(&sock), sizeof(sock));
+    }
 
     struct sockaddr_in sock;
     memset(&sock, 0, sizeof(sock));
@@ -94,9 +172,40 @@ int Socket::bind(int port) {
     return ::bind(_fd, reinterpret_cast<struct sockaddr*>(&sock), sizeof(sock));
 }
 
+int Socket::bind(const std::string& addr, int port) {
+    if (_domain == AF_INET6) {
+        struct sockaddr_in6 sock;
+        if (!make_sockaddr(addr, port, &sock)) {
+            return -1;
+        }
+        return ::bind(_fd, reinterpret_cast<struct sockaddr*>(&sock), sizeof(sock));
+    }
+
+    struct sockaddr_in sock;
+    memset(&sock, 0, sizeof(sock));
+    sock.sin_family = _domain;
+    sock.sin_port = htons(static_cast<in_port_t>(port));
+    if (inet_pton(_domain, addr.c_str(), &sock.sin_addr) != 1) {
+        return -1;
+    }
+
+    return ::bind(_fd, reinterpret_cast<struct sockaddr*>(&sock), sizeof(sock));
+}
+
+int Socket::bind_device(const std::string& name) {
+    return setsockopt(_fd, SOL_SOCKET, SO_BINDTODEVICE, name.c_str(), name.size());
+}
+
 int Socket::sendto(const void* in, int size, const std::string& addr, int port) {
     assert(_type == SOCK_DGRAM);
 
+    if (_domain == AF_INET6) {
+        struct sockaddr_in6 sock;
+        assert(make_sockaddr(addr, port, &sock));
+        return ::sendto(_fd, in, size, 0,
+                reinterpret_cast<struct sockaddr*>(&sock), sizeof(sock));
+    }
+
     struct sockaddr_in sock;
     memset(&sock, 0, sizeof(sock));
     sock.sin_family = _domain;
@@ -117,6 +226,258 @@ int Socket::recvfrom(char* out, int size, struct sockaddr* src, socklen_t* len)
     return ::recvfrom(_fd, out, size, 0, src, len);
 }
 
+int Socket::recvmmsg(struct mmsghdr* msgs, int n) {
+    assert(_type == SOCK_DGRAM);
+
+    return ::recvmmsg(_fd, msgs, n, MSG_WAITFORONE, nullptr);
+}
+
+int Socket::sendmmsg(struct mmsghdr* msgs, int n) {
+    assert(_type == SOCK_DGRAM);
+
+    int sent = 0;
+    while (sent < n) {
+        int nsend = ::sendmmsg(_fd, msgs + sent, n - sent, 0);
+        if (nsend <= 0) {
+            return sent ? sent : -1;
+        }
+        sent += nsend;
+    }
+    return sent;
+}
+
+static int set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int Socket::listen(int backlog) {
+    assert(_type == SOCK_STREAM);
+
+    if (set_nonblock(_fd) != 0) {
+        return -1;
+    }
+    return ::listen(_fd, backlog);
+}
+
+int Socket::connect(const struct sockaddr_in6& dest) {
+    if (_type == SOCK_STREAM && set_nonblock(_fd) != 0) {
+        return -1;
+    }
+    int ret = ::connect(_fd, reinterpret_cast<const struct sockaddr*>(&dest), sizeof(dest));
+    return ret == -1 && errno == EINPROGRESS ? 0 : ret;
+}
+
+int Socket::accept(struct sockaddr_in6* from) {
+    assert(_type == SOCK_STREAM);
+
+    socklen_t len = sizeof(*from);
+    return ::accept4(_fd, reinterpret_cast<struct sockaddr*>(from), &len, SOCK_NONBLOCK);
+}
+
+int Socket::writev(const struct iovec* iov, int n) {
+    assert(_type == SOCK_STREAM);
+
+    return ::writev(_fd, iov, n);
+}
+
+int Socket::set_buffers(int bytes) {
+    /* The FORCE variants need CAP_NET_ADMIN */
+    if (setsockopt(_fd, SOL_SOCKET, SO_SNDBUFFORCE, &bytes, sizeof(bytes)) != 0
+            && setsockopt(_fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes)) != 0) {
+        return -1;
+    }
+    if (setsockopt(_fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) != 0
+            && setsockopt(_fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int Socket::set_low_latency(int lowat) {
+    assert(_type == SOCK_STREAM);
+
+    int on = 1;
+    if (setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+        return -1;
+    }
+    return setsockopt(_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+}
+
+int Socket::set_txtime() {
+    assert(_type == SOCK_DGRAM);
+
+    struct sock_txtime txtime;
+    txtime.clockid = CLOCK_MONOTONIC;
+    txtime.flags = 0;
+    return setsockopt(_fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime));
+}
+
+int Socket::set_timestamps() {
+    assert(_type == SOCK_DGRAM);
+
+    int on = 1;
+    return setsockopt(_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+}
+
+int Socket::set_mtu_probe(bool on) {
+    assert(_type == SOCK_DGRAM);
+
+    int mode = on ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    if (setsockopt(_fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) != 0) {
+        return -1;
+    }
+    if (_domain != AF_INET6) {
+        return 0;
+    }
+    mode = on ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+    if (setsockopt(_fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode)) != 0) {
+        return -1;
+    }
+    /* IPv6 fragments at the source otherwise */
+    int dontfrag = on ? 1 : 0;
+    return setsockopt(_fd, IPPROTO_IPV6, IPV6_DONTFRAG, &dontfrag, sizeof(dontfrag));
+}
+
+int Socket::mtu() {
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    /* Either reads the route of a v4-mapped peer */
+    if (getsockopt(_fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0) {
+        return mtu;
+    }
+    if (_domain == AF_INET6 && getsockopt(_fd, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == 0) {
+        return mtu;
+    }
+    return -1;
+}
+
+bool make_sockaddr(const std::string& addr, int port, struct sockaddr_in6 *sock) {
+    memset(sock, 0, sizeof(*sock));
+    sock->sin6_family = AF_INET6;
+    sock->sin6_port = htons(static_cast<in_port_t>(port));
+    struct in_addr v4;
+    if (inet_pton(AF_INET, addr.c_str(), &v4) == 1) {
+        sock->sin6_addr.s6_addr[10] = 0xff;
+        sock->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&sock->sin6_addr.s6_addr[12], &v4, sizeof(v4));
+        return true;
+    }
+    return inet_pton(AF_INET6, addr.c_str(), &sock->sin6_addr) == 1;
+}
+
+bool is_v4(const struct sockaddr_in6& sock) {
+    return IN6_IS_ADDR_V4MAPPED(&sock.sin6_addr);
+}
+
+std::string sockaddr_string(const struct sockaddr_in6& sock) {
+    char addr[INET6_ADDRSTRLEN];
+    std::string port = std::to_string(ntohs(sock.sin6_port));
+    if (is_v4(sock)) {
+        inet_ntop(AF_INET, &sock.sin6_addr.s6_addr[12], addr, sizeof(addr));
+        return std::string(addr) + ":" + port;
+    }
+    inet_ntop(AF_INET6, &sock.sin6_addr, addr, sizeof(addr));
+    return "[" + std::string(addr) + "]:" + port;
+}
+
+/* Index of the interface owning the source address of the route to dest */
+static int route_ifindex(const struct sockaddr_in6& dest) {
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    struct sockaddr_in6 local;
+    socklen_t len = sizeof(local);
+    int ok = ::connect(fd, reinterpret_cast<const struct sockaddr*>(&dest), sizeof(dest)) == 0
+        && getsockname(fd, reinterpret_cast<struct sockaddr*>(&local), &len) == 0;
+    close(fd);
+    if (!ok) {
+        return 0;
+    }
+
+    struct ifaddrs *addrs;
+    if (getifaddrs(&addrs) != 0) {
+        return 0;
+    }
+    int index = 0;
+    for (struct ifaddrs *ifa = addrs; ifa != nullptr && index == 0; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == nullptr) {
+            continue;
+        }
+        bool same = false;
+        if (ifa->ifa_addr->sa_family == AF_INET && is_v4(local)) {
+            same = memcmp(&reinterpret_cast<struct sockaddr_in*>(ifa->ifa_addr)->sin_addr,
+                    &local.sin6_addr.s6_addr[12], 4) == 0;
+        } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+            same = IN6_ARE_ADDR_EQUAL(&reinterpret_cast<struct sockaddr_in6*>(ifa->ifa_addr)->sin6_addr,
+                    &local.sin6_addr);
+        }
+        if (same) {
+            index = if_nametoindex(ifa->ifa_name);
+        }
+    }
+    freeifaddrs(addrs);
+    return index;
+}
+
+bool txtime_qdisc(const struct sockaddr_in6& dest) {
+    int index = route_ifindex(dest);
+    if (index == 0) {
+        return false;
+    }
+
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        return false;
+    }
+    struct {
+        struct nlmsghdr  hdr;
+        struct tcmsg     tc;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.hdr.nlmsg_len = sizeof(req);
+    req.hdr.nlmsg_type = RTM_GETQDISC;
+    req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.tc.tcm_family = AF_UNSPEC;
+    if (send(fd, &req, sizeof(req), 0) < 0) {
+        close(fd);
+        return false;
+    }
+
+    /* Any fq on it counts, eg: under mq on a multi-queue NIC */
+    bool found = false;
+    bool done = false;
+    char buf[16384];
+    while (!done) {
+        int nread = recv(fd, buf, sizeof(buf), 0);
+        if (nread <= 0) {
+            break;
+        }
+        for (struct nlmsghdr *hdr = reinterpret_cast<struct nlmsghdr*>(buf);
+                NLMSG_OK(hdr, nread); hdr = NLMSG_NEXT(hdr, nread)) {
+            if (hdr->nlmsg_type == NLMSG_DONE || hdr->nlmsg_type == NLMSG_ERROR) {
+                done = true;
+                break;
+            }
+            struct tcmsg *tc = reinterpret_cast<struct tcmsg*>(NLMSG_DATA(hdr));
+            if (tc->tcm_ifindex != index) {
+                continue;
+            }
+            int len = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+            for (struct rtattr *attr = TCA_RTA(tc); RTA_OK(attr, len);
+                    attr = RTA_NEXT(attr, len)) {
+                if (attr->rta_type == TCA_KIND
+                        && strcmp(static_cast<const char*>(RTA_DATA(attr)), "fq") == 0) {
+                    found = true;
+                }
+            }
+        }
+    }
+    close(fd);
+    return found;
+}
+
 Epoll::Epoll(): _fd(-1) {
     _fd = epoll_create(MAX_EVENTS);
 }
@@ -128,9 +489,26 @@ int Epoll::add_read_event(int fd) {
     return epoll_ctl(_fd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-std::vector<struct epoll_event> Epoll::wait() {
+int Epoll::set_write_event(int fd, bool on) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (on) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+    return epoll_ctl(_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int Epoll::del_event(int fd) {
+    return epoll_ctl(_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+std::vector<struct epoll_event> Epoll::wait(int timeout) {
     struct epoll_event events[MAX_EVENTS];
-    int nwait = epoll_wait(_fd, events, MAX_EVENTS, -1);
+    int nwait = epoll_wait(_fd, events, MAX_EVENTS, timeout);
+    if (nwait == -1 && errno == EINTR) {
+        nwait = 0;
+    }
     assert(nwait != -1);
     return std::vector<struct epoll_event>(events, events + nwait);
 }
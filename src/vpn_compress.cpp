@@ -0,0 +1,221 @@
+#include "vpn_compress.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+namespace vpn {
+
+static const int HASH_BITS = 12;
+static const int MAX_OFFSET = 65535;
+static const int SAMPLE_SIZE = 256;
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Write a length extension(the part over 15), return new op or nullptr */
+static uint8_t* write_length(uint8_t *op, const uint8_t *oend, int len) {
+    for ( ; len >= 255; len -= 255) {
+        if (op >= oend) {
+            return nullptr;
+        }
+        *op++ = 255;
+    }
+    if (op >= oend) {
+        return nullptr;
+    }
+    *op++ = static_cast<uint8_t>(len);
+    return op;
+}
+
+/* Emit one sequence, match_len == 0 means literals only */
+static uint8_t* write_sequence(uint8_t *op, const uint8_t *oend,
+        const uint8_t *lit, int lit_len, int offset, int match_len) {
+    if (op >= oend) {
+        return nullptr;
+    }
+    uint8_t *token = op++;
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = static_cast<uint8_t>(((lit_len < 15 ? lit_len : 15) << 4)
+            | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && (op = write_length(op, oend, lit_len - 15)) == nullptr) {
+        return nullptr;
+    }
+    if (oend - op < lit_len) {
+        return nullptr;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+    if (oend - op < 2) {
+        return nullptr;
+    }
+    *op++ = static_cast<uint8_t>(offset & 0xff);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    if (ml >= 15 && (op = write_length(op, oend, ml - 15)) == nullptr) {
+        return nullptr;
+    }
+    return op;
+}
+
+int lz_compress(const char *in, int size, char *out, int cap) {
+    if (size <= 0 || cap <= 0) {
+        return -1;
+    }
+
+    const uint8_t *base = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + size;
+    const uint8_t *mlimit = iend - LZ_MIN_MATCH;
+    uint8_t *op = reinterpret_cast<uint8_t*>(out);
+    /* Not smaller than the input is a failure anyway */
+    const uint8_t *oend = op + (cap < size - 1 ? cap : size - 1);
+
+    /* Positions are stored +1 so that zero means empty */
+    uint16_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while (ip < mlimit && size <= MAX_OFFSET) {
+        uint32_t seq = read32(ip);
+        uint32_t h = hash32(seq);
+        int pos = ip - base;
+        int ref = table[h] - 1;
+        table[h] = static_cast<uint16_t>(pos + 1);
+
+        if (ref < 0 || read32(base + ref) != seq) {
+            ++ip;
+            continue;
+        }
+
+        const uint8_t *match = base + ref;
+        int len = LZ_MIN_MATCH;
+        while (ip + len < iend && match[len] == ip[len]) {
+            ++len;
+        }
+
+        op = write_sequence(op, oend, anchor, ip - anchor, ip - match, len);
+        if (op == nullptr) {
+            return -1;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == nullptr) {
+        return -1;
+    }
+    return op - reinterpret_cast<uint8_t*>(out);
+}
+
+/* Read a length extension, return -1 on truncated input */
+static int read_length(const uint8_t **ip, const uint8_t *iend) {
+    int len = 0;
+    for ( ; ; ) {
+        if (*ip >= iend) {
+            return -1;
+        }
+        uint8_t b = *(*ip)++;
+        len += b;
+        if (b != 255) {
+            return len;
+        }
+    }
+}
+
+int lz_decompress(const char *in, int size, char *out, int cap) {
+    const uint8_t *ip = reinterpret_cast<const uint8_t*>(in);
+    const uint8_t *iend = ip + size;
+    uint8_t *base = reinterpret_cast<uint8_t*>(out);
+    uint8_t *op = base;
+    uint8_t *oend = base + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            int ext = read_length(&ip, iend);
+            if (ext < 0) {
+                return -1;
+            }
+            lit_len += ext;
+        }
+        if (iend - ip < lit_len || oend - op < lit_len) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        /* The last sequence has no match part */
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int match_len = (token & 0x0f);
+        if (match_len == 15) {
+            int ext = read_length(&ip, iend);
+            if (ext < 0) {
+                return -1;
+            }
+            match_len += ext;
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op - base || oend - op < match_len) {
+            return -1;
+        }
+        /* Byte by byte, matches may overlap the output */
+        const uint8_t *match = op - offset;
+        for (int i = 0; i < match_len; ++i) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return op - base;
+}
+
+double lz_entropy(const char *data, int size) {
+    if (size <= 0) {
+        return 0.0;
+    }
+
+    int stride = size > SAMPLE_SIZE ? size / SAMPLE_SIZE : 1;
+    int count[256];
+    memset(count, 0, sizeof(count));
+
+    int n = 0;
+    for (int i = 0; i < size && n < SAMPLE_SIZE; i += stride, ++n) {
+        ++count[static_cast<uint8_t>(data[i])];
+    }
+
+    double entropy = 0.0;
+    for (int i = 0; i < 256; ++i) {
+        if (count[i]) {
+            double p = static_cast<double>(count[i]) / n;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+} /* namespace vpn */
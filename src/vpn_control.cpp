@@ -0,0 +1,150 @@
+#include "vpn_control.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace vpn {
+
+/* A stuck peer may hold up the data path this long at most */
+static const int IO_TIMEOUT_MS = 100;
+static const int MAX_COMMAND = 1024;
+
+static bool make_addr(const std::string& path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+    return true;
+}
+
+static void set_timeout(int fd, int ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static void write_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = ::write(fd, data.data() + sent, data.size() - sent);
+        if (n <= 0) {
+            return;
+        }
+        sent += n;
+    }
+}
+
+Control::Control(const std::string& path) : _fd(-1), _path(path), _handlers() {
+    struct sockaddr_un addr;
+    if (!make_addr(path, &addr)) {
+        return;
+    }
+    _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0) {
+        return;
+    }
+    /* Someone answering is a running instance, leave it be. A socket
+     * nobody listens on is left over by a previous run. */
+    if (connect(_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0) {
+        close(_fd);
+        _fd = -1;
+        return;
+    }
+    struct stat st;
+    if (errno == ECONNREFUSED && lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+    if (bind(_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0
+            || listen(_fd, 16) != 0) {
+        close(_fd);
+        _fd = -1;
+        return;
+    }
+
+    handle("help", [this](const std::string&) {
+        std::string reply;
+        for (const auto& it : _handlers) {
+            reply += it.first + "\n";
+        }
+        return reply;
+    });
+}
+
+Control::~Control() {
+    if (_fd >= 0) {
+        close(_fd);
+        unlink(_path.c_str());
+    }
+}
+
+void Control::handle(const std::string& command, const Handler& handler) {
+    _handlers[command] = handler;
+}
+
+void Control::serve() {
+    int fd = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    set_timeout(fd, IO_TIMEOUT_MS);
+
+    std::string line;
+    char buf[256];
+    while (line.find('\n') == std::string::npos && line.size() < MAX_COMMAND) {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        line.append(buf, n);
+    }
+    line = line.substr(0, line.find('\n'));
+
+    size_t space = line.find(' ');
+    std::string name = line.substr(0, space);
+    std::string args = space == std::string::npos ? "" : line.substr(space + 1);
+    auto it = _handlers.find(name);
+    if (it == _handlers.end()) {
+        write_all(fd, "unknown command: " + name + ", try help\n");
+    } else {
+        write_all(fd, it->second(args));
+    }
+    close(fd);
+}
+
+void Control::run() {
+    for ( ; ; ) {
+        serve();
+    }
+}
+
+bool Control::query(const std::string& path, const std::string& command,
+        std::string *reply) {
+    struct sockaddr_un addr;
+    if (!make_addr(path, &addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    write_all(fd, command + "\n");
+
+    reply->clear();
+    char buf[4096];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
+        reply->append(buf, n);
+    }
+    close(fd);
+    return true;
+}
+
+} /* namespace vpn */
@@ -0,0 +1,441 @@
+#include "vpn_crypto.h"
+
+#include <string.h>
+
+namespace vpn {
+
+/* Operations processed per chunk, bounds the on-stack poly1305 keys */
+static const int CHUNK_OPS = 64;
+
+static inline uint32_t load32(const uint8_t *p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+        | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &v, sizeof(v));
+#else
+    p[0] = static_cast<uint8_t>(v);
+    p[1] = static_cast<uint8_t>(v >> 8);
+    p[2] = static_cast<uint8_t>(v >> 16);
+    p[3] = static_cast<uint8_t>(v >> 24);
+#endif
+}
+
+/*
+ * ChaCha20 kernels, written with GCC vector extensions: lane l of x[i] is
+ * word i of block l, so one kernel call computes LANES independent blocks.
+ * */
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint32_t v8u __attribute__((vector_size(32)));
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) do { \
+    a += b; d ^= a; d = ROTL(d, 16);   \
+    c += d; b ^= c; b = ROTL(b, 12);   \
+    a += b; d ^= a; d = ROTL(d, 8);    \
+    c += d; b ^= c; b = ROTL(b, 7);    \
+} while (0)
+
+template <typename V, int LANES>
+static inline __attribute__((always_inline))
+void chacha_blocks(const uint32_t (*in)[16], uint8_t (*out)[64]) {
+    V x[16], s[16];
+    for (int i = 0; i < 16; ++i) {
+        for (int l = 0; l < LANES; ++l) {
+            s[i][l] = in[l][i];
+        }
+        x[i] = s[i];
+    }
+
+    for (int r = 0; r < 10; ++r) {
+        QUARTER_ROUND(x[0], x[4], x[8],  x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9],  x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8],  x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9],  x[14]);
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        x[i] += s[i];
+        for (int l = 0; l < LANES; ++l) {
+            store32(out[l] + 4 * i, x[i][l]);
+        }
+    }
+}
+
+static void chacha_blocks_sse(const uint32_t (*in)[16], uint8_t (*out)[64]) {
+    chacha_blocks<v4u, 4>(in, out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void chacha_blocks_avx2(const uint32_t (*in)[16], uint8_t (*out)[64]) {
+    chacha_blocks<v8u, 8>(in, out);
+}
+#endif
+
+struct Kernel {
+    void      (*blocks)(const uint32_t (*)[16], uint8_t (*)[64]);
+    int         lanes;
+    const char *name;
+};
+
+static Kernel select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Kernel{chacha_blocks_avx2, 8, "avx2"};
+    }
+    return Kernel{chacha_blocks_sse, 4, "sse2"};
+#else
+    return Kernel{chacha_blocks_sse, 4, "generic"};
+#endif
+}
+
+static const Kernel KERNEL = select_kernel();
+
+static const int MAX_LANES = 8;
+
+const char* aead_kernel() {
+    return KERNEL.name;
+}
+
+static inline void xor_bytes(uint8_t *dst, const uint8_t *src, int len) {
+    int i = 0;
+    for ( ; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for ( ; i < len; ++i) {
+        dst[i] ^= src[i];
+    }
+}
+
+/*
+ * Blocks waiting for the kernel. A block either becomes a poly1305 key
+ * (copy 32 bytes) or is xored into the data.
+ * */
+class BlockQueue {
+public:
+    BlockQueue() : _n(0) {  }
+    ~BlockQueue() { flush(); }
+
+    void push(const uint8_t *key, const uint8_t *nonce, uint32_t counter,
+            uint8_t *dst, int len, bool xor_data) {
+        uint32_t *st = _in[_n];
+        st[0] = 0x61707865;
+        st[1] = 0x3320646e;
+        st[2] = 0x79622d32;
+        st[3] = 0x6b206574;
+        for (int i = 0; i < 8; ++i) {
+            st[4 + i] = load32(key + 4 * i);
+        }
+        st[12] = counter;
+        st[13] = load32(nonce);
+        st[14] = load32(nonce + 4);
+        st[15] = load32(nonce + 8);
+        _dst[_n] = dst;
+        _len[_n] = len;
+        _xor[_n] = xor_data;
+        if (++_n == KERNEL.lanes) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (_n == 0) {
+            return;
+        }
+        /* Idle lanes compute garbage nobody reads */
+        KERNEL.blocks(_in, _out);
+        for (int l = 0; l < _n; ++l) {
+            if (_xor[l]) {
+                xor_bytes(_dst[l], _out[l], _len[l]);
+            } else {
+                memcpy(_dst[l], _out[l], _len[l]);
+            }
+        }
+        _n = 0;
+    }
+private:
+    int       _n;
+    uint32_t  _in[MAX_LANES][16];
+    uint8_t   _out[MAX_LANES][64];
+    uint8_t  *_dst[MAX_LANES];
+    int       _len[MAX_LANES];
+    bool      _xor[MAX_LANES];
+};
+
+static void push_keystream(BlockQueue *queue, const AeadOp& op) {
+    for (int off = 0, counter = 1; off < op.len; off += 64, ++counter) {
+        int len = op.len - off < 64 ? op.len - off : 64;
+        queue->push(op.key, op.nonce, counter, op.data + off, len, true);
+    }
+}
+
+/* poly1305-donna, 26 bit limbs */
+class Poly1305 {
+public:
+    explicit Poly1305(const uint8_t key[32]) : _left(0) {
+        _r[0] = (load32(key + 0)) & 0x3ffffff;
+        _r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+        _r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+        _r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+        _r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+        memset(_h, 0, sizeof(_h));
+        for (int i = 0; i < 4; ++i) {
+            _pad[i] = load32(key + 16 + 4 * i);
+        }
+    }
+
+    void update(const uint8_t *m, int len) {
+        if (_left) {
+            int want = 16 - _left < len ? 16 - _left : len;
+            memcpy(_buf + _left, m, want);
+            _left += want;
+            m += want;
+            len -= want;
+            if (_left < 16) {
+                return;
+            }
+            blocks(_buf, 16, 1 << 24);
+            _left = 0;
+        }
+        int full = len & ~15;
+        if (full) {
+            blocks(m, full, 1 << 24);
+            m += full;
+            len -= full;
+        }
+        if (len) {
+            memcpy(_buf, m, len);
+            _left = len;
+        }
+    }
+
+    /* Zero padding up to a multiple of 16 bytes */
+    void pad16() {
+        if (_left) {
+            memset(_buf + _left, 0, 16 - _left);
+            blocks(_buf, 16, 1 << 24);
+            _left = 0;
+        }
+    }
+
+    void finish(uint8_t mac[16]) {
+        if (_left) {
+            _buf[_left] = 1;
+            memset(_buf + _left + 1, 0, 16 - _left - 1);
+            blocks(_buf, 16, 0);
+        }
+
+        uint32_t h0 = _h[0], h1 = _h[1], h2 = _h[2], h3 = _h[3], h4 = _h[4];
+        uint32_t c;
+        c = h1 >> 26; h1 &= 0x3ffffff;
+        h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+        h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+        h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        /* g = h + -p */
+        uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+        uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+        uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+        uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+        uint32_t g4 = h4 + c - (1UL << 26);
+
+        /* Select h if h < p, or h + -p if h >= p, in constant time */
+        uint32_t mask = (g4 >> 31) - 1;
+        g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+        mask = ~mask;
+        h0 = (h0 & mask) | g0;
+        h1 = (h1 & mask) | g1;
+        h2 = (h2 & mask) | g2;
+        h3 = (h3 & mask) | g3;
+        h4 = (h4 & mask) | g4;
+
+        h0 = (h0 | (h1 << 26));
+        h1 = ((h1 >> 6) | (h2 << 20));
+        h2 = ((h2 >> 12) | (h3 << 14));
+        h3 = ((h3 >> 18) | (h4 << 8));
+
+        uint64_t f;
+        f = static_cast<uint64_t>(h0) + _pad[0];             h0 = f;
+        f = static_cast<uint64_t>(h1) + _pad[1] + (f >> 32); h1 = f;
+        f = static_cast<uint64_t>(h2) + _pad[2] + (f >> 32); h2 = f;
+        f = static_cast<uint64_t>(h3) + _pad[3] + (f >> 32); h3 = f;
+
+        store32(mac + 0, h0);
+        store32(mac + 4, h1);
+        store32(mac + 8, h2);
+        store32(mac + 12, h3);
+    }
+private:
+    uint32_t  _r[5];
+    uint32_t  _h[5];
+    uint32_t  _pad[4];
+    uint8_t   _buf[16];
+    int       _left;
+
+    void blocks(const uint8_t *m, int len, uint32_t hibit) {
+        const uint32_t r0 = _r[0], r1 = _r[1], r2 = _r[2], r3 = _r[3], r4 = _r[4];
+        const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+        uint32_t h0 = _h[0], h1 = _h[1], h2 = _h[2], h3 = _h[3], h4 = _h[4];
+
+        for ( ; len >= 16; m += 16, len -= 16) {
+            h0 += (load32(m + 0)) & 0x3ffffff;
+            h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+            h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+            h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+            h4 += (load32(m + 12) >> 8) | hibit;
+
+            uint64_t d0 = static_cast<uint64_t>(h0) * r0 + static_cast<uint64_t>(h1) * s4
+                + static_cast<uint64_t>(h2) * s3 + static_cast<uint64_t>(h3) * s2
+                + static_cast<uint64_t>(h4) * s1;
+            uint64_t d1 = static_cast<uint64_t>(h0) * r1 + static_cast<uint64_t>(h1) * r0
+                + static_cast<uint64_t>(h2) * s4 + static_cast<uint64_t>(h3) * s3
+                + static_cast<uint64_t>(h4) * s2;
+            uint64_t d2 = static_cast<uint64_t>(h0) * r2 + static_cast<uint64_t>(h1) * r1
+                + static_cast<uint64_t>(h2) * r0 + static_cast<uint64_t>(h3) * s4
+                + static_cast<uint64_t>(h4) * s3;
+            uint64_t d3 = static_cast<uint64_t>(h0) * r3 + static_cast<uint64_t>(h1) * r2
+                + static_cast<uint64_t>(h2) * r1 + static_cast<uint64_t>(h3) * r0
+                + static_cast<uint64_t>(h4) * s4;
+            uint64_t d4 = static_cast<uint64_t>(h0) * r4 + static_cast<uint64_t>(h1) * r3
+                + static_cast<uint64_t>(h2) * r2 + static_cast<uint64_t>(h3) * r1
+                + static_cast<uint64_t>(h4) * r0;
+
+            uint32_t c;
+            c = d0 >> 26; h0 = d0 & 0x3ffffff;
+            d1 += c; c = d1 >> 26; h1 = d1 & 0x3ffffff;
+            d2 += c; c = d2 >> 26; h2 = d2 & 0x3ffffff;
+            d3 += c; c = d3 >> 26; h3 = d3 & 0x3ffffff;
+            d4 += c; c = d4 >> 26; h4 = d4 & 0x3ffffff;
+            h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+            h1 += c;
+        }
+
+        _h[0] = h0; _h[1] = h1; _h[2] = h2; _h[3] = h3; _h[4] = h4;
+    }
+};
+
+/* RFC 8439 2.8: aad | pad16 | ciphertext | pad16 | le64(aad) | le64(ct) */
+static void compute_tag(const uint8_t polykey[32], const AeadOp& op, uint8_t tag[16]) {
+    Poly1305 poly(polykey);
+    poly.update(op.aad, op.aad_len);
+    poly.pad16();
+    poly.update(op.data, op.len);
+    poly.pad16();
+
+    uint8_t lens[16];
+    store32(lens + 0, static_cast<uint32_t>(op.aad_len));
+    store32(lens + 4, 0);
+    store32(lens + 8, static_cast<uint32_t>(op.len));
+    store32(lens + 12, 0);
+    poly.update(lens, sizeof(lens));
+    poly.finish(tag);
+}
+
+static bool tag_equal(const uint8_t *a, const uint8_t *b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_SIZE; ++i) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+void aead_seal(AeadOp *ops, int n) {
+    uint8_t polykey[CHUNK_OPS][32];
+
+    for (int base = 0; base < n; base += CHUNK_OPS) {
+        int count = n - base < CHUNK_OPS ? n - base : CHUNK_OPS;
+        {
+            BlockQueue queue;
+            for (int i = 0; i < count; ++i) {
+                const AeadOp& op = ops[base + i];
+                queue.push(op.key, op.nonce, 0, polykey[i], 32, false);
+                push_keystream(&queue, op);
+            }
+        }
+        for (int i = 0; i < count; ++i) {
+            compute_tag(polykey[i], ops[base + i], ops[base + i].tag);
+            ops[base + i].ok = true;
+        }
+    }
+}
+
+int aead_open(AeadOp *ops, int n) {
+    uint8_t polykey[CHUNK_OPS][32];
+    int nok = 0;
+
+    for (int base = 0; base < n; base += CHUNK_OPS) {
+        int count = n - base < CHUNK_OPS ? n - base : CHUNK_OPS;
+        {
+            BlockQueue queue;
+            for (int i = 0; i < count; ++i) {
+                const AeadOp& op = ops[base + i];
+                queue.push(op.key, op.nonce, 0, polykey[i], 32, false);
+            }
+        }
+
+        BlockQueue queue;
+        for (int i = 0; i < count; ++i) {
+            AeadOp& op = ops[base + i];
+            uint8_t tag[AEAD_TAG_SIZE];
+            compute_tag(polykey[i], op, tag);
+            op.ok = tag_equal(tag, op.tag);
+            if (op.ok) {
+                push_keystream(&queue, op);
+                ++nok;
+            }
+        }
+    }
+    return nok;
+}
+
+ReplayWindow::ReplayWindow() : _top(0), _empty(true) {
+    memset(_bitmap, 0, sizeof(_bitmap));
+}
+
+bool ReplayWindow::check(uint64_t seq) const {
+    if (_empty || seq > _top) {
+        return true;
+    }
+    /* The word holding _top is shared with the oldest seqs */
+    if (_top - seq >= static_cast<uint64_t>(BITS - 64)) {
+        return false;
+    }
+    uint64_t bit = seq % BITS;
+    return !(_bitmap[bit / 64] & (1ULL << (bit % 64)));
+}
+
+void ReplayWindow::update(uint64_t seq) {
+    if (_empty) {
+        _top = seq;
+        _empty = false;
+    } else if (seq > _top) {
+        uint64_t from = _top / 64 + 1;
+        uint64_t to = seq / 64;
+        if (to - from + 1 >= static_cast<uint64_t>(WORDS)) {
+            memset(_bitmap, 0, sizeof(_bitmap));
+        } else {
+            for (uint64_t w = from; w <= to; ++w) {
+                _bitmap[w % WORDS] = 0;
+            }
+        }
+        _top = seq;
+    }
+    uint64_t bit = seq % BITS;
+    _bitmap[bit / 64] |= 1ULL << (bit % 64);
+}
+
+} /* namespace vpn */
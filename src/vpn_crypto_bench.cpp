@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "vpn_crypto.h"
+#include "vpn_tunnel.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(seconds, 1, "seconds per case");
+
+/* RFC 8439 2.8.2 */
+static bool known_answer() {
+    uint8_t key[32];
+    for (int i = 0; i < 32; ++i) {
+        key[i] = 0x80 + i;
+    }
+    uint8_t nonce[12] = {7, 0, 0, 0, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    uint8_t aad[12] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+    const char *text = "Ladies and Gentlemen of the class of '99: If I could offer you "
+        "only one tip for the future, sunscreen would be it.";
+    const uint8_t expect_tag[16] = {0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+        0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+    const uint8_t expect_ct[8] = {0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb};
+
+    uint8_t data[128];
+    uint8_t tag[16];
+    int len = strlen(text);
+    memcpy(data, text, len);
+
+    vpn::AeadOp op = {key, nonce, aad, sizeof(aad), data, len, tag, false};
+    vpn::aead_seal(&op, 1);
+    if (memcmp(tag, expect_tag, 16) || memcmp(data, expect_ct, 8)) {
+        return false;
+    }
+    return vpn::aead_open(&op, 1) == 1 && memcmp(data, text, len) == 0;
+}
+
+/* Seal count packets of size bytes in batches, return Gbit/s */
+static double run(int size, int batch, bool open) {
+    const int count = 256;
+    uint8_t key[32] = {1};
+    std::vector<uint8_t> data(count * size);
+    std::vector<uint8_t> nonces(count * 12);
+    std::vector<uint8_t> tags(count * 16);
+    uint8_t aad[16] = {0};
+
+    std::vector<vpn::AeadOp> ops(count);
+    for (int i = 0; i < count; ++i) {
+        nonces[i * 12] = static_cast<uint8_t>(i);
+        ops[i] = vpn::AeadOp{key, &nonces[i * 12], aad, sizeof(aad),
+            &data[i * size], size, &tags[i * 16], false};
+    }
+    if (open) {
+        vpn::aead_seal(ops.data(), count);
+    }
+    /* open() decrypts in place, restore the ciphertext before each batch */
+    std::vector<uint8_t> sealed(data);
+
+    uint64_t bytes = 0;
+    uint64_t start = vpn::monotonic_ns();
+    uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+    uint64_t now = start;
+    while (now < end) {
+        for (int i = 0; i < count; i += batch) {
+            if (open) {
+                memcpy(&data[i * size], &sealed[i * size], batch * size);
+                if (vpn::aead_open(&ops[i], batch) != batch) {
+                    fprintf(stderr, "open failed\n");
+                    exit(1);
+                }
+            } else {
+                vpn::aead_seal(&ops[i], batch);
+            }
+        }
+        bytes += static_cast<uint64_t>(count) * size;
+        now = vpn::monotonic_ns();
+    }
+    return bytes * 8.0 / (now - start);
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("crypto_bench [--seconds N]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    if (!known_answer()) {
+        fprintf(stderr, "ChaCha20-Poly1305 known answer test failed\n");
+        return 1;
+    }
+    printf("kernel %s, single core\n", vpn::aead_kernel());
+    printf("%-8s %-6s %12s %12s\n", "size", "batch", "seal Gbit/s", "open Gbit/s");
+
+    const int sizes[] = {64, 1400};
+    const int batches[] = {1, 8, 32};
+    for (int size : sizes) {
+        for (int batch : batches) {
+            printf("%-8d %-6d %12.2f %12.2f\n", size, batch,
+                    run(size, batch, false), run(size, batch, true));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include "vpn_fec.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+namespace vpn {
+
+/* Longest symbol, a packet plus its small prefix */
+static const int MAX_SYMBOL = 4096;
+
+/* GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 */
+class GF256 {
+public:
+    GF256() {
+        int x = 1;
+        for (int i = 0; i < 255; ++i) {
+            _exp[i] = _exp[i + 255] = static_cast<uint8_t>(x);
+            _log[x] = i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+        _log[0] = 0;
+        for (int a = 0; a < 256; ++a) {
+            for (int b = 0; b < 256; ++b) {
+                _mul[a][b] = (a && b) ? _exp[_log[a] + _log[b]] : 0;
+            }
+        }
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const { return _mul[a][b]; }
+    uint8_t inv(uint8_t a) const { return _exp[255 - _log[a]]; }
+
+    /* dst ^= c * src */
+    void mul_add(uint8_t *dst, const uint8_t *src, int len, uint8_t c) const {
+        if (c == 1) {
+            int i = 0;
+            for ( ; i + 8 <= len; i += 8) {
+                uint64_t a, b;
+                memcpy(&a, dst + i, 8);
+                memcpy(&b, src + i, 8);
+                a ^= b;
+                memcpy(dst + i, &a, 8);
+            }
+            for ( ; i < len; ++i) {
+                dst[i] ^= src[i];
+            }
+            return;
+        }
+        const uint8_t *row = _mul[c];
+        for (int i = 0; i < len; ++i) {
+            dst[i] ^= row[src[i]];
+        }
+    }
+private:
+    uint8_t  _exp[510];
+    int      _log[256];
+    uint8_t  _mul[256][256];
+};
+
+static const GF256 GF;
+
+/* Coefficient of data symbol j in parity r, any square submatrix of it
+ * is invertible */
+static uint8_t coef(int r, int j, int m) {
+    if (m == 1) {
+        return 1;
+    }
+    return GF.inv(static_cast<uint8_t>(r ^ (FEC_MAX_M + j)));
+}
+
+FecEncoder::FecEncoder(int k, int m)
+    : _k(k), _m(m), _group(0), _count(0), _len(0),
+    _parity(m, std::vector<uint8_t>(MAX_SYMBOL, 0)),
+    _ready(0), _next(0), _ready_k(0), _ready_len(0), _ready_group(0),
+    _out(m, std::vector<uint8_t>(MAX_SYMBOL, 0)) {
+    assert(k >= 1 && k <= FEC_MAX_K && m >= 1 && m <= FEC_MAX_M);
+}
+
+bool FecEncoder::add(const uint8_t *symbol, int len, FecHeader *hdr) {
+    assert(len <= MAX_SYMBOL);
+
+    for (int r = 0; r < _m; ++r) {
+        GF.mul_add(_parity[r].data(), symbol, len, coef(r, _count, _m));
+    }
+    if (len > _len) {
+        _len = len;
+    }
+
+    hdr->group = htonl(_group);
+    hdr->index = static_cast<uint8_t>(_count);
+    hdr->k = static_cast<uint8_t>(_k);
+    hdr->m = static_cast<uint8_t>(_m);
+    hdr->reserved = 0;
+
+    if (++_count == _k) {
+        close();
+        return true;
+    }
+    return false;
+}
+
+bool FecEncoder::flush() {
+    if (_count == 0) {
+        return false;
+    }
+    close();
+    return true;
+}
+
+void FecEncoder::close() {
+    _parity.swap(_out);
+    for (int r = 0; r < _m; ++r) {
+        memset(_parity[r].data(), 0, _len);
+    }
+
+    _ready = _m;
+    _next = 0;
+    _ready_k = _count;
+    _ready_len = _len;
+    _ready_group = _group;
+
+    ++_group;
+    _count = 0;
+    _len = 0;
+}
+
+int FecEncoder::take_parity(uint8_t *out, int cap, FecHeader *hdr) {
+    if (_next >= _ready || cap < _ready_len) {
+        return -1;
+    }
+
+    int r = _next++;
+    memcpy(out, _out[r].data(), _ready_len);
+    hdr->group = htonl(_ready_group);
+    hdr->index = static_cast<uint8_t>(_ready_k + r);
+    hdr->k = static_cast<uint8_t>(_ready_k);
+    hdr->m = static_cast<uint8_t>(_m);
+    hdr->reserved = 0;
+    return _ready_len;
+}
+
+FecDecoder::FecDecoder() : _rebuilt(), _recovered(0), _unrecoverable(0) {
+    for (int i = 0; i < GROUPS; ++i) {
+        _groups[i].used = false;
+    }
+}
+
+bool FecDecoder::add(const FecHeader& hdr, const uint8_t *symbol, int len) {
+    uint32_t id = ntohl(hdr.group);
+    int k = hdr.k;
+    int m = hdr.m;
+    int index = hdr.index;
+    if (k < 1 || k > FEC_MAX_K || m < 1 || m > FEC_MAX_M
+            || index >= k + m || len > MAX_SYMBOL) {
+        return true;
+    }
+
+    Group *g = &_groups[id % GROUPS];
+    if (!g->used || g->id != id) {
+        /* Older than the group in the slot, too late to help */
+        if (g->used && static_cast<int32_t>(id - g->id) < 0) {
+            return true;
+        }
+        if (g->used && !g->done && g->k <= FEC_MAX_K) {
+            ++_unrecoverable;
+        }
+        g->id = id;
+        g->used = true;
+        g->done = false;
+        g->k = FEC_MAX_K + 1;
+        g->data_k = 0;
+        g->m = m;
+        g->have = 0;
+        g->len = 0;
+        g->present = 0;
+        g->rebuilt = 0;
+        g->symbols.resize(FEC_MAX_K + FEC_MAX_M);
+        g->lens.assign(FEC_MAX_K + FEC_MAX_M, 0);
+    }
+    if (m != g->m) {
+        return true;
+    }
+    bool parity = index >= k;
+    if (parity && g->k <= FEC_MAX_K && k != g->k) {
+        return true;
+    }
+    if (!parity && ((g->data_k != 0 && k != g->data_k) || index >= g->k)) {
+        return true;
+    }
+    if (g->rebuilt & (1ULL << index)) {
+        /* Late original of a rebuilt symbol */
+        return false;
+    }
+    if (g->done || (g->present & (1ULL << index))) {
+        return true;
+    }
+
+    /* Only parities know the real size of a flushed group, which is no
+     * larger than data symbols tell and holds those already seen */
+    if (parity && g->k > FEC_MAX_K) {
+        if ((g->data_k != 0 && k > g->data_k) || (g->present >> k) != 0) {
+            return true;
+        }
+        g->k = k;
+    } else if (!parity) {
+        g->data_k = k;
+    }
+    std::vector<uint8_t>& sym = g->symbols[index];
+    sym.assign(symbol, symbol + len);
+    g->lens[index] = len;
+    g->present |= 1ULL << index;
+    ++g->have;
+    if (len > g->len) {
+        g->len = len;
+    }
+
+    if (g->k > FEC_MAX_K) {
+        return true;
+    }
+    uint64_t data_mask = (1ULL << g->k) - 1;
+    if ((g->present & data_mask) == data_mask) {
+        /* Nothing lost */
+        g->done = true;
+    } else if (g->have >= g->k) {
+        rebuild(g);
+    }
+    return true;
+}
+
+void FecDecoder::rebuild(Group *g) {
+    int k = g->k;
+    int m = g->m;
+    int len = g->len;
+
+    int missing[FEC_MAX_M];
+    int rows[FEC_MAX_M];
+    int e = 0;
+    for (int j = 0; j < k; ++j) {
+        if (!(g->present & (1ULL << j))) {
+            missing[e++] = j;
+        }
+    }
+    int n = 0;
+    for (int r = 0; r < m && n < e; ++r) {
+        if (g->present & (1ULL << (k + r))) {
+            rows[n++] = r;
+        }
+    }
+    if (n < e) {
+        /* Not yet */
+        return;
+    }
+
+    /* Right hand side: parity minus what the known data contributes */
+    std::vector<std::vector<uint8_t>> rhs(e, std::vector<uint8_t>(len, 0));
+    for (int a = 0; a < e; ++a) {
+        const std::vector<uint8_t>& p = g->symbols[k + rows[a]];
+        memcpy(rhs[a].data(), p.data(), g->lens[k + rows[a]]);
+        for (int j = 0; j < k; ++j) {
+            if (g->present & (1ULL << j)) {
+                GF.mul_add(rhs[a].data(), g->symbols[j].data(), g->lens[j],
+                        coef(rows[a], j, m));
+            }
+        }
+    }
+
+    /* Invert the e x e matrix by Gauss-Jordan */
+    uint8_t mat[FEC_MAX_M][FEC_MAX_M];
+    uint8_t inv[FEC_MAX_M][FEC_MAX_M];
+    for (int a = 0; a < e; ++a) {
+        for (int b = 0; b < e; ++b) {
+            mat[a][b] = coef(rows[a], missing[b], m);
+            inv[a][b] = (a == b);
+        }
+    }
+    for (int col = 0; col < e; ++col) {
+        int pivot = col;
+        while (pivot < e && mat[pivot][col] == 0) {
+            ++pivot;
+        }
+        if (pivot == e) {
+            /* Never of a Cauchy matrix, give the group up */
+            g->done = true;
+            ++_unrecoverable;
+            return;
+        }
+        for (int b = 0; b < e; ++b) {
+            uint8_t t = mat[col][b]; mat[col][b] = mat[pivot][b]; mat[pivot][b] = t;
+            t = inv[col][b]; inv[col][b] = inv[pivot][b]; inv[pivot][b] = t;
+        }
+        uint8_t scale = GF.inv(mat[col][col]);
+        for (int b = 0; b < e; ++b) {
+            mat[col][b] = GF.mul(mat[col][b], scale);
+            inv[col][b] = GF.mul(inv[col][b], scale);
+        }
+        for (int a = 0; a < e; ++a) {
+            uint8_t f = mat[a][col];
+            if (a == col || f == 0) {
+                continue;
+            }
+            for (int b = 0; b < e; ++b) {
+                mat[a][b] ^= GF.mul(f, mat[col][b]);
+                inv[a][b] ^= GF.mul(f, inv[col][b]);
+            }
+        }
+    }
+
+    for (int b = 0; b < e; ++b) {
+        std::vector<uint8_t> out(len, 0);
+        for (int a = 0; a < e; ++a) {
+            GF.mul_add(out.data(), rhs[a].data(), len, inv[b][a]);
+        }
+        _rebuilt.push_back(out);
+        g->rebuilt |= 1ULL << missing[b];
+        ++_recovered;
+    }
+    g->done = true;
+}
+
+int FecDecoder::take(uint8_t *out, int cap) {
+    if (_rebuilt.empty()) {
+        return -1;
+    }
+    std::vector<uint8_t> sym;
+    sym.swap(_rebuilt.front());
+    _rebuilt.pop_front();
+    if (static_cast<int>(sym.size()) > cap) {
+        return -1;
+    }
+    memcpy(out, sym.data(), sym.size());
+    return sym.size();
+}
+
+} /* namespace vpn */
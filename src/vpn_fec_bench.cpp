@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "vpn_tunnel.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(packets, 200000, "packets per case");
+DEFINE_int32(size, 1200, "packet size in bytes");
+DEFINE_int32(pps, 10000, "packets per second offered by the sender");
+DEFINE_double(one_way_ms, 20.0, "one way delay of the simulated link");
+DEFINE_int32(seed, 1, "seed of the loss pattern");
+
+/*
+ * Deterministic loss injection: datagrams from a real sender Session go
+ * through a Bernoulli loss channel with fixed delay into a real receiver
+ * Session. A packet neither delivered nor rebuilt by FEC is resent by the
+ * inner TCP, modeled as one extra RTT per lost attempt.
+ * */
+struct Result {
+    double  residual;
+    double  efficiency;
+    double  p50;
+    double  p99;
+    double  p999;
+    double  mathis_mbps;
+};
+
+static Result run(double loss, int k, int m) {
+    vpn::TunnelOptions options;
+    options.fec_k = k;
+    options.fec_m = k > 0 ? m : 1;
+    vpn::Session sender(1, options, vpn::R_CLIENT);
+    vpn::Session receiver(1, options, vpn::R_SERVER);
+
+    std::mt19937 rng(FLAGS_seed);
+    std::uniform_real_distribution<double> dice(0.0, 1.0);
+
+    const double interval = 1000.0 / FLAGS_pps;
+    const double rtt = 2 * FLAGS_one_way_ms;
+    const int n = FLAGS_packets;
+
+    std::vector<double> delivered(n, -1.0);
+    std::vector<char> packet(FLAGS_size, 'x');
+    char datagram[vpn::MAX_DATAGRAM];
+    char out[vpn::MAX_DATAGRAM];
+    uint64_t wire = 0;
+
+    /* Arrival of a datagram sent at now, if the channel lets it through */
+    auto transmit = [&](const char *data, int size, double now) {
+        wire += size;
+        if (dice(rng) < loss) {
+            return;
+        }
+        double arrive = now + FLAGS_one_way_ms;
+        int nread = receiver.decap(data, size, out, sizeof(out));
+        if (nread > 0) {
+            int id;
+            memcpy(&id, out, sizeof(id));
+            if (delivered[id] < 0) {
+                delivered[id] = arrive;
+            }
+        }
+        while ((nread = receiver.take_ready(out, sizeof(out))) > 0) {
+            int id;
+            memcpy(&id, out, sizeof(id));
+            if (delivered[id] < 0) {
+                delivered[id] = arrive;
+            }
+        }
+    };
+    auto send_parities = [&](double now) {
+        int size;
+        while ((size = sender.take_parity(datagram, sizeof(datagram))) > 0) {
+            transmit(datagram, size, now);
+        }
+    };
+
+    for (int i = 0; i < n; ++i) {
+        double now = i * interval;
+        memcpy(packet.data(), &i, sizeof(i));
+        int size = sender.encap(packet.data(), packet.size(), datagram, sizeof(datagram));
+        transmit(datagram, size, now);
+        send_parities(now);
+    }
+    sender.tick(~0ULL);
+    send_parities(n * interval);
+
+    /* Inner TCP resends what is still missing */
+    std::vector<double> latency(n);
+    int residual = 0;
+    for (int i = 0; i < n; ++i) {
+        double sent = i * interval;
+        if (delivered[i] >= 0) {
+            latency[i] = delivered[i] - sent;
+            continue;
+        }
+        ++residual;
+        double at = sent + rtt;
+        for ( ; ; ) {
+            wire += FLAGS_size;
+            if (dice(rng) >= loss) {
+                break;
+            }
+            at += rtt;
+        }
+        latency[i] = at + FLAGS_one_way_ms - sent;
+    }
+    std::sort(latency.begin(), latency.end());
+
+    Result r;
+    r.residual = static_cast<double>(residual) / n;
+    r.efficiency = static_cast<double>(n) * FLAGS_size / wire;
+    r.p50 = latency[n / 2];
+    r.p99 = latency[static_cast<int>(n * 0.99)];
+    r.p999 = latency[static_cast<int>(n * 0.999)];
+    /* Mathis et al: rate <= MSS / RTT * 1.22 / sqrt(p) */
+    r.mathis_mbps = r.residual > 0
+        ? FLAGS_size * 8 / (rtt / 1000.0) * 1.22 / sqrt(r.residual) / 1e6
+        : INFINITY;
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("fec_bench [--packets N] [--one_way_ms MS] [--seed N]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    const double losses[] = {0.0, 0.005, 0.01, 0.02, 0.03, 0.05};
+    const int codes[][2] = {{0, 0}, {10, 1}, {10, 2}, {20, 4}};
+
+    printf("%d packets of %dB at %d pps, one way %.1fms, seed %d\n",
+            FLAGS_packets, FLAGS_size, FLAGS_pps, FLAGS_one_way_ms, FLAGS_seed);
+    printf("%-6s %-8s %10s %10s %9s %9s %9s %12s\n", "loss", "fec", "residual",
+            "goodput", "p50 ms", "p99 ms", "p99.9 ms", "tcp Mbit/s");
+    for (double loss : losses) {
+        for (const auto& code : codes) {
+            char name[16];
+            if (code[0] == 0) {
+                snprintf(name, sizeof(name), "off");
+            } else {
+                snprintf(name, sizeof(name), "%d/%d", code[0], code[1]);
+            }
+            Result r = run(loss, code[0], code[1]);
+            printf("%-6.3f %-8s %9.4f%% %9.2f%% %9.2f %9.2f %9.2f %12.1f\n", loss, name,
+                    r.residual * 100, r.efficiency * 100, r.p50, r.p99, r.p999,
+                    r.mathis_mbps);
+        }
+    }
+    return 0;
+}
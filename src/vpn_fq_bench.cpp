@@ -0,0 +1,136 @@
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "vpn_queue.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(link_mbit, 20, "rate of the bottleneck the queue is shaped to");
+DEFINE_int32(bulk, 4, "bulk flows, the last one offers three times the others");
+DEFINE_double(load, 1.5, "what the bulk flows offer together, relative to the link");
+DEFINE_int32(ping_ms, 10, "interval of the ping flow");
+DEFINE_int32(limit, 1024, "queue limit in packets");
+DEFINE_int32(seconds, 10, "simulated seconds per case");
+DEFINE_int32(seed, 1, "seed of the bulk arrivals");
+
+/*
+ * Latency under load: bulk flows of full sized packets offer more than the
+ * link takes while a ping flow sends a small packet now and then, all into
+ * a real FairQueue shaped to the link rate. Bulk packets arrive as Poisson
+ * processes. Time is simulated in steps of 50us, the ping latency is the
+ * time its packets wait in the queue.
+ * */
+enum Mode {
+    FIFO = 0,
+    DRR,
+    DRR_PRIORITY
+};
+
+struct Result {
+    double  p50;
+    double  p99;
+    double  max;
+    double  min_mbps;
+    double  max_mbps;
+    uint64_t dropped;
+};
+
+static const int BULK_SIZE = 1400;
+static const int PING_SIZE = 84;
+static const uint64_t STEP = 50000;
+
+static void make_packet(char *packet, int size) {
+    memset(packet, 0, size);
+    struct iphdr *ip = reinterpret_cast<struct iphdr*>(packet);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(size);
+}
+
+static Result run(Mode mode) {
+    vpn::FairQueue queue(FLAGS_limit);
+    uint64_t link = static_cast<uint64_t>(FLAGS_link_mbit) * 1000000 / 8;
+    queue.set_rate(link);
+
+    /* Flow n is the ping, the rest are bulk */
+    int n = FLAGS_bulk;
+    std::mt19937 rng(FLAGS_seed);
+    std::vector<std::exponential_distribution<double>> gaps;
+    std::vector<uint64_t> next(n + 1, 0);
+    int shares = n + 2;
+    for (int i = 0; i < n; ++i) {
+        double rate = link * FLAGS_load * (i == n - 1 ? 3 : 1) / shares;
+        /* Packets per ns */
+        gaps.emplace_back(rate / BULK_SIZE / 1e9);
+    }
+
+    char bulk[BULK_SIZE];
+    char ping[PING_SIZE];
+    make_packet(bulk, BULK_SIZE);
+    make_packet(ping, PING_SIZE);
+
+    std::vector<uint64_t> bytes(n, 0);
+    std::vector<double> latency;
+    char out[BULK_SIZE];
+    uint64_t end = FLAGS_seconds * 1000000000ULL;
+    for (uint64_t now = 0; now < end; now += STEP) {
+        for (int i = 0; i <= n; ++i) {
+            while (next[i] <= now) {
+                const char *packet = i == n ? ping : bulk;
+                int size = i == n ? PING_SIZE : BULK_SIZE;
+                uint32_t flow = mode == FIFO ? 0 : i + 1;
+                bool priority = mode == DRR_PRIORITY && vpn::interactive(packet, size);
+                /* The tag carries when it was queued */
+                queue.push(flow, priority, i, next[i], packet, size);
+                next[i] += i == n ? FLAGS_ping_ms * 1000000ULL
+                    : static_cast<uint64_t>(gaps[i](rng)) + 1;
+            }
+        }
+
+        int size;
+        uint32_t flow, owner;
+        uint64_t queued;
+        while ((size = queue.pop(now, out, sizeof(out), &flow, &owner, &queued)) > 0) {
+            if (static_cast<int>(owner) == n) {
+                latency.push_back((now - queued) / 1e6);
+            } else {
+                bytes[owner] += size;
+            }
+        }
+    }
+
+    Result r;
+    std::sort(latency.begin(), latency.end());
+    int count = latency.size();
+    r.p50 = count ? latency[count / 2] : 0;
+    r.p99 = count ? latency[static_cast<int>(count * 0.99)] : 0;
+    r.max = count ? latency.back() : 0;
+    r.min_mbps = *std::min_element(bytes.begin(), bytes.end()) * 8.0 / FLAGS_seconds / 1e6;
+    r.max_mbps = *std::max_element(bytes.begin(), bytes.end()) * 8.0 / FLAGS_seconds / 1e6;
+    r.dropped = queue.dropped();
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("fq_bench [--link_mbit N] [--bulk N] [--load X]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    printf("%d Mbit/s link, %d bulk flows offering %.1fx, ping every %dms, limit %d\n",
+            FLAGS_link_mbit, FLAGS_bulk, FLAGS_load, FLAGS_ping_ms, FLAGS_limit);
+    printf("%-14s %10s %10s %10s %14s %14s %10s\n", "queue", "ping p50", "p99 ms",
+            "max ms", "bulk min Mbps", "bulk max Mbps", "dropped");
+    const char *names[] = {"fifo", "drr", "drr+priority"};
+    for (int mode = FIFO; mode <= DRR_PRIORITY; ++mode) {
+        Result r = run(static_cast<Mode>(mode));
+        printf("%-14s %10.3f %10.3f %10.3f %14.2f %14.2f %10llu\n", names[mode],
+                r.p50, r.p99, r.max, r.min_mbps, r.max_mbps,
+                static_cast<unsigned long long>(r.dropped));
+    }
+    return 0;
+}
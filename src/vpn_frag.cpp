@@ -0,0 +1,147 @@
+#include "vpn_frag.h"
+
+#include <string.h>
+#include <stdio.h>
+
+namespace vpn {
+
+size_t FragKeyHash::operator()(const FragKey& key) const {
+    /* FNV-1a, like flow_hash() */
+    uint32_t words[3] = {key.session, key.id, key.protocol};
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(words);
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < sizeof(words); ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    AddrHash hash;
+    return h ^ hash(key.saddr) ^ (hash(key.daddr) * 16777619U);
+}
+
+Fragments::Fragments()
+    : _ids(), _origins(), _pending(), _id_order(), _origin_order(), _pending_order(),
+    _ready(), _next_id(1), _holding(0), _held(0), _dropped(0) {  }
+
+uint32_t Fragments::map_id(const FragKey& key, uint64_t now) {
+    auto it = _ids.find(key);
+    if (it != _ids.end()) {
+        return it->second.id;
+    }
+    while (_ids.size() >= MAX_ENTRIES) {
+        evict(&_ids, &_id_order);
+    }
+    uint32_t id = _next_id++;
+    _ids[key] = IdEntry{id, now};
+    _id_order.emplace_back(now, key);
+    return id;
+}
+
+void Fragments::learn(const FragKey& key, const OriginData& origin, uint64_t now) {
+    auto it = _origins.find(key);
+    if (it == _origins.end()) {
+        while (_origins.size() >= MAX_ENTRIES) {
+            evict(&_origins, &_origin_order);
+        }
+        _origins[key] = OriginEntry{origin, now};
+        _origin_order.emplace_back(now, key);
+    } else {
+        it->second.origin = origin;
+    }
+
+    auto pending = _pending.find(key);
+    if (pending == _pending.end()) {
+        return;
+    }
+    for (std::string& packet : pending->second.packets) {
+        _ready.push_back(std::move(packet));
+    }
+    _holding -= pending->second.packets.size();
+    _pending.erase(pending);
+}
+
+const OriginData* Fragments::lookup(const FragKey& key) const {
+    auto it = _origins.find(key);
+    return it == _origins.end() ? nullptr : &it->second.origin;
+}
+
+bool Fragments::hold(const FragKey& key, const char *packet, int size, uint64_t now) {
+    if (_holding >= MAX_HELD) {
+        ++_dropped;
+        return false;
+    }
+    auto it = _pending.find(key);
+    if (it == _pending.end()) {
+        /* Keys released by learn() stay in the order until expire() */
+        while (_pending_order.size() >= MAX_ENTRIES) {
+            pop_pending();
+        }
+        it = _pending.emplace(key, HeldEntry{std::deque<std::string>(), now}).first;
+        _pending_order.emplace_back(now, key);
+    }
+    it->second.packets.emplace_back(packet, size);
+    ++_holding;
+    ++_held;
+    return true;
+}
+
+int Fragments::take(char *out, int cap) {
+    if (_ready.empty()) {
+        return -1;
+    }
+    std::string packet = std::move(_ready.front());
+    _ready.pop_front();
+    if (static_cast<int>(packet.size()) > cap) {
+        return -1;
+    }
+    memcpy(out, packet.data(), packet.size());
+    return packet.size();
+}
+
+void Fragments::drop_pending(const FragKey& key) {
+    auto it = _pending.find(key);
+    if (it == _pending.end()) {
+        return;
+    }
+    _holding -= it->second.packets.size();
+    _dropped += it->second.packets.size();
+    _pending.erase(it);
+}
+
+void Fragments::pop_pending() {
+    auto it = _pending.find(_pending_order.front().second);
+    if (it != _pending.end() && it->second.at == _pending_order.front().first) {
+        drop_pending(it->first);
+    }
+    _pending_order.pop_front();
+}
+
+template <typename Map>
+void Fragments::evict(Map *map, Order *order) {
+    /* A key added again after its entry went has a later time */
+    auto it = map->find(order->front().second);
+    if (it != map->end() && it->second.at == order->front().first) {
+        map->erase(it);
+    }
+    order->pop_front();
+}
+
+void Fragments::expire(uint64_t now) {
+    while (!_id_order.empty() && now - _id_order.front().first > TIMEOUT) {
+        evict(&_ids, &_id_order);
+    }
+    while (!_origin_order.empty() && now - _origin_order.front().first > TIMEOUT) {
+        evict(&_origins, &_origin_order);
+    }
+    while (!_pending_order.empty() && now - _pending_order.front().first > TIMEOUT) {
+        pop_pending();
+    }
+}
+
+std::string Fragments::to_string() const {
+    char buf[192];
+    snprintf(buf, sizeof(buf), "datagrams from clients %zu from tun %zu, held %llu now %d, dropped %llu",
+            _ids.size(), _origins.size(), static_cast<unsigned long long>(_held), _holding,
+            static_cast<unsigned long long>(_dropped));
+    return buf;
+}
+
+} /* namespace vpn */
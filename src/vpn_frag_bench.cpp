@@ -0,0 +1,445 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "vpn_client.h"
+#include "vpn_memdev.h"
+#include "vpn_net.h"
+#include "vpn_server.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(seconds, 1, "seconds per case");
+DEFINE_int32(datagram, 4000, "UDP payload of a fragmented datagram");
+DEFINE_int32(mtu, 1500, "MTU the datagrams are fragmented to");
+
+/*
+ * Fragments through the real server, a client and a server back to back
+ * over QueueDevices as in bench. First checks what comes out: options
+ * kept, addresses, ports and ids rewritten, checksums right, fragments
+ * ahead of their first one held and released, the cache bounded and
+ * broken headers dropped as invalid. Then times server2client() for whole
+ * packets and fragments, in order and with the first fragment last,
+ * which makes the others wait in the cache.
+ * */
+using Packets = std::vector<std::string>;
+
+static const char *CLIENT_ADDR = "10.9.0.2";
+static const char *SERVER_ADDR = "10.0.0.1";
+static const char *REMOTE_ADDR = "8.8.8.8";
+static const int CLIENT_PORT = 1111;
+static const int REMOTE_PORT = 53;
+
+static void expect(bool ok, const char *what, int line) {
+    if (!ok) {
+        fprintf(stderr, "check failed at line %d: %s\n", line, what);
+        exit(1);
+    }
+}
+
+#define EXPECT(cond) expect((cond), #cond, __LINE__)
+
+/* Ones' complement sum, folded */
+static uint32_t sum16(const void *data, int size, uint32_t sum = 0) {
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    for (int i = 0; i + 1 < size; i += 2) {
+        sum += (p[i] << 8) | p[i + 1];
+    }
+    if (size & 1) {
+        sum += p[size - 1] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+/* UDP header and payload, its checksum right for the addresses */
+static uint32_t pseudo_sum(const char *src, const char *dst, int size) {
+    uint32_t words[2];
+    inet_pton(AF_INET, src, &words[0]);
+    inet_pton(AF_INET, dst, &words[1]);
+    uint16_t tail[2] = {htons(IPPROTO_UDP), htons(size)};
+    return sum16(tail, sizeof(tail), sum16(words, sizeof(words)));
+}
+
+static std::string udp(const char *src, const char *dst, int sport, int dport, int payload) {
+    std::string datagram(sizeof(struct udphdr) + payload, 0);
+    for (int i = 0; i < payload; ++i) {
+        datagram[sizeof(struct udphdr) + i] = static_cast<char>(i * 7);
+    }
+    struct udphdr *header = reinterpret_cast<struct udphdr*>(&datagram[0]);
+    header->source = htons(sport);
+    header->dest = htons(dport);
+    header->len = htons(datagram.size());
+    uint32_t sum = sum16(datagram.data(), datagram.size(),
+            pseudo_sum(src, dst, datagram.size()));
+    header->check = htons(~sum & 0xffff);
+    return datagram;
+}
+
+/* datagram cut into IPv4 fragments of at most mtu, with options bytes of
+ * NOPs in every header. One packet if it fits. */
+static Packets fragment(const std::string& datagram, const char *src, const char *dst,
+        uint16_t id, int mtu, int options = 0) {
+    int header = sizeof(struct iphdr) + options;
+    int step = (mtu - header) & ~7;
+    Packets packets;
+    for (size_t offset = 0; offset < datagram.size(); offset += step) {
+        int len = std::min<int>(step, datagram.size() - offset);
+        std::string packet(header + len, 0);
+        struct iphdr *ip = reinterpret_cast<struct iphdr*>(&packet[0]);
+        ip->version = 4;
+        ip->ihl = header / 4;
+        ip->tot_len = htons(packet.size());
+        ip->id = htons(id);
+        bool more = offset + len < datagram.size();
+        if (offset > 0 || more) {
+            ip->frag_off = htons((offset / 8) | (more ? vpn::IP_FRAG_MF : 0));
+        }
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_UDP;
+        inet_pton(AF_INET, src, &ip->saddr);
+        inet_pton(AF_INET, dst, &ip->daddr);
+        memset(&packet[sizeof(struct iphdr)], 1, options);
+        ip->check = htons(~sum16(packet.data(), header) & 0xffff);
+        memcpy(&packet[header], datagram.data() + offset, len);
+        packets.push_back(packet);
+    }
+    return packets;
+}
+
+static const struct iphdr* header_of(const std::string& packet) {
+    return reinterpret_cast<const struct iphdr*>(packet.data());
+}
+
+static std::string addr_of(uint32_t addr) {
+    char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr, text, sizeof(text));
+    return text;
+}
+
+/* The UDP datagram the fragments make, by their offsets. Each header has
+ * a right checksum and the addresses of the first one. */
+static std::string reassemble(const Packets& packets) {
+    std::string datagram;
+    for (const std::string& packet : packets) {
+        const struct iphdr *ip = header_of(packet);
+        EXPECT(sum16(packet.data(), ip->ihl * 4) == 0xffff);
+        EXPECT(ip->saddr == header_of(packets[0])->saddr);
+        EXPECT(ip->daddr == header_of(packets[0])->daddr);
+        EXPECT(ip->id == header_of(packets[0])->id);
+        size_t offset = (ntohs(ip->frag_off) & vpn::IP_FRAG_OFFSET) * 8;
+        std::string payload = packet.substr(ip->ihl * 4);
+        if (datagram.size() < offset + payload.size()) {
+            datagram.resize(offset + payload.size());
+        }
+        datagram.replace(offset, payload.size(), payload);
+    }
+    return datagram;
+}
+
+static bool udp_checksum_ok(const Packets& packets) {
+    const struct iphdr *ip = header_of(packets[0]);
+    std::string datagram = reassemble(packets);
+    return sum16(datagram.data(), datagram.size(),
+            pseudo_sum(addr_of(ip->saddr).c_str(), addr_of(ip->daddr).c_str(),
+                datagram.size())) == 0xffff;
+}
+
+static const struct udphdr* udp_of(const std::string& packet) {
+    return reinterpret_cast<const struct udphdr*>(packet.data() + header_of(packet)->ihl * 4);
+}
+
+static vpn::ClientOptions client_options() {
+    vpn::ClientOptions options;
+    options.srv_addrs.push_back("192.0.2.2");
+    options.srv_port = 5003;
+    options.pmtu = false;
+    return options;
+}
+
+/* A client and a server over QueueDevices, the client's flow from
+ * CLIENT_PORT mapped to port by the server's NAT */
+struct Tunnel {
+    vpn::QueueDevice  client_tun;
+    vpn::QueueDevice  client_socket;
+    vpn::QueueDevice  server_tun;
+    vpn::QueueDevice  server_socket;
+    vpn::Client       client;
+    vpn::Server       server;
+    struct sockaddr_in6  peer;
+    int               port;
+
+    Tunnel() : client_tun(), client_socket(), server_tun(4096), server_socket(4096),
+        client(client_options(), &client_tun, &client_socket),
+        server(&server_tun, &server_socket, SERVER_ADDR), peer(), port(0) {
+        vpn::make_sockaddr("192.0.2.1", 40000, &peer);
+        server.start();
+        Packets out = up(fragment(udp(CLIENT_ADDR, REMOTE_ADDR, CLIENT_PORT, REMOTE_PORT, 16),
+                    CLIENT_ADDR, REMOTE_ADDR, 1, FLAGS_mtu));
+        EXPECT(out.size() == 1);
+        port = ntohs(udp_of(out[0])->source);
+    }
+
+    /* Move datagrams between the sockets and let both ends run */
+    void settle() {
+        char buf[vpn::MAX_DATAGRAM];
+        for (int round = 0; round < 8; ++round) {
+            client.poll(0);
+            int size;
+            while ((size = client_socket.take(buf, sizeof(buf))) >= 0) {
+                server_socket.inject(buf, size, &peer);
+            }
+            server.poll(0);
+            while ((size = server_socket.take(buf, sizeof(buf))) >= 0) {
+                client_socket.inject(buf, size, &peer);
+            }
+        }
+    }
+
+    static Packets drain(vpn::QueueDevice *device) {
+        Packets packets;
+        char buf[vpn::MAX_DATAGRAM];
+        int size;
+        while ((size = device->take(buf, sizeof(buf))) >= 0) {
+            packets.emplace_back(buf, size);
+        }
+        return packets;
+    }
+
+    /* From the client's tun, what leaves the server's */
+    Packets up(const Packets& packets) {
+        for (const std::string& packet : packets) {
+            client_tun.inject(packet.data(), packet.size());
+        }
+        settle();
+        return drain(&server_tun);
+    }
+
+    /* Into the server's tun, what reaches the client's */
+    Packets down(const Packets& packets) {
+        for (const std::string& packet : packets) {
+            server_tun.inject(packet.data(), packet.size());
+        }
+        settle();
+        return drain(&client_tun);
+    }
+
+    uint64_t metric(const std::string& name) {
+        std::string text = server.metrics();
+        size_t at = text.find("\n" + name + " ");
+        EXPECT(at != std::string::npos);
+        return strtoull(text.c_str() + at + name.size() + 2, nullptr, 10);
+    }
+};
+
+static const char *HELD = "tinyvpn_fragments_held_total";
+static const char *DROPPED = "tinyvpn_fragments_dropped_total";
+
+static Packets down_datagram(const Tunnel& tunnel, uint16_t id, int payload, int options = 0) {
+    return fragment(udp(REMOTE_ADDR, SERVER_ADDR, REMOTE_PORT, tunnel.port, payload),
+            REMOTE_ADDR, SERVER_ADDR, id, FLAGS_mtu, options);
+}
+
+/* Fragments of a client share a new id and the source of the server,
+ * the first one a new port, options stay */
+static void check_up() {
+    Tunnel tunnel;
+    std::string datagram = udp(CLIENT_ADDR, REMOTE_ADDR, CLIENT_PORT, REMOTE_PORT,
+            FLAGS_datagram);
+    Packets sent = fragment(datagram, CLIENT_ADDR, REMOTE_ADDR, 77, FLAGS_mtu, 8);
+    Packets out = tunnel.up(sent);
+    EXPECT(sent.size() > 1);
+    EXPECT(out.size() == sent.size());
+    for (const std::string& packet : out) {
+        EXPECT(header_of(packet)->ihl == 7);
+        EXPECT(addr_of(header_of(packet)->saddr) == SERVER_ADDR);
+        EXPECT(addr_of(header_of(packet)->daddr) == REMOTE_ADDR);
+    }
+    EXPECT(ntohs(udp_of(out[0])->source) == tunnel.port);
+    EXPECT(ntohs(udp_of(out[0])->dest) == REMOTE_PORT);
+    EXPECT(udp_checksum_ok(out));
+
+    /* Another datagram of the flow, another id */
+    Packets again = tunnel.up(fragment(datagram, CLIENT_ADDR, REMOTE_ADDR, 78, FLAGS_mtu));
+    EXPECT(again.size() == sent.size());
+    EXPECT(header_of(again[0])->id != header_of(out[0])->id);
+    EXPECT(udp_checksum_ok(again));
+}
+
+/* A whole packet with options, then fragments in order */
+static void check_down() {
+    Tunnel tunnel;
+    Packets out = tunnel.down(down_datagram(tunnel, 500, 100, 4));
+    EXPECT(out.size() == 1);
+    EXPECT(header_of(out[0])->ihl == 6);
+    EXPECT(ntohs(header_of(out[0])->id) == 500);
+    EXPECT(addr_of(header_of(out[0])->saddr) == REMOTE_ADDR);
+    EXPECT(addr_of(header_of(out[0])->daddr) == CLIENT_ADDR);
+    EXPECT(ntohs(udp_of(out[0])->source) == REMOTE_PORT);
+    EXPECT(ntohs(udp_of(out[0])->dest) == CLIENT_PORT);
+    EXPECT(udp_checksum_ok(out));
+
+    Packets sent = down_datagram(tunnel, 501, FLAGS_datagram);
+    out = tunnel.down(sent);
+    EXPECT(out.size() == sent.size());
+    for (size_t i = 0; i < out.size(); ++i) {
+        EXPECT(header_of(out[i])->frag_off == header_of(sent[i])->frag_off);
+        EXPECT(ntohs(header_of(out[i])->id) == 501);
+        EXPECT(addr_of(header_of(out[i])->daddr) == CLIENT_ADDR);
+    }
+    EXPECT(ntohs(udp_of(out[0])->dest) == CLIENT_PORT);
+    EXPECT(udp_checksum_ok(out));
+    EXPECT(tunnel.metric(HELD) == 0);
+}
+
+/* Fragments ahead of their first one wait for it */
+static void check_held() {
+    Tunnel tunnel;
+    Packets sent = down_datagram(tunnel, 600, FLAGS_datagram);
+    Packets later(sent.begin() + 1, sent.end());
+    EXPECT(tunnel.down(later).empty());
+    EXPECT(tunnel.metric(HELD) == later.size());
+
+    Packets out = tunnel.down(Packets(1, sent[0]));
+    EXPECT(out.size() == sent.size());
+    for (const std::string& packet : out) {
+        EXPECT(addr_of(header_of(packet)->daddr) == CLIENT_ADDR);
+    }
+    std::sort(out.begin(), out.end(), [](const std::string& a, const std::string& b) {
+        return (ntohs(header_of(a)->frag_off) & vpn::IP_FRAG_OFFSET)
+            < (ntohs(header_of(b)->frag_off) & vpn::IP_FRAG_OFFSET);
+    });
+    EXPECT(ntohs(udp_of(out[0])->dest) == CLIENT_PORT);
+    EXPECT(udp_checksum_ok(out));
+    EXPECT(tunnel.metric(DROPPED) == 0);
+}
+
+/* What doesn't fit into the cache is dropped */
+static void check_overflow() {
+    Tunnel tunnel;
+    const int count = 300;
+    Packets later;
+    for (int i = 0; i < count; ++i) {
+        later.push_back(down_datagram(tunnel, 1000 + i, FLAGS_datagram)[1]);
+    }
+    EXPECT(tunnel.down(later).empty());
+    uint64_t held = tunnel.metric(HELD);
+    EXPECT(held > 0 && held < count);
+    EXPECT(tunnel.metric(DROPPED) == count - held);
+}
+
+/* Lengths and IHLs that don't add up are invalid */
+static void check_invalid() {
+    Tunnel tunnel;
+    std::string good = down_datagram(tunnel, 700, 100)[0];
+    Packets broken;
+    std::string packet = good;
+    reinterpret_cast<struct iphdr*>(&packet[0])->tot_len = htons(good.size() + 8);
+    broken.push_back(packet);
+    packet = good;
+    reinterpret_cast<struct iphdr*>(&packet[0])->tot_len = htons(12);
+    broken.push_back(packet);
+    packet = good;
+    reinterpret_cast<struct iphdr*>(&packet[0])->ihl = 4;
+    broken.push_back(packet);
+    packet = good.substr(0, 40);
+    reinterpret_cast<struct iphdr*>(&packet[0])->ihl = 15;
+    reinterpret_cast<struct iphdr*>(&packet[0])->tot_len = htons(40);
+    broken.push_back(packet);
+
+    const std::string invalid = "tinyvpn_drops_total{direction=\"down\",reason=\"invalid\"}";
+    EXPECT(tunnel.down(broken).empty());
+    EXPECT(tunnel.metric(invalid) == broken.size());
+    EXPECT(tunnel.metric(HELD) == 0);
+    /* The good one still goes */
+    EXPECT(tunnel.down(Packets(1, good)).size() == 1);
+}
+
+/* Print packets and bits per second through the server. Every datagram
+ * gets a new id, or later ones would find what the first round left. */
+static void run(const char *name, Tunnel& tunnel, const std::vector<Packets>& datagrams) {
+    uint64_t held = tunnel.metric(HELD);
+    char buf[vpn::MAX_DATAGRAM];
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t start = vpn::monotonic_ns();
+    uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+    uint64_t now = start;
+    uint16_t id = 0;
+    int injected = 0;
+    while (now < end) {
+        for (const Packets& datagram : datagrams) {
+            ++id;
+            for (const std::string& packet : datagram) {
+                memcpy(buf, packet.data(), packet.size());
+                struct iphdr *ip = reinterpret_cast<struct iphdr*>(buf);
+                ip->id = htons(id);
+                ip->check = 0;
+                ip->check = htons(~sum16(buf, sizeof(struct iphdr)) & 0xffff);
+                tunnel.server_tun.inject(buf, packet.size());
+                ++injected;
+                bytes += packet.size();
+            }
+            if (injected >= vpn::BATCH_SIZE) {
+                injected = 0;
+                /* Until what was read leaves nothing behind */
+                uint64_t sent;
+                do {
+                    sent = packets;
+                    tunnel.server.poll(0);
+                    while (tunnel.server_socket.take(buf, sizeof(buf)) >= 0) {
+                        ++packets;
+                    }
+                } while (packets > sent);
+            }
+        }
+        now = vpn::monotonic_ns();
+    }
+    if (tunnel.server_tun.dropped() > 0) {
+        fprintf(stderr, "devices dropped packets, results are off\n");
+    }
+    double seconds = (now - start) / 1e9;
+    printf("%-22s %10.3f %10.2f %8llu\n", name, packets / seconds / 1e6,
+            bytes * 8 / seconds / 1e9,
+            static_cast<unsigned long long>(tunnel.metric(HELD) - held));
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("frag_bench [--seconds N] [--datagram BYTES] [--mtu BYTES]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    check_up();
+    check_down();
+    check_held();
+    check_overflow();
+    check_invalid();
+    printf("checks passed\n");
+
+    const int count = 256;
+    Tunnel tunnel;
+    std::vector<Packets> whole, in_order, first_last;
+    for (int i = 0; i < count; ++i) {
+        whole.push_back(fragment(udp(REMOTE_ADDR, SERVER_ADDR, REMOTE_PORT, tunnel.port,
+                        FLAGS_mtu - sizeof(struct iphdr) - sizeof(struct udphdr)),
+                    REMOTE_ADDR, SERVER_ADDR, i, FLAGS_mtu));
+        in_order.push_back(down_datagram(tunnel, i, FLAGS_datagram));
+        Packets reversed = in_order.back();
+        std::rotate(reversed.begin(), reversed.begin() + 1, reversed.end());
+        first_last.push_back(reversed);
+    }
+
+    printf("%dB datagrams in %zu fragments of at most %dB\n", FLAGS_datagram,
+            in_order[0].size(), FLAGS_mtu);
+    printf("%-22s %10s %10s %8s\n", "case", "Mpps", "Gbit/s", "held");
+    run("whole", tunnel, whole);
+    run("fragments in order", tunnel, in_order);
+    run("first fragment last", tunnel, first_last);
+    return 0;
+}
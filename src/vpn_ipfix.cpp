@@ -0,0 +1,212 @@
+#include "vpn_ipfix.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+
+namespace vpn {
+
+/* Mappings made and reclaimed in a burst, eg: by a scan */
+static const int RING_CAPACITY = 1 << 14;
+/* Sleep of the exporter when the ring is empty */
+static const int EXPORT_INTERVAL_MS = 100;
+static const int HEADER_SIZE = 16;
+
+/* Information elements(RFC 7012) of the template, in order */
+struct Field {
+    uint16_t  id;
+    uint16_t  size;
+    /* Of the reverse direction */
+    bool      reverse;
+};
+static const Field FIELDS[] = {
+    {152, 8, false},    /* flowStartMilliseconds */
+    {153, 8, false},    /* flowEndMilliseconds */
+    {27, 16, false},    /* sourceIPv6Address */
+    {7, 2, false},      /* sourceTransportPort */
+    {281, 16, false},   /* postNATSourceIPv6Address */
+    {227, 2, false},    /* postNAPTSourceTransportPort */
+    {62, 16, false},    /* ipNextHopIPv6Address */
+    {230, 1, false},    /* natEvent */
+    {86, 8, false},     /* packetTotalCount */
+    {85, 8, false},     /* octetTotalCount */
+    {86, 8, true},
+    {85, 8, true},
+};
+static const int FIELD_COUNT = sizeof(FIELDS) / sizeof(FIELDS[0]);
+
+static char* put16(char *out, uint16_t value) {
+    out[0] = value >> 8;
+    out[1] = value;
+    return out + 2;
+}
+
+static char* put32(char *out, uint32_t value) {
+    out = put16(out, value >> 16);
+    return put16(out, value);
+}
+
+static char* put64(char *out, uint64_t value) {
+    out = put32(out, value >> 32);
+    return put32(out, value);
+}
+
+static char* put(char *out, const uint8_t *bytes, int size) {
+    memcpy(out, bytes, size);
+    return out + size;
+}
+
+int ipfix_template(char *out) {
+    char *p = put16(out, IPFIX_TEMPLATE_SET);
+    /* Length, set below */
+    p += 2;
+    p = put16(p, IPFIX_TEMPLATE_ID);
+    p = put16(p, FIELD_COUNT);
+    for (const Field& field : FIELDS) {
+        if (field.reverse) {
+            p = put16(p, 0x8000 | field.id);
+            p = put16(p, field.size);
+            p = put32(p, IPFIX_REVERSE_PEN);
+        } else {
+            p = put16(p, field.id);
+            p = put16(p, field.size);
+        }
+    }
+    put16(out + 2, p - out);
+    return p - out;
+}
+
+int ipfix_record(const FlowRecord& record, char *out) {
+    char *p = put64(out, record.start_ms);
+    p = put64(p, record.end_ms);
+    p = put(p, record.addr, 16);
+    p = put16(p, record.port);
+    p = put(p, record.nat_addr, 16);
+    p = put16(p, record.nat_port);
+    p = put(p, record.peer, 16);
+    *p++ = record.event;
+    p = put64(p, record.packets);
+    p = put64(p, record.bytes);
+    p = put64(p, record.reverse_packets);
+    p = put64(p, record.reverse_bytes);
+    return p - out;
+}
+
+FlowExporter::FlowExporter() : _ring(RING_CAPACITY), _file(nullptr), _socket(), _collector(),
+    _running(false), _thread(), _sequence(0), _messages(0), _exported(0) {  }
+
+FlowExporter::~FlowExporter() {
+    stop();
+}
+
+bool FlowExporter::start(const std::string& target) {
+    stop();
+    if (target.compare(0, 4, "udp:") == 0) {
+        size_t colon = target.rfind(':');
+        std::string addr = target.substr(4, colon - 4);
+        /* [addr] for IPv6 */
+        if (addr.size() > 2 && addr.front() == '[' && addr.back() == ']') {
+            addr = addr.substr(1, addr.size() - 2);
+        }
+        if (colon < 4 || !make_sockaddr(addr, atoi(target.c_str() + colon + 1), &_collector)) {
+            return false;
+        }
+        _socket.reset(new Socket(Socket::IPv6, Socket::UDP));
+    } else {
+        _file = fopen(target.c_str(), "wb");
+        if (_file == nullptr) {
+            return false;
+        }
+    }
+    _sequence = 0;
+    _running = true;
+    _thread = std::thread(&FlowExporter::run, this);
+    return true;
+}
+
+void FlowExporter::stop() {
+    if (!_running) {
+        return;
+    }
+    _running = false;
+    _thread.join();
+    flush();
+    if (_file) {
+        fclose(_file);
+        _file = nullptr;
+    }
+    _socket.reset();
+}
+
+void FlowExporter::run() {
+    while (_running) {
+        if (flush() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(EXPORT_INTERVAL_MS));
+        }
+    }
+}
+
+int FlowExporter::flush() {
+    char message[MESSAGE_SIZE];
+    int count = 0;
+    FlowRecord record;
+    bool more = _ring.pop(&record);
+    while (more) {
+        char *p = message + HEADER_SIZE;
+        uint64_t messages = _messages.load(std::memory_order_relaxed);
+        if (messages == 0 || (_socket && messages % TEMPLATE_EVERY == 0)) {
+            p += ipfix_template(p);
+        }
+        char *set = p;
+        p = put16(p, IPFIX_TEMPLATE_ID);
+        p += 2;
+        int records = 0;
+        /* Records of a set have one size, so room is known before encoding */
+        int size = ipfix_record(record, p);
+        while (more && p + size <= message + MESSAGE_SIZE) {
+            p += ipfix_record(record, p);
+            ++records;
+            more = _ring.pop(&record);
+        }
+        put16(set + 2, p - set);
+
+        char *header = put16(message, IPFIX_VERSION);
+        header = put16(header, p - message);
+        header = put32(header, time(nullptr));
+        header = put32(header, _sequence);
+        /* Observation domain */
+        put32(header, 0);
+        write(message, p - message);
+
+        _sequence += records;
+        _messages.store(messages + 1, std::memory_order_relaxed);
+        count += records;
+    }
+    if (count > 0) {
+        if (_file) {
+            fflush(_file);
+        }
+        _exported.store(_exported.load(std::memory_order_relaxed) + count,
+                std::memory_order_relaxed);
+    }
+    return count;
+}
+
+void FlowExporter::write(const char *message, int size) {
+    if (_file) {
+        fwrite(message, size, 1, _file);
+    } else {
+        /* A collector that is not there loses the message, as over any UDP */
+        _socket->sendto(message, size, reinterpret_cast<struct sockaddr*>(&_collector),
+                sizeof(_collector));
+    }
+}
+
+std::string FlowExporter::to_string() const {
+    return "exported " + std::to_string(_exported.load()) + " messages "
+        + std::to_string(_messages.load()) + " dropped " + std::to_string(_ring.dropped());
+}
+
+} /* namespace vpn */
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vpn_ipfix.h"
+#include "vpn_tunnel.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(seconds, 1, "seconds per case");
+DEFINE_string(target, "/dev/null", "where records are exported, a file or udp:addr:port");
+
+/*
+ * Cost of flow export: a push into the ring on the data path, which is
+ * what a NAT mapping made or reclaimed adds, and the encoding the
+ * exporter does on its own thread. Pushes the exporter can't keep up
+ * with are dropped.
+ * */
+static vpn::FlowRecord sample_record(uint64_t n) {
+    vpn::FlowRecord record;
+    memset(&record, 0, sizeof(record));
+    record.start_ms = n;
+    record.end_ms = n + 1000;
+    record.addr[10] = record.addr[11] = 0xff;
+    record.addr[12] = 10;
+    record.addr[15] = 2;
+    record.port = n;
+    memcpy(record.nat_addr, record.addr, sizeof(record.addr));
+    record.nat_port = n + 1;
+    record.event = vpn::NAT_EVENT_DELETE;
+    record.packets = n;
+    record.bytes = n * 1400;
+    return record;
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("ipfix_bench [--seconds N] [--target path|udp:addr:port]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    /* Encoding alone */
+    char out[256];
+    uint64_t encoded = 0;
+    uint64_t bytes = 0;
+    uint64_t start = vpn::monotonic_ns();
+    uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+    while (vpn::monotonic_ns() < end) {
+        for (int i = 0; i < 1024; ++i) {
+            bytes += vpn::ipfix_record(sample_record(encoded++), out);
+        }
+    }
+    double ns = static_cast<double>(vpn::monotonic_ns() - start) / encoded;
+    printf("%-12s %10.2f ns/record %12.1f M records (%lluB)\n", "encode", ns, encoded / 1e6,
+            static_cast<unsigned long long>(bytes / encoded));
+
+    vpn::FlowExporter exporter;
+    if (!exporter.start(FLAGS_target)) {
+        fprintf(stderr, "failed to open %s\n", FLAGS_target.c_str());
+        return 1;
+    }
+    uint64_t pushed = 0;
+    uint64_t taken = 0;
+    start = vpn::monotonic_ns();
+    end = start + FLAGS_seconds * 1000000000ULL;
+    while (vpn::monotonic_ns() < end) {
+        for (int i = 0; i < 1024; ++i) {
+            taken += exporter.push(sample_record(pushed++));
+        }
+    }
+    uint64_t elapsed = vpn::monotonic_ns() - start;
+    exporter.stop();
+    printf("%-12s %10.2f ns/record %12.1f M records, %.1f%% taken, %.2f M/s exported\n",
+            "push", static_cast<double>(elapsed) / pushed, pushed / 1e6,
+            100.0 * taken / pushed, taken / (elapsed / 1e3));
+    printf("%s\n", exporter.to_string().c_str());
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "vpn_common.h"
+#include "vpn_ipfix.h"
+
+/*
+ * Print IPFIX messages written by server --ipfix, from a file or as a
+ * collector on a UDP port, and check their sequence numbers for records
+ * lost on the way. Templates are read from the messages, elements the
+ * server does not export are printed as hex.
+ * */
+
+struct Spec {
+    uint16_t  id;
+    uint16_t  size;
+    uint32_t  enterprise;
+};
+
+struct Collector {
+    std::map<uint16_t, std::vector<Spec>>  templates;
+    bool      started;
+    uint32_t  next_sequence;
+    uint64_t  messages;
+    uint64_t  records;
+    uint64_t  lost;
+    uint64_t  unknown;
+};
+
+static uint16_t get16(const uint8_t *in) {
+    return in[0] << 8 | in[1];
+}
+
+static uint32_t get32(const uint8_t *in) {
+    return static_cast<uint32_t>(get16(in)) << 16 | get16(in + 2);
+}
+
+static uint64_t get64(const uint8_t *in) {
+    return static_cast<uint64_t>(get32(in)) << 32 | get32(in + 4);
+}
+
+static std::string field_name(const Spec& spec) {
+    std::string reverse = spec.enterprise == vpn::IPFIX_REVERSE_PEN ? "reverse_" : "";
+    if (spec.enterprise != 0 && reverse.empty()) {
+        return std::to_string(spec.enterprise) + "/" + std::to_string(spec.id);
+    }
+    switch (spec.id) {
+        case 152:
+            return reverse + "start";
+        case 153:
+            return reverse + "end";
+        case 27:
+            return reverse + "src";
+        case 7:
+            return reverse + "sport";
+        case 281:
+            return reverse + "nat_src";
+        case 227:
+            return reverse + "nat_sport";
+        case 62:
+            return reverse + "peer";
+        case 230:
+            return reverse + "event";
+        case 86:
+            return reverse + "packets";
+        case 85:
+            return reverse + "bytes";
+        default:
+            return reverse + "ie" + std::to_string(spec.id);
+    }
+}
+
+static std::string field_value(const Spec& spec, const uint8_t *in) {
+    char text[INET6_ADDRSTRLEN];
+    if (spec.size == 16 && (spec.id == 27 || spec.id == 281 || spec.id == 62)) {
+        static const uint8_t v4_mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if (memcmp(in, v4_mapped, sizeof(v4_mapped)) == 0) {
+            inet_ntop(AF_INET, in + 12, text, sizeof(text));
+        } else {
+            inet_ntop(AF_INET6, in, text, sizeof(text));
+        }
+        return text;
+    }
+    if (spec.id == 230 && spec.size == 1) {
+        return in[0] == vpn::NAT_EVENT_CREATE ? "create"
+            : in[0] == vpn::NAT_EVENT_DELETE ? "delete" : std::to_string(in[0]);
+    }
+    switch (spec.size) {
+        case 1:
+            return std::to_string(in[0]);
+        case 2:
+            return std::to_string(get16(in));
+        case 4:
+            return std::to_string(get32(in));
+        case 8:
+            return std::to_string(get64(in));
+    }
+    std::string hex;
+    for (int i = 0; i < spec.size; ++i) {
+        snprintf(text, sizeof(text), "%02x", in[i]);
+        hex += text;
+    }
+    return hex;
+}
+
+static void read_templates(Collector *collector, const uint8_t *in, const uint8_t *end) {
+    while (in + 4 <= end) {
+        uint16_t id = get16(in);
+        int count = get16(in + 2);
+        in += 4;
+        std::vector<Spec> specs;
+        for (int i = 0; i < count && in + 4 <= end; ++i) {
+            Spec spec = {static_cast<uint16_t>(get16(in) & 0x7fff), get16(in + 2), 0};
+            if (get16(in) & 0x8000) {
+                spec.enterprise = get32(in + 4);
+                in += 4;
+            }
+            in += 4;
+            specs.push_back(spec);
+        }
+        collector->templates[id] = specs;
+    }
+}
+
+static void read_records(Collector *collector, uint16_t id, const uint8_t *in,
+        const uint8_t *end) {
+    auto found = collector->templates.find(id);
+    if (found == collector->templates.end()) {
+        ++collector->unknown;
+        return ;
+    }
+    int size = 0;
+    for (const Spec& spec : found->second) {
+        size += spec.size;
+    }
+    /* What is left after the last record is padding */
+    while (size > 0 && in + size <= end) {
+        std::string line;
+        for (const Spec& spec : found->second) {
+            line += (line.empty() ? "" : " ") + field_name(spec) + "=" + field_value(spec, in);
+            in += spec.size;
+        }
+        printf("%s\n", line.c_str());
+        ++collector->records;
+    }
+}
+
+/* Return false if it is no IPFIX message */
+static bool read_message(Collector *collector, const uint8_t *in, int size) {
+    if (size < 16 || get16(in) != vpn::IPFIX_VERSION || get16(in + 2) != size) {
+        return false;
+    }
+    uint32_t sequence = get32(in + 8);
+    if (collector->started && sequence != collector->next_sequence) {
+        fprintf(stderr, "sequence %u, expected %u\n", sequence, collector->next_sequence);
+        collector->lost += sequence - collector->next_sequence;
+    }
+    uint64_t records = collector->records;
+    const uint8_t *end = in + size;
+    for (const uint8_t *set = in + 16; set + 4 <= end; ) {
+        uint16_t id = get16(set);
+        int length = get16(set + 2);
+        if (length < 4 || set + length > end) {
+            return false;
+        }
+        if (id == vpn::IPFIX_TEMPLATE_SET) {
+            read_templates(collector, set + 4, set + length);
+        } else if (id >= 256) {
+            read_records(collector, id, set + 4, set + length);
+        }
+        set += length;
+    }
+    collector->started = true;
+    collector->next_sequence = sequence + (collector->records - records);
+    ++collector->messages;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: ipfix_collect <file|udp:port> [records]\n"
+                "  a collector on udp:port stops after that many records, or never\n");
+        return 1;
+    }
+    std::string source = argv[1];
+    uint64_t wanted = argc == 3 ? strtoull(argv[2], nullptr, 10) : 0;
+    Collector collector = Collector();
+    uint8_t message[65536];
+
+    if (source.compare(0, 4, "udp:") == 0) {
+        vpn::Socket socket(vpn::Socket::IPv6, vpn::Socket::UDP);
+        if (socket.bind(atoi(source.c_str() + 4)) != 0) {
+            fprintf(stderr, "failed to bind %s\n", source.c_str());
+            return 1;
+        }
+        while (wanted == 0 || collector.records < wanted) {
+            int n = socket.recvfrom(reinterpret_cast<char*>(message), sizeof(message),
+                    nullptr, nullptr);
+            if (n > 0 && !read_message(&collector, message, n)) {
+                fprintf(stderr, "not an IPFIX message of %dB\n", n);
+            }
+            fflush(stdout);
+        }
+    } else {
+        FILE *in = fopen(source.c_str(), "rb");
+        if (in == nullptr) {
+            fprintf(stderr, "failed to open %s\n", source.c_str());
+            return 1;
+        }
+        while (fread(message, 16, 1, in) == 1) {
+            int size = get16(message + 2);
+            if (size < 16 || fread(message + 16, size - 16, 1, in) != 1
+                    || !read_message(&collector, message, size)) {
+                fprintf(stderr, "%s is cut short or no IPFIX\n", source.c_str());
+                break;
+            }
+        }
+        fclose(in);
+    }
+    fprintf(stderr, "messages %llu records %llu lost %llu without template %llu\n",
+            static_cast<unsigned long long>(collector.messages),
+            static_cast<unsigned long long>(collector.records),
+            static_cast<unsigned long long>(collector.lost),
+            static_cast<unsigned long long>(collector.unknown));
+    return collector.lost > 0 ? 2 : 0;
+}
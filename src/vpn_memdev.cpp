@@ -0,0 +1,169 @@
+#include "vpn_memdev.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+namespace vpn {
+
+QueueDevice::QueueDevice(int capacity, int mtu)
+    : _event(eventfd(0, EFD_NONBLOCK)), _readable(false), _mtu(mtu), _lock(), _in(), _out(),
+    _dropped(0) {
+    for (Queue *queue : {&_in, &_out}) {
+        queue->slots.resize(capacity);
+        for (Slot& slot : queue->slots) {
+            slot.data.resize(mtu);
+        }
+        queue->head = 0;
+        queue->count = 0;
+    }
+}
+
+QueueDevice::~QueueDevice() {
+    close(_event);
+}
+
+QueueDevice::Slot* QueueDevice::push(Queue *queue) {
+    if (queue->count == queue->slots.size()) {
+        ++_dropped;
+        return nullptr;
+    }
+    Slot *slot = &queue->slots[(queue->head + queue->count) % queue->slots.size()];
+    ++queue->count;
+    return slot;
+}
+
+int QueueDevice::pop(Queue *queue, char *out, int size, struct sockaddr_in6 *peer) {
+    if (queue->count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    const Slot& slot = queue->slots[queue->head];
+    queue->head = (queue->head + 1) % queue->slots.size();
+    --queue->count;
+    int n = std::min(size, slot.size);
+    memcpy(out, slot.data.data(), n);
+    if (peer) {
+        *peer = slot.peer;
+    }
+    return n;
+}
+
+void QueueDevice::signal() {
+    uint64_t value = 1;
+    if (_in.count > 0 && !_readable) {
+        _readable = ::write(_event, &value, sizeof(value)) == sizeof(value);
+    } else if (_in.count == 0 && _readable) {
+        _readable = ::read(_event, &value, sizeof(value)) != sizeof(value);
+    }
+}
+
+int QueueDevice::read(char *out, int size) {
+    std::lock_guard<std::mutex> lock(_lock);
+    int n = pop(&_in, out, size, nullptr);
+    signal();
+    return n;
+}
+
+int QueueDevice::write(const void *in, int size) {
+    std::lock_guard<std::mutex> lock(_lock);
+    Slot *slot = size <= _mtu ? push(&_out) : nullptr;
+    if (slot == nullptr) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    memcpy(slot->data.data(), in, size);
+    slot->size = size;
+    memset(&slot->peer, 0, sizeof(slot->peer));
+    return size;
+}
+
+int QueueDevice::recvmmsg(struct mmsghdr *msgs, int n) {
+    std::lock_guard<std::mutex> lock(_lock);
+    int count = 0;
+    while (count < n) {
+        struct msghdr *hdr = &msgs[count].msg_hdr;
+        struct sockaddr_in6 peer;
+        int nread = pop(&_in, static_cast<char*>(hdr->msg_iov[0].iov_base),
+                hdr->msg_iov[0].iov_len, &peer);
+        if (nread < 0) {
+            break;
+        }
+        if (hdr->msg_name && hdr->msg_namelen >= sizeof(peer)) {
+            memcpy(hdr->msg_name, &peer, sizeof(peer));
+            hdr->msg_namelen = sizeof(peer);
+        }
+        hdr->msg_controllen = 0;
+        msgs[count++].msg_len = nread;
+    }
+    signal();
+    return count ? count : -1;
+}
+
+int QueueDevice::sendmmsg(struct mmsghdr *msgs, int n) {
+    std::lock_guard<std::mutex> lock(_lock);
+    int count = 0;
+    for ( ; count < n; ++count) {
+        const struct msghdr *hdr = &msgs[count].msg_hdr;
+        size_t size = 0;
+        for (size_t i = 0; i < hdr->msg_iovlen; ++i) {
+            size += hdr->msg_iov[i].iov_len;
+        }
+        Slot *slot = size <= static_cast<size_t>(_mtu) ? push(&_out) : nullptr;
+        if (slot == nullptr) {
+            break;
+        }
+        slot->size = 0;
+        for (size_t i = 0; i < hdr->msg_iovlen; ++i) {
+            memcpy(slot->data.data() + slot->size, hdr->msg_iov[i].iov_base,
+                    hdr->msg_iov[i].iov_len);
+            slot->size += hdr->msg_iov[i].iov_len;
+        }
+        memset(&slot->peer, 0, sizeof(slot->peer));
+        if (hdr->msg_name && hdr->msg_namelen >= sizeof(slot->peer)) {
+            memcpy(&slot->peer, hdr->msg_name, sizeof(slot->peer));
+        }
+        msgs[count].msg_len = slot->size;
+    }
+    if (count == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    return count;
+}
+
+bool QueueDevice::inject(const void *data, int size, const struct sockaddr_in6 *from) {
+    std::lock_guard<std::mutex> lock(_lock);
+    Slot *slot = size <= _mtu ? push(&_in) : nullptr;
+    if (slot == nullptr) {
+        return false;
+    }
+    memcpy(slot->data.data(), data, size);
+    slot->size = size;
+    if (from) {
+        slot->peer = *from;
+    } else {
+        memset(&slot->peer, 0, sizeof(slot->peer));
+    }
+    signal();
+    return true;
+}
+
+int QueueDevice::take(char *out, int size, struct sockaddr_in6 *to) {
+    std::lock_guard<std::mutex> lock(_lock);
+    return pop(&_out, out, size, to);
+}
+
+int QueueDevice::pending() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _out.count;
+}
+
+uint64_t QueueDevice::dropped() {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _dropped;
+}
+
+} /* namespace vpn */
@@ -0,0 +1,237 @@
+#include "vpn_metrics.h"
+
+#include <stdio.h>
+
+namespace vpn {
+
+/* Powers of 2 of nanoseconds a histogram is exported with, 1us to 17s */
+static const int EXPORT_LOW = 10;
+static const int EXPORT_HIGH = 34;
+
+int next_metrics_thread() {
+    static std::atomic<int> next(0);
+    int index = next.fetch_add(1);
+    return index < METRICS_THREADS - 1 ? index : METRICS_THREADS - 1;
+}
+
+/* Publish a shard unless another thread sharing the slot did first */
+template <typename Shard>
+static Shard* publish(std::atomic<Shard*> *slot, Shard *made) {
+    Shard *expected = nullptr;
+    if (!slot->compare_exchange_strong(expected, made, std::memory_order_acq_rel)) {
+        delete made;
+        return expected;
+    }
+    return made;
+}
+
+Counter::Counter() {
+    for (int i = 0; i < METRICS_THREADS; ++i) {
+        _shards[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+Counter::~Counter() {
+    for (int i = 0; i < METRICS_THREADS; ++i) {
+        delete _shards[i].load();
+    }
+}
+
+Counter::Shard* Counter::make(int thread) {
+    Shard *shard = new Shard();
+    shard->value.store(0, std::memory_order_relaxed);
+    return publish(&_shards[thread], shard);
+}
+
+uint64_t Counter::value() const {
+    uint64_t value = 0;
+    for (int i = 0; i < METRICS_THREADS; ++i) {
+        const Shard *shard = _shards[i].load(std::memory_order_acquire);
+        if (shard) {
+            value += shard->value.load(std::memory_order_relaxed);
+        }
+    }
+    return value;
+}
+
+Histogram::Histogram() {
+    for (int i = 0; i < METRICS_THREADS; ++i) {
+        _shards[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+Histogram::~Histogram() {
+    for (int i = 0; i < METRICS_THREADS; ++i) {
+        delete _shards[i].load();
+    }
+}
+
+Histogram::Shard* Histogram::make(int thread) {
+    Shard *shard = new Shard();
+    shard->count.store(0, std::memory_order_relaxed);
+    shard->sum.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < BUCKETS; ++i) {
+        shard->buckets[i].store(0, std::memory_order_relaxed);
+    }
+    return publish(&_shards[thread], shard);
+}
+
+uint64_t Histogram::lowest(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index >> SUB_BITS) - 1;
+    return static_cast<uint64_t>(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snapshot;
+    snapshot.buckets.assign(BUCKETS, 0);
+    snapshot.count = 0;
+    snapshot.sum = 0;
+    for (int i = 0; i < METRICS_THREADS; ++i) {
+        const Shard *shard = _shards[i].load(std::memory_order_acquire);
+        if (shard == nullptr) {
+            continue;
+        }
+        for (int j = 0; j < BUCKETS; ++j) {
+            snapshot.buckets[j] += shard->buckets[j].load(std::memory_order_relaxed);
+        }
+        snapshot.count += shard->count.load(std::memory_order_relaxed);
+        snapshot.sum += shard->sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+    /* Buckets are read one by one, count may be off by a few */
+    uint64_t total = 0;
+    for (uint64_t n : buckets) {
+        total += n;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if (seen > rank) {
+            /* The highest value of the bucket */
+            return i + 1 < BUCKETS ? lowest(i + 1) - 1 : lowest(i);
+        }
+    }
+    return lowest(BUCKETS - 1);
+}
+
+uint64_t Histogram::Snapshot::below(uint64_t value) const {
+    int end = bucket(value);
+    uint64_t n = 0;
+    for (int i = 0; i < end; ++i) {
+        n += buckets[i];
+    }
+    return n;
+}
+
+std::string Histogram::Snapshot::to_string() const {
+    char text[128];
+    snprintf(text, sizeof(text), "p50 %.1fus p99 %.1fus p99.9 %.1fus of %llu",
+            quantile(0.5) / 1e3, quantile(0.99) / 1e3, quantile(0.999) / 1e3,
+            static_cast<unsigned long long>(count));
+    return text;
+}
+
+Metrics::Series* Metrics::add(const std::string& name, const std::string& help, Type type,
+        const std::string& labels) {
+    Family *family = nullptr;
+    for (Family& each : _families) {
+        if (each.name == name) {
+            family = &each;
+        }
+    }
+    if (family == nullptr) {
+        _families.push_back(Family{name, help, type, std::vector<Series>()});
+        family = &_families.back();
+    }
+    family->series.push_back(Series());
+    family->series.back().labels = labels;
+    return &family->series.back();
+}
+
+Counter* Metrics::counter(const std::string& name, const std::string& help,
+        const std::string& labels) {
+    std::lock_guard<std::mutex> lock(_lock);
+    Series *series = add(name, help, COUNTER, labels);
+    series->counter.reset(new Counter());
+    return series->counter.get();
+}
+
+Histogram* Metrics::histogram(const std::string& name, const std::string& help,
+        const std::string& labels) {
+    std::lock_guard<std::mutex> lock(_lock);
+    Series *series = add(name, help, HISTOGRAM, labels);
+    series->histogram.reset(new Histogram());
+    return series->histogram.get();
+}
+
+void Metrics::counter(const std::string& name, const std::string& help,
+        const std::string& labels, const std::function<uint64_t()>& read) {
+    std::lock_guard<std::mutex> lock(_lock);
+    add(name, help, COUNTER, labels)->read = [read]() {
+        return static_cast<double>(read());
+    };
+}
+
+void Metrics::gauge(const std::string& name, const std::string& help,
+        const std::string& labels, const std::function<double()>& read) {
+    std::lock_guard<std::mutex> lock(_lock);
+    add(name, help, GAUGE, labels)->read = read;
+}
+
+/* name{labels,extra} */
+static std::string series_name(const std::string& name, const std::string& labels,
+        const std::string& extra = "") {
+    std::string all = labels.empty() || extra.empty() ? labels + extra : labels + "," + extra;
+    return all.empty() ? name : name + "{" + all + "}";
+}
+
+static std::string number(double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+}
+
+std::string Metrics::to_prometheus() const {
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    std::lock_guard<std::mutex> lock(_lock);
+    std::string out;
+    for (const Family& family : _families) {
+        out += "# HELP " + family.name + " " + family.help + "\n";
+        out += "# TYPE " + family.name + " " + types[family.type] + "\n";
+        for (const Series& series : family.series) {
+            if (series.histogram) {
+                Histogram::Snapshot snapshot = series.histogram->snapshot();
+                for (int i = EXPORT_LOW; i <= EXPORT_HIGH; ++i) {
+                    out += series_name(family.name + "_bucket", series.labels,
+                            "le=\"" + number((1ULL << i) / 1e9) + "\"") + " "
+                        + std::to_string(snapshot.below(1ULL << i)) + "\n";
+                }
+                out += series_name(family.name + "_bucket", series.labels, "le=\"+Inf\"") + " "
+                    + std::to_string(snapshot.count) + "\n";
+                out += series_name(family.name + "_sum", series.labels) + " "
+                    + number(snapshot.sum / 1e9) + "\n";
+                out += series_name(family.name + "_count", series.labels) + " "
+                    + std::to_string(snapshot.count) + "\n";
+            } else if (series.counter) {
+                out += series_name(family.name, series.labels) + " "
+                    + std::to_string(series.counter->value()) + "\n";
+            } else {
+                out += series_name(family.name, series.labels) + " " + number(series.read())
+                    + "\n";
+            }
+        }
+    }
+    return out;
+}
+
+} /* namespace vpn */
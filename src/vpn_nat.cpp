@@ -1,4 +1,5 @@
 #include "vpn_nat.h"
+#include "vpn_probe.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -6,7 +7,7 @@
 
 namespace vpn {
 
-NAT::NAT() : _nat(-1), _in_use(-1) {
+NAT::NAT() : _nat(-1), _in_use(-1), _used(0) {
     init();
 }
 
@@ -25,44 +26,69 @@ void NAT::init() {
     }
 }
 
-int NAT::snat(const std::string& addr, int port, struct sockaddr_in sock) {
+int NAT::snat(const Addr& addr, int port, const struct sockaddr_in6& sock, uint32_t session,
+        int size) {
     if (empty(&_nat)) {
         prune(75000);
     }
     assert(!empty(&_nat));
 
     NATNode *node = lookup(addr, port);
-    if (node == nullptr) {
+    bool created = node == nullptr;
+    if (created) {
         node = _nat.next;
         node->addr = addr;
         node->port = port;
+        node->created = time(nullptr);
+        node->packets[0] = node->packets[1] = 0;
+        node->bytes[0] = node->bytes[1] = 0;
 
         remove(node);
         append(&_in_use, node);
+        ++_used;
     }
     node->use = time(nullptr);
     node->sock = sock;
+    node->session = session;
+    if (size > 0) {
+        ++node->packets[0];
+        node->bytes[0] += size;
+    }
+    if (created && _observer) {
+        _observer(*node, true);
+    }
+    VPN_PROBE3(nat__snat, port, node->new_port, static_cast<int>(created));
     return node->new_port;
 }
 
-std::shared_ptr<OriginData> NAT::dnat(int port) {
+bool NAT::dnat(int port, OriginData *origin, int size) {
     NATNode *node = lookup(port);
     if (node == nullptr) {
-        return nullptr;
+        VPN_PROBE1(nat__miss, port);
+        return false;
+    }
+    VPN_PROBE2(nat__dnat, port, node->session);
+    if (size > 0) {
+        ++node->packets[1];
+        node->bytes[1] += size;
     }
-    return std::make_shared<OriginData>(OriginData{node->sock, node->addr, node->port});
+    *origin = OriginData{node->sock, node->session, node->addr, node->port};
+    return true;
 }
 
-void NAT::snat(const std::string& saddr, const std::string& daddr, struct sockaddr_in sock) {
-    _addrmap[daddr] = OriginData{sock, saddr, 0};
+void NAT::snat(const Addr& saddr, const Addr& daddr,
+        const struct sockaddr_in6& sock, uint32_t session) {
+    _addrmap[daddr] = OriginData{sock, session, saddr, 0};
 }
 
-std::shared_ptr<OriginData> NAT::dnat(const std::string& daddr) {
+bool NAT::dnat(const Addr& daddr, OriginData *origin) {
     auto it = _addrmap.find(daddr);
     if (it == _addrmap.end()) {
-        return nullptr;
+        VPN_PROBE1(nat__miss, 0);
+        return false;
     }
-    return std::make_shared<OriginData>(it->second);
+    *origin = it->second;
+    return true;
 }
 
 void NAT::remove(NATNode *node) {
@@ -88,7 +114,7 @@ NATNode* NAT::lookup(int port) {
     return nullptr;
 }
 
-NATNode* NAT::lookup(const std::string& addr, int port) {
+NATNode* NAT::lookup(const Addr& addr, int port) {
     NATNode *node = _in_use.next;
     while (node != &_in_use) {
         if (node->addr == addr && node->port == port) {
@@ -100,6 +126,8 @@ NATNode* NAT::lookup(const std::string& addr, int port) {
 }
 
 NAT::~NAT() {
+    /* Whoever observes may be gone already */
+    _observer = nullptr;
     prune(0);
     assert(empty(&_in_use));
 
@@ -119,6 +147,12 @@ void NAT::prune(int timeout) {
         if (now - node->use >= timeout) {
             remove(node);
             append(&_nat, node);
+            --_used;
+            VPN_PROBE3(nat__expire, node->new_port, node->session,
+                    static_cast<long>(now - node->use));
+            if (_observer) {
+                _observer(*node, false);
+            }
         }
         node = next;
     }
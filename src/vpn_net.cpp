@@ -2,6 +2,7 @@
 
 #include <netinet/in.h>
 #include <assert.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -18,8 +19,133 @@ TCP::TCP(char *data) : _tcp(reinterpret_cast<struct tcphdr*>(data)) {  }
 UDP::UDP(char *data) : _udp(reinterpret_cast<struct udphdr*>(data)) {  }
 ICMP::ICMP(char *data) : _icmp(reinterpret_cast<struct icmphdr*>(data)) {  }
 
+Addr::Addr(int af, const void *raw) : family(af), bytes() {
+    memcpy(bytes, raw, size());
+}
+
+Addr Addr::parse(const std::string& text) {
+    Addr addr;
+    if (inet_pton(AF_INET, text.c_str(), addr.bytes) == 1) {
+        addr.family = AF_INET;
+    } else if (inet_pton(AF_INET6, text.c_str(), addr.bytes) == 1) {
+        addr.family = AF_INET6;
+    }
+    return addr;
+}
+
+std::string Addr::to_string() const {
+    char buf[INET6_ADDRSTRLEN];
+    if (family == 0 || inet_ntop(family, bytes, buf, sizeof(buf)) == nullptr) {
+        return "";
+    }
+    return buf;
+}
+
+bool Addr::operator==(const Addr& other) const {
+    return family == other.family && memcmp(bytes, other.bytes, size()) == 0;
+}
+
+size_t AddrHash::operator()(const Addr& addr) const {
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    for (int i = 0; i < addr.size(); ++i) {
+        h = (h ^ addr.bytes[i]) * 16777619U;
+    }
+    return h;
+}
+
+/* IPv6 extension headers(RFC 8200) */
+static const uint8_t EXT_HOP = 0;
+static const uint8_t EXT_ROUTING = 43;
+static const uint8_t EXT_FRAGMENT = 44;
+static const uint8_t EXT_AH = 51;
+static const uint8_t EXT_DEST = 60;
+/* More are taken as an attack */
+static const int MAX_EXTS = 8;
+static const uint16_t IP6_FRAG_OFFSET = 0xfff8;
+static const uint16_t IP6_FRAG_MF = 0x0001;
+
+/* Where the headers of a packet end */
+struct Layout {
+    uint8_t   protocol;
+    int       l4;
+    bool      fragment;
+    int       offset;
+    uint32_t  id;
+    /* Of the IPv6 fragment header, -1 if none */
+    int       id_at;
+};
+
+/* Walk the IP header and IPv6 extension headers within size, return
+ * false if they don't fit. The transport header is not checked. */
+static bool walk(const uint8_t *p, int size, Layout *out) {
+    if (size < 1) {
+        return false;
+    }
+    out->fragment = false;
+    out->offset = 0;
+    out->id = 0;
+    out->id_at = -1;
+    if ((p[0] >> 4) == 4) {
+        const struct iphdr *ip = reinterpret_cast<const struct iphdr*>(p);
+        int ihl = ip->ihl * 4;
+        if (static_cast<size_t>(size) < sizeof(struct iphdr)
+                || ihl < static_cast<int>(sizeof(struct iphdr)) || ihl > size) {
+            return false;
+        }
+        uint16_t frag = ntohs(ip->frag_off);
+        out->protocol = ip->protocol;
+        out->l4 = ihl;
+        out->fragment = (frag & (IP_FRAG_MF | IP_FRAG_OFFSET)) != 0;
+        out->offset = (frag & IP_FRAG_OFFSET) * 8;
+        out->id = ntohs(ip->id);
+        return true;
+    }
+    if ((p[0] >> 4) != 6 || static_cast<size_t>(size) < sizeof(struct ipv6hdr)) {
+        return false;
+    }
+
+    uint8_t next = reinterpret_cast<const struct ipv6hdr*>(p)->nexthdr;
+    int pos = sizeof(struct ipv6hdr);
+    for (int i = 0; i <= MAX_EXTS; ++i) {
+        if (next != EXT_HOP && next != EXT_ROUTING && next != EXT_FRAGMENT
+                && next != EXT_AH && next != EXT_DEST) {
+            out->protocol = next;
+            out->l4 = pos;
+            return true;
+        }
+        if (pos + 8 > size) {
+            return false;
+        }
+        uint8_t type = next;
+        next = p[pos];
+        if (type == EXT_FRAGMENT) {
+            uint16_t frag = (p[pos + 2] << 8) | p[pos + 3];
+            /* An atomic fragment(RFC 6946) is a whole packet */
+            out->fragment = (frag & (IP6_FRAG_OFFSET | IP6_FRAG_MF)) != 0;
+            out->offset = frag & IP6_FRAG_OFFSET;
+            out->id = (p[pos + 4] << 24) | (p[pos + 5] << 16) | (p[pos + 6] << 8) | p[pos + 7];
+            out->id_at = pos + 4;
+            pos += 8;
+            if (out->offset > 0) {
+                /* Later headers are in the first fragment */
+                out->protocol = next;
+                out->l4 = pos;
+                return true;
+            }
+        } else if (type == EXT_AH) {
+            pos += (p[pos + 1] + 2) * 4;
+        } else {
+            pos += (p[pos + 1] + 1) * 8;
+        }
+    }
+    return false;
+}
+
 IP::IP(char *data, int size, Memory option)
-    : _ip(nullptr), _option(option), _inner(nullptr), _data(nullptr), _size(size) {
+    : _ip(nullptr), _ip6(nullptr), _option(option), _inner(nullptr), _data(nullptr),
+    _size(size), _version(0), _protocol(P_NSY), _l4(0), _fragment(false), _offset(0),
+    _id(0), _id_at(-1), _tcp(nullptr), _udp(nullptr), _icmp(nullptr) {
     init(data, size, option);
 }
 
@@ -37,58 +163,124 @@ void IP::init(char *data, int size, Memory option) {
     }
 
     _ip = reinterpret_cast<struct iphdr*>(_data);
+    _ip6 = reinterpret_cast<struct ipv6hdr*>(_data);
+    _version = _ip->version;
 
-    if (protocol() == P_TCP) {
-        _inner = new TCP(_data + sizeof(struct iphdr));
-    } else if (protocol() == P_UDP) {
-        _inner = new UDP(_data + sizeof(struct iphdr));
-    } else if (protocol() == P_ICMP) {
-        _inner = new ICMP(_data + sizeof(struct iphdr));
+    Layout layout;
+    assert(walk(reinterpret_cast<const uint8_t*>(_data), size, &layout));
+    _l4 = layout.l4;
+    _fragment = layout.fragment;
+    _offset = layout.offset;
+    _id = layout.id;
+    _id_at = layout.id_at;
+    if (layout.protocol == IPPROTO_TCP) {
+        _protocol = P_TCP;
+    } else if (layout.protocol == IPPROTO_UDP) {
+        _protocol = P_UDP;
+    } else if (layout.protocol == IPPROTO_ICMP && _version == 4) {
+        _protocol = P_ICMP;
+    } else if (layout.protocol == IPPROTO_ICMPV6 && _version == 6) {
+        _protocol = P_ICMP6;
     }
+
+    char *trans = _data + _l4;
+    if (_offset > 0) {
+        /* No transport header */
+    } else if (_protocol == P_TCP && size >= _l4 + static_cast<int>(sizeof(struct tcphdr))) {
+        _tcp.attach(trans);
+        _inner = &_tcp;
+    } else if (_protocol == P_UDP && size >= _l4 + static_cast<int>(sizeof(struct udphdr))) {
+        _udp.attach(trans);
+        _inner = &_udp;
+    } else if ((_protocol == P_ICMP || _protocol == P_ICMP6)
+            && size >= _l4 + static_cast<int>(sizeof(struct icmphdr))) {
+        _icmp.attach(trans);
+        _inner = &_icmp;
+    }
+    pseudo_words(_origin);
+}
+
+bool IP::valid(const char *data, int size) {
+    if (data == nullptr || static_cast<size_t>(size) < sizeof(struct iphdr)) {
+        return false;
+    }
+    int length;
+    if ((data[0] >> 4) == 4) {
+        length = ntohs(reinterpret_cast<const struct iphdr*>(data)->tot_len);
+    } else {
+        /* 0 is a jumbogram, never seen on tun */
+        length = sizeof(struct ipv6hdr) + ntohs(reinterpret_cast<const struct ipv6hdr*>(data)->payload_len);
+    }
+    Layout layout;
+    return length <= size && walk(reinterpret_cast<const uint8_t*>(data), length, &layout)
+        && layout.l4 <= length;
 }
 
 IP::~IP() {
-    switch (_option) {
-        case ALLOC:
-            free(_data);
-            FALLTHROUGH_INTENDED;
-        default:
-            if (_inner) {
-                delete _inner;
-            }
-            break;
+    if (_option == ALLOC) {
+        free(_data);
     }
 }
 
 std::string IP::saddr() {
-    char buf[32];
-    inet_ntop(AF_INET, &_ip->saddr, buf, sizeof(buf));
-    return buf;
+    return src().to_string();
 }
 
 std::string IP::daddr() {
-    char buf[32];
-    inet_ntop(AF_INET, &_ip->daddr, buf, sizeof(buf));
-    return buf;
+    return dst().to_string();
 }
 
 void IP::set_saddr(const std::string& addr) {
-    inet_pton(AF_INET, addr.c_str(), &_ip->saddr);
+    set_src(Addr::parse(addr));
 }
 
 void IP::set_daddr(const std::string& addr) {
-    inet_pton(AF_INET, addr.c_str(), &_ip->daddr);
+    set_dst(Addr::parse(addr));
+}
+
+Addr IP::src() {
+    return _version == 6 ? Addr(AF_INET6, &_ip6->saddr) : Addr(AF_INET, &_ip->saddr);
+}
+
+Addr IP::dst() {
+    return _version == 6 ? Addr(AF_INET6, &_ip6->daddr) : Addr(AF_INET, &_ip->daddr);
 }
 
-Protocol IP::protocol() {
-    if (_ip->protocol == IPPROTO_TCP) {
-        return P_TCP;
-    } else if (_ip->protocol == IPPROTO_UDP) {
-        return P_UDP;
-    } else if (_ip->protocol == IPPROTO_ICMP) {
-        return P_ICMP;
+void IP::set_src(const Addr& addr) {
+    assert(addr.family == (_version == 6 ? AF_INET6 : AF_INET));
+    memcpy(_version == 6 ? static_cast<void*>(&_ip6->saddr) : &_ip->saddr, addr.bytes, addr.size());
+}
+
+void IP::set_dst(const Addr& addr) {
+    assert(addr.family == (_version == 6 ? AF_INET6 : AF_INET));
+    memcpy(_version == 6 ? static_cast<void*>(&_ip6->daddr) : &_ip->daddr, addr.bytes, addr.size());
+}
+
+/* The traffic class straddles the first two bytes of IPv6 */
+int IP::ecn() {
+    if (_version == 6) {
+        return (reinterpret_cast<uint8_t*>(_data)[1] >> 4) & 0x3;
+    }
+    return _ip->tos & 0x3;
+}
+
+void IP::set_ecn(int ecn) {
+    if (_version == 6) {
+        uint8_t *p = reinterpret_cast<uint8_t*>(_data);
+        p[1] = (p[1] & ~0x30) | ((ecn & 0x3) << 4);
+        return;
     }
-    return P_NSY;
+    _ip->tos = (_ip->tos & ~0x3) | (ecn & 0x3);
+}
+
+void IP::set_id(uint32_t id) {
+    if (_version == 4) {
+        _ip->id = htons(static_cast<uint16_t>(id));
+    } else if (_id_at >= 0) {
+        uint32_t be = htonl(id);
+        memcpy(_data + _id_at, &be, sizeof(be));
+    }
+    _id = id;
 }
 
 /* For UDP/TCP compute checksum */
@@ -135,7 +327,7 @@ void TCP::calc_checksum(const struct iphdr *ip) {
      * | PseudoHeader | TCP Header | TCP Data |
      * ----------------------------------------
      * */
-    int tot_len = sizeof(PseudoHeader) + ntohs(ip->tot_len) - sizeof(struct iphdr);
+    int tot_len = sizeof(PseudoHeader) + ntohs(ip->tot_len) - ip->ihl * 4;
     PseudoHeaderPtr tcp_header(reinterpret_cast<PseudoHeader*>(malloc(tot_len)));
     tcp_header->saddr = ip->saddr;
     tcp_header->daddr = ip->daddr;
@@ -155,12 +347,12 @@ void UDP::calc_checksum(const struct iphdr *ip) {
      * | PseudoHeader | UDP Header | UDP Data |
      * ----------------------------------------
      * */
-    int tot_len = sizeof(PseudoHeader) + ntohs(ip->tot_len) - sizeof(struct iphdr);
+    int tot_len = sizeof(PseudoHeader) + ntohs(ip->tot_len) - ip->ihl * 4;
     PseudoHeaderPtr udp_header(reinterpret_cast<PseudoHeader*>(malloc(tot_len)));
     udp_header->saddr = ip->saddr;
     udp_header->daddr = ip->daddr;
     udp_header->zero = 0;
-    udp_header->protocol = IPPROTO_TCP;
+    udp_header->protocol = IPPROTO_UDP;
     udp_header->tot_len = htons(tot_len - sizeof(PseudoHeader));
     memcpy(udp_header->origin, _udp, tot_len - sizeof(PseudoHeader));
 
@@ -169,20 +361,281 @@ void UDP::calc_checksum(const struct iphdr *ip) {
 
 void ICMP::calc_checksum(const struct iphdr *ip) {
     _icmp->checksum = 0;
-    _icmp->checksum = __checksum(_icmp, ntohs(ip->tot_len) - sizeof(struct iphdr));
+    _icmp->checksum = __checksum(_icmp, ntohs(ip->tot_len) - ip->ihl * 4);
 }
 
 void IP::calc_checksum() {
+    if (_version == 6) {
+        return;
+    }
     _ip->check = 0;
-    _ip->check = __checksum(_ip, sizeof(struct iphdr));
+    _ip->check = __checksum(_ip, _l4);
+}
+
+/* RFC 1624 eqn. 3, words as they lie in the packet */
+static uint16_t checksum_replace(uint16_t check, uint16_t old_word, uint16_t new_word) {
+    uint32_t sum = static_cast<uint16_t>(~check) + static_cast<uint16_t>(~old_word) + new_word;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+/* The same for the words that changed, any alignment */
+static void replace_words(void *check, const void *before, const void *after, int words) {
+    uint16_t sum;
+    memcpy(&sum, check, sizeof(sum));
+    for (int i = 0; i < words; ++i) {
+        uint16_t old_word, new_word;
+        memcpy(&old_word, static_cast<const char*>(before) + i * 2, 2);
+        memcpy(&new_word, static_cast<const char*>(after) + i * 2, 2);
+        if (old_word != new_word) {
+            sum = checksum_replace(sum, old_word, new_word);
+        }
+    }
+    memcpy(check, &sum, sizeof(sum));
+}
+
+void IP::pseudo_words(uint16_t *words) {
+    memset(words, 0, PSEUDO_WORDS * 2);
+    if (_version == 6) {
+        memcpy(words, &_ip6->saddr, 16);
+        memcpy(words + 8, &_ip6->daddr, 16);
+    } else {
+        memcpy(words, &_ip->saddr, 4);
+        memcpy(words + 8, &_ip->daddr, 4);
+    }
+    if (_inner != nullptr && (_protocol == P_TCP || _protocol == P_UDP)) {
+        memcpy(words + 16, _data + _l4, 4);
+    }
+}
+
+void IP::update_checksum() {
+    char *check;
+    if (_protocol == P_TCP) {
+        check = _data + _l4 + offsetof(struct tcphdr, check);
+    } else if (_protocol == P_UDP) {
+        check = _data + _l4 + offsetof(struct udphdr, check);
+        if (check[0] == 0 && check[1] == 0) {
+            /* Not computed by the sender */
+            return;
+        }
+    } else if (_protocol == P_ICMP6) {
+        check = _data + _l4 + offsetof(struct icmphdr, checksum);
+    } else {
+        /* ICMP has no pseudo header and nothing else is translated */
+        return;
+    }
+    uint16_t words[PSEUDO_WORDS];
+    pseudo_words(words);
+    replace_words(check, _origin, words, PSEUDO_WORDS);
+    if (_protocol == P_UDP && check[0] == 0 && check[1] == 0) {
+        /* 0 would say there is none */
+        check[0] = check[1] = static_cast<char>(0xff);
+    }
+    memcpy(_origin, words, sizeof(words));
 }
 
 const char* IP::raw_data() {
-    if (_inner) {
+    if (_inner && _protocol != P_ICMP) {
+        update_checksum();
+    } else if (_inner && !_fragment) {
         _inner->calc_checksum(_ip);
     }
     calc_checksum();
     return _data;
 }
 
+/* TCP options */
+static const uint8_t OPT_EOL = 0;
+static const uint8_t OPT_NOP = 1;
+static const uint8_t OPT_MSS = 2;
+static const uint8_t OPT_MSS_LEN = 4;
+
+bool clamp_mss(char *packet, int size, int mss) {
+    Layout layout;
+    /* Options are only in the first fragment */
+    if (!walk(reinterpret_cast<const uint8_t*>(packet), size, &layout)
+            || layout.protocol != IPPROTO_TCP || layout.offset != 0
+            || static_cast<size_t>(size) < layout.l4 + sizeof(struct tcphdr)) {
+        return false;
+    }
+    if ((packet[0] >> 4) == 6) {
+        mss -= sizeof(struct ipv6hdr) - sizeof(struct iphdr);
+    }
+    uint8_t *tcp = reinterpret_cast<uint8_t*>(packet) + layout.l4;
+    struct tcphdr *hdr = reinterpret_cast<struct tcphdr*>(tcp);
+    int doff = hdr->doff * 4;
+    if (!hdr->syn || doff < static_cast<int>(sizeof(struct tcphdr)) || layout.l4 + doff > size) {
+        return false;
+    }
+
+    int pos = sizeof(struct tcphdr);
+    while (pos < doff) {
+        uint8_t kind = tcp[pos];
+        if (kind == OPT_EOL) {
+            break;
+        }
+        if (kind == OPT_NOP) {
+            ++pos;
+            continue;
+        }
+        if (pos + 1 >= doff || tcp[pos + 1] < 2 || pos + tcp[pos + 1] > doff) {
+            return false;
+        }
+        if (kind != OPT_MSS || tcp[pos + 1] != OPT_MSS_LEN) {
+            pos += tcp[pos + 1];
+            continue;
+        }
+
+        int value = pos + 2;
+        if (((tcp[value] << 8) | tcp[value + 1]) <= mss) {
+            return false;
+        }
+        /* The checksum words the value touches, two if it is not aligned */
+        int first = value & ~1;
+        int words = (value & 1) ? 2 : 1;
+        uint16_t before[2];
+        memcpy(before, tcp + first, words * 2);
+        tcp[value] = static_cast<uint8_t>(mss >> 8);
+        tcp[value + 1] = static_cast<uint8_t>(mss & 0xff);
+        uint16_t after[2];
+        memcpy(after, tcp + first, words * 2);
+        for (int i = 0; i < words; ++i) {
+            hdr->check = checksum_replace(hdr->check, before[i], after[i]);
+        }
+        return true;
+    }
+    return false;
+}
+
+/* ICMPv6 errors(RFC 4443) */
+static const uint8_t ICMP6_DEST_UNREACH = 1;
+static const uint8_t ICMP6_PARAM_PROB = 4;
+
+bool flow_tuple(const char *packet, int size, FlowTuple *tuple) {
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(packet);
+    Layout layout;
+    if (!walk(p, size, &layout)) {
+        return false;
+    }
+    tuple->version = p[0] >> 4;
+    tuple->protocol = layout.protocol;
+    if (tuple->version == 4) {
+        tuple->src = Addr(AF_INET, p + offsetof(struct iphdr, saddr));
+        tuple->dst = Addr(AF_INET, p + offsetof(struct iphdr, daddr));
+    } else {
+        tuple->src = Addr(AF_INET6, p + offsetof(struct ipv6hdr, saddr));
+        tuple->dst = Addr(AF_INET6, p + offsetof(struct ipv6hdr, daddr));
+    }
+    tuple->sport = 0;
+    tuple->dport = 0;
+    if ((layout.protocol == IPPROTO_TCP || layout.protocol == IPPROTO_UDP)
+            && layout.offset == 0 && layout.l4 + 4 <= size) {
+        tuple->sport = (p[layout.l4] << 8) | p[layout.l4 + 1];
+        tuple->dport = (p[layout.l4 + 2] << 8) | p[layout.l4 + 3];
+    }
+    return true;
+}
+
+bool icmp_quote(char *packet, int size, Quote *quote) {
+    Layout layout;
+    if (!walk(reinterpret_cast<const uint8_t*>(packet), size, &layout) || layout.fragment
+            || static_cast<size_t>(size) < layout.l4 + sizeof(struct icmphdr)) {
+        return false;
+    }
+    struct icmphdr *icmp = reinterpret_cast<struct icmphdr*>(packet + layout.l4);
+    int version = packet[0] >> 4;
+    if (version == 4) {
+        if (layout.protocol != IPPROTO_ICMP || (icmp->type != ICMP_DEST_UNREACH
+                    && icmp->type != ICMP_TIME_EXCEEDED && icmp->type != ICMP_PARAMETERPROB)) {
+            return false;
+        }
+        quote->family = AF_INET;
+        quote->check = nullptr;
+    } else {
+        if (layout.protocol != IPPROTO_ICMPV6 || icmp->type < ICMP6_DEST_UNREACH
+                || icmp->type > ICMP6_PARAM_PROB) {
+            return false;
+        }
+        quote->family = AF_INET6;
+        quote->check = &icmp->checksum;
+    }
+
+    int offset = layout.l4 + sizeof(struct icmphdr);
+    const uint8_t *inner = reinterpret_cast<const uint8_t*>(packet + offset);
+    Layout quoted;
+    /* The quote is cut short, only its headers have to be there */
+    if (!walk(inner, size - offset, &quoted) || (inner[0] >> 4) != version
+            || quoted.offset != 0 || offset + quoted.l4 + 8 > size) {
+        return false;
+    }
+    quote->ip = packet + offset;
+    quote->trans = quote->ip + quoted.l4;
+    quote->protocol = quoted.protocol;
+    return true;
+}
+
+int quote_sport(const Quote& quote) {
+    if (quote.protocol != IPPROTO_TCP && quote.protocol != IPPROTO_UDP) {
+        return -1;
+    }
+    /* Ports lead both headers */
+    const uint8_t *trans = reinterpret_cast<const uint8_t*>(quote.trans);
+    return (trans[0] << 8) | trans[1];
+}
+
+Addr quote_daddr(const Quote& quote) {
+    if (quote.family == AF_INET6) {
+        return Addr(AF_INET6, &reinterpret_cast<const struct ipv6hdr*>(quote.ip)->daddr);
+    }
+    return Addr(AF_INET, &reinterpret_cast<const struct iphdr*>(quote.ip)->daddr);
+}
+
+void set_quote_source(Quote *quote, const Addr& addr, int port) {
+    assert(addr.family == quote->family);
+    /* Source address and port as they lie, then the UDP checksum */
+    char *saddr;
+    if (quote->family == AF_INET6) {
+        saddr = reinterpret_cast<char*>(&reinterpret_cast<struct ipv6hdr*>(quote->ip)->saddr);
+    } else {
+        saddr = reinterpret_cast<char*>(&reinterpret_cast<struct iphdr*>(quote->ip)->saddr);
+    }
+    int addr_words = addr.size() / 2;
+    uint16_t before[10];
+    uint16_t after[10];
+    memcpy(before, saddr, addr.size());
+    memcpy(saddr, addr.bytes, addr.size());
+    memcpy(after, saddr, addr.size());
+    if (quote->family == AF_INET) {
+        struct iphdr *ip = reinterpret_cast<struct iphdr*>(quote->ip);
+        replace_words(&ip->check, before, after, addr_words);
+    }
+    if (quote->check != nullptr) {
+        replace_words(quote->check, before, after, addr_words);
+    }
+    if (quote_sport(*quote) < 0) {
+        return;
+    }
+
+    char *trans = quote->trans;
+    memcpy(&before[addr_words], trans, 2);
+    after[addr_words] = htons(static_cast<uint16_t>(port));
+    memcpy(trans, &after[addr_words], 2);
+    if (quote->check != nullptr) {
+        replace_words(quote->check, &before[addr_words], &after[addr_words], 1);
+    }
+    /* Only UDP has its checksum within the 8 quoted bytes, which covers
+     * the pseudo header address too. 0 means none. */
+    if (quote->protocol == IPPROTO_UDP) {
+        struct udphdr *udp = reinterpret_cast<struct udphdr*>(trans);
+        if (udp->check != 0) {
+            uint16_t old_check = udp->check;
+            replace_words(&udp->check, before, after, addr_words + 1);
+            if (quote->check != nullptr) {
+                replace_words(quote->check, &old_check, &udp->check, 1);
+            }
+        }
+    }
+}
+
 } /* namespace vpn */
@@ -0,0 +1,408 @@
+#include "vpn_path.h"
+
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <stdio.h>
+
+namespace vpn {
+
+/* Before the first sample, and the floor of the probe timeout */
+static const uint64_t INITIAL_RTT = 100000000ULL;
+static const uint64_t MIN_PROBE_TIMEOUT = 1000000000ULL;
+static const double LOSS_GAIN = 0.125;
+
+PathStats::PathStats()
+    : _srtt(0), _rttvar(0), _jitter(0), _last_rtt(0), _loss(0.0), _misses(0), _sent(0), _replied(0) {
+    memset(_pending_id, 0, sizeof(_pending_id));
+    memset(_pending_at, 0, sizeof(_pending_at));
+}
+
+uint64_t PathStats::timeout() const {
+    uint64_t rto = _srtt ? _srtt + 4 * _rttvar : INITIAL_RTT;
+    return rto > MIN_PROBE_TIMEOUT ? rto : MIN_PROBE_TIMEOUT;
+}
+
+void PathStats::on_probe_sent(uint32_t id, uint64_t now) {
+    int slot = id % PENDING;
+    if (_pending_at[slot]) {
+        /* Overwritten before any reply */
+        _loss += LOSS_GAIN * (1.0 - _loss);
+        ++_misses;
+    }
+    _pending_id[slot] = id;
+    _pending_at[slot] = now;
+    ++_sent;
+}
+
+void PathStats::on_probe_reply(uint32_t id, uint64_t sent, uint64_t now) {
+    int slot = id % PENDING;
+    if (_pending_id[slot] != id || _pending_at[slot] == 0 || now < sent) {
+        /* Late or duplicated */
+        return;
+    }
+    _pending_at[slot] = 0;
+    ++_replied;
+    _misses = 0;
+    _loss -= LOSS_GAIN * _loss;
+
+    uint64_t rtt = now - sent;
+    if (_last_rtt) {
+        uint64_t d = rtt > _last_rtt ? rtt - _last_rtt : _last_rtt - rtt;
+        _jitter = (15 * _jitter + d) / 16;
+    }
+    _last_rtt = rtt;
+    if (_srtt == 0) {
+        _srtt = rtt;
+        _rttvar = rtt / 2;
+    } else {
+        uint64_t err = rtt > _srtt ? rtt - _srtt : _srtt - rtt;
+        _rttvar = (3 * _rttvar + err) / 4;
+        _srtt = (7 * _srtt + rtt) / 8;
+    }
+}
+
+void PathStats::tick(uint64_t now) {
+    uint64_t limit = timeout();
+    for (int i = 0; i < PENDING; ++i) {
+        if (_pending_at[i] && now - _pending_at[i] > limit) {
+            _pending_at[i] = 0;
+            _loss += LOSS_GAIN * (1.0 - _loss);
+            ++_misses;
+        }
+    }
+}
+
+double PathStats::weight() const {
+    if (!up()) {
+        return 0.0;
+    }
+    /* Roughly the rate a window-limited flow gets: (1 - loss) / rtt */
+    double rtt = static_cast<double>(_srtt ? _srtt : INITIAL_RTT) / 1e6;
+    return (1.0 - _loss) / (rtt > 0.05 ? rtt : 0.05);
+}
+
+std::string PathStats::to_string() const {
+    char buf[192];
+    snprintf(buf, sizeof(buf),
+            "srtt %.3fms rttvar %.3fms jitter %.3fms loss %.2f%% probes %llu/%llu %s",
+            _srtt / 1e6, _rttvar / 1e6, _jitter / 1e6, _loss * 100,
+            static_cast<unsigned long long>(_replied),
+            static_cast<unsigned long long>(_sent), up() ? "up" : "down");
+    return buf;
+}
+
+/* A lost probe costs this much, and a settled search starts over after
+ * RESEARCH(RFC 8899 PMTU_RAISE_TIMER) */
+static const uint64_t MTU_PROBE_TIMEOUT = 500000000ULL;
+static const uint64_t MTU_RESEARCH = 600000000000ULL;
+
+MtuProber::MtuProber(int least, int most)
+    : _least(least), _most(most), _confirmed(false), _low(least), _high(most + 1),
+    _size(0), _tries(0), _sent_at(0), _settled_at(0) {  }
+
+int MtuProber::next(uint64_t now) {
+    if (_size > 0) {
+        if (now - _sent_at < MTU_PROBE_TIMEOUT) {
+            return 0;
+        }
+        if (++_tries >= MAX_TRIES) {
+            _high = _size;
+            _size = 0;
+            if (settled()) {
+                _settled_at = now;
+            }
+        }
+    }
+    if (_size == 0) {
+        if (settled()) {
+            if (now - _settled_at < MTU_RESEARCH) {
+                return 0;
+            }
+            /* Only larger sizes, _low is still good as far as we know */
+            _high = _most + 1;
+        }
+        _size = _high > _most ? _most : (_low + _high) / 2;
+        _tries = 0;
+    }
+    _sent_at = now;
+    return _size;
+}
+
+void MtuProber::on_reply(int size) {
+    if (size < _least || size > _most) {
+        return;
+    }
+    _confirmed = true;
+    if (size > _low) {
+        _low = size;
+    }
+    if (_high <= _low) {
+        _high = _most + 1;
+    }
+    if (size == _size) {
+        _size = 0;
+        if (settled()) {
+            /* The timer of the last probe is as good as now */
+            _settled_at = _sent_at;
+        }
+    }
+}
+
+std::string MtuProber::to_string() const {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "mtu %d(%s, %d..%d)", mtu(),
+            settled() ? "settled" : "searching", _low, _high - 1);
+    return buf;
+}
+
+Scheduler::Scheduler(Mode mode, int paths)
+    : _mode(mode), _weight(paths, 1.0), _current(paths, 0.0) {  }
+
+void Scheduler::update(const std::vector<PathStats>& stats) {
+    bool any = false;
+    for (size_t i = 0; i < stats.size() && i < _weight.size(); ++i) {
+        _weight[i] = stats[i].weight();
+        any = any || _weight[i] > 0;
+    }
+    if (!any) {
+        /* Everything looks down, keep trying all of them */
+        for (double& w : _weight) {
+            w = 1.0;
+        }
+    }
+}
+
+int Scheduler::pick(uint32_t flow) {
+    int n = _weight.size();
+    if (n == 1) {
+        return 0;
+    }
+
+    double total = 0;
+    for (int i = 0; i < n; ++i) {
+        total += _weight[i];
+    }
+
+    if (_mode == FLOW) {
+        double point = (flow % 10007) / 10007.0 * total;
+        for (int i = 0; i < n; ++i) {
+            if (point < _weight[i]) {
+                return i;
+            }
+            point -= _weight[i];
+        }
+        return n - 1;
+    }
+
+    /* nginx's smooth weighted round robin */
+    int best = 0;
+    for (int i = 0; i < n; ++i) {
+        _current[i] += _weight[i];
+        if (_current[i] > _current[best]) {
+            best = i;
+        }
+    }
+    _current[best] -= total;
+    return best;
+}
+
+/* FNV-1a */
+static uint32_t fnv(uint32_t h, const void *data, size_t size) {
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
+}
+
+uint32_t flow_hash(const char *packet, int size) {
+    if (static_cast<size_t>(size) < sizeof(struct iphdr)) {
+        return 0;
+    }
+    const struct iphdr *ip = reinterpret_cast<const struct iphdr*>(packet);
+    uint32_t ports = 0;
+    if (ip->version == 6) {
+        if (static_cast<size_t>(size) < sizeof(struct ipv6hdr)) {
+            return 0;
+        }
+        /* Ports only right after the header, fragments and other
+         * extension headers leave them out */
+        const struct ipv6hdr *ip6 = reinterpret_cast<const struct ipv6hdr*>(packet);
+        int l4 = sizeof(struct ipv6hdr);
+        if ((ip6->nexthdr == IPPROTO_TCP || ip6->nexthdr == IPPROTO_UDP) && size >= l4 + 4) {
+            memcpy(&ports, packet + l4, sizeof(ports));
+        }
+        uint32_t h = fnv(2166136261U, &ip6->saddr, 32);
+        uint32_t words[2] = {ports, ip6->nexthdr};
+        return fnv(h, words, sizeof(words));
+    }
+    if (ip->version != 4) {
+        return 0;
+    }
+
+    /* Fragments of a datagram hash alike, only the first one has ports */
+    int ihl = ip->ihl * 4;
+    if ((ip->protocol == IPPROTO_TCP || ip->protocol == IPPROTO_UDP)
+            && size >= ihl + 4 && !(ntohs(ip->frag_off) & 0x3fff)) {
+        memcpy(&ports, packet + ihl, sizeof(ports));
+    }
+
+    /* Over the 5-tuple */
+    uint32_t words[4] = {ip->saddr, ip->daddr, ports, ip->protocol};
+    return fnv(2166136261U, words, sizeof(words));
+}
+
+ReorderBuffer::ReorderBuffer(int delay_ms)
+    : _slots(WINDOW), _started(false), _next(0), _buffered(0),
+    _delay(delay_ms * 1000000ULL), _force(0), _has_pending(false), _pending(),
+    _reordered(0), _skipped(0), _late(0) {
+    for (Slot& slot : _slots) {
+        slot.used = false;
+    }
+    memset(_path_high, 0, sizeof(_path_high));
+    memset(_path_seen, 0, sizeof(_path_seen));
+}
+
+bool ReorderBuffer::push(uint32_t seq, int path, const char *packet, int size,
+        uint64_t now) {
+    if (!_started) {
+        _started = true;
+        _next = seq;
+        _force = seq;
+    }
+
+    if (path >= 0) {
+        path %= PATHS;
+        if (_path_seen[path] == 0 || static_cast<int32_t>(seq - _path_high[path]) > 0) {
+            _path_high[path] = seq;
+        }
+        _path_seen[path] = now;
+    }
+
+    int32_t d = static_cast<int32_t>(seq - _next);
+    if (d < 0) {
+        /* Its gap has been given up, or a duplicate */
+        ++_late;
+        return true;
+    }
+    if (d == 0 && _buffered == 0) {
+        ++_next;
+        _force = _next;
+        return true;
+    }
+
+    ++_reordered;
+    Slot slot;
+    slot.used = true;
+    slot.seq = seq;
+    slot.arrived = now;
+    slot.data.assign(packet, size);
+
+    if (d >= WINDOW) {
+        /* Its slot is taken by older packets, release them first */
+        _force = seq - WINDOW + 1;
+        _pending.seq = seq;
+        _pending.arrived = now;
+        _pending.data.swap(slot.data);
+        _has_pending = true;
+        return false;
+    }
+    if (_slots[seq % WINDOW].used) {
+        /* Duplicate */
+        return false;
+    }
+    store(slot);
+    if (passed(now)) {
+        skip_gap();
+    }
+    return false;
+}
+
+bool ReorderBuffer::passed(uint64_t now) const {
+    for (int i = 0; i < PATHS; ++i) {
+        if (_path_seen[i] && now - _path_seen[i] < _delay
+                && static_cast<int32_t>(_path_high[i] - _next) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ReorderBuffer::skip_gap() {
+    for (int i = 1; i < WINDOW; ++i) {
+        const Slot& slot = _slots[(_next + i) % WINDOW];
+        if (slot.used && slot.seq == _next + i) {
+            /* take() releases from here on */
+            _force = slot.seq;
+            return;
+        }
+    }
+}
+
+void ReorderBuffer::store(const Slot& slot) {
+    Slot& s = _slots[slot.seq % WINDOW];
+    s.used = true;
+    s.seq = slot.seq;
+    s.arrived = slot.arrived;
+    s.data.assign(slot.data);
+    ++_buffered;
+}
+
+int ReorderBuffer::take(char *out, int cap) {
+    for ( ; ; ) {
+        Slot& slot = _slots[_next % WINDOW];
+        bool forced = static_cast<int32_t>(_force - _next) > 0;
+
+        if (slot.used && slot.seq == _next) {
+            slot.used = false;
+            --_buffered;
+            ++_next;
+            int size = slot.data.size();
+            if (size > cap) {
+                continue;
+            }
+            memcpy(out, slot.data.data(), size);
+            return size;
+        }
+        if (forced) {
+            ++_skipped;
+            ++_next;
+            continue;
+        }
+        if (_has_pending) {
+            _has_pending = false;
+            _pending.used = true;
+            if (_pending.seq == _next) {
+                ++_next;
+                int size = _pending.data.size();
+                if (size > cap) {
+                    continue;
+                }
+                memcpy(out, _pending.data.data(), size);
+                return size;
+            }
+            store(_pending);
+            continue;
+        }
+        return -1;
+    }
+}
+
+void ReorderBuffer::tick(uint64_t now) {
+    if (_buffered == 0) {
+        return;
+    }
+    for (int i = 1; i < WINDOW; ++i) {
+        const Slot& slot = _slots[(_next + i) % WINDOW];
+        if (slot.used && slot.seq == _next + i) {
+            if (now - slot.arrived >= _delay || passed(now)) {
+                _force = slot.seq;
+            }
+            return;
+        }
+    }
+}
+
+} /* namespace vpn */
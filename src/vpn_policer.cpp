@@ -0,0 +1,137 @@
+#include "vpn_policer.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+namespace vpn {
+
+static const int64_t NS_PER_SEC = 1000000000LL;
+/* Of the achieved rate */
+static const uint64_t WINDOW = 100000000ULL;
+
+TokenBucket::TokenBucket()
+    : _rate(0), _depth(0), _fill(0), _tokens(0), _last(0),
+    _passed(0), _marked(0), _dropped(0) {  }
+
+void TokenBucket::set_rate(uint64_t rate, uint64_t depth) {
+    /* Twice the depth in byte-nanoseconds must fit */
+    assert(depth < static_cast<uint64_t>(INT64_MAX / NS_PER_SEC / 2));
+    _rate = rate;
+    _depth = static_cast<int64_t>(depth) * NS_PER_SEC;
+    _fill = rate > 0 ? 2 * _depth / rate : 0;
+    _tokens = _depth;
+    _last = 0;
+}
+
+void TokenBucket::refill(uint64_t now) {
+    uint64_t elapsed = now > _last ? now - _last : 0;
+    _last = now;
+    if (elapsed >= _fill) {
+        _tokens = _depth;
+    } else {
+        _tokens += static_cast<int64_t>(elapsed * _rate);
+        if (_tokens > _depth) {
+            _tokens = _depth;
+        }
+    }
+}
+
+TokenBucket::Verdict TokenBucket::take(int size, bool ecn, uint64_t now) {
+    if (_rate == 0) {
+        ++_passed;
+        return PASS;
+    }
+
+    refill(now);
+    int64_t cost = size * NS_PER_SEC;
+    if (_tokens >= cost) {
+        _tokens -= cost;
+        ++_passed;
+        return PASS;
+    }
+    if (ecn && _tokens + _depth >= cost) {
+        _tokens -= cost;
+        ++_marked;
+        return MARK;
+    }
+    ++_dropped;
+    return DROP;
+}
+
+bool TokenBucket::fits(int size, uint64_t now) {
+    if (_rate == 0) {
+        return true;
+    }
+    refill(now);
+    return _tokens >= size * NS_PER_SEC;
+}
+
+void TokenBucket::charge(int size) {
+    if (_rate > 0) {
+        _tokens -= size * NS_PER_SEC;
+    }
+    ++_passed;
+}
+
+std::string TokenBucket::to_string() const {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "rate %.1fMbit/s passed %llu marked %llu dropped %llu",
+            _rate * 8 / 1e6, static_cast<unsigned long long>(_passed),
+            static_cast<unsigned long long>(_marked),
+            static_cast<unsigned long long>(_dropped));
+    return buf;
+}
+
+Pacer::Pacer()
+    : _rate(0), _next(0), _window_start(0), _window_bytes(0), _achieved(0),
+    _last_at(0), _burst(0), _max_burst(0), _bursts(0), _packets(0), _dropped(0) {  }
+
+void Pacer::set_rate(uint64_t rate) {
+    _rate = rate;
+    _next = 0;
+}
+
+uint64_t Pacer::schedule(int size, uint64_t now) {
+    if (_rate == 0) {
+        return now;
+    }
+    uint64_t at = _next > now ? _next : now;
+    _next = at + size * NS_PER_SEC / _rate;
+    return at;
+}
+
+void Pacer::sent(int size, uint64_t at) {
+    uint64_t gap = _rate ? size * NS_PER_SEC / _rate / 2 : 0;
+    if (_packets > 0 && at >= _last_at && at - _last_at < gap) {
+        ++_burst;
+    } else {
+        _burst = 1;
+        ++_bursts;
+    }
+    if (_burst > _max_burst) {
+        _max_burst = _burst;
+    }
+    _last_at = at;
+    ++_packets;
+
+    if (at - _window_start >= WINDOW) {
+        if (_window_start) {
+            _achieved = _window_bytes * NS_PER_SEC / (at - _window_start);
+        }
+        _window_start = at;
+        _window_bytes = 0;
+    }
+    _window_bytes += size;
+}
+
+std::string Pacer::to_string() const {
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+            "rate %.1fMbit/s achieved %.1fMbit/s burst avg %.2f max %d dropped %llu",
+            _rate * 8 / 1e6, _achieved * 8 / 1e6,
+            _bursts ? static_cast<double>(_packets) / _bursts : 0.0, _max_burst,
+            static_cast<unsigned long long>(_dropped));
+    return buf;
+}
+
+} /* namespace vpn */
@@ -0,0 +1,180 @@
+#include "vpn_queue.h"
+
+#include <linux/ip.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+namespace vpn {
+
+/* Pure ACKs, DNS queries and keystrokes fit */
+static const int INTERACTIVE_SIZE = 128;
+/* CS5 */
+static const int INTERACTIVE_DSCP = 40;
+/* Longer than the loops polling the queue sleep, shorter than anyone notices */
+static const int BURST_MS = 5;
+static const int MIN_BURST = 4096;
+
+bool interactive(const char *packet, int size) {
+    if (static_cast<size_t>(size) < sizeof(struct iphdr)) {
+        return false;
+    }
+    const struct iphdr *ip = reinterpret_cast<const struct iphdr*>(packet);
+    int tos;
+    if (ip->version == 4) {
+        tos = ip->tos;
+    } else if (ip->version == 6) {
+        /* The traffic class straddles the first two bytes */
+        const uint8_t *p = reinterpret_cast<const uint8_t*>(packet);
+        tos = ((p[0] & 0xf) << 4) | (p[1] >> 4);
+    } else {
+        return false;
+    }
+    return size <= INTERACTIVE_SIZE || (tos >> 2) >= INTERACTIVE_DSCP;
+}
+
+FairQueue::FairQueue(int limit)
+    : _packets(limit), _free(), _buckets(FLOWS + 1), _active(), _limit(limit), _count(0),
+    _rate(), _enqueued(0), _prioritized(0), _dropped(0) {
+    assert(limit > 0);
+    for (int i = limit - 1; i >= 0; --i) {
+        _free.push_back(i);
+    }
+    for (Bucket& bucket : _buckets) {
+        bucket = Bucket{-1, -1, 0, 0, 0, false};
+    }
+}
+
+void FairQueue::set_rate(uint64_t rate) {
+    uint64_t depth = rate * BURST_MS / 1000;
+    _rate.set_rate(rate, depth > MIN_BURST ? depth : MIN_BURST);
+}
+
+void FairQueue::push(uint32_t flow, bool priority, uint32_t owner, uint64_t tag,
+        const char *packet, int size) {
+    if (_count == _limit) {
+        drop();
+    }
+
+    int index = FLOWS;
+    if (!priority || _buckets[FLOWS].count >= PRIORITY_LIMIT) {
+        index = flow % FLOWS;
+    } else {
+        ++_prioritized;
+    }
+
+    int slot = _free.back();
+    _free.pop_back();
+    Packet& p = _packets[slot];
+    p.data.assign(packet, size);
+    p.flow = flow;
+    p.owner = owner;
+    p.tag = tag;
+    p.next = -1;
+
+    Bucket& bucket = _buckets[index];
+    if (bucket.count == 0) {
+        bucket.head = slot;
+    } else {
+        _packets[bucket.tail].next = slot;
+    }
+    bucket.tail = slot;
+    ++bucket.count;
+    bucket.bytes += size;
+    if (index != FLOWS && !bucket.active) {
+        bucket.active = true;
+        bucket.deficit = QUANTUM;
+        _active.push_back(index);
+    }
+    ++_count;
+    ++_enqueued;
+}
+
+int FairQueue::unlink(int index) {
+    Bucket& bucket = _buckets[index];
+    int slot = bucket.head;
+    bucket.head = _packets[slot].next;
+    --bucket.count;
+    bucket.bytes -= _packets[slot].data.size();
+    --_count;
+    return slot;
+}
+
+void FairQueue::drop() {
+    int fattest = -1;
+    for (int i = 0; i < FLOWS; ++i) {
+        if (_buckets[i].count > 0 && (fattest < 0 || _buckets[i].bytes > _buckets[fattest].bytes)) {
+            fattest = i;
+        }
+    }
+    if (fattest < 0) {
+        /* Nothing but priority packets */
+        fattest = FLOWS;
+    }
+    _free.push_back(unlink(fattest));
+    ++_dropped;
+}
+
+int FairQueue::copy(int slot, char *out, int cap, uint32_t *flow, uint32_t *owner,
+        uint64_t *tag) {
+    const Packet& p = _packets[slot];
+    int size = p.data.size();
+    assert(size <= cap);
+    memcpy(out, p.data.data(), size);
+    *flow = p.flow;
+    *owner = p.owner;
+    *tag = p.tag;
+    _free.push_back(slot);
+    return size;
+}
+
+int FairQueue::pop(uint64_t now, char *out, int cap, uint32_t *flow, uint32_t *owner,
+        uint64_t *tag) {
+    if (_count == 0) {
+        return -1;
+    }
+
+    if (_buckets[FLOWS].count > 0) {
+        int size = _packets[_buckets[FLOWS].head].data.size();
+        if (!_rate.fits(size, now)) {
+            return -1;
+        }
+        _rate.charge(size);
+        return copy(unlink(FLOWS), out, cap, flow, owner, tag);
+    }
+
+    for ( ; ; ) {
+        int index = _active.front();
+        Bucket& bucket = _buckets[index];
+        if (bucket.count == 0) {
+            bucket.active = false;
+            _active.pop_front();
+            continue;
+        }
+        if (bucket.deficit <= 0) {
+            bucket.deficit += QUANTUM;
+            _active.pop_front();
+            _active.push_back(index);
+            continue;
+        }
+
+        int size = _packets[bucket.head].data.size();
+        if (!_rate.fits(size, now)) {
+            return -1;
+        }
+        _rate.charge(size);
+        bucket.deficit -= size;
+        return copy(unlink(index), out, cap, flow, owner, tag);
+    }
+}
+
+std::string FairQueue::to_string() const {
+    char buf[160];
+    snprintf(buf, sizeof(buf), "queued %d enqueued %llu priority %llu dropped %llu",
+            _count, static_cast<unsigned long long>(_enqueued),
+            static_cast<unsigned long long>(_prioritized),
+            static_cast<unsigned long long>(_dropped));
+    return buf;
+}
+
+} /* namespace vpn */
@@ -1,141 +1,1414 @@
 #include "vpn_server.h"
+#include "vpn_probe.h"
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
 
-#ifdef DEBUG
-#include <iostream>
-#endif
+#include <sstream>
+#include <thread>
 #include <vector>
 
 namespace vpn {
 
 static const int MAX_EVENTS = 512;
+/* By Server::Stage */
+static const char *STAGE_NAMES[] = {"client2server", "server2client", "loop", "recvmmsg",
+    "sendmmsg", "tun_read", "tun_write", "nat", "checksum"};
+/* Datagrams that would wait longer for their time are dropped */
+static const uint64_t PACE_HORIZON = 100000000ULL;
 
-Server::Server(const std::string& addr, int port)
-    : _socket(Socket::IPv4, Socket::UDP), _epoll(), _tun(addr), _port(port) {
-    _epoll.add_read_event(_socket.fd());
-    _epoll.add_read_event(_tun.fd());
+/* The top bit of a key tells an IPv6 one */
+static const uint64_t KEY_V6 = 1ULL << 63;
+
+/* Streams are found by the address of their client. IPv4 keys are the
+ * address and port, IPv6 ones a hash of them. */
+static uint64_t addr_key(const struct sockaddr_in6& sock) {
+    if (is_v4(sock)) {
+        uint32_t addr;
+        memcpy(&addr, &sock.sin6_addr.s6_addr[12], sizeof(addr));
+        return (static_cast<uint64_t>(addr) << 16) | sock.sin6_port;
+    }
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 16; ++i) {
+        h = (h ^ sock.sin6_addr.s6_addr[i]) * 1099511628211ULL;
+    }
+    h = (h ^ sock.sin6_port) * 1099511628211ULL;
+    return h | KEY_V6;
+}
+
+struct sockaddr_in6 Server::key_addr(uint64_t key) const {
+    if (key & KEY_V6) {
+        auto it = _v6_addrs.find(key);
+        assert(it != _v6_addrs.end());
+        return it->second;
+    }
+    struct sockaddr_in6 sock;
+    memset(&sock, 0, sizeof(sock));
+    sock.sin6_family = AF_INET6;
+    sock.sin6_addr.s6_addr[10] = 0xff;
+    sock.sin6_addr.s6_addr[11] = 0xff;
+    uint32_t addr = static_cast<uint32_t>(key >> 16);
+    memcpy(&sock.sin6_addr.s6_addr[12], &addr, sizeof(addr));
+    sock.sin6_port = static_cast<uint16_t>(key & 0xffff);
+    return sock;
+}
+
+Server::Server(const std::string& addr, int port, const TunnelOptions& options)
+    : Server(new Tun(addr), new Socket(Socket::IPv6, Socket::UDP), nullptr, nullptr, addr, port,
+            options) {  }
+
+Server::Server(PacketDevice *tun, PacketDevice *socket, const std::string& addr,
+        const TunnelOptions& options)
+    : Server(nullptr, nullptr, tun, socket, addr, 0, options) {  }
+
+Server::Server(Tun *own_tun, Socket *own_socket, PacketDevice *tun, PacketDevice *socket,
+        const std::string& addr, int port, const TunnelOptions& options)
+    : _own_socket(own_socket), _own_tun(own_tun), _socket(socket ? socket : own_socket),
+    _listener(Socket::IPv6, Socket::TCP), _epoll(), _tun(tun ? tun : own_tun),
+    _port(port), _addr(Addr::parse(addr)), _addr6(),
+    _options(options), _stats_interval(0), _last_tick(0),
+    _probe_interval_ms(1000), _last_probe(0), _session_timeout(300), _nat_timeout(7440),
+    _last_expire(0), _probe_id(0), _arrived(0), _top_interval(0), _sampled(0), _now(0),
+    _pace_rate(0), _pacing(PACE_AUTO), _txtime(false), _held(0), _mss(0), _clamped(0),
+    _icmp_errors(0), _timeout(-1), _last_stats(0), _last_top(0), _stopped(false) {
+    register_metrics();
+    _epoll.add_read_event(_socket->fd());
+    if (_own_socket) {
+        _epoll.add_read_event(_listener.fd());
+    }
+    _epoll.add_read_event(_tun->fd());
+}
+
+Server::~Server() {
+    /* Before _flows stops, so the live mappings are exported as deleted */
+    _stopped = true;
+    _nat.prune(0);
 }
 
 void Server::run() {
-    assert(_tun.up() == 0);
-    assert(_socket.bind(_port) == 0);
+    start();
+    while (!_stopped) {
+        poll();
+    }
+}
 
-    for ( ; ; ) {
-        std::vector<struct epoll_event> events(_epoll.wait());
-
-        for (const auto& event : events) {
-            if (event.data.fd == _tun.fd()) {
-                /* Path:
-                 *      Server -> Trans -> Client
-                 * */
-                server2client();
-            } else if (event.data.fd == _socket.fd()) {
-                /* Path:
-                 *      Client -> Trans -> Server
-                 * */
-                client2server();
-            } else {
-                /* nerver do this */
-                assert(false);
+void Server::start() {
+    if (_own_tun) {
+        assert(_own_tun->up() == 0);
+        if (_addr6.family != 0) {
+            assert(_own_tun->route6(_addr6.to_string()) == 0);
+        }
+    }
+    if (_own_socket) {
+        assert(_own_socket->bind(_port) == 0);
+        _own_socket->set_buffers(Stream::BUFFERS);
+        /* For the time datagrams wait in the socket queue */
+        _own_socket->set_timestamps();
+        if (_pace_rate > 0 && _pacing != PACE_TIMER) {
+            _txtime = _own_socket->set_txtime() == 0;
+            if (!_txtime) {
+                fprintf(stderr, "SO_TXTIME unsupported, pacing by timer\n");
             }
         }
+        /* The same port serves clients behind UDP-hostile networks */
+        assert(_listener.bind(_port) == 0);
+        assert(_listener.listen() == 0);
+    }
+
+    _timeout = _options.fec_k > 0 ? _options.fec_timeout_ms : -1;
+    if (_probe_interval_ms > 0 && (_timeout < 0 || _timeout > _probe_interval_ms)) {
+        _timeout = _probe_interval_ms;
+    }
+
+    _last_stats = time(nullptr);
+    _last_top = _last_stats;
+}
+
+void Server::poll(int most) {
+    int timeout = _timeout;
+    if (most >= 0 && (timeout < 0 || timeout > most)) {
+        timeout = most;
+    }
+    if ((_stats_interval > 0 || _top_interval > 0) && (timeout < 0 || timeout > 1000)) {
+        timeout = 1000;
+    }
+
+    if (((_session_timeout > 0 && !_sessions.empty()) || (_nat_timeout > 0 && _nat.ports() > 0)
+                || _frags.holding() > 0) && (timeout < 0 || timeout > 1000)) {
+        timeout = 1000;
+    }
+
+    if ((_queue && !_queue->empty()) || _held > 0) {
+        /* Held back by the rate */
+        timeout = 1;
+    }
+
+    std::vector<struct epoll_event> events(_epoll.wait(timeout));
+    _now = monotonic_ns();
+
+    for (const auto& event : events) {
+        if (event.data.fd == _tun->fd()) {
+            /* Path:
+             *      Server -> Trans -> Client
+             * */
+            server2client();
+        } else if (event.data.fd == _socket->fd()) {
+            /* Path:
+             *      Client -> Trans -> Server
+             * */
+            client2server();
+        } else if (event.data.fd == _listener.fd()) {
+            accept_streams();
+        } else if (_control && event.data.fd == _control->fd()) {
+            _control->serve();
+        } else {
+            /* nerver do this */
+            assert(_streams.count(event.data.fd));
+            stream_event(event.data.fd, event.events);
+        }
+    }
+    if (_timeout >= 0) {
+        tick();
+    }
+    if (_queue && !_queue->empty()) {
+        drain();
+    }
+    if (_held > 0) {
+        release();
+    }
+    if (_now - _last_expire >= 1000000000ULL) {
+        _last_expire = _now;
+        /* Whether or not anything needs ticks */
+        _frags.expire(_now);
+        if (_session_timeout > 0) {
+            expire_sessions(_now);
+        }
+        if (_nat_timeout > 0) {
+            _nat.prune(_nat_timeout);
+        }
+    }
+    _stages[S_LOOP]->record(monotonic_ns() - _now);
+
+    time_t now = time(nullptr);
+    if (_stats_interval > 0 && now - _last_stats >= _stats_interval) {
+        _last_stats = now;
+        printf("%s", stats().c_str());
+        fflush(stdout);
+    }
+    if (_top_interval > 0 && now - _last_top >= _top_interval) {
+        _last_top = now;
+        printf("%s", top().c_str());
+        fflush(stdout);
+        for (auto& top : _top) {
+            top->clear();
+        }
     }
 }
 
 void Server::client2server() {
-    char buf[4096];
+    uint64_t start = monotonic_ns();
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    struct sockaddr_in6 socks[BATCH_SIZE];
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH_SIZE; ++i) {
+        iovs[i].iov_base = _rx[i];
+        iovs[i].iov_len = sizeof(_rx[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &socks[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(socks[i]);
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
 
-    struct sockaddr_in sock;
-    socklen_t len = sizeof(sock);
-    int nread = _socket.recvfrom(buf, sizeof(buf),
-            reinterpret_cast<struct sockaddr*>(&sock), &len);
+    int nread = _socket->recvmmsg(msgs, BATCH_SIZE);
     assert(nread != -1);
+    _arrived = monotonic_ns();
+    _stages[S_RECVMMSG]->record(_arrived - start);
 
-    std::shared_ptr<IP> ip = get_ip_packet(buf, nread);
-    if (ip == nullptr) {
+    /* RX timestamps are of the wall clock */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t real = now.tv_sec * 1000000000LL + now.tv_nsec;
+    for (int i = 0; i < nread; ++i) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        for ( ; cmsg != nullptr; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec stamp;
+                memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                int64_t wait = real - (stamp.tv_sec * 1000000000LL + stamp.tv_nsec);
+                _dwell[D_UP][W_WAIT]->record(wait > 0 ? wait : 0);
+            }
+        }
+    }
+
+    char *bufs[BATCH_SIZE];
+    int sizes[BATCH_SIZE];
+    for (int i = 0; i < nread; ++i) {
+        bufs[i] = _rx[i];
+        sizes[i] = msgs[i].msg_len;
+    }
+    receive(bufs, sizes, socks, nread);
+    _stages[S_CLIENT2SERVER]->record(monotonic_ns() - start);
+}
+
+void Server::accept_streams() {
+    for ( ; ; ) {
+        struct sockaddr_in6 from;
+        int fd = _listener.accept(&from);
+        if (fd < 0) {
+            return ;
+        }
+        StreamConn conn;
+        conn.stream.reset(new Stream(std::make_shared<Socket>(fd)));
+        conn.from = from;
+        _streams[fd] = conn;
+        _stream_addrs[addr_key(from)] = conn.stream;
+        assert(_epoll.add_read_event(fd) == 0);
+    }
+}
+
+void Server::stream_event(int fd, uint32_t events) {
+    /* Copies, replies may close it under our feet */
+    std::shared_ptr<Stream> stream = _streams[fd].stream;
+    struct sockaddr_in6 sock = _streams[fd].from;
+    if (events & EPOLLOUT) {
+        if (stream->flush() < 0) {
+            close_stream(fd);
+            return ;
+        }
+        watch(stream.get());
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
         return ;
     }
+    if (stream->read() < 0) {
+        close_stream(fd);
+        return ;
+    }
+    _arrived = monotonic_ns();
+
+    char *bufs[BATCH_SIZE];
+    int sizes[BATCH_SIZE];
+    struct sockaddr_in6 from[BATCH_SIZE];
+    for ( ; ; ) {
+        int n = 0;
+        int size = 0;
+        while (n < BATCH_SIZE && (size = stream->next(&bufs[n])) > 0) {
+            sizes[n] = size;
+            from[n++] = sock;
+        }
+        receive(bufs, sizes, from, n);
+        if (size < 0) {
+            /* Lost the framing, nothing after can be trusted */
+            if (_streams.count(fd)) {
+                close_stream(fd);
+            }
+            return ;
+        }
+        if (n < BATCH_SIZE) {
+            return ;
+        }
+    }
+}
+
+void Server::close_stream(int fd) {
+    auto it = _streams.find(fd);
+    if (it == _streams.end()) {
+        return ;
+    }
+    _epoll.del_event(fd);
+    _stream_addrs.erase(addr_key(it->second.from));
+    _streams.erase(it);
+}
 
-    if (ip->protocol() == P_TCP || ip->protocol() == P_UDP) {
+void Server::watch(Stream *stream) {
+    if (stream->blocked() != stream->polling_out) {
+        stream->polling_out = stream->blocked();
+        _epoll.set_write_event(stream->fd(), stream->polling_out);
+    }
+}
+
+void Server::receive(char **bufs, int *sizes, struct sockaddr_in6 *socks, int nread) {
+    Datagram batch[BATCH_SIZE];
+    struct sockaddr_in6 *from[BATCH_SIZE];
+    /* Sessions made for this batch, kept once a datagram of theirs opens,
+     * so forged session ids cost nothing past it */
+    std::shared_ptr<Session> fresh[BATCH_SIZE];
+    int n = 0;
+    for (int i = 0; i < nread; ++i) {
+        bool made = false;
+        std::shared_ptr<Session> session = get_session(bufs[i], sizes[i], &made);
+        if (session == nullptr) {
+            continue;
+        }
+        for (int j = 0; made && j < n; ++j) {
+            if (fresh[j] && fresh[j]->id() == session->id()) {
+                session = fresh[j];
+            }
+        }
+        fresh[n] = made ? session : nullptr;
+        batch[n] = Datagram{session.get(), bufs[i], sizes[i], false};
+        from[n++] = &socks[i];
+    }
+    Session::open(batch, n);
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < n; ++i) {
+        if (!batch[i].ok) {
+            continue;
+        }
+        batch[i].session->set_active(now);
+        if (fresh[i]) {
+            _sessions.emplace(fresh[i]->id(), fresh[i]);
+        }
+    }
+    char buf[MAX_DATAGRAM];
+    Datagram replies[BATCH_SIZE];
+    struct sockaddr_in6 dests[BATCH_SIZE];
+    int nreply = 0;
+    for (int i = 0; i < n; ++i) {
+        if (!batch[i].ok) {
+            continue;
+        }
+        Session *session = batch[i].session;
+
+        /* Answer a probe through the path it came by */
+        uint8_t type;
+        ProbeBody body;
+        if (Session::parse_probe(batch[i].data, batch[i].size, &type, &body)) {
+            int nwrite = -1;
+            if (type == T_PROBE) {
+                nwrite = session->probe(T_PROBE_REPLY, body, _tx[nreply], sizeof(_tx[nreply]));
+            } else if (type == T_MTU_PROBE) {
+                /* Short, only the way to us is measured */
+                nwrite = session->probe(T_MTU_REPLY, body, _tx[nreply], sizeof(_tx[nreply]));
+            } else if (type == T_PROBE_REPLY) {
+                session->path_stats().on_probe_reply(body.id, body.sent, monotonic_ns());
+            }
+            if (nwrite > 0) {
+                replies[nreply] = Datagram{session, _tx[nreply], nwrite, false};
+                dests[nreply++] = *from[i];
+            }
+            continue;
+        }
+
+        session->set_peer(*from[i]);
+        int size = session->decap(batch[i].data, batch[i].size, buf, sizeof(buf));
+        if (size > 0) {
+            forward(buf, size, *from[i], session);
+        }
+        while ((size = session->take_ready(buf, sizeof(buf))) > 0) {
+            forward(buf, size, *from[i], session);
+        }
+
+        /* Reordering sessions need ticks */
+        int timeout = session->timeout_ms();
+        if (timeout >= 0 && (_timeout < 0 || timeout < _timeout)) {
+            _timeout = timeout;
+        }
+    }
+    send(replies, dests, nreply);
+}
+
+void Server::forward(char *buf, int size, const struct sockaddr_in6& sock, Session *session) {
+    VPN_PROBE3(receive, D_UP, session->id(), size);
+    int total = size;
+    size = packet_size(buf, size);
+    if (size < 0) {
+        drop(D_UP, V_INVALID, session->id(), nullptr, total);
+        return ;
+    }
+    /* As it came, whatever becomes of it */
+    uint32_t captured = _capture.sample(buf, size);
+    if (captured != 0) {
+        _capture.add(captured, CAPTURE_PRE_NAT, D_UP, session->id(), buf, size);
+    }
+    clamp(buf, size, sock);
+    IP ip(buf, size, IP::REUSE);
+    if (!translatable(&ip)) {
+        drop(D_UP, V_INVALID, session->id(), &ip, size);
+        return ;
+    }
+    /* NAT66 to the address of tun, like NAT44 */
+    const Addr& source = ip.version() == 6 ? _addr6 : _addr;
+    if (source.family == 0 || (ip.version() == 6 && !routable6(ip.dst()))) {
+        drop(D_UP, V_NO_ROUTE, session->id(), &ip, size);
+        return ;
+    }
+    if (!police(session->id(), &ip, true)) {
+        drop(D_UP, V_POLICED, session->id(), &ip, size);
+        return ;
+    }
+
+    /* Traced as the client sent it */
+    TraceRecord record;
+    bool traced = tracing(TRACE_ALL);
+    if (traced) {
+        trace_fill(&record, D_UP, V_FORWARDED, session->id(), &ip, size);
+    }
+    bool timed = sample();
+    uint64_t start = timed ? monotonic_ns() : 0;
+    if (ip.fragment()) {
+        /* Keyed before the source changes */
+        ip.set_id(_frags.map_id(FragKey{session->id(), ip.src(), ip.dst(),
+                    ip.id(), static_cast<uint8_t>(ip.protocol())}, _now));
+    }
+    if (ip.inner() == nullptr) {
+        /* A later fragment, its first one set up the NAT */
+    } else if (ip.protocol() == P_TCP || ip.protocol() == P_UDP) {
         /* Safe down cast */
-        TransLayer *trans = dynamic_cast<TransLayer*>(ip->inner());
-        assert(trans != nullptr);
+        TransLayer *trans = static_cast<TransLayer*>(ip.inner());
 
-        trans->set_sport(_nat.snat(ip->saddr(), trans->sport(), sock));
-        ip->set_saddr(_tun.ip());
+        trans->set_sport(_nat.snat(ip.src(), trans->sport(), sock, session->id(),
+                    ip.size()));
+        if (traced) {
+            record.nat_port = trans->sport();
+        }
     } else {
-        _nat.snat(ip->saddr(), ip->daddr(), sock);
-        ip->set_saddr(_tun.ip());
+        _nat.snat(ip.src(), ip.dst(), sock, session->id());
+    }
+    ip.set_src(source);
+    const char *packet;
+    if (!timed) {
+        VPN_PROBE1(checksum__start, D_UP);
+        packet = ip.raw_data();
+        VPN_PROBE2(checksum__done, D_UP, ip.size());
+        _tun->write(packet, ip.size());
+    } else {
+        uint64_t natted = monotonic_ns();
+        VPN_PROBE1(checksum__start, D_UP);
+        packet = ip.raw_data();
+        VPN_PROBE2(checksum__done, D_UP, ip.size());
+        uint64_t summed = monotonic_ns();
+        _tun->write(packet, ip.size());
+        uint64_t written = monotonic_ns();
+        _stages[S_NAT]->record(natted - start);
+        _stages[S_CHECKSUM]->record(summed - natted);
+        _stages[S_TUN_WRITE]->record(written - summed);
+        _dwell[D_UP][W_PROCESSING]->record(written - _arrived);
+    }
+    VPN_PROBE2(send, D_UP, 1);
+    if (captured != 0) {
+        _capture.add(captured, CAPTURE_POST_NAT, D_UP, session->id(), packet, ip.size());
+    }
+    _packets[D_UP]->add();
+    _bytes[D_UP]->add(ip.size());
+    if (_top_interval > 0) {
+        account(session->id(), &ip, true);
+    }
+    if (traced) {
+        trace(record);
     }
-    _tun.write(ip->raw_data(), ip->size());
-
-#ifdef DEBUG
-    std::cout << "from client to server" << std::endl;
-#endif
 }
 
 void Server::server2client() {
-    char buf[4096];
+    uint64_t start = monotonic_ns();
+    Datagram batch[BATCH_SIZE + FEC_MAX_M];
+    struct sockaddr_in6 dests[BATCH_SIZE + FEC_MAX_M];
+    char buf[MAX_PACKET];
+    /* When sampled packets were read, by batch index */
+    uint64_t read_at[BATCH_SIZE + FEC_MAX_M] = {0};
 
-    int nread = _tun.read(buf, sizeof(buf));
-    assert(nread != -1);
+    int n = 0;
+    while (n < BATCH_SIZE) {
+        /* Fragments released by their first one go before new packets */
+        int nread = _frags.take(buf, sizeof(buf));
+        uint64_t read = 0;
+        if (nread < 0 && sample()) {
+            uint64_t reading = monotonic_ns();
+            nread = _tun->read(buf, sizeof(buf));
+            read = monotonic_ns();
+            _stages[S_TUN_READ]->record(read - reading);
+            _dwell[D_DOWN][W_WAIT]->record(reading - _now);
+        } else if (nread < 0) {
+            nread = _tun->read(buf, sizeof(buf));
+        }
+        if (nread < 0) {
+            /* Drained */
+            break;
+        }
+        if (translate(buf, nread, _tx[n], &batch[n], &dests[n])) {
+            read_at[n] = read;
+            n = take_parities(batch[n].session, dests[n], batch, dests, n + 1);
+        }
+    }
+    send(batch, dests, n);
+    uint64_t sent = monotonic_ns();
+    for (int i = 0; i < n; ++i) {
+        if (read_at[i] != 0) {
+            _dwell[D_DOWN][W_PROCESSING]->record(sent - read_at[i]);
+        }
+    }
+    if (_queue) {
+        drain();
+    }
+    _stages[S_SERVER2CLIENT]->record(monotonic_ns() - start);
+}
 
-    std::shared_ptr<IP> ip = get_ip_packet(buf, nread);
-    if (ip == nullptr) {
+void Server::set_shaping(uint64_t rate, int limit) {
+    _queue.reset(new FairQueue(limit));
+    _queue->set_rate(rate);
+}
+
+void Server::drain() {
+    Datagram batch[BATCH_SIZE + FEC_MAX_M];
+    struct sockaddr_in6 dests[BATCH_SIZE + FEC_MAX_M];
+    char buf[MAX_PACKET];
+    int size = 0;
+    while (size >= 0) {
+        int n = 0;
+        while (n < BATCH_SIZE) {
+            uint32_t flow, owner;
+            uint64_t tag;
+            size = _queue->pop(_now, buf, sizeof(buf), &flow, &owner, &tag);
+            if (size < 0) {
+                break;
+            }
+            auto it = _sessions.find(owner);
+            if (it == _sessions.end()) {
+                continue;
+            }
+            int nwrite = it->second->encap(buf, size, _tx[n], MAX_DATAGRAM);
+            if (nwrite < 0) {
+                continue;
+            }
+            batch[n] = Datagram{it->second.get(), _tx[n], nwrite, false};
+            dests[n] = key_addr(tag);
+            n = take_parities(batch[n].session, dests[n], batch, dests, n + 1);
+        }
+        send(batch, dests, n);
+    }
+}
+
+void Server::tick() {
+    uint64_t now = monotonic_ns();
+    if (now - _last_tick < 1000000ULL) {
         return ;
     }
+    _last_tick = now;
 
-    std::shared_ptr<OriginData> origin;
-    if (ip->protocol() == P_TCP || ip->protocol() == P_UDP) {
-        /* Safe down cast */
-        TransLayer *trans = dynamic_cast<TransLayer*>(ip->inner());
-        assert(trans != nullptr);
-        origin = _nat.dnat(trans->dport());
-        if (origin == nullptr) {
-            return ;
+    Datagram batch[BATCH_SIZE + FEC_MAX_M];
+    struct sockaddr_in6 dests[BATCH_SIZE + FEC_MAX_M];
+    int n = 0;
+    for (const auto& it : _sessions) {
+        Session *session = it.second.get();
+        session->tick(now);
+
+        char buf[MAX_DATAGRAM];
+        int size;
+        while ((size = session->take_ready(buf, sizeof(buf))) > 0) {
+            forward(buf, size, session->peer(), session);
+        }
+        n = take_parities(session, session->peer(), batch, dests, n);
+        if (n >= BATCH_SIZE) {
+            send(batch, dests, n);
+            n = 0;
         }
+    }
+    send(batch, dests, n);
 
-        ip->set_daddr(origin->addr);
-        trans->set_dport(origin->port);
-    } else {
-        origin = _nat.dnat(ip->saddr());
-        if (origin == nullptr) {
+    if (_probe_interval_ms > 0 && now - _last_probe >= _probe_interval_ms * 1000000ULL) {
+        _last_probe = now;
+        probe(now);
+    }
+}
+
+void Server::probe(uint64_t now) {
+    Datagram batch[BATCH_SIZE];
+    struct sockaddr_in6 dests[BATCH_SIZE];
+    int n = 0;
+    for (const auto& it : _sessions) {
+        Session *session = it.second.get();
+        if (session->peer().sin6_family == 0) {
+            continue;
+        }
+        PathStats& stats = session->path_stats();
+        stats.tick(now);
+
+        ProbeBody body = {++_probe_id, 0, now};
+        int nwrite = session->probe(T_PROBE, body, _tx[n], sizeof(_tx[n]));
+        if (nwrite < 0) {
+            continue;
+        }
+        stats.on_probe_sent(body.id, now);
+        batch[n] = Datagram{session, _tx[n], nwrite, false};
+        dests[n++] = session->peer();
+        if (n == BATCH_SIZE) {
+            send(batch, dests, n);
+            n = 0;
+        }
+    }
+    send(batch, dests, n);
+}
+
+int Server::take_parities(Session *session, const struct sockaddr_in6& dest,
+        Datagram *batch, struct sockaddr_in6 *dests, int n) {
+    int nwrite;
+    while ((nwrite = session->take_parity(_tx[n], sizeof(_tx[n]))) > 0) {
+        batch[n] = Datagram{session, _tx[n], nwrite, false};
+        dests[n++] = dest;
+    }
+    return n;
+}
+
+void Server::send(Datagram *batch, struct sockaddr_in6 *dests, int n) {
+    if (n == 0) {
+        return ;
+    }
+    Session::seal(batch, n);
+
+    struct mmsghdr msgs[BATCH_SIZE + FEC_MAX_M];
+    struct iovec iovs[BATCH_SIZE + FEC_MAX_M];
+    Stream *streams[BATCH_SIZE + FEC_MAX_M];
+    char control[BATCH_SIZE + FEC_MAX_M][CMSG_SPACE(sizeof(uint64_t))];
+    int count = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < n; ++i) {
+        streams[i] = nullptr;
+        if (!_stream_addrs.empty()) {
+            auto it = _stream_addrs.find(addr_key(dests[i]));
+            if (it != _stream_addrs.end()) {
+                streams[i] = it->second.get();
+                continue;
+            }
+        }
+        if (_pace_rate > 0) {
+            PacedSession& paced = pacing(batch[i].session, dests[i]);
+            if (paced.pacer.delay(_now) > PACE_HORIZON) {
+                paced.pacer.drop();
+                continue;
+            }
+            uint64_t at = paced.pacer.schedule(batch[i].size, _now);
+            if (paced.txtime) {
+                msgs[count].msg_hdr.msg_control = control[count];
+                msgs[count].msg_hdr.msg_controllen = sizeof(control[count]);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[count].msg_hdr);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_TXTIME;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                memcpy(CMSG_DATA(cmsg), &at, sizeof(at));
+                paced.pacer.sent(batch[i].size, at);
+            } else if (at > _now || !paced.held.empty()) {
+                /* Behind what is held already, release() sends it */
+                paced.held.push_back(Held{at, dests[i],
+                        std::string(batch[i].data, batch[i].size)});
+                ++_held;
+                continue;
+            } else {
+                paced.pacer.sent(batch[i].size, _now);
+            }
+        }
+        iovs[count].iov_base = batch[i].data;
+        iovs[count].iov_len = batch[i].size;
+        msgs[count].msg_hdr.msg_iov = &iovs[count];
+        msgs[count].msg_hdr.msg_iovlen = 1;
+        msgs[count].msg_hdr.msg_name = &dests[i];
+        msgs[count].msg_hdr.msg_namelen = sizeof(dests[i]);
+        ++count;
+    }
+    if (count > 0) {
+        uint64_t start = monotonic_ns();
+        _socket->sendmmsg(msgs, count);
+        _stages[S_SENDMMSG]->record(monotonic_ns() - start);
+        VPN_PROBE2(send, D_DOWN, count);
+    }
+
+    /* One writev() per stream, in the order of the batch */
+    for (int i = 0; i < n; ++i) {
+        Stream *stream = streams[i];
+        if (stream == nullptr) {
+            continue;
+        }
+        count = 0;
+        for (int j = i; j < n; ++j) {
+            if (streams[j] == stream) {
+                iovs[count].iov_base = batch[j].data;
+                iovs[count++].iov_len = batch[j].size;
+                streams[j] = nullptr;
+            }
+        }
+        if (stream->write(iovs, count) < 0) {
+            close_stream(stream->fd());
+        } else {
+            watch(stream);
+        }
+    }
+}
+
+void Server::set_link_mtu(int mtu) {
+    /* Less IPv4 and TCP headers without options */
+    _mss = mtu > 0 ? _options.inner_mtu(mtu) - 40 : 0;
+}
+
+void Server::clamp(char *packet, int size, const struct sockaddr_in6& peer) {
+    /* IPv6 between us takes 20 bytes more of the link */
+    if (_mss > 0 && clamp_mss(packet, size,
+                _mss - (is_v4(peer) ? 0 : TUNNEL_UDP6_OVERHEAD - TUNNEL_UDP_OVERHEAD))) {
+        ++_clamped;
+    }
+}
+
+void Server::set_tun_addr6(const std::string& addr) {
+    _addr6 = Addr::parse(addr);
+}
+
+void Server::set_pacing(uint64_t rate, Pacing mode) {
+    _pace_rate = rate;
+    _pacing = mode;
+    _paced.clear();
+}
+
+Server::PacedSession& Server::pacing(Session *session, const struct sockaddr_in6& dest) {
+    auto it = _paced.find(session->id());
+    if (it != _paced.end()) {
+        return it->second;
+    }
+    PacedSession& paced = _paced[session->id()];
+    paced.pacer.set_rate(_pace_rate);
+    /* Decided once by where the client was first, a qdisc lookup is slow */
+    paced.txtime = _txtime && (_pacing == PACE_TXTIME || txtime_qdisc(dest));
+    return paced;
+}
+
+void Server::release() {
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    int count = BATCH_SIZE;
+    while (count == BATCH_SIZE) {
+        count = 0;
+        memset(msgs, 0, sizeof(msgs));
+        /* Popped after sending, msgs point into them */
+        std::vector<PacedSession*> popped;
+        for (auto& it : _paced) {
+            PacedSession& paced = it.second;
+            for (const Held& held : paced.held) {
+                if (held.at > _now || count == BATCH_SIZE) {
+                    break;
+                }
+                iovs[count].iov_base = const_cast<char*>(held.data.data());
+                iovs[count].iov_len = held.data.size();
+                msgs[count].msg_hdr.msg_iov = &iovs[count];
+                msgs[count].msg_hdr.msg_iovlen = 1;
+                msgs[count].msg_hdr.msg_name = const_cast<struct sockaddr_in6*>(&held.dest);
+                msgs[count].msg_hdr.msg_namelen = sizeof(held.dest);
+                paced.pacer.sent(held.data.size(), _now);
+                popped.push_back(&paced);
+                ++count;
+            }
+        }
+        if (count == 0) {
             return ;
         }
-        ip->set_daddr(origin->addr);
+        _socket->sendmmsg(msgs, count);
+        for (PacedSession *paced : popped) {
+            paced->held.pop_front();
+            --_held;
+        }
+    }
+}
+
+bool Server::translate(char *buf, int size, char *out, Datagram *datagram,
+        struct sockaddr_in6 *dest) {
+    VPN_PROBE3(receive, D_DOWN, 0, size);
+    uint32_t captured = _capture.sample(buf, size);
+    if (captured != 0) {
+        _capture.add(captured, CAPTURE_POST_NAT, D_DOWN, 0, buf, size);
+    }
+    /* An error about a packet of a client quotes it as it left here, the
+     * quote tells whom the error is for and is put back as they sent it */
+    OriginData origin;
+    Quote quote;
+    bool quoted = icmp_quote(buf, size, &quote);
+    if (quoted) {
+        int sport = quote_sport(quote);
+        bool found = sport >= 0 ? _nat.dnat(sport, &origin)
+            : _nat.dnat(quote_daddr(quote), &origin);
+        if (!found || origin.addr.family != quote.family) {
+            drop(D_DOWN, V_NO_NAT, 0, nullptr, size);
+            return false;
+        }
+        set_quote_source(&quote, origin.addr, origin.port);
+        ++_icmp_errors;
+    }
+
+    int total = size;
+    size = packet_size(buf, size);
+    if (size < 0) {
+        drop(D_DOWN, V_INVALID, 0, nullptr, total);
+        return false;
+    }
+    IP ip(buf, size, IP::REUSE);
+    if (!translatable(&ip)) {
+        drop(D_DOWN, V_INVALID, 0, &ip, size);
+        return false;
+    }
+
+    bool timed = sample();
+    uint64_t start = timed ? monotonic_ns() : 0;
+    int nat_port = 0;
+    FragKey key = {0, ip.src(), ip.dst(), ip.id(), static_cast<uint8_t>(ip.protocol())};
+    if (quoted) {
+        /* Found above */
+    } else if (ip.inner() == nullptr) {
+        /* A later fragment goes where its first one went */
+        const OriginData *found = _frags.lookup(key);
+        if (found == nullptr) {
+            if (tracing(TRACE_ALL)) {
+                TraceRecord record;
+                trace_fill(&record, D_DOWN, V_HELD, 0, &ip, size);
+                trace(record);
+            }
+            _frags.hold(key, buf, size, _now);
+            return false;
+        }
+        origin = *found;
+    } else if (ip.protocol() == P_TCP || ip.protocol() == P_UDP) {
+        /* Safe down cast */
+        TransLayer *trans = static_cast<TransLayer*>(ip.inner());
+        if (!_nat.dnat(trans->dport(), &origin, size)) {
+            drop(D_DOWN, V_NO_NAT, 0, &ip, size);
+            return false;
+        }
+        nat_port = trans->dport();
+        trans->set_dport(origin.port);
+    } else if (!_nat.dnat(ip.src(), &origin)) {
+        drop(D_DOWN, V_NO_NAT, 0, &ip, size);
+        return false;
+    }
+    /* Ports are shared by both families */
+    if (origin.addr.family != (ip.version() == 6 ? AF_INET6 : AF_INET)) {
+        drop(D_DOWN, V_NO_NAT, origin.session, &ip, size);
+        return false;
+    }
+    ip.set_dst(origin.addr);
+    if (ip.fragment() && ip.offset() == 0) {
+        _frags.learn(key, origin, _now);
+    }
+    if (timed) {
+        _stages[S_NAT]->record(monotonic_ns() - start);
     }
-    _socket.sendto(ip->raw_data(), ip->size(),
-            reinterpret_cast<struct sockaddr*>(&(origin->sock)), sizeof(origin->sock));
 
-#ifdef DEBUG
-    std::cout << "from server to client" << std::endl;
-#endif
+    auto it = _sessions.find(origin.session);
+    if (it == _sessions.end()) {
+        drop(D_DOWN, V_NO_SESSION, origin.session, &ip, size);
+        return false;
+    }
+    if (!police(origin.session, &ip, false)) {
+        drop(D_DOWN, V_POLICED, origin.session, &ip, size);
+        return false;
+    }
+    *dest = origin.sock;
+
+    /* The connection the flow came by is gone, use the one it reconnected by */
+    const struct sockaddr_in6& peer = it->second->peer();
+    if (!_stream_addrs.empty() && !_stream_addrs.count(addr_key(origin.sock))
+            && _stream_addrs.count(addr_key(peer))) {
+        *dest = peer;
+    }
+    clamp(buf, size, *dest);
+
+    /* Traced as the client gets it */
+    TraceRecord record;
+    bool traced = tracing(TRACE_ALL);
+    if (traced) {
+        trace_fill(&record, D_DOWN, _queue ? V_QUEUED : V_FORWARDED, origin.session, &ip, size);
+        record.nat_port = nat_port;
+    }
+    start = timed ? monotonic_ns() : 0;
+    VPN_PROBE1(checksum__start, D_DOWN);
+    const char *packet = ip.raw_data();
+    VPN_PROBE2(checksum__done, D_DOWN, ip.size());
+    if (timed) {
+        _stages[S_CHECKSUM]->record(monotonic_ns() - start);
+    }
+    if (captured != 0) {
+        _capture.add(captured, CAPTURE_PRE_NAT, D_DOWN, origin.session, packet, ip.size());
+    }
+    _packets[D_DOWN]->add();
+    _bytes[D_DOWN]->add(ip.size());
+    if (_top_interval > 0) {
+        account(origin.session, &ip, false);
+    }
+    if (_queue) {
+        /* Left to drain(), flows of different clients get different buckets */
+        uint64_t tag = addr_key(*dest);
+        if (tag & KEY_V6) {
+            _v6_addrs[tag] = *dest;
+        }
+        _queue->push(flow_hash(packet, ip.size()) ^ origin.session,
+                interactive(packet, ip.size()), origin.session, tag, packet, ip.size());
+        if (traced) {
+            trace(record);
+        }
+        return false;
+    }
+    int nwrite = it->second->encap(packet, ip.size(), out, MAX_DATAGRAM);
+    if (nwrite < 0) {
+        return false;
+    }
+    *datagram = Datagram{it->second.get(), out, nwrite, false};
+    if (traced) {
+        trace(record);
+    }
+    return true;
 }
 
-std::shared_ptr<IP> Server::get_ip_packet(char *buf, int size) {
-    if (buf == nullptr) {
-        return nullptr;
+void Server::set_rate_limit(const RateLimit& limit) {
+    _limit = limit;
+    _up.set_rate(limit.total_up, limit.total_up * limit.burst_ms / 1000);
+    _down.set_rate(limit.total_down, limit.total_down * limit.burst_ms / 1000);
+    _policers.clear();
+}
+
+bool Server::police(uint32_t session, IP *ip, bool up) {
+    bool ecn = ip->ecn() != 0;
+    TokenBucket::Verdict verdict = TokenBucket::PASS;
+    if (_limit.client_up || _limit.client_down) {
+        auto it = _policers.find(session);
+        if (it == _policers.end()) {
+            it = _policers.emplace(session, ClientPolicer()).first;
+            it->second.up.set_rate(_limit.client_up, _limit.client_up * _limit.burst_ms / 1000);
+            it->second.down.set_rate(_limit.client_down,
+                    _limit.client_down * _limit.burst_ms / 1000);
+        }
+        verdict = (up ? it->second.up : it->second.down).take(ip->size(), ecn, _now);
     }
-    if (static_cast<size_t>(size) < sizeof(struct iphdr)) {
-        return nullptr;
+    if (verdict != TokenBucket::DROP) {
+        TokenBucket::Verdict total = (up ? _up : _down).take(ip->size(), ecn, _now);
+        verdict = total > verdict ? total : verdict;
+    }
+
+    if (verdict == TokenBucket::DROP) {
+        return false;
     }
+    if (verdict == TokenBucket::MARK) {
+        ip->set_ecn(0x3);
+    }
+    return true;
+}
 
-    std::shared_ptr<IP> ip(new IP(buf, size, IP::ALLOC));
+int Server::packet_size(const char *buf, int size) {
+    if (!IP::valid(buf, size)) {
+        return -1;
+    }
+    /* Whatever follows the datagram is not part of it */
+    if ((buf[0] >> 4) == 6) {
+        return sizeof(struct ipv6hdr)
+            + ntohs(reinterpret_cast<const struct ipv6hdr*>(buf)->payload_len);
+    }
+    return ntohs(reinterpret_cast<const struct iphdr*>(buf)->tot_len);
+}
 
+bool Server::translatable(IP *ip) {
     if (ip->protocol() != P_TCP
             && ip->protocol() != P_UDP
-            && ip->protocol() != P_ICMP) {
-        return nullptr;
+            && ip->protocol() != P_ICMP
+            && ip->protocol() != P_ICMP6) {
+        return false;
     }
 
-    if (ip->inner() == nullptr) {
+    /* A first fragment needs the transport header to be translated */
+    return ip->inner() != nullptr || ip->offset() > 0;
+}
+
+bool Server::routable6(const Addr& addr) {
+    /* Multicast(ff00::/8) and link-local(fe80::/10) end at tun, eg:
+     * neighbor and router discovery of the client */
+    return addr.bytes[0] != 0xff && !(addr.bytes[0] == 0xfe && (addr.bytes[1] & 0xc0) == 0x80);
+}
+
+std::shared_ptr<Session> Server::get_session(const char *buf, int size, bool *fresh) {
+    TunnelHeader hdr;
+    *fresh = false;
+    if (!Session::parse_header(buf, size, &hdr)) {
         return nullptr;
     }
 
-    return ip;
+    auto it = _sessions.find(hdr.session);
+    if (it != _sessions.end()) {
+        return it->second;
+    }
+
+    *fresh = true;
+    return std::shared_ptr<Session>(new Session(hdr.session, _options, R_SERVER));
+}
+
+void Server::expire_sessions(uint64_t now) {
+    uint64_t idle = _session_timeout * 1000000000ULL;
+    for (auto it = _sessions.begin(); it != _sessions.end(); ) {
+        if (now - it->second->active_at() < idle) {
+            ++it;
+            continue;
+        }
+        uint32_t id = it->first;
+        _policers.erase(id);
+        auto paced = _paced.find(id);
+        if (paced != _paced.end()) {
+            _held -= paced->second.held.size();
+            _paced.erase(paced);
+        }
+        it = _sessions.erase(it);
+    }
+}
+
+bool Server::set_control(const std::string& path) {
+    _control.reset(new Control(path));
+    if (_control->fd() < 0) {
+        _control.reset();
+        return false;
+    }
+    _control->handle("stats", [this](const std::string&) {
+        return stats();
+    });
+    _control->handle("metrics", [this](const std::string&) {
+        return metrics();
+    });
+    _control->handle("top", [this](const std::string&) {
+        return _top_interval > 0 ? top() : "not counted, start the server with --top_interval\n";
+    });
+    _control->handle("trace", [this](const std::string& args) {
+        return trace_command(args);
+    });
+    _control->handle("capture", [this](const std::string& args) {
+        return capture_command(args);
+    });
+    _epoll.add_read_event(_control->fd());
+    return true;
+}
+
+void Server::set_top_interval(int seconds) {
+    _top_interval = seconds;
+    for (auto& top : _top) {
+        top.reset(seconds > 0 ? new HeavyHitters() : nullptr);
+    }
+}
+
+void Server::account(uint32_t session, IP *ip, bool up) {
+    /* Whatever is beyond the server is the source of packets to clients */
+    Addr remote = up ? ip->dst() : ip->src();
+    uint8_t addr[sizeof(remote.bytes) + 1];
+    addr[0] = remote.family;
+    memcpy(addr + 1, remote.bytes, remote.size());
+
+    int size = ip->size();
+    _top[T_CLIENT]->add(SketchKey(&session, sizeof(session)), size);
+    _top[T_DESTINATION]->add(SketchKey(addr, remote.size() + 1), size);
+    if (ip->inner() && (ip->protocol() == P_TCP || ip->protocol() == P_UDP)) {
+        /* Safe down cast */
+        TransLayer *trans = static_cast<TransLayer*>(ip->inner());
+        uint8_t port[3] = {static_cast<uint8_t>(ip->protocol())};
+        uint16_t number = up ? trans->dport() : trans->sport();
+        memcpy(port + 1, &number, sizeof(number));
+        _top[T_PORT]->add(SketchKey(port, sizeof(port)), size);
+    }
+}
+
+std::string Server::top_key(int kind, const SketchKey& key) const {
+    if (kind == T_CLIENT) {
+        uint32_t id;
+        memcpy(&id, key.bytes, sizeof(id));
+        char text[16];
+        snprintf(text, sizeof(text), "%08x", id);
+        auto it = _sessions.find(id);
+        return it == _sessions.end() ? text
+            : std::string(text) + " " + sockaddr_string(it->second->peer());
+    }
+    if (kind == T_DESTINATION) {
+        return Addr(key.bytes[0], key.bytes + 1).to_string();
+    }
+    uint16_t number;
+    memcpy(&number, key.bytes + 1, sizeof(number));
+    return std::string(key.bytes[0] == P_TCP ? "tcp/" : "udp/") + std::to_string(number);
+}
+
+std::string Server::top() const {
+    static const char *kinds[] = {"clients", "destinations", "ports"};
+    std::string top;
+    for (int kind = 0; kind < TOP_KINDS; ++kind) {
+        const HeavyHitters& hitters = *_top[kind];
+        for (int by_bytes = 0; by_bytes < 2; ++by_bytes) {
+            top += std::string("top ") + kinds[kind] + " by " + (by_bytes ? "bytes" : "packets")
+                + " of " + std::to_string(hitters.packets()) + " packets "
+                + std::to_string(hitters.bytes()) + " bytes:\n";
+            for (const HeavyHitters::Entry& entry : hitters.top(by_bytes)) {
+                char line[128];
+                snprintf(line, sizeof(line), "  %-40s %12llu packets %15llu bytes\n",
+                        top_key(kind, entry.key).c_str(),
+                        static_cast<unsigned long long>(entry.packets),
+                        static_cast<unsigned long long>(entry.bytes));
+                top += line;
+            }
+        }
+    }
+    return top;
+}
+
+bool Server::set_trace(const std::string& path) {
+    _tracer.reset(new TraceDrainer());
+    if (!_tracer->start(path)) {
+        _tracer.reset();
+        return false;
+    }
+    return true;
+}
+
+/* IPv6 as is, IPv4 mapped(RFC 4291) */
+static void mapped(const Addr& addr, uint8_t *out) {
+    if (addr.family == AF_INET6) {
+        memcpy(out, addr.bytes, 16);
+        return ;
+    }
+    memset(out, 0, 16);
+    out[10] = 0xff;
+    out[11] = 0xff;
+    memcpy(out + 12, addr.bytes, 4);
+}
+
+bool Server::set_flow_export(const std::string& target) {
+    _flows.reset(new FlowExporter());
+    if (!_flows->start(target)) {
+        _flows.reset();
+        return false;
+    }
+    _nat.set_observer([this](const NATNode& node, bool created) {
+        FlowRecord record;
+        record.start_ms = static_cast<uint64_t>(node.created) * 1000;
+        record.end_ms = static_cast<uint64_t>(node.use) * 1000;
+        mapped(node.addr, record.addr);
+        record.port = node.port;
+        mapped(node.addr.family == AF_INET6 ? _addr6 : _addr, record.nat_addr);
+        record.nat_port = node.new_port;
+        memcpy(record.peer, node.sock.sin6_addr.s6_addr, 16);
+        record.event = created ? NAT_EVENT_CREATE : NAT_EVENT_DELETE;
+        record.packets = node.packets[0];
+        record.bytes = node.bytes[0];
+        record.reverse_packets = node.packets[1];
+        record.reverse_bytes = node.bytes[1];
+        /* What is left at exit must not be lost to a full ring */
+        while (!_flows->push(record) && _stopped) {
+            std::this_thread::yield();
+        }
+    });
+    return true;
+}
+
+void Server::trace_fill(TraceRecord *record, int direction, int verdict, uint32_t session,
+        IP *ip, int size) {
+    static const uint8_t numbers[] = {IPPROTO_ICMP, IPPROTO_TCP, IPPROTO_UDP, IPPROTO_IPIP,
+        IPPROTO_ICMPV6, 0};
+    memset(record, 0, sizeof(*record));
+    record->ts = monotonic_ns();
+    record->session = session;
+    record->size = size;
+    record->direction = direction;
+    record->verdict = verdict;
+    if (ip == nullptr) {
+        return ;
+    }
+    record->version = ip->version();
+    record->protocol = numbers[ip->protocol()];
+    Addr src = ip->src();
+    Addr dst = ip->dst();
+    memcpy(record->saddr, src.bytes, src.size());
+    memcpy(record->daddr, dst.bytes, dst.size());
+    if (ip->inner() && (ip->protocol() == P_TCP || ip->protocol() == P_UDP)) {
+        /* Safe down cast */
+        TransLayer *trans = static_cast<TransLayer*>(ip->inner());
+        record->sport = trans->sport();
+        record->dport = trans->dport();
+    }
+}
+
+bool Server::set_capture(const std::string& path, const CaptureOptions& options,
+        std::string *error) {
+    return _capture.start(path, options, error);
+}
+
+std::string Server::capture_command(const std::string& args) {
+    static const char *usage = "usage: capture [stop | start <file> [sample=N] [snaplen=N] "
+        "[filter]]\n";
+    std::istringstream in(args);
+    std::string verb;
+    in >> verb;
+    if (verb == "stop") {
+        _capture.stop();
+    } else if (verb == "start") {
+        std::string path;
+        if (!(in >> path)) {
+            return usage;
+        }
+        CaptureOptions options;
+        std::string word;
+        while (in >> word) {
+            if (word.compare(0, 7, "sample=") == 0) {
+                options.sample = atoi(word.c_str() + 7);
+            } else if (word.compare(0, 8, "snaplen=") == 0) {
+                options.snaplen = atoi(word.c_str() + 8);
+            } else {
+                options.filter += (options.filter.empty() ? "" : " ") + word;
+            }
+        }
+        std::string error;
+        if (!set_capture(path, options, &error)) {
+            return error + "\n";
+        }
+    } else if (!verb.empty()) {
+        return usage;
+    }
+    return "capture: " + _capture.to_string() + "\n";
+}
+
+std::string Server::trace_command(const std::string& args) {
+    static const char *names[] = {"off", "drops", "all"};
+    if (!args.empty()) {
+        int level = -1;
+        for (int i = TRACE_OFF; i <= TRACE_ALL; ++i) {
+            if (args == names[i] || args == std::to_string(i)) {
+                level = i;
+            }
+        }
+        if (level < 0) {
+            return "usage: trace [off|drops|all]\n";
+        }
+        if (level != TRACE_OFF && !_tracer) {
+            return "no trace output, start the server with --trace\n";
+        }
+        trace_level = level;
+    }
+    std::string reply = std::string("trace: ") + names[trace_level.load()];
+    if (_tracer) {
+        reply += ", " + _tracer->to_string();
+    }
+    return reply + "\n";
+}
+
+void Server::register_metrics() {
+    static const char *directions[] = {"up", "down"};
+    for (int d = D_UP; d <= D_DOWN; ++d) {
+        std::string label = std::string("direction=\"") + directions[d] + "\"";
+        _packets[d] = _metrics.counter("tinyvpn_packets_total",
+                "Packets forwarded, up is from clients", label);
+        _bytes[d] = _metrics.counter("tinyvpn_bytes_total",
+                "Bytes of inner packets forwarded", label);
+        _dwell[d][W_WAIT] = _metrics.histogram("tinyvpn_dwell_seconds",
+                "Time packets spend here, waiting to be read and processed", label
+                + ",part=\"wait\"");
+        _dwell[d][W_PROCESSING] = _metrics.histogram("tinyvpn_dwell_seconds",
+                "Time packets spend here, waiting to be read and processed", label
+                + ",part=\"processing\"");
+        for (int v = 0; v < V_VERDICTS; ++v) {
+            _drops[d][v] = v > V_HELD ? _metrics.counter("tinyvpn_drops_total",
+                    "Packets dropped by reason", label + ",reason=\"" + verdict_name(v) + "\"")
+                : nullptr;
+        }
+    }
+    for (int i = 0; i < STAGES; ++i) {
+        _stages[i] = _metrics.histogram("tinyvpn_stage_seconds",
+                "Time spent by stage, per packet ones are sampled",
+                std::string("stage=\"") + STAGE_NAMES[i] + "\"");
+    }
+
+    _metrics.gauge("tinyvpn_sessions", "Sessions of clients", "", [this]() {
+        return static_cast<double>(_sessions.size());
+    });
+    _metrics.gauge("tinyvpn_streams", "Clients connected by TCP", "", [this]() {
+        return static_cast<double>(_streams.size());
+    });
+    _metrics.gauge("tinyvpn_nat_entries", "NAT entries in use", "table=\"port\"", [this]() {
+        return static_cast<double>(_nat.ports());
+    });
+    _metrics.gauge("tinyvpn_nat_entries", "NAT entries in use", "table=\"addr\"", [this]() {
+        return static_cast<double>(_nat.addrs());
+    });
+    _metrics.gauge("tinyvpn_queue_packets", "Packets waiting in the fair queue", "", [this]() {
+        return _queue ? static_cast<double>(_queue->size()) : 0.0;
+    });
+    _metrics.counter("tinyvpn_queue_drops_total", "Packets the fair queue dropped", "",
+            [this]() {
+        return _queue ? _queue->dropped() : 0;
+    });
+    _metrics.counter("tinyvpn_fragments_held_total", "Fragments held for their first one", "",
+            [this]() {
+        return _frags.held();
+    });
+    _metrics.counter("tinyvpn_fragments_dropped_total", "Held fragments dropped", "",
+            [this]() {
+        return _frags.dropped();
+    });
+    _metrics.counter("tinyvpn_mss_clamped_total", "TCP handshakes whose MSS was clamped", "",
+            [this]() {
+        return _clamped;
+    });
+    _metrics.counter("tinyvpn_icmp_errors_total", "ICMP errors passed to clients", "",
+            [this]() {
+        return _icmp_errors;
+    });
+}
+
+std::string Server::stats() const {
+    std::string stats;
+    if (_up.limited()) {
+        stats += "total up: " + _up.to_string() + "\n";
+    }
+    if (_down.limited()) {
+        stats += "total down: " + _down.to_string() + "\n";
+    }
+    if (_queue) {
+        stats += "egress: " + _queue->to_string() + "\n";
+    }
+    if (_mss > 0) {
+        stats += "mss: clamped " + std::to_string(_clamped) + " to " + std::to_string(_mss) + "\n";
+    }
+    if (_frags.held() > 0 || _frags.dropped() > 0) {
+        stats += "fragments: " + _frags.to_string() + "\n";
+    }
+    if (_icmp_errors > 0) {
+        stats += "icmp errors: " + std::to_string(_icmp_errors) + " passed to clients\n";
+    }
+    for (int i = 0; i < STAGES; ++i) {
+        Histogram::Snapshot snapshot = _stages[i]->snapshot();
+        if (snapshot.count > 0) {
+            stats += std::string("stage ") + STAGE_NAMES[i] + ": " + snapshot.to_string() + "\n";
+        }
+    }
+    static const char *parts[] = {"up wait", "up processing", "down wait", "down processing"};
+    for (int i = 0; i < 2 * DWELL_PARTS; ++i) {
+        Histogram::Snapshot snapshot = _dwell[i / DWELL_PARTS][i % DWELL_PARTS]->snapshot();
+        if (snapshot.count > 0) {
+            stats += std::string("dwell ") + parts[i] + ": " + snapshot.to_string() + "\n";
+        }
+    }
+    if (_flows) {
+        stats += "flows: " + _flows->to_string() + "\n";
+    }
+    for (const auto& it : _sessions) {
+        Session *session = it.second.get();
+        stats += session->stats();
+        auto policer = _policers.find(it.first);
+        if (policer != _policers.end()) {
+            stats += "  policer up: " + policer->second.up.to_string() + "\n";
+            stats += "  policer down: " + policer->second.down.to_string() + "\n";
+        }
+        auto paced = _paced.find(it.first);
+        if (paced != _paced.end()) {
+            stats += "  pacer: " + paced->second.pacer.to_string()
+                + (paced->second.txtime ? " txtime" : " timer") + " held "
+                + std::to_string(paced->second.held.size()) + "\n";
+        }
+        if (session->peer().sin6_family != 0) {
+            stats += "  peer " + sockaddr_string(session->peer()) + ": "
+                + session->path_stats().to_string() + "\n";
+        }
+    }
+    return stats;
 }
 
 } /* namespace vpn */
@@ -1,30 +1,245 @@
 #include <arpa/inet.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
 
+#include "vpn_control.h"
 #include "vpn_server.h"
 
 #include "gflags/gflags.h"
 
+DEFINE_string(control, "/run/tinyvpn-server.sock", "unix socket answering --query, "
+        "empty disables it");
+DEFINE_string(query, "", "send a command(eg: stats, metrics, top, help) to a running server and exit");
 DEFINE_string(tun_addr, "", "tun's address. eg: 127.0.0.1");
+DEFINE_string(tun_addr6, "", "IPv6 address packets of clients are NATed to, routed to tun. "
+        "Empty drops them. eg: fd00:9::1");
 DEFINE_int32(port, -1, "server's port. eg: 5003");
+DEFINE_bool(compress, false, "compress tunnel payloads, incompressible ones are sent as is");
+DEFINE_string(key_file, "", "file holding a 64 hex digits key, encrypts the tunnel when given");
+DEFINE_int32(fec_k, 0, "datagrams per FEC group, 0 disables FEC. eg: 10");
+DEFINE_int32(fec_m, 1, "parity datagrams per FEC group, 1 is XOR, more is Reed-Solomon");
+DEFINE_int32(fec_timeout_ms, 5, "send parities of a partial FEC group after this");
+DEFINE_int32(reorder_ms, 30, "longest wait for a datagram missing on another path");
+DEFINE_int32(probe_interval_ms, 1000, "measure RTT and loss to every client this often, "
+        "0 means never");
+DEFINE_int32(session_timeout, 300, "forget clients that sent nothing for this many seconds, "
+        "0 means never");
+DEFINE_int32(nat_timeout, 7440, "reclaim NAT ports unused for this many seconds, "
+        "0 only when they run out");
+DEFINE_int32(client_up_mbit, 0, "police what each client sends to this Mbit/s, 0 means unlimited");
+DEFINE_int32(client_down_mbit, 0, "police what each client receives to this Mbit/s, "
+        "0 means unlimited");
+DEFINE_int32(total_up_mbit, 0, "police what all clients send to this Mbit/s, 0 means unlimited");
+DEFINE_int32(total_down_mbit, 0, "police what all clients receive to this Mbit/s, "
+        "0 means unlimited");
+DEFINE_int32(burst_ms, 200, "burst allowed by the policers, as time at their rate. "
+        "TCP gets well below the rate once it is shorter than its RTO");
+DEFINE_int32(shape_mbit, 0, "queue packets to clients fairly and send them at this Mbit/s, "
+        "a little below the downlink. 0 sends them at once");
+DEFINE_int32(queue_limit, 1024, "packets queued by --shape_mbit before dropping");
+DEFINE_int32(pace_mbit, 0, "space out datagrams to each client at this Mbit/s, "
+        "its access link rate. 0 sends them at once");
+DEFINE_string(pacing, "auto", "how paced datagrams wait: txtime(SO_TXTIME, needs the fq qdisc), "
+        "timer(user space), or auto(txtime when fq is on the way to the client)");
+DEFINE_int32(link_mtu, 1500, "MTU of the network between server and clients, the MSS of "
+        "tunneled TCP is clamped to fit. 0 disables clamping");
+DEFINE_string(trace, "", "trace packets to this file, decoded by trace_decode, or to stdout "
+        "as text with -. Empty disables tracing");
+DEFINE_string(trace_level, "drops", "what --trace records: drops, all(every packet) or off. "
+        "Changed at run time by --query 'trace <level>'");
+DEFINE_string(ipfix, "", "export NAT mappings as IPFIX flow records to this file, or to a "
+        "collector at udp:addr:port. Empty disables exporting");
+DEFINE_string(capture, "", "capture packets before and after NAT into this pcapng file. "
+        "Also started and stopped at run time by --query 'capture start|stop'");
+DEFINE_string(capture_filter, "", "what --capture takes, eg: 'tcp and port 443', primitives "
+        "are ip, ip6, tcp, udp, icmp, icmp6, [src|dst] host and [src|dst] port joined by and");
+DEFINE_int32(capture_sample, 1, "--capture takes one in N of the packets the filter matches");
+DEFINE_int32(capture_snaplen, 128, "bytes --capture keeps of a packet");
+DEFINE_int32(top_interval, 0, "count the top clients, destinations and ports in fixed memory, "
+        "print them every N seconds and start over. 0 means no counting");
+DEFINE_int32(stats_interval, 0, "print session stats every N seconds, 0 means never");
 
+/* Nothing else is needed to query */
 static bool validate_addr(const char* flagname, const std::string& value) {
+    if (!FLAGS_query.empty()) {
+        return true;
+    }
     struct in_addr addr;
     return inet_pton(AF_INET, value.c_str(), &addr);
 }
 
+static bool validate_addr6(const char* flagname, const std::string& value) {
+    struct in6_addr addr;
+    return value.empty() || inet_pton(AF_INET6, value.c_str(), &addr) == 1;
+}
+
 static bool validate_port(const char* flagname, int value) {
-    return value >= 1 && value <= 65535;
+    return !FLAGS_query.empty() || (value >= 1 && value <= 65535);
+}
+
+/* Stopped on SIGINT and SIGTERM, so flows still open are exported */
+static vpn::Server *running = nullptr;
+
+static void on_signal(int) {
+    running->stop();
+}
+
+static bool validate_rate(const char* flagname, int value) {
+    return value >= 0;
+}
+
+static bool validate_session_timeout(const char* flagname, int value) {
+    return value >= 0;
+}
+
+static bool validate_queue_limit(const char* flagname, int value) {
+    return value >= 1 && value <= 65536;
+}
+
+static bool validate_pacing(const char* flagname, const std::string& value) {
+    return value == "auto" || value == "txtime" || value == "timer";
+}
+
+static bool validate_link_mtu(const char* flagname, int value) {
+    return value == 0 || (value >= 576 && value <= 65535);
+}
+
+static bool validate_trace_level(const char* flagname, const std::string& value) {
+    return value == "off" || value == "drops" || value == "all";
+}
+
+static bool validate_burst(const char* flagname, int value) {
+    return value >= 1 && value <= 10000;
+}
+
+static bool validate_fec_k(const char* flagname, int value) {
+    return value >= 0 && value <= vpn::FEC_MAX_K;
+}
+
+static bool validate_fec_m(const char* flagname, int value) {
+    return value >= 1 && value <= vpn::FEC_MAX_M;
+}
+
+/* A wait of 0 spins the event loop, a negative one never ends */
+static bool validate_wait_ms(const char* flagname, int value) {
+    return value >= 1;
 }
 
 DEFINE_validator(tun_addr, validate_addr);
+DEFINE_validator(tun_addr6, validate_addr6);
 DEFINE_validator(port, validate_port);
+DEFINE_validator(fec_k, validate_fec_k);
+DEFINE_validator(fec_m, validate_fec_m);
+DEFINE_validator(fec_timeout_ms, validate_wait_ms);
+DEFINE_validator(reorder_ms, validate_wait_ms);
+DEFINE_validator(session_timeout, validate_session_timeout);
+DEFINE_validator(nat_timeout, validate_session_timeout);
+DEFINE_validator(client_up_mbit, validate_rate);
+DEFINE_validator(client_down_mbit, validate_rate);
+DEFINE_validator(total_up_mbit, validate_rate);
+DEFINE_validator(total_down_mbit, validate_rate);
+DEFINE_validator(burst_ms, validate_burst);
+DEFINE_validator(shape_mbit, validate_rate);
+DEFINE_validator(queue_limit, validate_queue_limit);
+DEFINE_validator(pace_mbit, validate_rate);
+DEFINE_validator(pacing, validate_pacing);
+DEFINE_validator(link_mtu, validate_link_mtu);
+DEFINE_validator(trace_level, validate_trace_level);
+
+/* Mbit/s to bytes per second */
+static uint64_t bytes_per_sec(int mbit) {
+    return static_cast<uint64_t>(mbit) * 1000000 / 8;
+}
 
 int main(int argc, char *argv[]) {
     google::SetUsageMessage("sudo server --tun_addr <addr> --port <port>");
     google::SetVersionString("1.0.0");
     google::ParseCommandLineFlags(&argc, &argv, true);
 
-    vpn::Server server(FLAGS_tun_addr, FLAGS_port);
+    if (!FLAGS_query.empty()) {
+        std::string reply;
+        if (!vpn::Control::query(FLAGS_control, FLAGS_query, &reply)) {
+            fprintf(stderr, "no server at %s\n", FLAGS_control.c_str());
+            return 1;
+        }
+        printf("%s", reply.c_str());
+        return 0;
+    }
+
+    vpn::TunnelOptions options;
+    options.compress = FLAGS_compress;
+    options.fec_k = FLAGS_fec_k;
+    options.fec_m = FLAGS_fec_m;
+    options.fec_timeout_ms = FLAGS_fec_timeout_ms;
+    options.reorder_ms = FLAGS_reorder_ms;
+    if (!FLAGS_key_file.empty() && !options.load_key(FLAGS_key_file)) {
+        fprintf(stderr, "invalid key file: %s\n", FLAGS_key_file.c_str());
+        return 1;
+    }
+
+    vpn::Server server(FLAGS_tun_addr, FLAGS_port, options);
+    server.set_stats_interval(FLAGS_stats_interval);
+    server.set_top_interval(FLAGS_top_interval);
+    server.set_probe_interval(FLAGS_probe_interval_ms);
+    server.set_session_timeout(FLAGS_session_timeout);
+    server.set_nat_timeout(FLAGS_nat_timeout);
+
+    vpn::RateLimit limit;
+    limit.client_up = bytes_per_sec(FLAGS_client_up_mbit);
+    limit.client_down = bytes_per_sec(FLAGS_client_down_mbit);
+    limit.total_up = bytes_per_sec(FLAGS_total_up_mbit);
+    limit.total_down = bytes_per_sec(FLAGS_total_down_mbit);
+    limit.burst_ms = FLAGS_burst_ms;
+    server.set_rate_limit(limit);
+    server.set_link_mtu(FLAGS_link_mtu);
+    if (!FLAGS_tun_addr6.empty()) {
+        server.set_tun_addr6(FLAGS_tun_addr6);
+    }
+    if (FLAGS_shape_mbit > 0) {
+        server.set_shaping(bytes_per_sec(FLAGS_shape_mbit), FLAGS_queue_limit);
+    }
+    if (FLAGS_pace_mbit > 0) {
+        vpn::Server::Pacing mode = vpn::Server::PACE_AUTO;
+        if (FLAGS_pacing == "txtime") {
+            mode = vpn::Server::PACE_TXTIME;
+        } else if (FLAGS_pacing == "timer") {
+            mode = vpn::Server::PACE_TIMER;
+        }
+        server.set_pacing(bytes_per_sec(FLAGS_pace_mbit), mode);
+    }
+    if (!FLAGS_trace.empty()) {
+        if (!server.set_trace(FLAGS_trace)) {
+            fprintf(stderr, "failed to open trace file: %s\n", FLAGS_trace.c_str());
+            return 1;
+        }
+        vpn::trace_level = FLAGS_trace_level == "all" ? vpn::TRACE_ALL
+            : FLAGS_trace_level == "drops" ? vpn::TRACE_DROPS : vpn::TRACE_OFF;
+    }
+    if (!FLAGS_capture.empty()) {
+        vpn::CaptureOptions options;
+        options.filter = FLAGS_capture_filter;
+        options.sample = FLAGS_capture_sample;
+        options.snaplen = FLAGS_capture_snaplen;
+        std::string error;
+        if (!server.set_capture(FLAGS_capture, options, &error)) {
+            fprintf(stderr, "failed to capture: %s\n", error.c_str());
+            return 1;
+        }
+    }
+    if (!FLAGS_ipfix.empty() && !server.set_flow_export(FLAGS_ipfix)) {
+        fprintf(stderr, "failed to export flows to %s\n", FLAGS_ipfix.c_str());
+        return 1;
+    }
+    if (!FLAGS_control.empty() && !server.set_control(FLAGS_control)) {
+        fprintf(stderr, "failed to listen on %s, --query disabled\n", FLAGS_control.c_str());
+    }
+    running = &server;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
     server.run();
     return 0;
 }
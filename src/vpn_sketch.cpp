@@ -0,0 +1,131 @@
+#include "vpn_sketch.h"
+
+#include <algorithm>
+
+namespace vpn {
+
+static const int MAX_DEPTH = 8;
+
+/* Odd multipliers of the rows, from the digits of pi */
+static const uint64_t SEEDS[] = {
+    0x243f6a8885a308d3ULL, 0x13198a2e03707345ULL, 0xa4093822299f31d1ULL,
+    0x082efa98ec4e6c89ULL, 0x452821e638d01377ULL, 0xbe5466cf34e90c6dULL,
+    0xc0ac29b7c97c50ddULL, 0x3f84d5b5b5470917ULL
+};
+
+uint64_t SketchKey::hash() const {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < size; ++i) {
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    }
+    /* FNV leaves the high bits poor, which the rows index by */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+HeavyHitters::HeavyHitters(int width, int depth, int k)
+    : _shift(64), _width(1), _depth(std::min(std::max(depth, 1), MAX_DEPTH)), _k(k),
+    _least(), _packets(0), _bytes(0) {
+    while (_width < width) {
+        _width <<= 1;
+        --_shift;
+    }
+    _cells.assign(static_cast<size_t>(_width) * _depth, Cell{0, 0});
+    _top[0].reserve(k);
+    _top[1].reserve(k);
+}
+
+int HeavyHitters::index(int row, uint64_t hash) const {
+    int column = _shift == 64 ? 0 : static_cast<int>((hash * SEEDS[row]) >> _shift);
+    return row * _width + column;
+}
+
+void HeavyHitters::add(const SketchKey& key, uint32_t bytes) {
+    uint64_t hash = key.hash();
+    Cell *cells[MAX_DEPTH];
+    uint64_t packets = UINT64_MAX;
+    uint64_t octets = UINT64_MAX;
+    for (int row = 0; row < _depth; ++row) {
+        cells[row] = &_cells[index(row, hash)];
+        packets = std::min(packets, cells[row]->packets);
+        octets = std::min(octets, cells[row]->bytes);
+    }
+    /* Conservative update: raise only the cells below the new estimate */
+    packets += 1;
+    octets += bytes;
+    for (int row = 0; row < _depth; ++row) {
+        cells[row]->packets = std::max(cells[row]->packets, packets);
+        cells[row]->bytes = std::max(cells[row]->bytes, octets);
+    }
+    _packets += 1;
+    _bytes += bytes;
+
+    offer(0, key, hash, packets);
+    offer(1, key, hash, octets);
+}
+
+void HeavyHitters::offer(int which, const SketchKey& key, uint64_t hash, uint64_t count) {
+    /* A key kept has grown past its last count, which is at least _least,
+     * so only those that would not get in stop here. The common case. */
+    std::vector<Candidate>& top = _top[which];
+    if (count <= _least[which]) {
+        return ;
+    }
+    Candidate *least = nullptr;
+    Candidate *found = nullptr;
+    for (Candidate& candidate : top) {
+        if (candidate.hash == hash && candidate.key == key) {
+            found = &candidate;
+        } else if (least == nullptr || candidate.count < least->count) {
+            least = &candidate;
+        }
+    }
+    if (found != nullptr) {
+        found->count = count;
+    } else if (static_cast<int>(top.size()) < _k) {
+        top.push_back(Candidate{key, hash, count});
+    } else {
+        *least = Candidate{key, hash, count};
+    }
+    if (static_cast<int>(top.size()) == _k) {
+        _least[which] = UINT64_MAX;
+        for (const Candidate& candidate : top) {
+            _least[which] = std::min(_least[which], candidate.count);
+        }
+    }
+}
+
+HeavyHitters::Entry HeavyHitters::estimate(const SketchKey& key) const {
+    uint64_t hash = key.hash();
+    Entry entry = {key, UINT64_MAX, UINT64_MAX};
+    for (int row = 0; row < _depth; ++row) {
+        const Cell& cell = _cells[index(row, hash)];
+        entry.packets = std::min(entry.packets, cell.packets);
+        entry.bytes = std::min(entry.bytes, cell.bytes);
+    }
+    return entry;
+}
+
+std::vector<HeavyHitters::Entry> HeavyHitters::top(bool by_bytes) const {
+    std::vector<Entry> entries;
+    for (const Candidate& candidate : _top[by_bytes ? 1 : 0]) {
+        entries.push_back(estimate(candidate.key));
+    }
+    std::sort(entries.begin(), entries.end(), [by_bytes](const Entry& a, const Entry& b) {
+        return by_bytes ? a.bytes > b.bytes : a.packets > b.packets;
+    });
+    return entries;
+}
+
+void HeavyHitters::clear() {
+    std::fill(_cells.begin(), _cells.end(), Cell{0, 0});
+    _top[0].clear();
+    _top[1].clear();
+    _least[0] = _least[1] = 0;
+    _packets = 0;
+    _bytes = 0;
+}
+
+} /* namespace vpn */
@@ -0,0 +1,127 @@
+#include "vpn_stream.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "vpn_tunnel.h"
+
+namespace vpn {
+
+static const int FRAME_HEADER = 2;
+/* At most this many datagrams per writev(), two iovecs each */
+static const int MAX_WRITE = 64;
+static const size_t READ_BUFFER = 256 * 1024;
+
+Stream::Stream(const std::shared_ptr<Socket>& socket)
+    : polling_out(false), _socket(socket), _out(), _out_begin(0),
+    _in(READ_BUFFER), _in_begin(0), _in_end(0), _dropped(0) {
+    _socket->set_buffers(BUFFERS);
+    _socket->set_low_latency(LOWAT);
+}
+
+void Stream::queue(const char *data, int size) {
+    if (_out_begin == _out.size()) {
+        _out.clear();
+        _out_begin = 0;
+    }
+    _out.insert(_out.end(), data, data + size);
+}
+
+int Stream::write(const struct iovec *datagrams, int n) {
+    for (int base = 0; base < n; base += MAX_WRITE) {
+        int count = n - base < MAX_WRITE ? n - base : MAX_WRITE;
+        const struct iovec *dg = datagrams + base;
+
+        uint8_t lengths[MAX_WRITE][FRAME_HEADER];
+        struct iovec iov[MAX_WRITE * 2];
+        for (int i = 0; i < count; ++i) {
+            lengths[i][0] = static_cast<uint8_t>(dg[i].iov_len >> 8);
+            lengths[i][1] = static_cast<uint8_t>(dg[i].iov_len & 0xff);
+            iov[2 * i].iov_base = lengths[i];
+            iov[2 * i].iov_len = FRAME_HEADER;
+            iov[2 * i + 1] = dg[i];
+        }
+
+        /* Behind queued bytes nothing can go straight to the socket */
+        size_t sent = 0;
+        if (!blocked()) {
+            ssize_t nwrite = _socket->writev(iov, count * 2);
+            if (nwrite < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            sent = nwrite > 0 ? nwrite : 0;
+        }
+
+        /* Queue the rest, a frame the socket has started must be finished */
+        for (int i = 0; i < count; ++i) {
+            size_t frame = FRAME_HEADER + dg[i].iov_len;
+            if (sent >= frame) {
+                sent -= frame;
+                continue;
+            }
+            if (sent == 0 && _out.size() - _out_begin + frame > MAX_QUEUED) {
+                ++_dropped;
+                continue;
+            }
+            for (int j = 2 * i; j < 2 * i + 2; ++j) {
+                if (sent >= iov[j].iov_len) {
+                    sent -= iov[j].iov_len;
+                    continue;
+                }
+                queue(static_cast<const char*>(iov[j].iov_base) + sent, iov[j].iov_len - sent);
+                sent = 0;
+            }
+        }
+    }
+    return n;
+}
+
+int Stream::flush() {
+    while (blocked()) {
+        struct iovec iov;
+        iov.iov_base = &_out[_out_begin];
+        iov.iov_len = _out.size() - _out_begin;
+        ssize_t nwrite = _socket->writev(&iov, 1);
+        if (nwrite < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        _out_begin += nwrite;
+    }
+    return 0;
+}
+
+int Stream::read() {
+    if (_in_begin > 0) {
+        memmove(&_in[0], &_in[_in_begin], _in_end - _in_begin);
+        _in_end -= _in_begin;
+        _in_begin = 0;
+    }
+    int nread = _socket->read(&_in[_in_end], _in.size() - _in_end);
+    if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (nread <= 0) {
+        return -1;
+    }
+    _in_end += nread;
+    return nread;
+}
+
+int Stream::next(char **datagram) {
+    if (_in_end - _in_begin < static_cast<size_t>(FRAME_HEADER)) {
+        return 0;
+    }
+    const uint8_t *p = reinterpret_cast<const uint8_t*>(&_in[_in_begin]);
+    int size = (p[0] << 8) | p[1];
+    if (size == 0 || size > MAX_DATAGRAM) {
+        return -1;
+    }
+    if (_in_end - _in_begin < static_cast<size_t>(FRAME_HEADER + size)) {
+        return 0;
+    }
+    *datagram = &_in[_in_begin + FRAME_HEADER];
+    _in_begin += FRAME_HEADER + size;
+    return size;
+}
+
+} /* namespace vpn */
@@ -0,0 +1,187 @@
+#include "vpn_trace.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace vpn {
+
+/* Records of one thread, a few seconds of a busy server */
+static const int RING_CAPACITY = 1 << 16;
+/* Sleep of the drainer when the rings are empty */
+static const int DRAIN_INTERVAL_MS = 10;
+/* Records written at once */
+static const int DRAIN_BATCH = 256;
+
+std::atomic<int> trace_level(TRACE_OFF);
+
+/* Rings of every thread that has traced, kept after it exits until drained */
+static std::mutex rings_lock;
+static std::vector<std::shared_ptr<TraceRing>> rings;
+
+void trace(const TraceRecord& record) {
+    static thread_local TraceRing *ring = nullptr;
+    if (ring == nullptr) {
+        std::shared_ptr<TraceRing> made(new TraceRing(RING_CAPACITY));
+        std::lock_guard<std::mutex> lock(rings_lock);
+        rings.push_back(made);
+        ring = made.get();
+    }
+    ring->push(record);
+}
+
+const char* verdict_name(int verdict) {
+    static const char *names[V_VERDICTS] = {"forwarded", "queued", "held", "invalid",
+        "no-nat", "no-route", "no-session", "policed"};
+    return verdict >= 0 && verdict < V_VERDICTS ? names[verdict] : "?";
+}
+
+static std::string protocol_name(int protocol) {
+    switch (protocol) {
+        case IPPROTO_TCP:
+            return "tcp";
+        case IPPROTO_UDP:
+            return "udp";
+        case IPPROTO_ICMP:
+            return "icmp";
+        case IPPROTO_ICMPV6:
+            return "icmp6";
+        default:
+            return std::to_string(protocol);
+    }
+}
+
+/* addr:port, [addr]:port for IPv6, no port if 0 */
+static std::string endpoint(int version, const uint8_t *addr, int port) {
+    char text[INET6_ADDRSTRLEN];
+    inet_ntop(version == 6 ? AF_INET6 : AF_INET, addr, text, sizeof(text));
+    std::string out = version == 6 && port ? "[" + std::string(text) + "]" : text;
+    return port ? out + ":" + std::to_string(port) : out;
+}
+
+std::string format_trace(const TraceRecord& record) {
+    char head[64];
+    snprintf(head, sizeof(head), "%llu.%09llu %-4s %08x ",
+            static_cast<unsigned long long>(record.ts / 1000000000ULL),
+            static_cast<unsigned long long>(record.ts % 1000000000ULL),
+            record.direction == D_UP ? "up" : "down", record.session);
+    std::string line = head;
+    if (record.version == 4 || record.version == 6) {
+        line += protocol_name(record.protocol) + " "
+            + endpoint(record.version, record.saddr, record.sport) + " -> "
+            + endpoint(record.version, record.daddr, record.dport);
+        if (record.nat_port) {
+            line += " nat " + std::to_string(record.nat_port);
+        }
+    } else {
+        line += "-";
+    }
+    return line + " size " + std::to_string(record.size) + " " + verdict_name(record.verdict);
+}
+
+TraceDrainer::TraceDrainer() : _out(nullptr), _binary(false), _running(false), _thread(),
+    _written(0) {  }
+
+TraceDrainer::~TraceDrainer() {
+    stop();
+}
+
+bool TraceDrainer::start(const std::string& path) {
+    stop();
+    if (path == "-") {
+        _out = stdout;
+        _binary = false;
+    } else {
+        _out = fopen(path.c_str(), "wb");
+        if (_out == nullptr) {
+            return false;
+        }
+        _binary = true;
+        TraceFileHeader header;
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(TraceRecord);
+        fwrite(&header, sizeof(header), 1, _out);
+    }
+    _running = true;
+    _thread = std::thread(&TraceDrainer::run, this);
+    return true;
+}
+
+void TraceDrainer::stop() {
+    if (!_running) {
+        return;
+    }
+    _running = false;
+    _thread.join();
+    drain();
+    if (_out != stdout) {
+        fclose(_out);
+    }
+    _out = nullptr;
+}
+
+void TraceDrainer::run() {
+    while (_running) {
+        if (drain() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+        }
+    }
+}
+
+int TraceDrainer::drain() {
+    std::vector<TraceRing*> all;
+    {
+        std::lock_guard<std::mutex> lock(rings_lock);
+        for (const auto& ring : rings) {
+            all.push_back(ring.get());
+        }
+    }
+
+    int count = 0;
+    TraceRecord batch[DRAIN_BATCH];
+    for (TraceRing *ring : all) {
+        /* Bounded, so one busy thread does not starve the others */
+        for (int i = 0; i < RING_CAPACITY; ) {
+            int n = 0;
+            while (n < DRAIN_BATCH && ring->pop(&batch[n])) {
+                ++n;
+            }
+            if (_binary) {
+                fwrite(batch, sizeof(batch[0]), n, _out);
+            } else {
+                for (int j = 0; j < n; ++j) {
+                    fprintf(_out, "%s\n", format_trace(batch[j]).c_str());
+                }
+            }
+            count += n;
+            i += n;
+            if (n < DRAIN_BATCH) {
+                break;
+            }
+        }
+    }
+    if (count > 0) {
+        fflush(_out);
+        _written += count;
+    }
+    return count;
+}
+
+std::string TraceDrainer::to_string() const {
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(rings_lock);
+        for (const auto& ring : rings) {
+            dropped += ring->dropped();
+        }
+    }
+    return "written " + std::to_string(_written.load()) + " dropped " + std::to_string(dropped)
+        + " rings " + std::to_string(rings.size());
+}
+
+} /* namespace vpn */
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vpn_trace.h"
+
+/* Print a binary trace written by server --trace as text */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: trace_decode <file>\n");
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == nullptr) {
+        fprintf(stderr, "failed to open %s\n", argv[1]);
+        return 1;
+    }
+
+    vpn::TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1
+            || memcmp(header.magic, vpn::TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    if (header.version != vpn::TRACE_VERSION || header.record_size != sizeof(vpn::TraceRecord)) {
+        fprintf(stderr, "trace version %d with %dB records, expected %d with %zuB\n",
+                header.version, header.record_size, vpn::TRACE_VERSION,
+                sizeof(vpn::TraceRecord));
+        fclose(in);
+        return 1;
+    }
+
+    vpn::TraceRecord record;
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        printf("%s\n", vpn::format_trace(record).c_str());
+    }
+    fclose(in);
+    return 0;
+}
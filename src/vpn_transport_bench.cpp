@@ -0,0 +1,194 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "vpn_common.h"
+#include "vpn_stream.h"
+#include "vpn_tunnel.h"
+
+#include "gflags/gflags.h"
+
+DEFINE_int32(seconds, 2, "seconds per case");
+DEFINE_int32(size, 1400, "datagram size in bytes");
+DEFINE_int32(port, 15555, "loopback port to use");
+
+/*
+ * Tunnel datagrams from one thread to another over loopback, once by UDP
+ * with sendmmsg()/recvmmsg() and once by a Stream, the way the client and
+ * the server move them. UDP may drop, TCP pushes back on the sender.
+ * */
+struct Result {
+    uint64_t    sent;
+    uint64_t    received;
+    double      seconds;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct sockaddr_in6 loopback() {
+    struct sockaddr_in6 sock;
+    vpn::make_sockaddr("127.0.0.1", FLAGS_port, &sock);
+    return sock;
+}
+
+static void wait_for(int fd, short events, int timeout) {
+    struct pollfd pfd = {fd, events, 0};
+    poll(&pfd, 1, timeout);
+}
+
+static Result run_udp() {
+    vpn::Socket rx(vpn::Socket::IPv6, vpn::Socket::UDP);
+    vpn::Socket tx(vpn::Socket::IPv6, vpn::Socket::UDP);
+    rx.set_buffers(vpn::Stream::BUFFERS);
+    tx.set_buffers(vpn::Stream::BUFFERS);
+    struct sockaddr_in6 dest = loopback();
+    if (rx.bind("127.0.0.1", FLAGS_port) != 0) {
+        perror("bind");
+        exit(1);
+    }
+
+    std::atomic<bool> done(false);
+    uint64_t received = 0;
+    uint64_t last = 0;
+    std::thread receiver([&]() {
+        static char bufs[vpn::BATCH_SIZE][vpn::MAX_DATAGRAM];
+        struct mmsghdr msgs[vpn::BATCH_SIZE];
+        struct iovec iovs[vpn::BATCH_SIZE];
+        for ( ; ; ) {
+            wait_for(rx.fd(), POLLIN, 100);
+            memset(msgs, 0, sizeof(msgs));
+            for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+                iovs[i].iov_base = bufs[i];
+                iovs[i].iov_len = sizeof(bufs[i]);
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = ::recvmmsg(rx.fd(), msgs, vpn::BATCH_SIZE, MSG_DONTWAIT, nullptr);
+            if (n > 0) {
+                received += n;
+                last = now_ns();
+            } else if (done) {
+                return;
+            }
+        }
+    });
+
+    std::vector<char> data(FLAGS_size, 'x');
+    struct mmsghdr msgs[vpn::BATCH_SIZE];
+    struct iovec iov = {data.data(), data.size()};
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &dest;
+        msgs[i].msg_hdr.msg_namelen = sizeof(dest);
+    }
+
+    uint64_t sent = 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+    while (now_ns() < end) {
+        int n = tx.sendmmsg(msgs, vpn::BATCH_SIZE);
+        sent += n > 0 ? n : 0;
+    }
+    done = true;
+    receiver.join();
+    return Result{sent, received, (last - start) / 1e9};
+}
+
+static Result run_tcp() {
+    vpn::Socket listener(vpn::Socket::IPv6, vpn::Socket::TCP);
+    if (listener.bind(FLAGS_port) != 0 || listener.listen() != 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    uint64_t received = 0;
+    uint64_t last = 0;
+    std::thread receiver([&]() {
+        struct sockaddr_in6 from;
+        int fd;
+        while ((fd = listener.accept(&from)) < 0) {
+            wait_for(listener.fd(), POLLIN, 100);
+        }
+        vpn::Stream stream(std::make_shared<vpn::Socket>(fd));
+        for ( ; ; ) {
+            wait_for(stream.fd(), POLLIN, 100);
+            if (stream.read() < 0) {
+                return;
+            }
+            char *datagram;
+            while (stream.next(&datagram) > 0) {
+                ++received;
+            }
+            last = now_ns();
+        }
+    });
+
+    uint64_t sent = 0;
+    uint64_t start = now_ns();
+    {
+        std::shared_ptr<vpn::Socket> socket(new vpn::Socket(vpn::Socket::IPv6,
+                    vpn::Socket::TCP));
+        socket->connect(loopback());
+        vpn::Stream stream(socket);
+
+        std::vector<char> data(FLAGS_size, 'x');
+        struct iovec iovs[vpn::BATCH_SIZE];
+        for (int i = 0; i < vpn::BATCH_SIZE; ++i) {
+            iovs[i].iov_base = data.data();
+            iovs[i].iov_len = data.size();
+        }
+
+        uint64_t end = start + FLAGS_seconds * 1000000000ULL;
+        while (now_ns() < end) {
+            /* Push back instead of dropping from the queue */
+            while (stream.blocked()) {
+                wait_for(stream.fd(), POLLOUT, 100);
+                if (stream.flush() < 0) {
+                    perror("flush");
+                    exit(1);
+                }
+            }
+            if (stream.write(iovs, vpn::BATCH_SIZE) < 0) {
+                perror("write");
+                exit(1);
+            }
+            sent += vpn::BATCH_SIZE;
+        }
+        while (stream.blocked()) {
+            wait_for(stream.fd(), POLLOUT, 100);
+            stream.flush();
+        }
+        sent -= stream.dropped();
+    }
+    receiver.join();
+    return Result{sent, received, (last - start) / 1e9};
+}
+
+static void print(const char *name, const Result& r) {
+    double loss = r.sent ? 100.0 * (r.sent - r.received) / r.sent : 0.0;
+    printf("%-6s %12.0f %12.2f %9.2f%%\n", name, r.received / r.seconds,
+            r.received * FLAGS_size * 8 / r.seconds / 1e9, loss);
+}
+
+int main(int argc, char *argv[]) {
+    google::SetUsageMessage("transport_bench [--seconds N] [--size BYTES]");
+    google::ParseCommandLineFlags(&argc, &argv, true);
+
+    printf("%dB datagrams over loopback, %ds per case\n", FLAGS_size, FLAGS_seconds);
+    printf("%-6s %12s %12s %10s\n", "", "pps", "Gbit/s", "loss");
+    print("udp", run_udp());
+    print("tcp", run_tcp());
+    return 0;
+}
@@ -0,0 +1,567 @@
+#include "vpn_tunnel.h"
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <fstream>
+#include <random>
+
+#include "vpn_compress.h"
+
+namespace vpn {
+
+/* Headers alone hardly compress, don't waste cycles on them */
+static const int MIN_COMPRESS_SIZE = 128;
+/* Never above log2(sample size), so scale with it */
+static const double ENTROPY_RATIO = 0.85;
+static const double MAX_ENTROPY = 7.0;
+/* Direction bit of seq, see TunnelHeader */
+static const uint64_t SEQ_SERVER = 1ULL << 63;
+
+static inline void store64(char *p, uint64_t v) {
+    for (int i = 7; i >= 0; --i, v >>= 8) {
+        p[i] = static_cast<char>(v & 0xff);
+    }
+}
+
+static inline void store32(char *p, uint32_t v) {
+    for (int i = 3; i >= 0; --i, v >>= 8) {
+        p[i] = static_cast<char>(v & 0xff);
+    }
+}
+
+static inline uint32_t load32(const char *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        v = (v << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return v;
+}
+
+static inline uint64_t load64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v = (v << 8) | static_cast<uint8_t>(p[i]);
+    }
+    return v;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool TunnelOptions::load_key(const std::string& path) {
+    std::ifstream in(path.c_str());
+    std::string hex;
+    if (!(in >> hex) || hex.size() != AEAD_KEY_SIZE * 2) {
+        return false;
+    }
+
+    std::string raw(AEAD_KEY_SIZE, '\0');
+    for (int i = 0; i < AEAD_KEY_SIZE; ++i) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        raw[i] = static_cast<char>((hi << 4) | lo);
+    }
+    key = raw;
+    return true;
+}
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+double CompressStats::ratio() const {
+    if (raw_bytes == 0) {
+        return 1.0;
+    }
+    return static_cast<double>(wire_bytes) / raw_bytes;
+}
+
+Session::Session(uint32_t id, const TunnelOptions& options, TunnelRole role)
+    : _id(id), _options(options), _tx(), _rx(),
+    _role(role), _tx_seq(0), _replay(), _rejected(0),
+    _fec_tx(), _fec_rx(), _fec_opened(0), _fec_parities(0), _fec_duplicates(0),
+    _reorder(), _reordering(false), _tx_dseq(0) {
+    std::random_device rd;
+    uint64_t seq = ((static_cast<uint64_t>(rd()) << 32) | rd()) >> 2;
+    if (_role == R_SERVER) {
+        seq |= SEQ_SERVER;
+    }
+    _tx_seq = seq;
+    memset(&_peer, 0, sizeof(_peer));
+    _active_at = 0;
+    if (_options.fec_k > 0) {
+        _fec_tx.reset(new FecEncoder(_options.fec_k, _options.fec_m));
+    }
+}
+
+bool Session::parse_header(const char *in, int size, TunnelHeader *hdr) {
+    if (in == nullptr || static_cast<size_t>(size) < sizeof(TunnelHeader)) {
+        return false;
+    }
+    memcpy(hdr, in, sizeof(TunnelHeader));
+    hdr->session = ntohl(hdr->session);
+    return hdr->version == TUNNEL_VERSION;
+}
+
+bool Session::worth_compress(const char *in, int size) {
+    if (size < MIN_COMPRESS_SIZE) {
+        return false;
+    }
+    int n = size < 256 ? size : 256;
+    double limit = ENTROPY_RATIO * log2(n);
+    return lz_entropy(in, size) < (limit < MAX_ENTROPY ? limit : MAX_ENTROPY);
+}
+
+int TunnelOptions::inner_mtu(int link_mtu, bool ipv6) const {
+    int overhead = sizeof(TunnelHeader) + (key.empty() ? 0 : TUNNEL_CRYPTO_OVERHEAD);
+    if (fec_k > 0) {
+        /* A parity is as long as the longest symbol, which carries dseq */
+        overhead += sizeof(FecHeader) + TUNNEL_SYMBOL_PREFIX + TUNNEL_DSEQ_SIZE;
+    } else {
+        overhead += TUNNEL_DSEQ_SIZE;
+    }
+    return link_mtu - (ipv6 ? TUNNEL_UDP6_OVERHEAD : TUNNEL_UDP_OVERHEAD) - overhead;
+}
+
+int Session::overhead() const {
+    return sizeof(TunnelHeader) + (encrypted() ? TUNNEL_CRYPTO_OVERHEAD : 0)
+        + (_fec_tx ? sizeof(FecHeader) : 0) + (ordered() ? TUNNEL_DSEQ_SIZE : 0);
+}
+
+char* Session::write_header(char *out, uint8_t type, uint8_t flags) {
+    TunnelHeader *hdr = reinterpret_cast<TunnelHeader*>(out);
+    hdr->version = TUNNEL_VERSION;
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->path = 0;
+    hdr->session = htonl(_id);
+
+    char *payload = out + sizeof(TunnelHeader);
+    if (encrypted()) {
+        hdr->flags |= F_ENCRYPTED;
+        store64(payload, _tx_seq.fetch_add(1, std::memory_order_relaxed));
+        payload += TUNNEL_SEQ_SIZE;
+    }
+    return payload;
+}
+
+int Session::encap(const char *in, int size, char *out, int cap) {
+    if (cap < overhead() + size) {
+        return -1;
+    }
+
+    char *payload = write_header(out, T_DATA,
+            (_fec_tx ? F_FEC : 0) | (ordered() ? F_ORDERED : 0));
+    TunnelHeader *hdr = reinterpret_cast<TunnelHeader*>(out);
+    uint32_t dseq = _tx_dseq;
+    if (hdr->flags & F_ORDERED) {
+        store32(payload, _tx_dseq++);
+        payload += TUNNEL_DSEQ_SIZE;
+    }
+    FecHeader *fec = reinterpret_cast<FecHeader*>(payload);
+    if (_fec_tx) {
+        payload += sizeof(FecHeader);
+    }
+    int payload_cap = cap - (payload - out) - (encrypted() ? AEAD_TAG_SIZE : 0);
+    int nwrite = -1;
+
+    if (_options.compress) {
+        ++_tx.packets;
+        _tx.raw_bytes += size;
+
+        uint64_t start = monotonic_ns();
+        if (!worth_compress(in, size)) {
+            ++_tx.bypassed;
+        } else if ((nwrite = lz_compress(in, size, payload, payload_cap)) < 0) {
+            ++_tx.expanded;
+        } else {
+            ++_tx.compressed;
+            hdr->flags |= F_COMPRESSED;
+        }
+        _tx.cpu_ns += monotonic_ns() - start;
+    }
+
+    if (nwrite < 0) {
+        memcpy(payload, in, size);
+        nwrite = size;
+    }
+    if (_options.compress) {
+        _tx.wire_bytes += nwrite;
+    }
+
+    if (_fec_tx) {
+        uint8_t symbol[MAX_DATAGRAM];
+        int prefix = TUNNEL_SYMBOL_PREFIX;
+        symbol[0] = hdr->flags & (F_COMPRESSED | F_ORDERED);
+        symbol[1] = static_cast<uint8_t>(nwrite >> 8);
+        symbol[2] = static_cast<uint8_t>(nwrite & 0xff);
+        if (hdr->flags & F_ORDERED) {
+            store32(reinterpret_cast<char*>(symbol) + prefix, dseq);
+            prefix += TUNNEL_DSEQ_SIZE;
+        }
+        memcpy(symbol + prefix, payload, nwrite);
+        if (_fec_tx->pending() == 0) {
+            _fec_opened = monotonic_ns();
+        }
+        _fec_tx->add(symbol, nwrite + prefix, fec);
+    }
+
+    return (payload - out) + nwrite + (encrypted() ? AEAD_TAG_SIZE : 0);
+}
+
+int Session::take_parity(char *out, int cap) {
+    if (!_fec_tx) {
+        return -1;
+    }
+
+    /* Before the header, so no seq is burnt when there is nothing */
+    uint8_t parity[MAX_DATAGRAM];
+    FecHeader fec;
+    int len = _fec_tx->take_parity(parity, sizeof(parity), &fec);
+    if (len < 0) {
+        return -1;
+    }
+    if (cap < overhead() + len) {
+        return -1;
+    }
+
+    char *payload = write_header(out, T_FEC_PARITY, F_FEC);
+    memcpy(payload, &fec, sizeof(fec));
+    memcpy(payload + sizeof(fec), parity, len);
+    ++_fec_parities;
+    return (payload - out) + sizeof(fec) + len + (encrypted() ? AEAD_TAG_SIZE : 0);
+}
+
+int Session::probe(uint8_t type, const ProbeBody& body, char *out, int cap, int size) {
+    int least = sizeof(TunnelHeader) + (encrypted() ? TUNNEL_CRYPTO_OVERHEAD : 0)
+        + sizeof(body);
+    size = size > least ? size : least;
+    if (cap < size) {
+        return -1;
+    }
+    char *payload = write_header(out, type, 0);
+    memcpy(payload, &body, sizeof(body));
+    memset(payload + sizeof(body), 0, size - least);
+    return size;
+}
+
+bool Session::parse_probe(const char *in, int size, uint8_t *type, ProbeBody *body) {
+    TunnelHeader hdr;
+    if (!parse_header(in, size, &hdr)
+            || hdr.type < T_PROBE || hdr.type > T_MTU_REPLY) {
+        return false;
+    }
+    int offset = sizeof(TunnelHeader) + ((hdr.flags & F_ENCRYPTED) ? TUNNEL_SEQ_SIZE : 0);
+    if (size < offset + static_cast<int>(sizeof(*body))) {
+        return false;
+    }
+    *type = hdr.type;
+    memcpy(body, in + offset, sizeof(*body));
+    return true;
+}
+
+int Session::timeout_ms() const {
+    int timeout = _fec_tx ? _options.fec_timeout_ms : -1;
+    if (_reordering.load(std::memory_order_acquire)) {
+        /* Gaps are given up within a quarter of reorder_ms late */
+        int reorder = _options.reorder_ms / 4 + 1;
+        timeout = timeout < 0 || reorder < timeout ? reorder : timeout;
+    }
+    return timeout;
+}
+
+void Session::tick_tx(uint64_t now) {
+    if (_fec_tx && _fec_tx->pending() > 0
+            && now - _fec_opened >= _options.fec_timeout_ms * 1000000ULL) {
+        _fec_tx->flush();
+    }
+}
+
+void Session::tick_rx(uint64_t now) {
+    if (_reorder) {
+        _reorder->tick(now);
+    }
+}
+
+int Session::decap(const char *in, int size, char *out, int cap) {
+    TunnelHeader hdr;
+    if (!parse_header(in, size, &hdr) || hdr.session != _id
+            || (hdr.type != T_DATA && hdr.type != T_FEC_PARITY)) {
+        return -1;
+    }
+
+    const char *payload = in + sizeof(TunnelHeader);
+    int payload_size = size - sizeof(TunnelHeader);
+    if (hdr.flags & F_ENCRYPTED) {
+        payload += TUNNEL_SEQ_SIZE;
+        payload_size -= TUNNEL_CRYPTO_OVERHEAD;
+    }
+    uint32_t dseq = 0;
+    if (hdr.flags & F_ORDERED) {
+        if (payload_size < TUNNEL_DSEQ_SIZE) {
+            return -1;
+        }
+        dseq = load32(payload);
+        payload += TUNNEL_DSEQ_SIZE;
+        payload_size -= TUNNEL_DSEQ_SIZE;
+    }
+
+    if ((hdr.flags & F_FEC) && _options.fec_k == 0) {
+        /* Not asked for, a decoder fed anyway is only open to abuse */
+        return -1;
+    } else if (hdr.flags & F_FEC) {
+        FecHeader fec;
+        if (payload_size < static_cast<int>(sizeof(fec))) {
+            return -1;
+        }
+        memcpy(&fec, payload, sizeof(fec));
+        payload += sizeof(fec);
+        payload_size -= sizeof(fec);
+
+        if (hdr.type == T_FEC_PARITY) {
+            _fec_rx.add(fec, reinterpret_cast<const uint8_t*>(payload), payload_size);
+            return 0;
+        }
+
+        uint8_t symbol[MAX_DATAGRAM];
+        int prefix = TUNNEL_SYMBOL_PREFIX + ((hdr.flags & F_ORDERED) ? TUNNEL_DSEQ_SIZE : 0);
+        if (payload_size < 0
+                || payload_size + prefix > static_cast<int>(sizeof(symbol))) {
+            return -1;
+        }
+        symbol[0] = hdr.flags & (F_COMPRESSED | F_ORDERED);
+        symbol[1] = static_cast<uint8_t>(payload_size >> 8);
+        symbol[2] = static_cast<uint8_t>(payload_size & 0xff);
+        if (hdr.flags & F_ORDERED) {
+            store32(reinterpret_cast<char*>(symbol) + 3, dseq);
+        }
+        memcpy(symbol + prefix, payload, payload_size);
+        if (!_fec_rx.add(fec, symbol, payload_size + prefix)) {
+            ++_fec_duplicates;
+            return 0;
+        }
+    } else if (hdr.type != T_DATA) {
+        return -1;
+    }
+
+    if (payload_size < 0) {
+        return -1;
+    }
+    return deliver(payload, payload_size, hdr.flags, dseq, hdr.path, out, cap);
+}
+
+int Session::take_ready(char *out, int cap) {
+    uint8_t symbol[MAX_DATAGRAM];
+    for ( ; ; ) {
+        int nread;
+        if (_reorder && (nread = _reorder->take(out, cap)) > 0) {
+            return nread;
+        }
+
+        int len = _fec_rx.take(symbol, sizeof(symbol));
+        if (len < 0) {
+            return -1;
+        }
+        int prefix = (len > 0 && (symbol[0] & F_ORDERED)) ? 3 + TUNNEL_DSEQ_SIZE : 3;
+        int size = len < prefix ? -1 : (symbol[1] << 8) | symbol[2];
+        if (size < 0 || size + prefix > len) {
+            /* Garbage in, garbage out */
+            continue;
+        }
+        uint32_t dseq = prefix > 3 ? load32(reinterpret_cast<char*>(symbol) + 3) : 0;
+        /* Not from any path, only the delay bounds its wait */
+        nread = deliver(reinterpret_cast<char*>(symbol) + prefix, size, symbol[0], dseq,
+                -1, out, cap);
+        if (nread > 0) {
+            return nread;
+        }
+    }
+}
+
+int Session::deliver(const char *payload, int size, uint8_t flags, uint32_t dseq,
+        int path, char *out, int cap) {
+    int nread = unwrap(payload, size, flags, out, cap);
+    if (nread <= 0 || !(flags & F_ORDERED)) {
+        return nread;
+    }
+
+    if (!_reorder) {
+        _reorder.reset(new ReorderBuffer(_options.reorder_ms));
+        _reordering.store(true, std::memory_order_release);
+    }
+    return _reorder->push(dseq, path, out, nread, monotonic_ns()) ? nread : 0;
+}
+
+void Session::set_path(Datagram *datagram, int path) {
+    reinterpret_cast<TunnelHeader*>(datagram->data)->path = static_cast<uint8_t>(path);
+}
+
+int Session::unwrap(const char *payload, int size, uint8_t flags, char *out, int cap) {
+    if (!(flags & F_COMPRESSED)) {
+        if (size > cap) {
+            return -1;
+        }
+        memcpy(out, payload, size);
+        /* Sent as is, like tx counts them */
+        if (_options.compress) {
+            ++_rx.packets;
+            ++_rx.bypassed;
+            _rx.raw_bytes += size;
+            _rx.wire_bytes += size;
+        }
+        return size;
+    }
+
+    uint64_t start = monotonic_ns();
+    int nread = lz_decompress(payload, size, out, cap);
+    _rx.cpu_ns += monotonic_ns() - start;
+    if (nread < 0) {
+        return -1;
+    }
+
+    ++_rx.packets;
+    ++_rx.compressed;
+    _rx.raw_bytes += nread;
+    _rx.wire_bytes += size;
+    return nread;
+}
+
+void Session::seal(Datagram *batch, int n) {
+    AeadOp ops[BATCH_SIZE];
+    int aad_len = sizeof(TunnelHeader) + TUNNEL_SEQ_SIZE;
+
+    for (int base = 0; base < n; base += BATCH_SIZE) {
+        int count = 0;
+        for (int i = base; i < n && i < base + BATCH_SIZE; ++i) {
+            Datagram& d = batch[i];
+            d.ok = true;
+            if (!d.session->encrypted()) {
+                continue;
+            }
+            uint8_t *data = reinterpret_cast<uint8_t*>(d.data);
+            AeadOp& op = ops[count++];
+            op.key = reinterpret_cast<const uint8_t*>(d.session->_options.key.data());
+            /* session | seq are adjacent on the wire */
+            op.nonce = data + offsetof(TunnelHeader, session);
+            op.aad = data;
+            op.aad_len = aad_len;
+            op.data = data + aad_len;
+            op.len = d.size - aad_len - AEAD_TAG_SIZE;
+            op.tag = data + d.size - AEAD_TAG_SIZE;
+        }
+        aead_seal(ops, count);
+    }
+}
+
+void Session::open(Datagram *batch, int n) {
+    AeadOp ops[BATCH_SIZE];
+    Datagram *owner[BATCH_SIZE];
+    int aad_len = sizeof(TunnelHeader) + TUNNEL_SEQ_SIZE;
+
+    for (int base = 0; base < n; base += BATCH_SIZE) {
+        int count = 0;
+        for (int i = base; i < n && i < base + BATCH_SIZE; ++i) {
+            Datagram& d = batch[i];
+            Session *s = d.session;
+            TunnelHeader hdr;
+            d.ok = parse_header(d.data, d.size, &hdr)
+                && s->encrypted() == !!(hdr.flags & F_ENCRYPTED);
+            if (!d.ok || !s->encrypted()) {
+                s->_rejected += !d.ok;
+                continue;
+            }
+            if (d.size < aad_len + AEAD_TAG_SIZE
+                    || !s->_replay.check(load64(d.data + sizeof(TunnelHeader)))) {
+                d.ok = false;
+                ++s->_rejected;
+                continue;
+            }
+            uint8_t *data = reinterpret_cast<uint8_t*>(d.data);
+            AeadOp& op = ops[count];
+            op.key = reinterpret_cast<const uint8_t*>(s->_options.key.data());
+            op.nonce = data + offsetof(TunnelHeader, session);
+            op.aad = data;
+            op.aad_len = aad_len;
+            op.data = data + aad_len;
+            op.len = d.size - aad_len - AEAD_TAG_SIZE;
+            op.tag = data + d.size - AEAD_TAG_SIZE;
+            owner[count++] = &d;
+        }
+        aead_open(ops, count);
+
+        /* Update the windows in order, duplicates of one batch fail here */
+        for (int i = 0; i < count; ++i) {
+            Datagram& d = *owner[i];
+            Session *s = d.session;
+            uint64_t seq = load64(d.data + sizeof(TunnelHeader));
+            d.ok = ops[i].ok && s->_replay.check(seq);
+            if (d.ok) {
+                s->_replay.update(seq);
+            } else {
+                ++s->_rejected;
+            }
+        }
+    }
+}
+
+static std::string format_stats(const char *name, const CompressStats& s) {
+    char buf[256];
+    double ns = s.packets ? static_cast<double>(s.cpu_ns) / s.packets : 0.0;
+    snprintf(buf, sizeof(buf),
+            "%s: packets %llu compressed %llu bypassed %llu expanded %llu "
+            "raw %llu wire %llu ratio %.3f cpu %.0fns/pkt",
+            name,
+            static_cast<unsigned long long>(s.packets),
+            static_cast<unsigned long long>(s.compressed),
+            static_cast<unsigned long long>(s.bypassed),
+            static_cast<unsigned long long>(s.expanded),
+            static_cast<unsigned long long>(s.raw_bytes),
+            static_cast<unsigned long long>(s.wire_bytes),
+            s.ratio(), ns);
+    return buf;
+}
+
+std::string Session::stats() const {
+    char id[32];
+    snprintf(id, sizeof(id), "session %08x rejected %llu\n", _id,
+            static_cast<unsigned long long>(_rejected));
+    char fec[160];
+    snprintf(fec, sizeof(fec), "  fec: parities %llu recovered %llu unrecoverable %llu "
+            "duplicates %llu\n",
+            static_cast<unsigned long long>(_fec_parities),
+            static_cast<unsigned long long>(_fec_rx.recovered()),
+            static_cast<unsigned long long>(_fec_rx.unrecoverable()),
+            static_cast<unsigned long long>(_fec_duplicates));
+    std::string reorder;
+    if (_reordering.load(std::memory_order_acquire)) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "  reorder: reordered %llu skipped %llu late %llu\n",
+                static_cast<unsigned long long>(_reorder->reordered()),
+                static_cast<unsigned long long>(_reorder->skipped()),
+                static_cast<unsigned long long>(_reorder->late()));
+        reorder = buf;
+    }
+    return std::string(id) + fec + reorder
+        + "  " + format_stats("tx", _tx) + "\n"
+        + "  " + format_stats("rx", _rx) + "\n";
+}
+
+} /* namespace vpn */